@@ -29,6 +29,7 @@
 /*** MODULEINFO
 	<defaultenabled>no</defaultenabled>
 	<depend>spandsp</depend>
+	<depend>openssl</depend>
 	<support_level>extended</support_level>
 ***/
 
@@ -36,20 +37,33 @@
 #define ASTMM_LIBC ASTMM_IGNORE
 #include "asterisk.h"
 
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <pthread.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #define SPANDSP_EXPOSE_INTERNAL_STRUCTURES
 #include <spandsp.h>
 #include <spandsp/version.h>
 
-#ifndef FSK_FRAME_MODE_8N1_FRAMES /* was removed from spandsp */
-#define FSK_FRAME_MODE_8N1_FRAMES 10
-#endif
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 #define BLOCK_LEN           160
 
@@ -62,7 +76,20 @@
 #include "asterisk/app.h"
 #include "asterisk/dsp.h"
 #include "asterisk/manager.h"
+#include "asterisk/musiconhold.h"
 #include "asterisk/format_cache.h"
+#include "asterisk/framehook.h"
+#include "asterisk/localtime.h"
+#include "asterisk/translate.h"
+#include "asterisk/callerid.h"
+#include "asterisk/cli.h"
+#include "asterisk/config.h"
+#include "asterisk/paths.h"
+#include "asterisk/test.h"
+
+#include "fsk_dsp.h"
+#include "fsk_receive.h"
+#include "fsk_shm.h"
 
 /*** DOCUMENTATION
 	<application name="SendFSK" language="en_US">
@@ -79,11 +106,101 @@
 					<enum name="202">
 						<para>Bell 202 modem (1200 baud)</para>
 					</enum>
+					<enum name="v23">
+						<para>ITU-T V.23 forward channel (1200 baud)</para>
+					</enum>
 				</enumlist>
+				<para>Any profile defined in <filename>fsk.conf</filename> can be named as well, see
+				<literal>fsk show profiles</literal>.</para>
+				<para>Naming a <literal>type = ladder</literal> section sends the message in blocks,
+				each answered by ReceiveFSK over the same ladder, and moves between the profiles of the
+				ladder as the receiver measures the line. The message cannot be streamed then.</para>
+			</parameter>
+			<parameter name="data" required="yes">
+				<para>Text to be sent, or where to take the payload from when the <literal>v</literal>
+				or <literal>f</literal> option is given.</para>
+			</parameter>
+			<parameter name="options" required="no">
+				<optionlist>
+					<option name="c">
+						<para>Append a CRC-16 (ITU) of the message, to be checked by ReceiveFSK with the same option.</para>
+					</option>
+					<option name="e">
+						<argument name="key" required="true" />
+						<para>Encrypt and authenticate the message with AES-GCM under key <replaceable>key</replaceable>
+						of the <literal>[keys]</literal> section of <filename>fsk.conf</filename>. The key id and a
+						random nonce are sent in a 14 byte header and a 16 byte tag follows the message, so the
+						peer's ReceiveFSK with the same option needs no other setup than the key. The CRC, when
+						requested, covers the encrypted message. With 8N1 framing the 30 added bytes take
+						a second to send at 300 baud and a quarter of one at 1200. Not available with
+						<literal>u</literal>.</para>
+					</option>
+					<option name="f">
+						<para><replaceable>data</replaceable> is the path of a file whose content is sent.
+						The file is memory-mapped and read as the modulator goes, so it may be binary and
+						is not bound by dialplan argument limits.</para>
+					</option>
+					<option name="u">
+						<para><replaceable>data</replaceable> is the path of a Unix stream socket to connect to.
+						Everything read from it is sent until the peer closes its end. When the socket is
+						slower than the modem, mark-idle is sent in between; when it is faster, reading
+						stops until the modem catches up.</para>
+					</option>
+					<option name="v">
+						<para><replaceable>data</replaceable> is the name of a channel variable whose value is sent.</para>
+					</option>
+					<option name="p">
+						<para>Keep the modem session alive after the message has been sent. The modulator
+						state is stored on the channel and a mark-idle tone is held while the dialplan runs,
+						so the next SendFSK does not force the peer to reacquire the carrier.
+						The session is torn down on hangup, or by the first SendFSK without this option.</para>
+					</option>
+				</optionlist>
 			</parameter>
 		</syntax>
 		<description>
 			<para>SendFSK() is an utility to send digital messages over an audio channel</para>
+			<para>When the module is at the capacity set in the <literal>[admission]</literal> section of
+			<filename>fsk.conf</filename>, the channel waits for a slot with music on hold or is turned away,
+			and the application returns without sending.</para>
+			<variablelist>
+				<variable name="FSKADMISSION">
+					<para>Whether the session was let run.</para>
+					<value name="ADMITTED">Straight away.</value>
+					<value name="QUEUED">After waiting for a slot.</value>
+					<value name="REJECTED">The module was at capacity and queueing is disabled.</value>
+					<value name="TIMEOUT">No slot became free within <literal>queue_timeout</literal>.</value>
+					<value name="HANGUP">The channel hung up while queued.</value>
+				</variable>
+				<variable name="FSKRECORDING">
+					<para>Set when the session failed and the flight recorder of the <literal>[recorder]</literal>
+					section of <filename>fsk.conf</filename> dumped its last seconds of audio, empty otherwise. The path the
+					<literal>.rx.sln</literal>, <literal>.tx.sln</literal>, <literal>.frames</literal> and
+					<literal>.meta</literal> files were written to, without the suffix.</para>
+				</variable>
+				<variable name="FSKSHAPING">
+					<para>Transmit shaping of <filename>fsk.conf</filename> the message was sent with, named
+					by the profile or picked for the codec of the channel, empty if none.</para>
+				</variable>
+				<variable name="FSKLADDERSTATUS">
+					<para>Outcome of a transfer over a ladder.</para>
+					<value name="OK">Every block was acknowledged.</value>
+					<value name="FAILED">A block went unacknowledged for <literal>attempts</literal> tries.</value>
+					<value name="HANGUP" />
+				</variable>
+				<variable name="FSKLADDERPROFILE">
+					<para>Profile the transfer ended on.</para>
+				</variable>
+				<variable name="FSKLADDERRETRIES">
+					<para>Blocks sent again.</para>
+				</variable>
+				<variable name="FSKLADDERSTEPS">
+					<para>Times the transfer moved to another profile.</para>
+				</variable>
+				<variable name="FSKLADDERGOODPUT">
+					<para>Message bits delivered per second of the whole transfer, answers and retries
+					included.</para>
+				</variable>
 		</description>
 		<see-also>
 			<ref type="application">ReceiveFSK</ref>
@@ -106,44 +223,700 @@
 					<enum name="202">
 						<para>Bell 202 modem (1200 baud)</para>
 					</enum>
+					<enum name="v23">
+						<para>ITU-T V.23 forward channel (1200 baud)</para>
+					</enum>
 				</enumlist>
+				<para>Any profile defined in <filename>fsk.conf</filename> can be named as well, see
+				<literal>fsk show profiles</literal>.</para>
+				<para>A ladder takes the message from SendFSK over the same ladder, answering each block.
+				The receive ends once the last block has been answered and the sender has stopped
+				sending it again.</para>
 			</parameter>
 			<parameter name="options" required="no">
 				<optionlist>
+					<option name="a">
+						<para>Raise <literal>FSKReceiveData</literal> manager events with the bytes as they are
+						received, and <literal>FSKCarrier</literal> and <literal>FSKReceiveEnd</literal> events.
+						Bytes are batched per event as set in the <literal>[ami]</literal> section of
+						<filename>fsk.conf</filename>.</para>
+					</option>
+					<option name="c">
+						<para>The last two bytes of the message are a CRC-16 appended by SendFSK. They are
+						checked and removed from the variable, and <variable>FSKCRC</variable> is set.
+						Streamed sinks receive the bytes as they were sent.</para>
+					</option>
+					<option name="e">
+						<para>The message was encrypted by SendFSK with the same option. It is authenticated and
+						decrypted with the key it names from the <literal>[keys]</literal> section of
+						<filename>fsk.conf</filename>, and <variable>FSKAUTH</variable> is set. The variable is
+						left empty unless authentication succeeds. The spool keeps the message as it was
+						received. Not available with <literal>a</literal>, <literal>m</literal>, <literal>u</literal>
+						or <literal>w</literal>, which publish bytes as they arrive.</para>
+					</option>
+					<option name="d">
+						<para>Append the message and its metadata (channel, caller, timing, CRC status) to the
+						durable spool configured in the <literal>[spool]</literal> section of
+						<filename>fsk.conf</filename>, and return only once it is on disk. Concurrent receives
+						share a single disk sync. With <literal>u</literal> or <literal>w</literal> only the
+						metadata is spooled. <variable>FSKSPOOL</variable> is set.</para>
+					</option>
 					<option name="h">
 						<para>Receive frames until it gets a hangup. Default behaviour is to stop receiving on carrier loss.</para>
 					</option>
+					<option name="m">
+						<para>Also publish received bytes and carrier events to the shared-memory ring
+						<literal>/dev/shm/asterisk-fsk</literal>, batched per received frame. Local processes
+						can follow it without copies or system calls; <filename>fsk_shm.h</filename>
+						documents the layout.</para>
+					</option>
 					<option name="s">
 						<para>Generate silence back to caller. Default behaviour is generate no stream. This can cause some applications to misbehave.</para>
 					</option>
+					<option name="p">
+						<para>Keep the modem session alive after the message has been received. The demodulator
+						stays locked on the carrier between calls, and a message is considered complete when the
+						peer falls back to mark-idle, not only on carrier loss.
+						The session is torn down on hangup, or by the first ReceiveFSK without this option.</para>
+					</option>
+					<option name="u">
+						<argument name="path" required="true" />
+						<para>Connect to the Unix stream socket at <replaceable>path</replaceable> and push
+						received bytes to it as they arrive. Delivery is decoupled from the demodulator as
+						with <literal>w</literal>, and the variable is set to the number of bytes received.</para>
+					</option>
+					<option name="w">
+						<argument name="path" required="true" />
+						<para>Append received bytes to the file or named pipe at <replaceable>path</replaceable>
+						as they arrive, instead of collecting them in memory. A file is created if missing, so
+						a named pipe must exist before the receive starts. Writes are done by a background
+						thread in batches, so a slow disk or reader never delays the demodulator. The
+						variable is set to the number of bytes received.</para>
+					</option>
 				</optionlist>
 			</parameter>
 		</syntax>
 		<description>
 			<para>ReceiveFSK() is an utility to receive digital messages from an audio channel</para>
 			<para>This application will answer the channel if it has not yet been answered.</para>
+			<para>Sessions are admitted as for <literal>SendFSK</literal>; a channel turned away gets an
+			empty variable.</para>
+			<variablelist>
+				<variable name="FSKADMISSION">
+					<para>As set by <literal>SendFSK</literal>.</para>
+				</variable>
+				<variable name="FSKRECORDING">
+					<para>As set by <literal>SendFSK</literal>. A receive has failed when the CRC or
+					authentication fails, when the channel hangs up while the carrier is still up with data
+					received, and, with <literal>p</literal>, when the carrier is lost before the peer goes
+					back to mark-idle.</para>
+				</variable>
+				<variable name="FSKCRC">
+					<para>Outcome of the CRC check, when the <literal>c</literal> option is given.</para>
+					<value name="OK" />
+					<value name="ERROR" />
+				</variable>
+				<variable name="FSKAUTH">
+					<para>Outcome of decryption, when the <literal>e</literal> option is given. Unlike a CRC
+					error, a failure means the message was altered or sealed with a different key.</para>
+					<value name="OK" />
+					<value name="FAILED" />
+					<value name="NOKEY">The message names a key that is not configured.</value>
+					<value name="MALFORMED">Too short or of an unknown format to be a sealed message.</value>
+				</variable>
+				<variable name="FSKSPOOL">
+					<para>Outcome of spooling, when the <literal>d</literal> option is given.</para>
+					<value name="OK" />
+					<value name="FAILED" />
+					<value name="DISABLED" />
+				</variable>
+				<variable name="FSKLEVEL">
+					<para>Received level while the carrier was up, in dBm0. This and the other line quality
+					variables are measured over the bits of this receive, and are cleared when the carrier
+					never came up or the profile has <literal>quality = no</literal>.</para>
+				</variable>
+				<variable name="FSKSNR">
+					<para>Signal to noise ratio at the middle of each bit, in dB.</para>
+				</variable>
+				<variable name="FSKBER">
+					<para>Bit error rate expected from how clearly each bit was decided, such as
+					<literal>1.20e-05</literal>. It moves well before bytes start to be lost, so a dialplan
+					can prefer another route or a slower modem on lines that come close.</para>
+				</variable>
+				<variable name="FSKOFFSET">
+					<para>Received tones against the nominal ones, in Hz.</para>
+				</variable>
+				<variable name="FSKJITTER">
+					<para>RMS timing error of the tone changes, in percent of a bit.</para>
+				</variable>
+				<variable name="FSKIMBALANCE">
+					<para>Mark level over space level, in dB.</para>
+				</variable>
+				<variable name="FSKLADDERSTATUS">
+					<para>As set by <literal>SendFSK</literal>, with <literal>TIMEOUT</literal> when the
+					sender went quiet before the last block. The line quality variables are those of the
+					last block taken.</para>
+				</variable>
+				<variable name="FSKLADDERPROFILE">
+					<para>As set by <literal>SendFSK</literal>.</para>
+				</variable>
+				<variable name="FSKLADDERRETRIES">
+					<para>Blocks lost and asked for again.</para>
+				</variable>
+				<variable name="FSKLADDERSTEPS">
+					<para>As set by <literal>SendFSK</literal>.</para>
+				</variable>
+				<variable name="FSKLADDERGOODPUT">
+					<para>As set by <literal>SendFSK</literal>.</para>
+				</variable>
+			</variablelist>
+		</description>
+		<see-also>
+			<ref type="application">SendFSK</ref>
+		</see-also>
+	</application>
+	<application name="SendFSKQueue" language="en_US">
+		<synopsis>
+			Send the FSK messages queued on the channel back-to-back.
+		</synopsis>
+		<syntax>
+			<parameter name="modem" required="no">
+				<para>Name of modem protocol to use, as in <literal>SendFSK</literal>. Default is Bell 103.</para>
+			</parameter>
+			<parameter name="options" required="no">
+				<optionlist>
+					<option name="b">
+						<para>Drain the queue in the background. The application returns immediately and
+						queued messages are sent by a generator while the dialplan goes on, with mark-idle
+						in between. Implies <literal>p</literal>.</para>
+					</option>
+					<option name="j">
+						<argument name="id" required="true" />
+						<para>Send the payload of outbound spool job <replaceable>id</replaceable> ahead of the
+						queue. Used by the calls the outbound spool originates, see the
+						<literal>[outbound]</literal> section of <filename>fsk.conf</filename>.</para>
+					</option>
+					<option name="p">
+						<para>Keep the modem session alive afterwards, as in <literal>SendFSK</literal>.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Sends every message queued with <literal>FSK_QUEUE</literal>, including those queued while
+			sending is in progress, with no gap between them. Messages are framed when they are queued, so
+			the modulator only has to play them back.</para>
+			<para>Sessions are admitted and <variable>FSKADMISSION</variable> is set as for
+			<literal>SendFSK</literal>. With <literal>b</literal>, the carrier that sends the queue keeps
+			the slot until it is dropped.</para>
 		</description>
 		<see-also>
+			<ref type="function">FSK_QUEUE</ref>
 			<ref type="application">SendFSK</ref>
 		</see-also>
 	</application>
+	<application name="CidT2FSK" language="en_US">
+		<synopsis>
+			Send a Type II caller ID (call waiting caller ID) on a call in progress.
+		</synopsis>
+		<syntax>
+			<parameter name="number" required="no">
+				<para>Number of the waiting caller. <literal>P</literal> for private and <literal>O</literal>
+				for unavailable. Default is unavailable.</para>
+			</parameter>
+			<parameter name="name" required="no">
+				<para>Name of the waiting caller, with the same special values.</para>
+			</parameter>
+			<parameter name="options" required="no">
+				<optionlist>
+					<option name="n">
+						<para>Send the data even if the CPE does not acknowledge the CAS.</para>
+					</option>
+					<option name="s">
+						<para>Precede the mark with a channel seizure signal.</para>
+					</option>
+					<option name="v">
+						<para>Use V.23 instead of Bell 202.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Sends the CPE alerting signal, waits for the CPE to acknowledge it with DTMF
+			<literal>A</literal> or <literal>D</literal>, then sends an MDMF message with date and time,
+			number and name. The whole burst is rendered before the CAS is sent, tones and preamble
+			once at load, so the data goes out within the timing window of the CPE regardless of load.</para>
+			<para>Sessions are admitted and <variable>FSKADMISSION</variable> is set as for
+			<literal>SendFSK</literal>; a channel turned away gets <literal>FAILED</literal>.</para>
+			<variablelist>
+				<variable name="CIDT2STATUS">
+					<value name="SUCCESS" />
+					<value name="NOACK" />
+					<value name="HANGUP" />
+					<value name="FAILED" />
+				</variable>
+			</variablelist>
+		</description>
+	</application>
+	<application name="SendFSKSMS" language="en_US">
+		<synopsis>
+			Send a text message to a fixed line SMS terminal, or submit one to a service centre.
+		</synopsis>
+		<syntax>
+			<parameter name="number" required="yes">
+				<para>Originator of the message, or its destination with the <literal>s</literal> option.</para>
+			</parameter>
+			<parameter name="text" required="no">
+				<para>At most 160 characters, sent in the GSM default alphabet.</para>
+			</parameter>
+			<parameter name="options" required="no">
+				<optionlist>
+					<option name="s">
+						<para>Act as a terminal submitting the message to a service centre (SMS-SUBMIT)
+						instead of as a service centre delivering it (SMS-DELIVER).</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Implements ETSI ES 201 912 protocol 1 over V.23: the message is sent in an
+			<literal>SMS_DATA</literal> data link message, repeated until the peer answers with
+			<literal>SMS_ACK</literal> or <literal>SMS_NACK</literal>, and the link is then released.</para>
+			<para>Sessions are admitted and <variable>FSKADMISSION</variable> is set as for
+			<literal>SendFSK</literal>; a channel turned away gets <literal>ERROR</literal>.</para>
+			<variablelist>
+				<variable name="FSKSMSSTATUS">
+					<value name="ACK" />
+					<value name="NACK" />
+					<value name="TIMEOUT" />
+					<value name="HANGUP" />
+					<value name="ERROR" />
+				</variable>
+			</variablelist>
+		</description>
+		<see-also>
+			<ref type="application">ReceiveFSKSMS</ref>
+		</see-also>
+	</application>
+	<application name="ReceiveFSKSMS" language="en_US">
+		<synopsis>
+			Receive a text message from a fixed line SMS terminal or service centre.
+		</synopsis>
+		<syntax>
+			<parameter name="options" required="no">
+				<optionlist>
+					<option name="d">
+						<para>Append the message, as received, to the durable spool as the <literal>d</literal>
+						option of <literal>ReceiveFSK</literal> does, and set <variable>FSKSPOOL</variable>.
+						Concurrent sessions share the disk syncs of the spool.</para>
+					</option>
+					<option name="t">
+						<argument name="seconds" required="true" />
+						<para>How long to wait for the message. Default is 10 seconds.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Waits for an ETSI ES 201 912 protocol 1 <literal>SMS_DATA</literal> message, checks its
+			checksum and transfer layer PDU, and acknowledges it. Damaged messages are answered with
+			<literal>SMS_NACK</literal> so that the sender repeats them.</para>
+			<para>Sessions are admitted as for <literal>SendFSKSMS</literal>.</para>
+			<variablelist>
+				<variable name="FSKSMSSTATUS">
+					<value name="OK" />
+					<value name="TIMEOUT" />
+					<value name="HANGUP" />
+					<value name="ERROR" />
+				</variable>
+				<variable name="FSKSMS_TYPE">
+					<value name="DELIVER" />
+					<value name="SUBMIT" />
+				</variable>
+				<variable name="FSKSMS_NUMBER">
+					<para>Originator of a DELIVER, destination of a SUBMIT.</para>
+				</variable>
+				<variable name="FSKSMS_TIMESTAMP">
+					<para>Service centre time stamp of a DELIVER.</para>
+				</variable>
+				<variable name="FSKSMS_TEXT" />
+			</variablelist>
+		</description>
+		<see-also>
+			<ref type="application">SendFSKSMS</ref>
+		</see-also>
+	</application>
+	<application name="FSKRelay" language="en_US">
+		<synopsis>
+			Relay an FSK device on this channel as text to the bridged peer.
+		</synopsis>
+		<syntax>
+			<parameter name="modem" required="no">
+				<para>Modem protocol of the device, as in <literal>ReceiveFSK</literal>. Default is Bell 103.</para>
+			</parameter>
+			<parameter name="options" required="no">
+				<optionlist>
+					<option name="t">
+						<para>Send T.140 text frames instead of plain text frames.</para>
+					</option>
+					<option name="x">
+						<para>Stop relaying.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Demodulates what the device sends and passes it on as text frames in place of the audio,
+			so the peer, typically an IP endpoint bridged with <literal>Dial</literal>, gets the bytes
+			rather than modem audio through its codec. Text frames written to this channel are modulated
+			back to the device by a carrier held for the whole relay, which replaces the audio of the
+			peer. The application returns at once, and relaying goes on until hangup or
+			<literal>FSKRelay(,x)</literal>.</para>
+			<para>Sessions are admitted and <variable>FSKADMISSION</variable> is set as for
+			<literal>SendFSK</literal>, and the relay keeps its slot until it stops.</para>
+			<example title="Bridge a Bell 202 device to a SIP endpoint with real-time text">
+			same => n,FSKRelay(202,t)
+			same => n,Dial(PJSIP/rtt-endpoint)
+			</example>
+		</description>
+	</application>
+	<function name="FSK_QUEUE" language="en_US">
+		<synopsis>
+			Queue a message for SendFSKQueue.
+		</synopsis>
+		<syntax>
+			<parameter name="channel" required="no">
+				<para>Channel whose queue is used. Defaults to the current channel.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Writing appends the value to the channel's FSK send queue. Reading returns the number of
+			messages not yet sent.</para>
+			<example title="Queue two messages and send them back-to-back">
+			same => n,Set(FSK_QUEUE()=first)
+			same => n,Set(FSK_QUEUE()=second)
+			same => n,SendFSKQueue(202)
+			</example>
+		</description>
+		<see-also>
+			<ref type="application">SendFSKQueue</ref>
+		</see-also>
+	</function>
+	<function name="FSK_ADMISSION" language="en_US">
+		<synopsis>
+			Read the load of FSK sessions against the admission limits.
+		</synopsis>
+		<syntax>
+			<parameter name="item" required="no">
+				<enumlist>
+					<enum name="utilization"><para>Default. Percent of the tighter of
+					<literal>max_sessions</literal> and <literal>cpu_budget</literal> in use.</para></enum>
+					<enum name="sessions"><para>Sessions running.</para></enum>
+					<enum name="queued"><para>Channels waiting for a slot.</para></enum>
+					<enum name="load"><para>Measured CPU use of the sessions, in percent of one core.</para></enum>
+					<enum name="max_sessions" />
+					<enum name="cpu_budget" />
+				</enumlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Lets the dialplan steer calls elsewhere before the module has to queue them.</para>
+		</description>
+		<see-also>
+			<ref type="manager">FSKAdmission</ref>
+		</see-also>
+	</function>
+	<manager name="FSKSend" language="en_US">
+		<synopsis>
+			Send an FSK message on one or more channels.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel" required="true">
+				<para>Comma separated list of channels.</para>
+			</parameter>
+			<parameter name="Data" required="true">
+				<para>The message, at least one byte once decoded.</para>
+			</parameter>
+			<parameter name="Encoding">
+				<enumlist>
+					<enum name="text"><para>Default.</para></enum>
+					<enum name="hex" />
+					<enum name="base64" />
+				</enumlist>
+			</parameter>
+			<parameter name="Modem">
+				<para>As in <literal>SendFSK</literal>. Default is Bell 103.</para>
+			</parameter>
+			<parameter name="CRC">
+				<para>Append a CRC-16, as the <literal>c</literal> option of <literal>SendFSK</literal> does.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Queues the message on each channel, as <literal>FSK_QUEUE</literal> does, and starts sending
+			it in the background as <literal>SendFSKQueue(modem,b)</literal> does. The carrier is held
+			afterwards, until <literal>FSKCancel</literal> or hangup. A channel already sending, or holding
+			its carrier, on another modem refuses the message. A carrier is admitted as the sessions of
+			<literal>SendFSK</literal> are, but never queued: at capacity the channel refuses the message.</para>
+			<para>The response is a list of <literal>FSKChannelResult</literal> events, one per channel,
+			followed by <literal>FSKSendComplete</literal>.</para>
+		</description>
+	</manager>
+	<manager name="FSKReceive" language="en_US">
+		<synopsis>
+			Receive FSK data in the background on one or more channels.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel" required="true">
+				<para>Comma separated list of channels.</para>
+			</parameter>
+			<parameter name="Modem">
+				<para>As in <literal>ReceiveFSK</literal>. Default is Bell 103.</para>
+			</parameter>
+			<parameter name="Variable">
+				<para>Channel variable set to the received data when the receive ends.</para>
+			</parameter>
+			<parameter name="UntilHangup">
+				<para>Keep receiving across carrier loss, as the <literal>h</literal> option of
+				<literal>ReceiveFSK</literal> does.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Demodulates what each channel receives while the dialplan goes on, and raises the events
+			of <literal>ReceiveFSK(...,a)</literal>. The receive ends on carrier loss, on
+			<literal>FSKCancel</literal> or on hangup. It is admitted as the sessions of
+			<literal>SendFSK</literal> are, sharing the slot of a carrier held on the channel, but never
+			queued: at capacity the channel refuses the action.</para>
+		</description>
+	</manager>
+	<manager name="FSKStatus" language="en_US">
+		<synopsis>
+			Show the FSK state of one or more channels.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel" required="true">
+				<para>Comma separated list of channels.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Each <literal>FSKChannelResult</literal> carries <literal>Sending</literal>,
+			<literal>Queued</literal>, <literal>CarrierHeld</literal> and <literal>Receiving</literal>, and
+			<literal>Carrier</literal> and <literal>BytesReceived</literal> while receiving. Once the carrier
+			has been up, a receive also reports the line quality headers of <literal>FSKReceiveEnd</literal>,
+			measured so far.</para>
+		</description>
+	</manager>
+	<manager name="FSKAdmission" language="en_US">
+		<synopsis>
+			Show the load of FSK sessions against the admission limits.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>The response carries <literal>Sessions</literal>, <literal>Queued</literal>,
+			<literal>MaxSessions</literal>, <literal>Load</literal>, <literal>CPUBudget</literal>,
+			<literal>SessionCost</literal> and <literal>Utilization</literal>, loads in percent of one core,
+			and the <literal>Admitted</literal>, <literal>Waited</literal>, <literal>Rejected</literal> and
+			<literal>Timeouts</literal> counters since the module was loaded. A load balancer polling it can
+			steer calls away while <literal>Utilization</literal> is high.</para>
+		</description>
+	</manager>
+	<manager name="FSKCancel" language="en_US">
+		<synopsis>
+			Stop sending or receiving FSK on one or more channels.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel" required="true">
+				<para>Comma separated list of channels.</para>
+			</parameter>
+			<parameter name="Direction">
+				<enumlist>
+					<enum name="send" />
+					<enum name="receive" />
+					<enum name="both"><para>Default.</para></enum>
+				</enumlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Drops what is queued and the held carrier, and ends a receive. Running
+			<literal>SendFSK</literal> and <literal>ReceiveFSK</literal> applications return.</para>
+		</description>
+	</manager>
 ***/
 
 enum read_option_flags {
 	OPT_HANGOUT    = (1 << 0),
 	OPT_SILENCE    = (1 << 1),
+	OPT_PERSIST    = (1 << 2),
+	OPT_SINK_FILE  = (1 << 6),
+	OPT_SINK_SOCKET = (1 << 7),
+	OPT_SINK_SHM   = (1 << 9),
+	OPT_CRC        = (1 << 10),
+	OPT_SPOOL      = (1 << 11),
+	OPT_AMI        = (1 << 13),
+	OPT_ENCRYPT    = (1 << 22),
+};
+
+enum read_option_args {
+	OPT_ARG_SINK_FILE,
+	OPT_ARG_SINK_SOCKET,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
 };
 
 AST_APP_OPTIONS(read_app_options, {
+	AST_APP_OPTION('a', OPT_AMI),
+	AST_APP_OPTION('c', OPT_CRC),
+	AST_APP_OPTION('d', OPT_SPOOL),
+	AST_APP_OPTION('e', OPT_ENCRYPT),
 	AST_APP_OPTION('h', OPT_HANGOUT),
+	AST_APP_OPTION('m', OPT_SINK_SHM),
 	AST_APP_OPTION('s', OPT_SILENCE),
+	AST_APP_OPTION('p', OPT_PERSIST),
+	AST_APP_OPTION_ARG('u', OPT_SINK_SOCKET, OPT_ARG_SINK_SOCKET),
+	AST_APP_OPTION_ARG('w', OPT_SINK_FILE, OPT_ARG_SINK_FILE),
+});
+
+enum queue_option_flags {
+	OPT_BACKGROUND = (1 << 3),
+	OPT_OUTBOUND_JOB = (1 << 12),
+};
+
+enum queue_option_args {
+	OPT_ARG_OUTBOUND_JOB,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_QUEUE_ARRAY_SIZE,
+};
+
+enum send_option_flags {
+	OPT_PAYLOAD_VAR  = (1 << 4),
+	OPT_PAYLOAD_FILE = (1 << 5),
+	OPT_PAYLOAD_SOCKET = (1 << 8),
+};
+
+enum send_option_args {
+	OPT_ARG_ENCRYPT,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_SEND_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(send_app_options, {
+	AST_APP_OPTION('c', OPT_CRC),
+	AST_APP_OPTION_ARG('e', OPT_ENCRYPT, OPT_ARG_ENCRYPT),
+	AST_APP_OPTION('f', OPT_PAYLOAD_FILE),
+	AST_APP_OPTION('p', OPT_PERSIST),
+	AST_APP_OPTION('u', OPT_PAYLOAD_SOCKET),
+	AST_APP_OPTION('v', OPT_PAYLOAD_VAR),
+});
+
+enum cid_option_flags {
+	OPT_CID_V23     = (1 << 14),
+	OPT_CID_SEIZURE = (1 << 15),
+	OPT_CID_NOACK   = (1 << 16),
+};
+
+AST_APP_OPTIONS(cid_app_options, {
+	AST_APP_OPTION('n', OPT_CID_NOACK),
+	AST_APP_OPTION('s', OPT_CID_SEIZURE),
+	AST_APP_OPTION('v', OPT_CID_V23),
+});
+
+enum sms_option_flags {
+	OPT_SMS_SUBMIT  = (1 << 17),
+	OPT_SMS_SPOOL   = (1 << 18),
+	OPT_SMS_TIMEOUT = (1 << 19),
+};
+
+enum sms_option_args {
+	OPT_ARG_SMS_TIMEOUT,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_SMS_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(sms_app_options, {
+	AST_APP_OPTION('d', OPT_SMS_SPOOL),
+	AST_APP_OPTION('s', OPT_SMS_SUBMIT),
+	AST_APP_OPTION_ARG('t', OPT_SMS_TIMEOUT, OPT_ARG_SMS_TIMEOUT),
+});
+
+enum relay_option_flags {
+	OPT_RELAY_T140  = (1 << 20),
+	OPT_RELAY_STOP  = (1 << 21),
+};
+
+AST_APP_OPTIONS(relay_app_options, {
+	AST_APP_OPTION('t', OPT_RELAY_T140),
+	AST_APP_OPTION('x', OPT_RELAY_STOP),
+});
+
+AST_APP_OPTIONS(queue_app_options, {
+	AST_APP_OPTION('b', OPT_BACKGROUND),
+	AST_APP_OPTION_ARG('j', OPT_OUTBOUND_JOB, OPT_ARG_OUTBOUND_JOB),
+	AST_APP_OPTION('p', OPT_PERSIST),
 });
 
+/* Messages that may wait on a single channel queue */
+#define FSK_QUEUE_MAX       256
+
+/* Shared-memory export ring geometry, records are batched per received frame */
+#define FSK_SHM_SLOTS       4096
+#define FSK_SHM_SLOT_SIZE   256
+#define FSK_SHM_STAGE       (FSK_SHM_SLOT_SIZE - sizeof(struct fsk_shm_slot))
+
+/* Upper bound for the bytes= setting of [ami], received bytes are raised in batches of at most this */
+#define FSK_AMI_BATCH_MAX   1024
+
+/* A persistent receiver considers the message complete after this many character times of mark-idle */
+#define FSK_IDLE_EOM_CHARS  10
+
+/* spandsp keeps the baud rate in units of 0.01 baud */
+#define FSK_SPEC_BAUD(spec) ((spec)->baud_rate / 100)
+
+/*! \brief Framing of queued messages, whatever the profile they are played with */
+static struct fsk_framing fsk_framing_8n1;
+
 struct receive_buffer_s {
+	struct fsk_receive rcv;         /* first, the receive callbacks get back here from it */
+	struct fsk_quality quality;     /* line measured while the carrier is up, fed by rcv */
+	struct fsk_agc agc;             /* ahead of the demodulator when [agc] is enabled */
 	int ptr;
-	int quitoncarrierlost;
-	int FSK_eof;
+	int size;
 	char *buffer;
+	struct fsk_sink *sink;          /* streams bytes out instead of accumulating them in buffer */
+	int shm;                        /* export to the shared-memory ring as well */
+	uint64_t shm_session;
+	uint32_t shm_seq;
+	int shm_len;
+	unsigned char shm_stage[FSK_SHM_SLOT_SIZE];
+	struct ast_channel *ami;        /* raise manager events on behalf of this channel */
+	unsigned int ami_receive;
+	unsigned int ami_seq;
+	int ami_len;
+	struct timeval ami_first;       /* when the oldest staged byte arrived */
+	unsigned char ami_stage[FSK_AMI_BATCH_MAX];
+};
+
+/*! \brief A queued message, already framed as the bit sequence put_bit() would produce */
+struct fsk_queue_entry {
+	AST_LIST_ENTRY(fsk_queue_entry) list;
+	int bits;
+	unsigned char frame[0];
+};
+
+AST_LIST_HEAD_NOLOCK(fsk_queue, fsk_queue_entry);
+
+/*! \brief Where SendFSK reads its payload from */
+struct fsk_payload {
+	const char *data;
+	size_t len;
+	void *map;                      /*!< mmap()ed file backing data, if any */
+	char *copy;                     /*!< heap copy backing data, if any */
+	unsigned char *sealed;          /*!< encrypted copy backing data, if any */
+	struct fsk_source *source;      /*!< streamed payload, data is unused */
 };
 
 struct transmit_buffer_s {
@@ -151,288 +924,7349 @@ struct transmit_buffer_s {
 	int bytes2send;
 	int current_bit_no;
 	char *buffer;
+	struct fsk_source *source;      /* streamed payload, used once the buffer is exhausted */
+	int current_byte;
+	const struct fsk_framing *framing;
+	uint16_t current_frame;         /* character being sent, from framing */
+	int draining;                   /* pull from the queue once the buffer is exhausted */
+	int framed_bit;
+	struct fsk_queue_entry *framed; /* queued message being played */
+	struct fsk_queue queue;
+	int queued;
+	int crc;                        /* CRC-16 trailer: 0 none, 1 accumulating, 2 being sent */
+	uint16_t crc_value;
+	unsigned char trailer[2];
 };
 
 typedef struct transmit_buffer_s transmit_buffer_t;
 typedef struct receive_buffer_s  receive_buffer_t;
 
-static const char app_fskTX[] = "SendFSK";
-static const char app_fskRX[] = "ReceiveFSK";
+/*!
+ * \brief A worker thread of the module
+ *
+ * Sink writers, source readers and outbound workers run on their own and
+ * end when their owner lets them. They are still joined, on unload at the
+ * latest, so none is left running module code once it is gone.
+ */
+struct fsk_thread {
+	pthread_t id;
+	void *(*start)(void *);
+	void *data;
+	int done;                       /*!< start has returned, joining will not block */
+	AST_LIST_ENTRY(fsk_thread) list;
+};
 
-static void rx_status(void *user_data, int status){
-	receive_buffer_t *data;
+static AST_LIST_HEAD_STATIC(fsk_threads, fsk_thread);
 
-	data = (receive_buffer_t *) user_data;
-	ast_debug(1, "FSK rx status is %s (%d)\n", signal_status_to_str(status), status);
-	if ((status == -1) && (data->quitoncarrierlost)) {
-		data->FSK_eof = 1;
-	}
+static void *fsk_thread_run(void *data)
+{
+	struct fsk_thread *thread = data;
+	void *res = thread->start(thread->data);
+
+	AST_LIST_LOCK(&fsk_threads);
+	thread->done = 1;
+	AST_LIST_UNLOCK(&fsk_threads);
+	return res;
 }
 
-static void get_bit(void *user_data, int bit)
+/*! \brief Called with fsk_threads locked, join the threads that have ended */
+static void fsk_threads_reap(void)
 {
-	receive_buffer_t *data;
+	struct fsk_thread *thread;
 
-	data=(receive_buffer_t *) user_data;
-	if (bit < 0) {
-		rx_status(user_data, bit);
-		return;
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&fsk_threads, thread, list) {
+		if (thread->done) {
+			AST_LIST_REMOVE_CURRENT(list);
+			pthread_join(thread->id, NULL);
+			ast_free(thread);
+		}
 	}
+	AST_LIST_TRAVERSE_SAFE_END;
+}
+
+static int fsk_thread_start(void *(*start)(void *), void *data)
+{
+	struct fsk_thread *thread;
 
-	ast_debug(1, "Got '%c' on the stream\n", (char) bit & 0xff);
-	*(data->buffer + data->ptr++)=(char) bit & 0xff;
+	if (!(thread = ast_calloc(1, sizeof(*thread)))) {
+		return -1;
+	}
+	thread->start = start;
+	thread->data = data;
+	AST_LIST_LOCK(&fsk_threads);
+	fsk_threads_reap();
+	if (ast_pthread_create_background(&thread->id, NULL, fsk_thread_run, thread)) {
+		AST_LIST_UNLOCK(&fsk_threads);
+		ast_free(thread);
+		return -1;
+	}
+	AST_LIST_INSERT_TAIL(&fsk_threads, thread, list);
+	AST_LIST_UNLOCK(&fsk_threads);
+	return 0;
 }
 
-static int put_bit(transmit_buffer_t *user_data)
+/*! \brief Wait for every worker thread, once nothing can start another */
+static void fsk_threads_join(void)
 {
-	int8_t data;
+	struct fsk_thread *thread;
 
-	if (user_data->ptr <= user_data->bytes2send) {
-		if ( (user_data->current_bit_no != 0) && (user_data->current_bit_no != 9) ) {
-			data = *((int8_t *)user_data->buffer + user_data->ptr) & (1 << (user_data->current_bit_no - 1));
-		} else if (user_data->current_bit_no != 9) {
-			data = 0;
-		} else {
-			data = 1;
-		}
-		++user_data->current_bit_no;
-		if (user_data->current_bit_no == 10) {
-			user_data->ptr++;
-		}
-		if (user_data->current_bit_no == 10) {
-			user_data->current_bit_no = 0;
+	for (;;) {
+		AST_LIST_LOCK(&fsk_threads);
+		thread = AST_LIST_REMOVE_HEAD(&fsk_threads, list);
+		AST_LIST_UNLOCK(&fsk_threads);
+		if (!thread) {
+			break;
 		}
-		return data != 0 ? 1 : 0;
-	} else {
-		return 1;
+		/* the list is unlocked, a thread that ends marks itself done under it */
+		pthread_join(thread->id, NULL);
+		ast_free(thread);
 	}
 }
 
-static int fskTX_exec(struct ast_channel *chan, const char *data) { /* SendFSK */
-	typedef struct ast_frame ast_frame_t;
-	char *argcopy = NULL;
-	fsk_tx_state_t *caller_tx;
-	transmit_buffer_t *out;
-	int16_t caller_amp[BLOCK_LEN];
-	ast_frame_t *fr;
-	struct ast_frame f = {
-		.frametype = AST_FRAME_VOICE,
-		.src = "SendFSK",
-		.datalen = BLOCK_LEN * 2,
-		.samples = BLOCK_LEN,
-		.data.ptr = &caller_amp,
-	};
-	struct ast_format * native_format;
-	unsigned int sampling_rate;
-	struct ast_format * write_format;
-	int samples;
-	int modem;
-	int res = 0;
+/*!
+ * \brief Single producer, single consumer byte ring
+ *
+ * The producer only moves head and the consumer only moves tail, so the
+ * channel thread can hand bytes to a worker thread without taking a lock.
+ */
+struct fsk_ring {
+	unsigned char *buf;
+	size_t size;                    /*!< power of two */
+	size_t head;
+	size_t tail;
+};
 
-	AST_DECLARE_APP_ARGS(arglist,
-		AST_APP_ARG(modem);
+static int fsk_ring_init(struct fsk_ring *ring, size_t size)
+{
+	ring->buf = ast_malloc(size);
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	return ring->buf ? 0 : -1;
+}
+
+static void fsk_ring_free(struct fsk_ring *ring)
+{
+	ast_free(ring->buf);
+	ring->buf = NULL;
+}
+
+static size_t fsk_ring_used(struct fsk_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/*! \brief Producer side, returns how many bytes fitted */
+static size_t fsk_ring_put(struct fsk_ring *ring, const void *data, size_t len)
+{
+	size_t head = ring->head;
+	size_t space = ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+	size_t first;
+
+	len = MIN(len, space);
+	first = MIN(len, ring->size - (head & (ring->size - 1)));
+	memcpy(ring->buf + (head & (ring->size - 1)), data, first);
+	memcpy(ring->buf, (const unsigned char *) data + first, len - first);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+/*! \brief Consumer side, returns the length of the contiguous readable span at *data */
+static size_t fsk_ring_peek(struct fsk_ring *ring, const unsigned char **data)
+{
+	size_t tail = ring->tail;
+	size_t used = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+
+	*data = ring->buf + (tail & (ring->size - 1));
+	return MIN(used, ring->size - (tail & (ring->size - 1)));
+}
+
+static void fsk_ring_consume(struct fsk_ring *ring, size_t len)
+{
+	__atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+}
+
+#define FSK_SINK_RING_SIZE  65536
+/* The writer wakes up when this much is buffered, or every FSK_SINK_FLUSH_MS */
+#define FSK_SINK_BATCH      1024
+#define FSK_SINK_FLUSH_MS   200
+/* Longest wait between two tries at a FIFO nobody reads or a socket nobody listens on */
+#define FSK_SINK_RETRY_MS   5000
+
+/*!
+ * \brief Write-behind destination for received bytes
+ *
+ * The channel thread only fills the ring, a writer thread owns the
+ * file descriptor so a slow disk or an idle FIFO reader never stalls the
+ * demodulator. Bytes that do not fit in the ring are dropped and counted.
+ */
+struct fsk_sink {
+	struct fsk_ring ring;
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	int fd;
+	int socket;                     /*!< path is a listening Unix stream socket */
+	int fifo;                       /*!< path was a FIFO, it is never created */
+	int closing;
+	unsigned int dropped;
+	unsigned int attempts;          /*!< at opening the path */
+	size_t written;
+	char path[0];
+};
+
+static void fsk_sink_destructor(void *obj)
+{
+	struct fsk_sink *sink = obj;
+
+	if (sink->fd >= 0) {
+		close(sink->fd);
+	}
+	fsk_ring_free(&sink->ring);
+	ast_mutex_destroy(&sink->lock);
+	ast_cond_destroy(&sink->cond);
+}
+
+static int fsk_unix_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+	int fd;
+	int err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	ast_copy_string(addr.sun_path, path, sizeof(addr.sun_path));
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/*!
+ * \retval 0 the sink is open
+ * \retval 1 nobody is listening yet, try again on the next flush
+ * \retval -1 the sink cannot be opened
+ */
+static int fsk_sink_open(struct fsk_sink *sink)
+{
+	struct stat st;
+	int fd;
+	int flags;
+
+	if (sink->socket) {
+		fd = fsk_unix_connect(sink->path);
+		if (fd < 0 && (errno == ENOENT || errno == ECONNREFUSED)) {
+			return 1;
+		}
+	} else {
+		/* never create what should be a FIFO as a file that grows without a reader */
+		if (!stat(sink->path, &st) && S_ISFIFO(st.st_mode)) {
+			sink->fifo = 1;
+		}
+		fd = open(sink->path, O_WRONLY | O_APPEND | O_NONBLOCK | (sink->fifo ? 0 : O_CREAT), 0644);
+		/* non blocking open fails with ENXIO on a FIFO nobody reads yet */
+		if (fd < 0 && (errno == ENXIO || (sink->fifo && errno == ENOENT))) {
+			return 1;
+		}
+	}
+	if (fd < 0) {
+		ast_log(LOG_WARNING, "Unable to open FSK sink '%s': %s\n", sink->path, strerror(errno));
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	sink->fd = fd;
+	return 0;
+}
+
+static void *fsk_sink_writer(void *data)
+{
+	struct fsk_sink *sink = data;
+	const unsigned char *chunk;
+	struct timeval wait;
+	struct timespec ts;
+	size_t len;
+	ssize_t res;
+	int closing;
+	int failed = 0;
+	int retry = 0;                  /* ms to wait before the next try at opening, 0 once open */
+	int opened;
+
+	for (;;) {
+		ast_mutex_lock(&sink->lock);
+		/* a full batch does not hurry a try at a path nobody is on yet, only closing does */
+		wait = ast_tvadd(ast_tvnow(), ast_samp2tv(retry ? retry : FSK_SINK_FLUSH_MS, 1000));
+		ts.tv_sec = wait.tv_sec;
+		ts.tv_nsec = wait.tv_usec * 1000;
+		while (!sink->closing && (retry || fsk_ring_used(&sink->ring) < FSK_SINK_BATCH)) {
+			if (ast_cond_timedwait(&sink->cond, &sink->lock, &ts) == ETIMEDOUT) {
+				break;
+			}
+		}
+		closing = sink->closing;
+		ast_mutex_unlock(&sink->lock);
+
+		if (sink->fd < 0 && !failed) {
+			__atomic_add_fetch(&sink->attempts, 1, __ATOMIC_RELAXED);
+			opened = fsk_sink_open(sink);
+		} else {
+			opened = 0;
+		}
+		if (opened) {
+			if (opened < 0) {
+				failed = 1;
+			} else if (!closing) {
+				retry = retry ? MIN(retry * 2, FSK_SINK_RETRY_MS) : FSK_SINK_FLUSH_MS;
+				continue;
+			} else {
+				ast_log(LOG_WARNING, "Nobody is reading FSK sink '%s', dropping %zu bytes\n",
+					sink->path, fsk_ring_used(&sink->ring));
+				break;
+			}
+		}
+		retry = 0;
+		while ((len = fsk_ring_peek(&sink->ring, &chunk))) {
+			res = failed ? len : write(sink->fd, chunk, len);
+			if (res < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				ast_log(LOG_WARNING, "Write to FSK sink '%s' failed: %s\n", sink->path, strerror(errno));
+				failed = 1;
+				continue;
+			}
+			if (!failed) {
+				sink->written += res;
+			}
+			fsk_ring_consume(&sink->ring, res);
+		}
+		if (closing) {
+			break;
+		}
+	}
+	ast_debug(1, "FSK sink '%s' closed, %zu bytes written\n", sink->path, sink->written);
+	ao2_ref(sink, -1);
+	return NULL;
+}
+
+static struct fsk_sink *fsk_sink_alloc(const char *path, int socket)
+{
+	struct fsk_sink *sink;
+
+	sink = ao2_alloc(sizeof(*sink) + strlen(path) + 1, fsk_sink_destructor);
+	if (!sink) {
+		return NULL;
+	}
+	strcpy(sink->path, path); /* Safe */
+	sink->fd = -1;
+	sink->socket = socket;
+	ast_mutex_init(&sink->lock);
+	ast_cond_init(&sink->cond, NULL);
+	if (fsk_ring_init(&sink->ring, FSK_SINK_RING_SIZE)) {
+		ao2_ref(sink, -1);
+		return NULL;
+	}
+	if (fsk_thread_start(fsk_sink_writer, ao2_bump(sink))) {
+		ast_log(LOG_WARNING, "Unable to start writer for FSK sink '%s'\n", path);
+		ao2_ref(sink, -2);
+		return NULL;
+	}
+	return sink;
+}
+
+static void fsk_sink_put(struct fsk_sink *sink, unsigned char byte)
+{
+	if (!fsk_ring_put(&sink->ring, &byte, 1)) {
+		sink->dropped++;
+		return;
+	}
+	if (fsk_ring_used(&sink->ring) == FSK_SINK_BATCH) {
+		ast_mutex_lock(&sink->lock);
+		ast_cond_signal(&sink->cond);
+		ast_mutex_unlock(&sink->lock);
+	}
+}
+
+/*! \brief Let the writer flush what is left and drop our reference */
+static void fsk_sink_close(struct fsk_sink *sink)
+{
+	if (sink->dropped) {
+		ast_log(LOG_WARNING, "FSK sink '%s' overran, %u bytes dropped\n", sink->path, sink->dropped);
+	}
+	ast_mutex_lock(&sink->lock);
+	sink->closing = 1;
+	ast_cond_signal(&sink->cond);
+	ast_mutex_unlock(&sink->lock);
+	ao2_ref(sink, -1);
+}
+
+#define FSK_SOURCE_RING_SIZE 16384
+#define FSK_SOURCE_POLL_MS  100
+
+/*!
+ * \brief Streamed payload read from a Unix socket
+ *
+ * A reader thread fills the ring and stops reading while it is
+ * full, which lets the socket buffers push back on the sender. The
+ * modulator takes bytes from the ring without locking.
+ */
+struct fsk_source {
+	struct fsk_ring ring;
+	int fd;
+	int eof;
+	int closing;
+	char path[0];
+};
+
+static void fsk_source_destructor(void *obj)
+{
+	struct fsk_source *source = obj;
+
+	if (source->fd >= 0) {
+		close(source->fd);
+	}
+	fsk_ring_free(&source->ring);
+}
+
+static void *fsk_source_reader(void *data)
+{
+	struct fsk_source *source = data;
+	unsigned char buf[4096];
+	struct pollfd pfd = { .fd = source->fd, .events = POLLIN, };
+	size_t space;
+	ssize_t res;
+
+	while (!__atomic_load_n(&source->closing, __ATOMIC_ACQUIRE)) {
+		space = source->ring.size - fsk_ring_used(&source->ring);
+		if (!space) {
+			usleep(FSK_SOURCE_POLL_MS * 1000 / 10);
+			continue;
+		}
+		if (poll(&pfd, 1, FSK_SOURCE_POLL_MS) <= 0) {
+			continue;
+		}
+		res = read(source->fd, buf, MIN(space, sizeof(buf)));
+		if (res < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (res <= 0) {
+			if (res < 0) {
+				ast_log(LOG_WARNING, "Read from FSK source '%s' failed: %s\n", source->path, strerror(errno));
+			}
+			break;
+		}
+		fsk_ring_put(&source->ring, buf, res);
+	}
+	__atomic_store_n(&source->eof, 1, __ATOMIC_RELEASE);
+	ao2_ref(source, -1);
+	return NULL;
+}
+
+static struct fsk_source *fsk_source_alloc(const char *path)
+{
+	struct fsk_source *source;
+
+	source = ao2_alloc(sizeof(*source) + strlen(path) + 1, fsk_source_destructor);
+	if (!source) {
+		return NULL;
+	}
+	strcpy(source->path, path); /* Safe */
+	if (fsk_ring_init(&source->ring, FSK_SOURCE_RING_SIZE)) {
+		source->fd = -1;
+		ao2_ref(source, -1);
+		return NULL;
+	}
+	if ((source->fd = fsk_unix_connect(path)) < 0) {
+		ast_log(LOG_WARNING, "Unable to connect to FSK source '%s': %s\n", path, strerror(errno));
+		ao2_ref(source, -1);
+		return NULL;
+	}
+	if (fsk_thread_start(fsk_source_reader, ao2_bump(source))) {
+		ast_log(LOG_WARNING, "Unable to start reader for FSK source '%s'\n", path);
+		ao2_ref(source, -2);
+		return NULL;
+	}
+	return source;
+}
+
+/*! \brief Modulator side, returns 0 if the reader has not caught up yet */
+static int fsk_source_get(struct fsk_source *source, int *byte)
+{
+	const unsigned char *data;
+
+	if (!fsk_ring_peek(&source->ring, &data)) {
+		return 0;
+	}
+	*byte = *data;
+	fsk_ring_consume(&source->ring, 1);
+	return 1;
+}
+
+/*! \brief Whether the source may still produce bytes */
+static int fsk_source_pending(struct fsk_source *source)
+{
+	return !__atomic_load_n(&source->eof, __ATOMIC_ACQUIRE) || fsk_ring_used(&source->ring);
+}
+
+static void fsk_source_close(struct fsk_source *source)
+{
+	__atomic_store_n(&source->closing, 1, __ATOMIC_RELEASE);
+	ao2_ref(source, -1);
+}
+
+/* Seconds of CPU use the measured load is worked out over, and after which a sample replaces it outright */
+#define FSK_ADMISSION_SAMPLE 1
+#define FSK_ADMISSION_STALE 10
+/* How often a queued channel checks for a free slot, ms */
+#define FSK_ADMISSION_POLL  100
+
+/*! \brief Settings of the [admission] section of fsk.conf */
+struct fsk_admission_config {
+	unsigned int max_sessions;      /*!< 0 is no limit */
+	double cpu_budget;              /*!< percent of one core, 0 is no limit */
+	double session_cost;            /*!< percent of one core a session is taken to use until one is measured */
+	unsigned int queue_timeout;     /*!< seconds, 0 rejects at once */
+	char musicclass[MAX_MUSICCLASS];
+};
+
+/*! \brief A channel queued for a session slot, served in arrival order */
+struct fsk_admission_waiter {
+	AST_LIST_ENTRY(fsk_admission_waiter) list;
+};
+
+/*! \brief Held by a running application, or by a session for its carrier and framehook receive */
+struct fsk_admission_ticket {
+	struct timeval start;
+	uint64_t busy_ns;               /*!< spent modulating or demodulating */
+	int admitted;
+};
+
+/*! \brief What the load balancer and the dialplan see */
+struct fsk_admission_stats {
+	unsigned int sessions;
+	unsigned int queued;
+	unsigned int max_sessions;
+	double cpu_budget;
+	double load;                    /*!< percent of one core */
+	double session_cost;
+	double utilization;             /*!< percent of the tighter of the two limits */
+	unsigned long admitted;
+	unsigned long waited;
+	unsigned long rejected;
+	unsigned long timeouts;
+};
+
+static struct {
+	ast_mutex_t lock;
+	struct fsk_admission_config cfg;
+	AST_LIST_HEAD_NOLOCK(, fsk_admission_waiter) waiters;
+	unsigned int sessions;
+	unsigned int queued;
+	double load;
+	double session_cost;            /*!< learned from the sessions that ended */
+	uint64_t busy_ns;               /*!< of all sessions since the last sample, updated without the lock */
+	struct timeval sampled;
+	unsigned long admitted;
+	unsigned long waited;
+	unsigned long rejected;
+	unsigned long timeouts;
+} admission;
+
+static uint64_t fsk_admission_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*! \brief Fold the time sessions spent working since the last sample into the load, lock held */
+static void fsk_admission_sample(void)
+{
+	struct timeval now = ast_tvnow();
+	int64_t elapsed = ast_tvdiff_us(now, admission.sampled);
+	double load;
+
+	if (elapsed < FSK_ADMISSION_SAMPLE * 1000000) {
+		return;
+	}
+	load = __atomic_exchange_n(&admission.busy_ns, 0, __ATOMIC_RELAXED) / (elapsed * 10.0);
+	admission.load = elapsed > FSK_ADMISSION_STALE * 1000000 ? load : (admission.load + load) / 2;
+	admission.sampled = now;
+}
+
+/*!
+ * \brief Load the running sessions are expected to put on the host, lock held
+ *
+ * Sessions started since the last sample have not shown up in the measured
+ * load yet, so a burst of calls is charged their learned cost up front.
+ */
+static double fsk_admission_projected(void)
+{
+	return MAX(admission.load, admission.sessions * admission.session_cost);
+}
+
+/*! \brief Whether one more session fits, lock held */
+static int fsk_admission_fits(void)
+{
+	if (admission.cfg.max_sessions && admission.sessions >= admission.cfg.max_sessions) {
+		return 0;
+	}
+	return !(admission.cfg.cpu_budget > 0) || fsk_admission_projected() + admission.session_cost <= admission.cfg.cpu_budget;
+}
+
+static void fsk_admission_stats(struct fsk_admission_stats *stats)
+{
+	double utilization = 0;
+
+	ast_mutex_lock(&admission.lock);
+	fsk_admission_sample();
+	stats->sessions = admission.sessions;
+	stats->queued = admission.queued;
+	stats->max_sessions = admission.cfg.max_sessions;
+	stats->cpu_budget = admission.cfg.cpu_budget;
+	stats->load = admission.load;
+	stats->session_cost = admission.session_cost;
+	if (stats->max_sessions) {
+		utilization = 100.0 * stats->sessions / stats->max_sessions;
+	}
+	if (stats->cpu_budget > 0) {
+		utilization = MAX(utilization, 100.0 * fsk_admission_projected() / stats->cpu_budget);
+	}
+	stats->utilization = utilization;
+	stats->admitted = admission.admitted;
+	stats->waited = admission.waited;
+	stats->rejected = admission.rejected;
+	stats->timeouts = admission.timeouts;
+	ast_mutex_unlock(&admission.lock);
+}
+
+/*! \brief Take a session slot, lock held */
+static void fsk_admission_take(struct fsk_admission_ticket *ticket)
+{
+	admission.sessions++;
+	admission.admitted++;
+	ticket->start = ast_tvnow();
+	ticket->busy_ns = 0;
+	ticket->admitted = 1;
+}
+
+/*!
+ * \brief Admit a session at once or not at all, for what has no channel in the dialplan to queue
+ * \retval 0 admitted
+ * \retval 1 rejected
+ */
+static int fsk_admission_try(struct fsk_admission_ticket *ticket)
+{
+	int res = 0;
+
+	ticket->admitted = 0;
+	ast_mutex_lock(&admission.lock);
+	fsk_admission_sample();
+	if (AST_LIST_EMPTY(&admission.waiters) && fsk_admission_fits()) {
+		fsk_admission_take(ticket);
+	} else {
+		admission.rejected++;
+		res = 1;
+	}
+	ast_mutex_unlock(&admission.lock);
+	return res;
+}
+
+/*!
+ * \brief Admit a session, queueing the channel with music on hold while the module is at capacity
+ *
+ * Sets FSKADMISSION. A ticket that is not admitted needs no fsk_admission_leave().
+ *
+ * \retval 0 admitted
+ * \retval 1 rejected or timed out in the queue
+ * \retval -1 hangup while queued
+ */
+static int fsk_admission_enter(struct ast_channel *chan, struct fsk_admission_ticket *ticket)
+{
+	struct fsk_admission_waiter waiter;
+	char musicclass[MAX_MUSICCLASS];
+	struct timeval deadline;
+	const char *status = NULL;
+	int res = 0;
+
+	ticket->admitted = 0;
+	ast_mutex_lock(&admission.lock);
+	fsk_admission_sample();
+	if (AST_LIST_EMPTY(&admission.waiters) && fsk_admission_fits()) {
+		fsk_admission_take(ticket);
+		ast_mutex_unlock(&admission.lock);
+		pbx_builtin_setvar_helper(chan, "FSKADMISSION", "ADMITTED");
+		return 0;
+	}
+	if (!admission.cfg.queue_timeout) {
+		admission.rejected++;
+		ast_mutex_unlock(&admission.lock);
+		ast_verb(3, "FSK session on %s rejected, module at capacity\n", ast_channel_name(chan));
+		pbx_builtin_setvar_helper(chan, "FSKADMISSION", "REJECTED");
+		return 1;
+	}
+	AST_LIST_INSERT_TAIL(&admission.waiters, &waiter, list);
+	admission.queued++;
+	admission.waited++;
+	deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(admission.cfg.queue_timeout, 1));
+	ast_copy_string(musicclass, admission.cfg.musicclass, sizeof(musicclass));
+	ast_mutex_unlock(&admission.lock);
+
+	ast_verb(3, "FSK session on %s queued, module at capacity\n", ast_channel_name(chan));
+	ast_moh_start(chan, S_OR(musicclass, NULL), NULL);
+	while (!status) {
+		if (ast_safe_sleep(chan, FSK_ADMISSION_POLL)) {
+			status = "HANGUP";
+			res = -1;
+		}
+		ast_mutex_lock(&admission.lock);
+		fsk_admission_sample();
+		if (status) {
+			/* hung up */
+		} else if (AST_LIST_FIRST(&admission.waiters) == &waiter && fsk_admission_fits()) {
+			fsk_admission_take(ticket);
+			status = "QUEUED";
+		} else if (ast_tvcmp(ast_tvnow(), deadline) >= 0) {
+			admission.timeouts++;
+			status = "TIMEOUT";
+			res = 1;
+		}
+		if (status) {
+			AST_LIST_REMOVE(&admission.waiters, &waiter, list);
+			admission.queued--;
+		}
+		ast_mutex_unlock(&admission.lock);
+	}
+	ast_moh_stop(chan);
+	pbx_builtin_setvar_helper(chan, "FSKADMISSION", status);
+	return res;
+}
+
+/*! \brief Charge the time since start, taken with fsk_admission_clock(), to the session */
+static void fsk_admission_charge(struct fsk_admission_ticket *ticket, uint64_t start)
+{
+	uint64_t ns;
+
+	if (!ticket || !ticket->admitted) {
+		return;
+	}
+	ns = fsk_admission_clock() - start;
+	ticket->busy_ns += ns;
+	__atomic_add_fetch(&admission.busy_ns, ns, __ATOMIC_RELAXED);
+}
+
+/*! \brief Give the slot back, and learn what a session costs from what this one took */
+static void fsk_admission_leave(struct fsk_admission_ticket *ticket)
+{
+	int64_t elapsed;
+
+	if (!ticket->admitted) {
+		return;
+	}
+	elapsed = ast_tvdiff_us(ast_tvnow(), ticket->start);
+	ast_mutex_lock(&admission.lock);
+	admission.sessions--;
+	if (elapsed >= FSK_ADMISSION_SAMPLE * 1000000) {
+		admission.session_cost = admission.session_cost * 0.8 + ticket->busy_ns / (elapsed * 10.0) * 0.2;
+	}
+	ast_mutex_unlock(&admission.lock);
+	ticket->admitted = 0;
+}
+
+/*! \brief Kernel every profile is made to use, NULL to let the tuner choose */
+static const struct fsk_kernel *fsk_kernel_pinned;
+
+/*! \brief Modem state that can outlive a single SendFSK/ReceiveFSK invocation */
+struct fsk_session {
+	struct fsk_profile *tx_profile;
+	struct fsk_profile *rx_profile;
+	struct fsk_mod *tx;             /*!< tx_state once a profile is prepared, else NULL */
+	fsk_rx_state_t *rx;             /*!< rx_state once a profile is prepared, else NULL */
+	struct fsk_mod tx_state;
+	fsk_rx_state_t rx_state;
+	struct fsk_shaping *tx_shaping; /*!< of tx_state, NULL if none */
+	struct fsk_mod_params *shaped;  /*!< what tx_state renders with a shaping, allocated on first use */
+	char codec[32];                 /*!< the channel sends with, for shapings picked by codec */
+	transmit_buffer_t out;
+	receive_buffer_t in;
+	unsigned int carrier:1;         /*!< mark-idle tone generator is active on the channel */
+	int rx_hook;                    /*!< framehook of a background receive, -1 if none */
+	struct fsk_admission_ticket ticket; /*!< slot of the held carrier and the framehook receive, or of a private session */
+	struct fsk_recorder *recorder;  /*!< last seconds of audio, NULL if not recording */
+};
+
+static const char app_fskTX[] = "SendFSK";
+static const char app_fskRX[] = "ReceiveFSK";
+static const char app_fskTXQueue[] = "SendFSKQueue";
+static const char app_cidfsk[] = "CidT2FSK";
+static const char app_smsTX[] = "SendFSKSMS";
+static const char app_smsRX[] = "ReceiveFSKSMS";
+static const char app_relay[] = "FSKRelay";
+static const char fsk_config_file[] = "fsk.conf";
+
+/*! \brief Shared-memory export of received data, see fsk_shm.h for the layout */
+static struct fsk_shm_header *fsk_shm;
+static size_t fsk_shm_size;
+static uint64_t fsk_shm_sessions;
+
+static int fsk_shm_create(void)
+{
+	struct fsk_shm_header *hdr;
+	size_t header_size = FSK_SHM_SLOT_SIZE;
+	int fd;
+
+	fsk_shm_size = header_size + FSK_SHM_SLOTS * FSK_SHM_SLOT_SIZE;
+	fd = shm_open(FSK_SHM_NAME, O_CREAT | O_RDWR | O_TRUNC, 0640);
+	if (fd < 0) {
+		ast_log(LOG_WARNING, "Unable to create shared memory '%s': %s\n", FSK_SHM_NAME, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, fsk_shm_size)) {
+		ast_log(LOG_WARNING, "Unable to size shared memory '%s': %s\n", FSK_SHM_NAME, strerror(errno));
+		close(fd);
+		shm_unlink(FSK_SHM_NAME);
+		return -1;
+	}
+	hdr = mmap(NULL, fsk_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		ast_log(LOG_WARNING, "Unable to map shared memory '%s': %s\n", FSK_SHM_NAME, strerror(errno));
+		shm_unlink(FSK_SHM_NAME);
+		return -1;
+	}
+	hdr->version = FSK_SHM_VERSION;
+	hdr->header_size = header_size;
+	hdr->slot_size = FSK_SHM_SLOT_SIZE;
+	hdr->slot_count = FSK_SHM_SLOTS;
+	hdr->write_seq = 0;
+	/* consumers check the magic last */
+	__atomic_store_n(&hdr->magic, FSK_SHM_MAGIC, __ATOMIC_RELEASE);
+	fsk_shm = hdr;
+	return 0;
+}
+
+static void fsk_shm_destroy(void)
+{
+	if (!fsk_shm) {
+		return;
+	}
+	munmap(fsk_shm, fsk_shm_size);
+	shm_unlink(FSK_SHM_NAME);
+	fsk_shm = NULL;
+}
+
+/*! \brief Append a record, claiming its slot with an atomic increment so writers never lock each other out */
+static void fsk_shm_publish(uint64_t session, uint32_t *session_seq, int type, const void *data, size_t len)
+{
+	struct fsk_shm_slot *slot;
+	struct timeval now;
+	uint64_t n;
+
+	if (!fsk_shm) {
+		return;
+	}
+	len = MIN(len, FSK_SHM_STAGE);
+	now = ast_tvnow();
+	n = __atomic_fetch_add(&fsk_shm->write_seq, 1, __ATOMIC_ACQ_REL);
+	slot = fsk_shm_slot(fsk_shm, n);
+	__atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->session = session;
+	slot->timestamp_us = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	slot->session_seq = (*session_seq)++;
+	slot->type = type;
+	slot->length = len;
+	memcpy(slot->data, data, len);
+	__atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+}
+
+/*! \brief Publish what the receiver staged since the last frame */
+static void fsk_shm_flush(receive_buffer_t *in)
+{
+	if (in->shm_len) {
+		fsk_shm_publish(in->shm_session, &in->shm_seq, FSK_SHM_DATA, in->shm_stage, in->shm_len);
+		in->shm_len = 0;
+	}
+}
+
+/*! \brief Inbound spool settings, from the [spool] section of fsk.conf */
+struct fsk_spool_config {
+	int enabled;
+	char directory[PATH_MAX];
+	unsigned int commit_interval;   /*!< ms a commit waits for other sessions to join it */
+	size_t segment_size;            /*!< bytes after which a new segment is started */
+	unsigned int retention_segments;
+	unsigned int retention_days;
+};
+
+#define FSK_SPOOL_MAGIC     "FSK1"
+
+/*! \brief A received message waiting for the next group commit */
+struct fsk_spool_record {
+	AST_LIST_ENTRY(fsk_spool_record) list;
+	size_t len;
+	unsigned char data[0];
+};
+
+/*!
+ * \brief Durable log of received messages
+ *
+ * Sessions append records to a pending list and sleep until the spool
+ * thread has made them durable. The thread waits commit_interval for more
+ * sessions to join, writes the whole batch and calls fdatasync() once for
+ * all of them.
+ */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t work;
+	ast_cond_t done;
+	struct fsk_spool_config cfg;
+	AST_LIST_HEAD_NOLOCK(, fsk_spool_record) pending;
+	uint64_t next_ticket;
+	uint64_t committed;
+	uint64_t failed;                /*!< last ticket whose commit failed */
+	pthread_t thread;
+	int running;
+	int rotate;
+	int fd;
+	size_t segment_bytes;
+	unsigned int segment_no;
+} spool = {
+	.thread = AST_PTHREADT_NULL,
+	.fd = -1,
+};
+
+static int fsk_spool_segment_filter(const struct dirent *entry)
+{
+	size_t len = strlen(entry->d_name);
+
+	return len > 7 && !strcmp(entry->d_name + len - 7, ".fsklog");
+}
+
+/*! \brief Remove the oldest segments beyond the configured count or age, segment names sort by age */
+static void fsk_spool_retention(const struct fsk_spool_config *cfg)
+{
+	struct dirent **entries;
+	char path[PATH_MAX];
+	struct stat st;
+	time_t limit = cfg->retention_days ? time(NULL) - cfg->retention_days * 86400 : 0;
+	int count;
+	int i;
+
+	count = scandir(cfg->directory, &entries, fsk_spool_segment_filter, alphasort);
+	if (count < 0) {
+		return;
+	}
+	/* the last entry is the segment being written */
+	for (i = 0; i < count - 1; i++) {
+		snprintf(path, sizeof(path), "%s/%s", cfg->directory, entries[i]->d_name);
+		if ((cfg->retention_segments && count - i > cfg->retention_segments)
+			|| (limit && !stat(path, &st) && st.st_mtime < limit)) {
+			ast_debug(1, "Removing spool segment %s\n", path);
+			unlink(path);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		ast_std_free(entries[i]);
+	}
+	ast_std_free(entries);
+}
+
+static int fsk_spool_open_segment(const struct fsk_spool_config *cfg)
+{
+	char path[PATH_MAX];
+	struct timeval now = ast_tvnow();
+
+	if (spool.fd >= 0) {
+		close(spool.fd);
+		spool.fd = -1;
+	}
+	if (ast_mkdir(cfg->directory, 0755)) {
+		ast_log(LOG_WARNING, "Unable to create spool directory '%s': %s\n", cfg->directory, strerror(errno));
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%010ld%06ld-%04u.fsklog", cfg->directory,
+		(long) now.tv_sec, (long) now.tv_usec, spool.segment_no++ % 10000);
+	spool.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0640);
+	if (spool.fd < 0) {
+		ast_log(LOG_WARNING, "Unable to open spool segment '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	spool.segment_bytes = 0;
+	fsk_spool_retention(cfg);
+	return 0;
+}
+
+/*! \brief Write a batch with as few system calls as possible */
+static int fsk_spool_write_batch(struct fsk_spool_record *first)
+{
+	struct iovec iov[64];
+	struct fsk_spool_record *rec = first;
+	ssize_t res;
+	size_t expected;
+	int n;
+
+	while (rec) {
+		expected = 0;
+		for (n = 0; rec && n < ARRAY_LEN(iov); n++, rec = AST_LIST_NEXT(rec, list)) {
+			iov[n].iov_base = rec->data;
+			iov[n].iov_len = rec->len;
+			expected += rec->len;
+		}
+		res = writev(spool.fd, iov, n);
+		if (res < 0 || (size_t) res != expected) {
+			ast_log(LOG_ERROR, "Unable to write FSK spool: %s\n", res < 0 ? strerror(errno) : "short write");
+			return -1;
+		}
+		spool.segment_bytes += res;
+	}
+	return 0;
+}
+
+static void *fsk_spool_thread(void *unused)
+{
+	struct fsk_spool_config cfg;
+	struct fsk_spool_record *batch;
+	struct fsk_spool_record *rec;
+	uint64_t last;
+	int res;
+
+	ast_mutex_lock(&spool.lock);
+	while (spool.running) {
+		if (AST_LIST_EMPTY(&spool.pending)) {
+			ast_cond_wait(&spool.work, &spool.lock);
+			continue;
+		}
+		cfg = spool.cfg;
+		if (cfg.commit_interval) {
+			/* let concurrent sessions join this commit */
+			ast_mutex_unlock(&spool.lock);
+			usleep(cfg.commit_interval * 1000);
+			ast_mutex_lock(&spool.lock);
+		}
+		batch = AST_LIST_FIRST(&spool.pending);
+		AST_LIST_HEAD_INIT_NOLOCK(&spool.pending);
+		last = spool.next_ticket;
+		if (spool.rotate && spool.fd >= 0) {
+			close(spool.fd);
+			spool.fd = -1;
+		}
+		spool.rotate = 0;
+		ast_mutex_unlock(&spool.lock);
+
+		res = 0;
+		if (spool.fd < 0 || spool.segment_bytes >= cfg.segment_size) {
+			res = fsk_spool_open_segment(&cfg);
+		}
+		if (!res) {
+			res = fsk_spool_write_batch(batch);
+		}
+		if (!res && fdatasync(spool.fd)) {
+			ast_log(LOG_ERROR, "Unable to sync FSK spool: %s\n", strerror(errno));
+			res = -1;
+		}
+		if (res && spool.fd >= 0) {
+			/* start from a fresh segment rather than appending after a torn record */
+			close(spool.fd);
+			spool.fd = -1;
+		}
+		while ((rec = batch)) {
+			batch = AST_LIST_NEXT(rec, list);
+			ast_free(rec);
+		}
+
+		ast_mutex_lock(&spool.lock);
+		spool.committed = last;
+		if (res) {
+			spool.failed = last;
+		}
+		ast_cond_broadcast(&spool.done);
+	}
+	ast_mutex_unlock(&spool.lock);
+	if (spool.fd >= 0) {
+		close(spool.fd);
+		spool.fd = -1;
+	}
+	return NULL;
+}
+
+static void fsk_spool_start(void)
+{
+	ast_mutex_lock(&spool.lock);
+	if (spool.running || !spool.cfg.enabled) {
+		ast_mutex_unlock(&spool.lock);
+		return;
+	}
+	spool.running = 1;
+	if (ast_pthread_create_background(&spool.thread, NULL, fsk_spool_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start FSK spool thread\n");
+		spool.running = 0;
+		spool.thread = AST_PTHREADT_NULL;
+	}
+	ast_mutex_unlock(&spool.lock);
+}
+
+static void fsk_spool_stop(void)
+{
+	ast_mutex_lock(&spool.lock);
+	if (!spool.running) {
+		ast_mutex_unlock(&spool.lock);
+		return;
+	}
+	/* the thread drains what is pending before it looks at the flag again */
+	while (!AST_LIST_EMPTY(&spool.pending)) {
+		ast_cond_wait(&spool.done, &spool.lock);
+	}
+	spool.running = 0;
+	ast_cond_signal(&spool.work);
+	ast_mutex_unlock(&spool.lock);
+	pthread_join(spool.thread, NULL);
+	spool.thread = AST_PTHREADT_NULL;
+}
+
+/*!
+ * \brief Durably append a received message to the spool
+ *
+ * The record is a fixed header, FSK1 then the metadata and payload lengths
+ * as native 32 bit integers, followed by key=value metadata lines and the
+ * payload bytes.
+ *
+ * \retval 0 the record is on disk
+ * \retval 1 the spool is disabled
+ * \retval -1 the commit failed
+ */
+static int fsk_spool_append(const char *meta, const void *payload, size_t len)
+{
+	struct fsk_spool_record *rec;
+	uint32_t meta_len = strlen(meta);
+	uint32_t payload_len = len;
+	uint64_t ticket;
+	int res;
+
+	rec = ast_malloc(sizeof(*rec) + 12 + meta_len + len);
+	if (!rec) {
+		return -1;
+	}
+	memcpy(rec->data, FSK_SPOOL_MAGIC, 4);
+	memcpy(rec->data + 4, &meta_len, 4);
+	memcpy(rec->data + 8, &payload_len, 4);
+	memcpy(rec->data + 12, meta, meta_len);
+	memcpy(rec->data + 12 + meta_len, payload, len);
+	rec->len = 12 + meta_len + len;
+	AST_LIST_NEXT(rec, list) = NULL;
+
+	ast_mutex_lock(&spool.lock);
+	if (!spool.running) {
+		ast_mutex_unlock(&spool.lock);
+		ast_free(rec);
+		return 1;
+	}
+	AST_LIST_INSERT_TAIL(&spool.pending, rec, list);
+	ticket = ++spool.next_ticket;
+	ast_cond_signal(&spool.work);
+	while (spool.committed < ticket) {
+		ast_cond_wait(&spool.done, &spool.lock);
+	}
+	res = spool.failed >= ticket ? -1 : 0;
+	ast_mutex_unlock(&spool.lock);
+	return res;
+}
+
+/*! \brief Spool a completed ReceiveFSK with its metadata */
+static int fsk_spool_received(struct ast_channel *chan, receive_buffer_t *in, struct timeval start, int crc_ok)
+{
+	struct ast_str *meta;
+	struct ast_party_caller *caller;
+	int res;
+
+	if (!(meta = ast_str_create(256))) {
+		return -1;
+	}
+	ast_channel_lock(chan);
+	caller = ast_channel_caller(chan);
+	ast_str_set(&meta, 0, "channel=%s\nuniqueid=%s\ncaller=%s\n",
+		ast_channel_name(chan), ast_channel_uniqueid(chan),
+		S_COR(caller->id.number.valid, caller->id.number.str, ""));
+	ast_channel_unlock(chan);
+	ast_str_append(&meta, 0, "start=%ld.%06ld\nduration_ms=%ld\nbytes=%d\ncrc=%s\n",
+		(long) start.tv_sec, (long) start.tv_usec, (long) ast_tvdiff_ms(ast_tvnow(), start),
+		in->rcv.received, in->rcv.crc ? (crc_ok ? "ok" : "error") : "none");
+	res = fsk_spool_append(ast_str_buffer(meta), in->buffer ? in->buffer : "", in->buffer ? in->ptr : 0);
+	ast_free(meta);
+	return res;
+}
+
+/*! \brief Line quality of a receive as channel variables, cleared if no bit was measured */
+static void fsk_quality_setvars(struct ast_channel *chan, const receive_buffer_t *in)
+{
+	struct fsk_quality_report r;
+	char value[6][32];
+	static const char *names[] = { "FSKLEVEL", "FSKSNR", "FSKBER", "FSKOFFSET", "FSKJITTER", "FSKIMBALANCE" };
+	int i;
+
+	fsk_quality_report(&in->quality, &r);
+	snprintf(value[0], sizeof(value[0]), "%.1f", r.level);
+	snprintf(value[1], sizeof(value[1]), "%.1f", r.snr);
+	snprintf(value[2], sizeof(value[2]), "%.2e", r.ber);
+	snprintf(value[3], sizeof(value[3]), "%.1f", r.offset);
+	snprintf(value[4], sizeof(value[4]), "%.1f", r.jitter);
+	snprintf(value[5], sizeof(value[5]), "%.1f", r.imbalance);
+	for (i = 0; i < ARRAY_LEN(names); i++) {
+		pbx_builtin_setvar_helper(chan, names[i], r.bits ? value[i] : NULL);
+	}
+}
+
+/*! \brief Line quality of a receive as manager headers, empty if no bit was measured */
+static void fsk_quality_headers(const receive_buffer_t *in, char *buf, size_t len)
+{
+	struct fsk_quality_report r;
+
+	fsk_quality_report(&in->quality, &r);
+	if (!r.bits) {
+		*buf = '\0';
+		return;
+	}
+	snprintf(buf, len, "Level: %.1f\r\nSNR: %.1f\r\nBER: %.2e\r\nFrequencyOffset: %.1f\r\nJitter: %.1f\r\n"
+		"Imbalance: %.1f\r\nBitsMeasured: %u\r\n",
+		r.level, r.snr, r.ber, r.offset, r.jitter, r.imbalance, r.bits);
+}
+
+/*! \brief Manager event batching, from the [ami] section of fsk.conf */
+struct fsk_ami_config {
+	unsigned int window;            /*!< ms a received byte may wait for others to join its event */
+	unsigned int bytes;             /*!< bytes that trigger an event regardless of window */
+	int base64;
+};
+
+static struct fsk_ami_config fsk_ami_cfg = {
+	.window = 100,
+	.bytes = 64,
+};
+AST_RWLOCK_DEFINE_STATIC(fsk_ami_lock);
+
+static unsigned int fsk_ami_receives;
+
+/*! \brief Raise the bytes staged so far as a single FSKReceiveData event */
+static void fsk_ami_flush(receive_buffer_t *in)
+{
+	char encoded[FSK_AMI_BATCH_MAX * 2 + 1];
+	int base64;
+	int i;
+
+	if (!in->ami_len) {
+		return;
+	}
+	ast_rwlock_rdlock(&fsk_ami_lock);
+	base64 = fsk_ami_cfg.base64;
+	ast_rwlock_unlock(&fsk_ami_lock);
+	if (base64) {
+		ast_base64encode(encoded, in->ami_stage, in->ami_len, sizeof(encoded));
+	} else {
+		for (i = 0; i < in->ami_len; i++) {
+			snprintf(encoded + i * 2, 3, "%02x", in->ami_stage[i]);
+		}
+	}
+	/*** DOCUMENTATION
+		<managerEvent language="en_US" name="FSKReceiveData">
+			<managerEventInstance class="EVENT_FLAG_CALL">
+				<synopsis>Raised with bytes ReceiveFSK demodulated, when its <literal>a</literal> option is given.</synopsis>
+				<syntax>
+					<parameter name="Channel" />
+					<parameter name="Uniqueid" />
+					<parameter name="ReceiveId">
+						<para>Identifies the ReceiveFSK execution the event belongs to.</para>
+					</parameter>
+					<parameter name="Seq">
+						<para>Counts the events of a ReceiveFSK execution from 1, a gap means events were lost.</para>
+					</parameter>
+					<parameter name="Length">
+						<para>Number of bytes in <replaceable>Data</replaceable>, once decoded.</para>
+					</parameter>
+					<parameter name="Encoding">
+						<enumlist>
+							<enum name="hex" />
+							<enum name="base64" />
+						</enumlist>
+					</parameter>
+					<parameter name="Data" />
+				</syntax>
+				<see-also>
+					<ref type="managerEvent">FSKCarrier</ref>
+					<ref type="managerEvent">FSKReceiveEnd</ref>
+				</see-also>
+			</managerEventInstance>
+		</managerEvent>
+	***/
+	manager_event(EVENT_FLAG_CALL, "FSKReceiveData",
+		"Channel: %s\r\n"
+		"Uniqueid: %s\r\n"
+		"ReceiveId: %u\r\n"
+		"Seq: %u\r\n"
+		"Length: %d\r\n"
+		"Encoding: %s\r\n"
+		"Data: %s\r\n",
+		ast_channel_name(in->ami), ast_channel_uniqueid(in->ami), in->ami_receive, ++in->ami_seq,
+		in->ami_len, base64 ? "base64" : "hex", encoded);
+	in->ami_len = 0;
+}
+
+/*! \brief Once per received frame, raise what has waited long enough */
+static void fsk_ami_poll(receive_buffer_t *in)
+{
+	unsigned int window;
+
+	if (!in->ami_len) {
+		return;
+	}
+	ast_rwlock_rdlock(&fsk_ami_lock);
+	window = fsk_ami_cfg.window;
+	ast_rwlock_unlock(&fsk_ami_lock);
+	if (ast_tvdiff_ms(ast_tvnow(), in->ami_first) >= window) {
+		fsk_ami_flush(in);
+	}
+}
+
+static void fsk_ami_carrier(receive_buffer_t *in, int up)
+{
+	fsk_ami_flush(in);
+	/*** DOCUMENTATION
+		<managerEvent language="en_US" name="FSKCarrier">
+			<managerEventInstance class="EVENT_FLAG_CALL">
+				<synopsis>Raised when ReceiveFSK acquires or loses the carrier, when its <literal>a</literal> option is given.</synopsis>
+				<syntax>
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='Channel'])" />
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='Uniqueid'])" />
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='ReceiveId'])" />
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='Seq'])" />
+					<parameter name="Status">
+						<enumlist>
+							<enum name="Up" />
+							<enum name="Down" />
+						</enumlist>
+					</parameter>
+				</syntax>
+			</managerEventInstance>
+		</managerEvent>
+	***/
+	manager_event(EVENT_FLAG_CALL, "FSKCarrier",
+		"Channel: %s\r\n"
+		"Uniqueid: %s\r\n"
+		"ReceiveId: %u\r\n"
+		"Seq: %u\r\n"
+		"Status: %s\r\n",
+		ast_channel_name(in->ami), ast_channel_uniqueid(in->ami), in->ami_receive, ++in->ami_seq,
+		up ? "Up" : "Down");
+}
+
+static void fsk_ami_end(receive_buffer_t *in)
+{
+	char quality[256];
+
+	fsk_ami_flush(in);
+	fsk_quality_headers(in, quality, sizeof(quality));
+	/*** DOCUMENTATION
+		<managerEvent language="en_US" name="FSKReceiveEnd">
+			<managerEventInstance class="EVENT_FLAG_CALL">
+				<synopsis>Raised when ReceiveFSK returns, when its <literal>a</literal> option is given.</synopsis>
+				<syntax>
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='Channel'])" />
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='Uniqueid'])" />
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='ReceiveId'])" />
+					<xi:include xpointer="xpointer(/docs/managerEvent[@name='FSKReceiveData']/managerEventInstance/syntax/parameter[@name='Seq'])" />
+					<parameter name="Bytes">
+						<para>Total number of bytes received.</para>
+					</parameter>
+					<parameter name="Level">
+						<para>Received level while the carrier was up, in dBm0.</para>
+					</parameter>
+					<parameter name="SNR">
+						<para>The tone against everything else in the voice band at the middle of each bit, in dB.</para>
+					</parameter>
+					<parameter name="BER">
+						<para>Bit error rate expected from how clearly each bit was decided.</para>
+					</parameter>
+					<parameter name="FrequencyOffset">
+						<para>Received tones against the nominal ones, in Hz.</para>
+					</parameter>
+					<parameter name="Jitter">
+						<para>RMS timing error of the tone changes, in percent of a bit.</para>
+					</parameter>
+					<parameter name="Imbalance">
+						<para>Mark level over space level, in dB.</para>
+					</parameter>
+					<parameter name="BitsMeasured">
+						<para>Bits the estimates are taken over. The line quality headers are left out when
+						the carrier never came up.</para>
+					</parameter>
+				</syntax>
+			</managerEventInstance>
+		</managerEvent>
+	***/
+	manager_event(EVENT_FLAG_CALL, "FSKReceiveEnd",
+		"Channel: %s\r\n"
+		"Uniqueid: %s\r\n"
+		"ReceiveId: %u\r\n"
+		"Seq: %u\r\n"
+		"Bytes: %d\r\n"
+		"%s",
+		ast_channel_name(in->ami), ast_channel_uniqueid(in->ami), in->ami_receive, ++in->ami_seq,
+		in->rcv.received, quality);
+}
+
+/*! \brief Carrier changes of a receive, once the receive core has taken them into account */
+static void rx_carrier(struct fsk_receive *rcv, int up)
+{
+	receive_buffer_t *data = (receive_buffer_t *) rcv;
+
+	ast_debug(1, "FSK carrier %s\n", up ? "up" : "down");
+	if (data->shm) {
+		fsk_shm_flush(data);
+		fsk_shm_publish(data->shm_session, &data->shm_seq, up ? FSK_SHM_CARRIER_UP : FSK_SHM_CARRIER_DOWN, NULL, 0);
+	}
+	if (data->ami) {
+		fsk_ami_carrier(data, up);
+	}
+}
+
+/*! \brief Received characters, once the receive core has taken them into account */
+static void rx_byte(struct fsk_receive *rcv, unsigned char byte)
+{
+	receive_buffer_t *data = (receive_buffer_t *) rcv;
+	int full;
+
+	ast_debug(1, "Got '%c' on the stream\n", (char) byte);
+	if (data->shm) {
+		data->shm_stage[data->shm_len++] = byte;
+		if (data->shm_len == FSK_SHM_STAGE) {
+			fsk_shm_flush(data);
+		}
+	}
+	if (data->ami) {
+		if (!data->ami_len) {
+			data->ami_first = ast_tvnow();
+		}
+		data->ami_stage[data->ami_len++] = byte;
+		ast_rwlock_rdlock(&fsk_ami_lock);
+		full = data->ami_len >= fsk_ami_cfg.bytes;
+		ast_rwlock_unlock(&fsk_ami_lock);
+		if (full) {
+			fsk_ami_flush(data);
+		}
+	}
+	if (data->sink) {
+		fsk_sink_put(data->sink, byte);
+		return;
+	}
+	if (!data->buffer || data->ptr >= data->size - 1) {
+		return;
+	}
+	*(data->buffer + data->ptr++) = (char) byte;
+}
+
+/*! \brief Frame a message, in the bit order put_bit() uses */
+static struct fsk_queue_entry *fsk_queue_entry_render(const char *payload, size_t len, const struct fsk_framing *framing)
+{
+	struct fsk_queue_entry *entry;
+	int bit = 0;
+	size_t i;
+	int j;
+
+	entry = ast_calloc(1, sizeof(*entry) + (len * framing->bits + 7) / 8);
+	if (!entry) {
+		return NULL;
+	}
+	for (i = 0; i < len; i++) {
+		for (j = 0; j < framing->bits; j++, bit++) {
+			if (framing->frame[(unsigned char) payload[i]] & (1 << j)) {
+				entry->frame[bit >> 3] |= 1 << (bit & 7);
+			}
+		}
+	}
+	entry->bits = bit;
+	return entry;
+}
+
+static int put_bit_queue(transmit_buffer_t *user_data)
+{
+	struct fsk_queue_entry *entry;
+	int bit;
+
+	if (!user_data->framed) {
+		user_data->framed = AST_LIST_REMOVE_HEAD(&user_data->queue, list);
+		user_data->framed_bit = 0;
+		if (!user_data->framed) {
+			return 1;
+		}
+		user_data->queued--;
+	}
+	entry = user_data->framed;
+	/* an entry with no bits sends one of mark and is gone */
+	bit = user_data->framed_bit < entry->bits ? (entry->frame[user_data->framed_bit >> 3] >> (user_data->framed_bit & 7)) & 1 : 1;
+	if (++user_data->framed_bit >= entry->bits) {
+		ast_free(entry);
+		user_data->framed = NULL;
+	}
+	return bit;
+}
+
+/*! \brief Queue the CRC-16 of what was sent so far as the last two bytes of the message */
+static void fsk_tx_crc_arm(transmit_buffer_t *out)
+{
+	uint16_t crc = out->crc_value ^ 0xffff;
+
+	out->trailer[0] = crc & 0xff;
+	out->trailer[1] = crc >> 8;
+	out->buffer = (char *) out->trailer;
+	out->bytes2send = sizeof(out->trailer);
+	out->ptr = 0;
+	out->crc = 2;
+}
+
+/*! \brief Framing of a streamed payload, idling on mark while the source has nothing to give */
+static int put_bit_source(transmit_buffer_t *user_data)
+{
+	int bit;
+
+	if (user_data->current_bit_no == 0) {
+		if (!fsk_source_get(user_data->source, &user_data->current_byte)) {
+			return 1;
+		}
+		if (user_data->crc == 1) {
+			uint8_t byte = user_data->current_byte;
+
+			user_data->crc_value = crc_itu16_calc(&byte, 1, user_data->crc_value);
+		}
+		user_data->current_frame = user_data->framing->frame[user_data->current_byte & 0xff];
+	}
+	bit = (user_data->current_frame >> user_data->current_bit_no) & 1;
+	if (++user_data->current_bit_no == user_data->framing->bits) {
+		user_data->current_bit_no = 0;
+	}
+	return bit;
+}
+
+/*! \brief Whether the modulator still has message bits to play */
+static int fsk_tx_pending(transmit_buffer_t *out)
+{
+	if (out->ptr < out->bytes2send || out->crc == 1) {
+		return 1;
+	}
+	if (out->source) {
+		return out->current_bit_no != 0 || fsk_source_pending(out->source);
+	}
+	return out->draining && (out->framed || !AST_LIST_EMPTY(&out->queue));
+}
+
+static int put_bit(transmit_buffer_t *user_data)
+{
+	int bit;
+
+	if (user_data->crc == 1 && user_data->ptr >= user_data->bytes2send && user_data->current_bit_no == 0
+		&& (!user_data->source || !fsk_source_pending(user_data->source))) {
+		fsk_tx_crc_arm(user_data);
+	}
+	if (user_data->ptr < user_data->bytes2send) {
+		if (user_data->current_bit_no == 0) {
+			if (user_data->crc == 1) {
+				user_data->crc_value = crc_itu16_calc((uint8_t *) user_data->buffer + user_data->ptr, 1, user_data->crc_value);
+			}
+			user_data->current_frame = user_data->framing->frame[(uint8_t) user_data->buffer[user_data->ptr]];
+		}
+		bit = (user_data->current_frame >> user_data->current_bit_no) & 1;
+		if (++user_data->current_bit_no == user_data->framing->bits) {
+			user_data->current_bit_no = 0;
+			user_data->ptr++;
+		}
+		return bit;
+	} else if (user_data->source) {
+		return put_bit_source(user_data);
+	} else if (user_data->draining) {
+		return put_bit_queue(user_data);
+	} else {
+		return 1;
+	}
+}
+
+/* Frames the recorder keeps per second of audio, both directions, with room for 10 ms frames */
+#define FSK_RECORDER_FRAMES_PER_SECOND 200
+
+/*! \brief Receive AGC, from the [agc] section of fsk.conf */
+struct fsk_agc_config {
+	int enabled;
+	struct fsk_agc_params params;   /*!< but the ceiling, which is the min_level of each profile */
+};
+
+static struct fsk_agc_config fsk_agc_cfg;
+AST_RWLOCK_DEFINE_STATIC(fsk_agc_lock);
+
+/*!
+ * \brief Set up the AGC of a receive on a modem, if enabled
+ * \return what goes in the agc of the struct fsk_receive
+ */
+static struct fsk_agc *fsk_agc_setup(struct fsk_agc *agc, const fsk_spec_t *spec)
+{
+	struct fsk_agc_params params;
+	int enabled;
+
+	ast_rwlock_rdlock(&fsk_agc_lock);
+	enabled = fsk_agc_cfg.enabled;
+	params = fsk_agc_cfg.params;
+	ast_rwlock_unlock(&fsk_agc_lock);
+	if (!enabled) {
+		return NULL;
+	}
+	/* on a noisy line the threshold goes up no further than where the profile has it */
+	params.ceiling = spec->min_level;
+	fsk_agc_init(agc, &params);
+	return agc;
+}
+
+/*! \brief Settings of the [recorder] section of fsk.conf */
+struct fsk_recorder_config {
+	int enabled;
+	unsigned int seconds;           /*!< of audio kept per direction */
+	char directory[PATH_MAX];
+};
+
+static struct fsk_recorder_config fsk_recorder_cfg = {
+	.enabled = 0,
+	.seconds = 10,
+};
+AST_RWLOCK_DEFINE_STATIC(fsk_recorder_lock);
+
+/*! \brief A frame as it went by, and where its samples are in the audio of its direction */
+struct fsk_recorder_frame {
+	int64_t offset_us;              /*!< since the recorder was started */
+	uint64_t sample;                /*!< first sample, counted since the recorder was started */
+	uint16_t samples;
+	uint8_t tx;
+	uint8_t demodulated;            /*!< received audio that was fed to the demodulator */
+};
+
+/*!
+ * \brief The last seconds of audio of a session, both directions, with the timing of each frame
+ *
+ * All of it is allocated with the session, so keeping it current costs a
+ * copy per frame. It only reaches the disk when a session fails.
+ */
+struct fsk_recorder {
+	struct timeval start;
+	size_t len;                     /*!< samples kept per direction */
+	size_t nframes;
+	uint64_t total[2];              /*!< samples recorded so far, received and sent */
+	uint64_t frames;                /*!< frames recorded so far */
+	int16_t *audio[2];
+	struct fsk_recorder_frame frame[0];
+};
+
+static struct fsk_recorder *fsk_recorder_alloc(void)
+{
+	struct fsk_recorder *rec;
+	unsigned int seconds;
+
+	ast_rwlock_rdlock(&fsk_recorder_lock);
+	seconds = fsk_recorder_cfg.enabled ? fsk_recorder_cfg.seconds : 0;
+	ast_rwlock_unlock(&fsk_recorder_lock);
+	if (!seconds) {
+		return NULL;
+	}
+	rec = ast_calloc(1, sizeof(*rec) + seconds * FSK_RECORDER_FRAMES_PER_SECOND * sizeof(rec->frame[0])
+		+ 2 * seconds * FSK_DSP_SAMPLE_RATE * sizeof(int16_t));
+	if (!rec) {
+		return NULL;
+	}
+	rec->start = ast_tvnow();
+	rec->len = seconds * FSK_DSP_SAMPLE_RATE;
+	rec->nframes = seconds * FSK_RECORDER_FRAMES_PER_SECOND;
+	rec->audio[0] = (int16_t *) &rec->frame[rec->nframes];
+	rec->audio[1] = rec->audio[0] + rec->len;
+	return rec;
+}
+
+/*!
+ * \brief Keep a frame of 8 kHz linear audio
+ * \param tx 1 if it was sent, 0 if received
+ * \param demodulated received audio that went through the demodulator
+ */
+static void fsk_recorder_put(struct fsk_recorder *rec, int tx, int demodulated, const int16_t *amp, int samples)
+{
+	struct fsk_recorder_frame *frame;
+	size_t pos;
+	size_t first;
+
+	if (!rec || samples <= 0 || samples > rec->len) {
+		return;
+	}
+	frame = &rec->frame[rec->frames++ % rec->nframes];
+	frame->offset_us = ast_tvdiff_us(ast_tvnow(), rec->start);
+	frame->sample = rec->total[tx];
+	frame->samples = samples;
+	frame->tx = tx;
+	frame->demodulated = demodulated;
+
+	pos = rec->total[tx] % rec->len;
+	first = MIN((size_t) samples, rec->len - pos);
+	memcpy(rec->audio[tx] + pos, amp, first * sizeof(*amp));
+	memcpy(rec->audio[tx], amp + first, (samples - first) * sizeof(*amp));
+	rec->total[tx] += samples;
+}
+
+/*! \brief Keep a frame read from the channel, if it is audio the recorder can hold */
+static void fsk_recorder_put_frame(struct fsk_recorder *rec, struct ast_frame *f, int demodulated)
+{
+	if (rec && f->frametype == AST_FRAME_VOICE && ast_format_cmp(f->subclass.format, ast_format_slin) == AST_FORMAT_CMP_EQUAL) {
+		fsk_recorder_put(rec, 0, demodulated, f->data.ptr, f->samples);
+	}
+}
+
+static void fsk_session_destructor(void *obj)
+{
+	struct fsk_session *session = obj;
+	struct fsk_queue_entry *entry;
+
+	while ((entry = AST_LIST_REMOVE_HEAD(&session->out.queue, list))) {
+		ast_free(entry);
+	}
+	ast_free(session->out.framed);
+	ast_free(session->recorder);
+
+	ao2_cleanup(session->tx_profile);
+	ao2_cleanup(session->rx_profile);
+	ao2_cleanup(session->tx_shaping);
+	ast_free(session->shaped);
+	fsk_admission_leave(&session->ticket);
+}
+
+static struct fsk_session *fsk_session_alloc(void)
+{
+	struct fsk_session *session;
+
+	session = ao2_alloc(sizeof(*session), fsk_session_destructor);
+	if (!session) {
+		return NULL;
+	}
+	session->rx_hook = -1;
+	session->recorder = fsk_recorder_alloc();
+	return session;
+}
+
+static void fsk_session_datastore_destroy(void *data)
+{
+	ao2_ref(data, -1);
+}
+
+static const struct ast_datastore_info fsk_session_datastore = {
+	.type = "fsk_session",
+	.destroy = fsk_session_datastore_destroy,
+};
+
+/*!
+ * \brief Find the modem session stored on a channel
+ * \param chan channel the session belongs to
+ * \param create allocate and attach a new session if none is found
+ * \return session with a reference bumped, or NULL
+ */
+static struct fsk_session *fsk_session_find(struct ast_channel *chan, int create)
+{
+	struct ast_datastore *datastore;
+	struct fsk_session *session = NULL;
+
+	ast_channel_lock(chan);
+	datastore = ast_channel_datastore_find(chan, &fsk_session_datastore, NULL);
+	if (datastore) {
+		session = ao2_bump(datastore->data);
+	} else if (create && (session = fsk_session_alloc())) {
+		datastore = ast_datastore_alloc(&fsk_session_datastore, NULL);
+		if (datastore) {
+			datastore->data = ao2_bump(session);
+			ast_channel_datastore_add(chan, datastore);
+		}
+	}
+	ast_channel_unlock(chan);
+
+	return session;
+}
+
+static void *fsk_carrier_alloc(struct ast_channel *chan, void *params)
+{
+	return ao2_bump(params);
+}
+
+/*! \brief Hand an admitted ticket to the background work of a session, unless it holds a slot already, session locked */
+static void fsk_session_slot_adopt(struct fsk_session *session, struct fsk_admission_ticket *ticket)
+{
+	if (ticket && ticket->admitted && !session->ticket.admitted) {
+		session->ticket = *ticket;
+		ticket->admitted = 0;
+	}
+}
+
+/*! \brief Give the slot of the background work back once neither the carrier nor a framehook receive runs, session locked */
+static void fsk_session_slot_release(struct fsk_session *session)
+{
+	if (!session->carrier && session->rx_hook < 0) {
+		fsk_admission_leave(&session->ticket);
+	}
+}
+
+static void fsk_carrier_release(struct ast_channel *chan, void *data)
+{
+	struct fsk_session *session = data;
+
+	ao2_lock(session);
+	session->carrier = 0;
+	fsk_session_slot_release(session);
+	ao2_unlock(session);
+	ao2_ref(session, -1);
+}
+
+/*! \brief Keep the modulator running on an exhausted buffer, which put_bit() turns into a mark-idle tone */
+static int fsk_carrier_generate(struct ast_channel *chan, void *data, int len, int samples)
+{
+	struct fsk_session *session = data;
+	int16_t buf[BLOCK_LEN];
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "SendFSK",
+		.data.ptr = buf,
+	};
+	uint64_t busy;
+	int chunk;
+
+	f.subclass.format = ast_format_slin;
+	while (samples > 0) {
+		chunk = MIN(samples, BLOCK_LEN);
+		busy = fsk_admission_clock();
+		ao2_lock(session);
+		fsk_mod(session->tx, buf, chunk);
+		fsk_admission_charge(&session->ticket, busy);
+		ao2_unlock(session);
+		f.samples = chunk;
+		f.datalen = chunk * 2;
+		if (ast_write(chan, &f) < 0) {
+			return -1;
+		}
+		samples -= chunk;
+	}
+	return 0;
+}
+
+static struct ast_generator fsk_carrier_generator = {
+	.alloc = fsk_carrier_alloc,
+	.release = fsk_carrier_release,
+	.generate = fsk_carrier_generate,
+};
+
+/*! \brief Stop the mark-idle tone so the calling application can drive the modulator itself */
+static void fsk_session_carrier_pause(struct ast_channel *chan, struct fsk_session *session)
+{
+	if (session->carrier) {
+		ast_deactivate_generator(chan);
+	}
+}
+
+/*!
+ * \brief Keep the modulator running from a generator once the application returns
+ * \param ticket admission the carrier runs under, handed to the session unless it holds a slot already
+ */
+static int fsk_session_carrier_hold(struct ast_channel *chan, struct fsk_session *session, struct fsk_admission_ticket *ticket)
+{
+	if (!session->tx) {
+		return 0;
+	}
+	ao2_lock(session);
+	fsk_session_slot_adopt(session, ticket);
+	ao2_unlock(session);
+	if (ast_activate_generator(chan, &fsk_carrier_generator, session)) {
+		ast_log(LOG_WARNING, "Unable to hold FSK carrier on %s\n", ast_channel_name(chan));
+		ao2_lock(session);
+		fsk_session_slot_release(session);
+		ao2_unlock(session);
+		return -1;
+	}
+	session->carrier = 1;
+	return 0;
+}
+
+/*!
+ * \brief Admit an application that sends on the session of a channel
+ *
+ * A session holding the carrier already has a slot; the application takes
+ * it over while it drives the modulator, and hands it back if it holds the
+ * carrier again. Otherwise as fsk_admission_enter().
+ */
+static int fsk_session_admission_enter(struct ast_channel *chan, struct fsk_admission_ticket *ticket)
+{
+	struct fsk_session *session;
+
+	ticket->admitted = 0;
+	if ((session = fsk_session_find(chan, 0))) {
+		ao2_lock(session);
+		if (session->ticket.admitted && session->rx_hook < 0) {
+			*ticket = session->ticket;
+			session->ticket.admitted = 0;
+		}
+		ao2_unlock(session);
+		ao2_ref(session, -1);
+	}
+	if (ticket->admitted) {
+		pbx_builtin_setvar_helper(chan, "FSKADMISSION", "ADMITTED");
+		return 0;
+	}
+	return fsk_admission_enter(chan, ticket);
+}
+
+/*! \brief Detach the session from the channel, dropping the carrier */
+static void fsk_session_end(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore;
+	struct fsk_session *session = NULL;
+
+	ast_channel_lock(chan);
+	datastore = ast_channel_datastore_find(chan, &fsk_session_datastore, NULL);
+	if (datastore) {
+		ast_channel_datastore_remove(chan, datastore);
+		session = ao2_bump(datastore->data);
+	}
+	ast_channel_unlock(chan);
+	if (!datastore) {
+		return;
+	}
+	fsk_session_carrier_pause(chan, session);
+	ao2_ref(session, -1);
+	ast_datastore_free(datastore);
+	ast_debug(1, "FSK session on %s ended\n", ast_channel_name(chan));
+}
+
+/*! \brief Bucket count of the profile container */
+#define FSK_PROFILE_BUCKETS 17
+
+/*!
+ * \brief A named modem, built in or from a section of fsk.conf
+ *
+ * Everything a session needs is worked out and checked when the profile is
+ * loaded, so a session does not find out that a modem cannot run.
+ */
+struct fsk_profile {
+	fsk_spec_t tx_spec;
+	fsk_spec_t rx_spec;
+	struct fsk_framing framing;
+	struct fsk_mod_params mod;
+	float kernel_ns[FSK_KERNELS_MAX]; /*!< render time per sample by kernel, see fsk_tune() */
+	int eom_samples;                /*!< mark-idle that completes a message of a persistent ReceiveFSK */
+	int crc;                        /*!< SendFSK and ReceiveFSK act as if given the c option */
+	int key;                        /*!< SendFSK and ReceiveFSK act as if given e with this key, -1 if none */
+	char *sink;                     /*!< ReceiveFSK default sink, "file:" or "socket:" then a path */
+	char *shaping;                  /*!< SendFSK transmit shaping by name, "none", or NULL to pick it by codec */
+	int quality;                    /*!< ReceiveFSK measures the line, ladders always do */
+	char name[0];
+};
+
+/*! \brief Profiles by name, replaced as a whole on reload */
+static AO2_GLOBAL_OBJ_STATIC(fsk_profiles);
+
+/*!
+ * \brief Transmit shaping of SendFSK, from a type = shaping section of fsk.conf
+ *
+ * Named by a profile, or picked for the codec the channel sends with.
+ */
+struct fsk_shaping {
+	struct fsk_shape shape;         /*!< tone gains, and the filter if given as taps */
+	float tilt;                     /*!< dB, worked into a filter for the tones of each profile when no taps are given */
+	char *codecs;                   /*!< comma separated, as Asterisk names them */
+	char name[0];
+};
+
+/*! \brief Shapings by name, replaced as a whole on reload */
+static AO2_GLOBAL_OBJ_STATIC(fsk_shapings);
+
+/*! \brief Built in profiles, which fsk.conf cannot redefine */
+static struct fsk_profile *fsk_profile_103;
+static struct fsk_profile *fsk_profile_202;
+static struct fsk_profile *fsk_profile_v23;
+
+static int fsk_profile_hash_fn(const void *obj, const int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? obj : ((const struct fsk_profile *) obj)->name;
+
+	return ast_str_case_hash(name);
+}
+
+static int fsk_profile_cmp_fn(void *obj, void *arg, int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? arg : ((const struct fsk_profile *) arg)->name;
+
+	return strcasecmp(((struct fsk_profile *) obj)->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static void fsk_profile_destructor(void *obj)
+{
+	struct fsk_profile *profile = obj;
+
+	ast_free(profile->sink);
+	ast_free(profile->shaping);
+}
+
+/*! \brief Benchmark the render kernels on a profile and have it use the fastest, or the pinned one */
+static void fsk_profile_tune(struct fsk_profile *profile)
+{
+	const struct fsk_kernel *kernel = fsk_tune(&profile->mod, profile->kernel_ns);
+	const struct fsk_kernel *pinned = __atomic_load_n(&fsk_kernel_pinned, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < fsk_kernel_count; i++) {
+		if (profile->kernel_ns[i] < 0) {
+			ast_log(LOG_WARNING, "FSK %s kernel does not match the scalar one on profile '%s', not using it\n",
+				fsk_kernels[i].name, profile->name);
+		}
+	}
+
+	if (pinned && profile->kernel_ns[pinned - fsk_kernels] > 0) {
+		kernel = pinned;
+	}
+	__atomic_store_n(&profile->mod.kernel, kernel, __ATOMIC_RELAXED);
+	ast_verb(3, "FSK profile '%s' modulates with the %s kernel (%.2f ns/sample)%s\n", profile->name, kernel->name,
+		profile->kernel_ns[kernel - fsk_kernels], kernel == pinned ? ", pinned" : "");
+}
+
+static struct fsk_profile *fsk_profile_alloc(const char *name, const fsk_spec_t *tx, const fsk_spec_t *rx)
+{
+	struct fsk_profile *profile;
+
+	profile = ao2_alloc_options(sizeof(*profile) + strlen(name) + 1, fsk_profile_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!profile) {
+		return NULL;
+	}
+	strcpy(profile->name, name); /* safe */
+	profile->tx_spec = *tx;
+	profile->rx_spec = *rx;
+	profile->tx_spec.name = profile->name;
+	profile->rx_spec.name = profile->name;
+	fsk_framing_init(&profile->framing, 8, 1);
+	profile->key = -1;
+	profile->quality = 1;
+	return profile;
+}
+
+/*!
+ * \brief Check a profile and work out its modem state
+ * \retval 0 the profile can be used
+ * \retval -1 it cannot, the reason has been logged
+ */
+static int fsk_profile_compile(struct fsk_profile *profile)
+{
+	const fsk_spec_t *specs[] = { &profile->tx_spec, &profile->rx_spec };
+	fsk_rx_state_t rx;
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(specs); i++) {
+		if (specs[i]->freq_zero < 100 || specs[i]->freq_zero > 3800 || specs[i]->freq_one < 100 || specs[i]->freq_one > 3800
+			|| specs[i]->freq_zero == specs[i]->freq_one) {
+			ast_log(LOG_WARNING, "FSK profile '%s' needs distinct mark and space tones between 100 and 3800 Hz\n", profile->name);
+			return -1;
+		}
+		if (FSK_SPEC_BAUD(specs[i]) < 50 || FSK_SPEC_BAUD(specs[i]) > 2400) {
+			ast_log(LOG_WARNING, "FSK profile '%s' needs a baud rate between 50 and 2400\n", profile->name);
+			return -1;
+		}
+		if (specs[i]->tx_level > 0 || specs[i]->tx_level < -60 || specs[i]->min_level > 0 || specs[i]->min_level < -60) {
+			ast_log(LOG_WARNING, "FSK profile '%s' needs levels between -60 and 0 dBm0\n", profile->name);
+			return -1;
+		}
+	}
+	if (profile->sink && profile->key >= 0) {
+		ast_log(LOG_WARNING, "FSK profile '%s' cannot have both a sink and a key\n", profile->name);
+		return -1;
+	}
+	/* the CRC trailer and sealed messages are bytes */
+	if ((profile->crc || profile->key >= 0) && profile->framing.data_bits != 8) {
+		ast_log(LOG_WARNING, "FSK profile '%s' needs 8 data bits for crc or key\n", profile->name);
+		return -1;
+	}
+	fsk_mod_params_init(&profile->mod, profile->tx_spec.freq_zero, profile->tx_spec.freq_one,
+		profile->tx_spec.tx_level, profile->tx_spec.baud_rate);
+	fsk_profile_tune(profile);
+	/* the receiver checks a single stop bit, any further ones are mark-idle to it */
+	if (!fsk_rx_init(&rx, &profile->rx_spec, profile->framing.data_bits + 2, fsk_receive_put_bit, NULL)) {
+		ast_log(LOG_WARNING, "FSK profile '%s' is not a demodulator spandsp can run\n", profile->name);
+		return -1;
+	}
+	profile->eom_samples = FSK_IDLE_EOM_CHARS * profile->framing.bits * 8000 / FSK_SPEC_BAUD(&profile->rx_spec);
+	return 0;
+}
+
+static struct fsk_profile *fsk_profile_builtin(const char *name, int tx, int rx)
+{
+	struct fsk_profile *profile;
+
+	profile = fsk_profile_alloc(name, &preset_fsk_specs[tx], &preset_fsk_specs[rx]);
+	if (profile && fsk_profile_compile(profile)) {
+		ao2_ref(profile, -1);
+		return NULL;
+	}
+	return profile;
+}
+
+/*!
+ * \brief Find a profile by name
+ * \param name the modem argument of an application, the default profile if empty
+ * \return a reference, or NULL if there is no such profile
+ */
+static struct fsk_profile *fsk_profile_find(const char *name)
+{
+	struct ao2_container *profiles;
+	struct fsk_profile *profile = NULL;
+
+	if (ast_strlen_zero(name)) {
+		return ao2_bump(fsk_profile_103);
+	}
+	profiles = ao2_global_obj_ref(fsk_profiles);
+	if (profiles) {
+		profile = ao2_find(profiles, name, OBJ_SEARCH_KEY);
+		ao2_ref(profiles, -1);
+	}
+	if (!profile) {
+		ast_log(LOG_WARNING, "Unknown modem protocol: %s\n", name);
+	}
+	return profile;
+}
+
+/*!
+ * \brief Build a profile from a section of fsk.conf
+ *
+ * \code
+ * [meter]
+ * type = profile
+ * base = 202            ; built in profile to start from, default 103
+ * mark = 1300           ; or tx_mark and rx_mark, in Hz
+ * space = 2100          ; or tx_space and rx_space
+ * baud = 1200
+ * level = -14           ; transmit level, dBm0
+ * min_level = -30       ; weakest carrier the receiver accepts, dBm0
+ * framing = 8N1         ; 5 to 8 data bits, 1 or 2 stop bits
+ * crc = yes
+ * key = 1
+ * sink = file:/var/spool/asterisk/meter.log
+ * shaping = auto        ; or none, or a type = shaping section
+ * \endcode
+ */
+static struct fsk_profile *fsk_profile_load(struct ast_config *config, const char *name)
+{
+	struct ao2_container *shapings;
+	struct fsk_shaping *shaping;
+	struct fsk_profile *profile;
+	const struct fsk_profile *base = fsk_profile_103;
+	const char *value;
+	struct ast_variable *var;
+	unsigned int data_bits;
+	unsigned int stop_bits;
+	char parity;
+	int num;
+
+	value = ast_variable_retrieve(config, name, "base");
+	if (!ast_strlen_zero(value)) {
+		base = !strcasecmp(value, "202") ? fsk_profile_202 : !strcasecmp(value, "v23") ? fsk_profile_v23
+			: !strcasecmp(value, "103") ? fsk_profile_103 : NULL;
+		if (!base) {
+			ast_log(LOG_WARNING, "FSK profile '%s' is based on '%s', not one of 103, 202 or v23\n", name, value);
+			return NULL;
+		}
+	}
+	if (!(profile = fsk_profile_alloc(name, &base->tx_spec, &base->rx_spec))) {
+		return NULL;
+	}
+	for (var = ast_variable_browse(config, name); var; var = var->next) {
+		num = atoi(var->value);
+		if (!strcasecmp(var->name, "type") || !strcasecmp(var->name, "base")) {
+			continue;
+		} else if (!strcasecmp(var->name, "mark")) {
+			profile->tx_spec.freq_one = profile->rx_spec.freq_one = num;
+		} else if (!strcasecmp(var->name, "space")) {
+			profile->tx_spec.freq_zero = profile->rx_spec.freq_zero = num;
+		} else if (!strcasecmp(var->name, "tx_mark")) {
+			profile->tx_spec.freq_one = num;
+		} else if (!strcasecmp(var->name, "tx_space")) {
+			profile->tx_spec.freq_zero = num;
+		} else if (!strcasecmp(var->name, "rx_mark")) {
+			profile->rx_spec.freq_one = num;
+		} else if (!strcasecmp(var->name, "rx_space")) {
+			profile->rx_spec.freq_zero = num;
+		} else if (!strcasecmp(var->name, "baud")) {
+			profile->tx_spec.baud_rate = profile->rx_spec.baud_rate = num * 100;
+		} else if (!strcasecmp(var->name, "level")) {
+			profile->tx_spec.tx_level = profile->rx_spec.tx_level = num;
+		} else if (!strcasecmp(var->name, "min_level")) {
+			profile->tx_spec.min_level = profile->rx_spec.min_level = num;
+		} else if (!strcasecmp(var->name, "framing")) {
+			if (sscanf(var->value, "%1u%c%1u", &data_bits, &parity, &stop_bits) != 3 || data_bits < 5 || data_bits > 8
+				|| toupper(parity) != 'N' || stop_bits < 1 || stop_bits > 2) {
+				ast_log(LOG_WARNING, "FSK profile '%s' has framing '%s', only 5N1 to 8N2 are supported\n", name, var->value);
+				ao2_ref(profile, -1);
+				return NULL;
+			}
+			fsk_framing_init(&profile->framing, data_bits, stop_bits);
+		} else if (!strcasecmp(var->name, "crc")) {
+			profile->crc = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "quality")) {
+			profile->quality = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "key")) {
+			profile->key = ast_strlen_zero(var->value) ? -1 : num;
+		} else if (!strcasecmp(var->name, "sink")) {
+			if (strncmp(var->value, "file:", 5) && strncmp(var->value, "socket:", 7)) {
+				ast_log(LOG_WARNING, "FSK profile '%s' has sink '%s', not file: or socket:\n", name, var->value);
+				ao2_ref(profile, -1);
+				return NULL;
+			}
+			ast_free(profile->sink);
+			profile->sink = ast_strdup(var->value);
+		} else if (!strcasecmp(var->name, "shaping")) {
+			ast_free(profile->shaping);
+			profile->shaping = NULL;
+			if (ast_strlen_zero(var->value) || !strcasecmp(var->value, "auto")) {
+				continue;
+			}
+			profile->shaping = ast_strdup(var->value);
+			/* shapings are loaded first, but a reload may still bring it */
+			if (!strcasecmp(var->value, "none")) {
+				continue;
+			}
+			shapings = ao2_global_obj_ref(fsk_shapings);
+			shaping = shapings ? ao2_find(shapings, var->value, OBJ_SEARCH_KEY) : NULL;
+			if (!shaping) {
+				ast_log(LOG_WARNING, "FSK profile '%s' has shaping '%s', which is not defined\n", name, var->value);
+			}
+			ao2_cleanup(shaping);
+			ao2_cleanup(shapings);
+		} else {
+			ast_log(LOG_WARNING, "Unknown setting '%s' of FSK profile '%s' at line %d of %s\n",
+				var->name, name, var->lineno, fsk_config_file);
+		}
+	}
+	if (fsk_profile_compile(profile)) {
+		ao2_ref(profile, -1);
+		return NULL;
+	}
+	return profile;
+}
+
+/*!
+ * \brief Replace the profiles with the built in ones and those of a configuration
+ *
+ * A profile that does not validate is left out and logged, the others are
+ * still loaded. Sessions keep the profile they started with until they
+ * prepare another one.
+ */
+static int fsk_profiles_load(struct ast_config *config)
+{
+	struct ao2_container *profiles;
+	struct fsk_profile *profile;
+	const char *category = NULL;
+	const char *type;
+
+	profiles = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, FSK_PROFILE_BUCKETS,
+		fsk_profile_hash_fn, NULL, fsk_profile_cmp_fn);
+	if (!profiles) {
+		return -1;
+	}
+	ao2_link(profiles, fsk_profile_103);
+	ao2_link(profiles, fsk_profile_202);
+	ao2_link(profiles, fsk_profile_v23);
+	while (config && (category = ast_category_browse(config, category))) {
+		type = ast_variable_retrieve(config, category, "type");
+		if (!type || strcasecmp(type, "profile")) {
+			continue;
+		}
+		if ((profile = ao2_find(profiles, category, OBJ_SEARCH_KEY))) {
+			ast_log(LOG_WARNING, "FSK profile '%s' is already defined, ignoring section [%s]\n", category, category);
+			ao2_ref(profile, -1);
+			continue;
+		}
+		if ((profile = fsk_profile_load(config, category))) {
+			ao2_link(profiles, profile);
+			ao2_ref(profile, -1);
+		}
+	}
+	ao2_global_obj_replace_unref(fsk_profiles, profiles);
+	ao2_ref(profiles, -1);
+	return 0;
+}
+
+static int fsk_shaping_hash_fn(const void *obj, const int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? obj : ((const struct fsk_shaping *) obj)->name;
+
+	return ast_str_case_hash(name);
+}
+
+static int fsk_shaping_cmp_fn(void *obj, void *arg, int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? arg : ((const struct fsk_shaping *) arg)->name;
+
+	return strcasecmp(((struct fsk_shaping *) obj)->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static void fsk_shaping_destructor(void *obj)
+{
+	struct fsk_shaping *shaping = obj;
+
+	ast_free(shaping->codecs);
+}
+
+/*!
+ * \brief Build a transmit shaping from a section of fsk.conf
+ *
+ * \code
+ * [lowrate]
+ * type = shaping
+ * codecs = gsm,g729,ilbc   ; picked for these by profiles with shaping = auto
+ * tilt = 4                 ; dB of the higher tone over the lower one
+ * fir = 1.2,-0.3           ; or the taps of the filter, up to 8
+ * space_gain = 0           ; dB on each tone, over the level of the profile
+ * mark_gain = 0
+ * \endcode
+ */
+static struct fsk_shaping *fsk_shaping_load(struct ast_config *config, const char *name)
+{
+	struct fsk_shaping *shaping;
+	struct ast_variable *var;
+	char *taps;
+	char *tap;
+	char *end;
+	int nonzero;
+
+	shaping = ao2_alloc_options(sizeof(*shaping) + strlen(name) + 1, fsk_shaping_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!shaping) {
+		return NULL;
+	}
+	strcpy(shaping->name, name); /* safe */
+	for (var = ast_variable_browse(config, name); var; var = var->next) {
+		if (!strcasecmp(var->name, "type")) {
+			continue;
+		} else if (!strcasecmp(var->name, "codecs")) {
+			ast_free(shaping->codecs);
+			shaping->codecs = ast_strdup(var->value);
+		} else if (!strcasecmp(var->name, "tilt")) {
+			shaping->tilt = atof(var->value);
+		} else if (!strcasecmp(var->name, "space_gain")) {
+			shaping->shape.gain[0] = atof(var->value);
+		} else if (!strcasecmp(var->name, "mark_gain")) {
+			shaping->shape.gain[1] = atof(var->value);
+		} else if (!strcasecmp(var->name, "fir")) {
+			taps = ast_strdupa(var->value);
+			shaping->shape.taps = 0;
+			nonzero = 0;
+			while ((tap = strsep(&taps, ","))) {
+				if (shaping->shape.taps == FSK_SHAPE_TAPS) {
+					ast_log(LOG_WARNING, "FSK shaping '%s' has more than %d taps\n", name, FSK_SHAPE_TAPS);
+					ao2_ref(shaping, -1);
+					return NULL;
+				}
+				shaping->shape.fir[shaping->shape.taps] = strtod(tap, &end);
+				if (end == tap || !ast_strlen_zero(ast_skip_blanks(end))) {
+					ast_log(LOG_WARNING, "FSK shaping '%s' has a tap '%s' that is not a number at line %d of %s\n",
+						name, tap, var->lineno, fsk_config_file);
+					ao2_ref(shaping, -1);
+					return NULL;
+				}
+				nonzero |= shaping->shape.fir[shaping->shape.taps++] != 0;
+			}
+			if (!nonzero) {
+				/* all zero taps would filter the tones to silence */
+				ast_log(LOG_WARNING, "FSK shaping '%s' needs a tap other than 0\n", name);
+				ao2_ref(shaping, -1);
+				return NULL;
+			}
+		} else {
+			ast_log(LOG_WARNING, "Unknown setting '%s' of FSK shaping '%s' at line %d of %s\n",
+				var->name, name, var->lineno, fsk_config_file);
+		}
+	}
+	if (fabsf(shaping->tilt) > 20 || fabsf(shaping->shape.gain[0]) > 20 || fabsf(shaping->shape.gain[1]) > 20) {
+		ast_log(LOG_WARNING, "FSK shaping '%s' needs tilt and gains within 20 dB\n", name);
+		ao2_ref(shaping, -1);
+		return NULL;
+	}
+	return shaping;
+}
+
+static int fsk_shaping_codec_cmp(void *obj, void *arg, int flags)
+{
+	struct fsk_shaping *shaping = obj;
+	const char *codec = arg;
+	char *codecs;
+	char *name;
+
+	if (ast_strlen_zero(shaping->codecs)) {
+		return 0;
+	}
+	codecs = ast_strdupa(shaping->codecs);
+	while ((name = strsep(&codecs, ","))) {
+		if (!strcasecmp(ast_strip(name), codec)) {
+			return CMP_MATCH | CMP_STOP;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Drop the codecs of a shaping that an earlier section already lists, the first in fsk.conf is picked for them */
+static void fsk_shaping_dedup(struct ao2_container *shapings, struct fsk_shaping *shaping)
+{
+	struct fsk_shaping *other;
+	struct ast_str *kept;
+	char *codecs;
+	char *name;
+
+	if (ast_strlen_zero(shaping->codecs) || !(kept = ast_str_create(64))) {
+		return;
+	}
+	codecs = ast_strdupa(shaping->codecs);
+	while ((name = strsep(&codecs, ","))) {
+		name = ast_strip(name);
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+		if ((other = ao2_callback(shapings, 0, fsk_shaping_codec_cmp, name))) {
+			ast_log(LOG_WARNING, "FSK shapings '%s' and '%s' both list codec '%s', '%s' comes first in %s and is picked for it\n",
+				other->name, shaping->name, name, other->name, fsk_config_file);
+			ao2_ref(other, -1);
+			continue;
+		}
+		ast_str_append(&kept, 0, "%s%s", ast_str_strlen(kept) ? "," : "", name);
+	}
+	ast_free(shaping->codecs);
+	shaping->codecs = ast_strdup(ast_str_buffer(kept));
+	ast_free(kept);
+}
+
+/*! \brief Replace the shapings with those of a configuration, ahead of the profiles that name them */
+static int fsk_shapings_load(struct ast_config *config)
+{
+	struct ao2_container *shapings;
+	struct fsk_shaping *shaping;
+	const char *category = NULL;
+	const char *type;
+
+	shapings = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, FSK_PROFILE_BUCKETS,
+		fsk_shaping_hash_fn, NULL, fsk_shaping_cmp_fn);
+	if (!shapings) {
+		return -1;
+	}
+	while (config && (category = ast_category_browse(config, category))) {
+		type = ast_variable_retrieve(config, category, "type");
+		if (!type || strcasecmp(type, "shaping")) {
+			continue;
+		}
+		if ((shaping = fsk_shaping_load(config, category))) {
+			fsk_shaping_dedup(shapings, shaping);
+			ao2_link(shapings, shaping);
+			ao2_ref(shaping, -1);
+		}
+	}
+	ao2_global_obj_replace_unref(fsk_shapings, shapings);
+	ao2_ref(shapings, -1);
+	return 0;
+}
+
+/*!
+ * \brief Shaping a profile sends with over a codec
+ * \param codec as Asterisk names it, may be empty
+ * \return a reference, NULL for none
+ */
+static struct fsk_shaping *fsk_shaping_pick(const struct fsk_profile *profile, const char *codec)
+{
+	struct ao2_container *shapings;
+	struct fsk_shaping *shaping = NULL;
+
+	if (profile->shaping && !strcasecmp(profile->shaping, "none")) {
+		return NULL;
+	}
+	if (!(shapings = ao2_global_obj_ref(fsk_shapings))) {
+		return NULL;
+	}
+	if (profile->shaping) {
+		shaping = ao2_find(shapings, profile->shaping, OBJ_SEARCH_KEY);
+	} else if (!ast_strlen_zero(codec)) {
+		shaping = ao2_callback(shapings, 0, fsk_shaping_codec_cmp, (void *) codec);
+	}
+	ao2_ref(shapings, -1);
+	return shaping;
+}
+
+static char *handle_fsk_show_kernels(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_container *profiles;
+	struct ao2_iterator i;
+	struct fsk_profile *profile;
+	const struct fsk_kernel *kernel;
+	const struct fsk_kernel *pinned = __atomic_load_n(&fsk_kernel_pinned, __ATOMIC_RELAXED);
+	int k;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "fsk show kernels";
+		e->usage =
+			"Usage: fsk show kernels\n"
+			"       Show the modulator kernel each FSK profile uses, and the time per\n"
+			"       sample of every kernel as last measured. '-' is a kernel this host\n"
+			"       does not run or whose output differs from the scalar one.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+	if (!(profiles = ao2_global_obj_ref(fsk_profiles))) {
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "Kernel choice: %s\n\n%-16s %-8s", pinned ? pinned->name : "auto", "Profile", "Uses");
+	for (k = 0; k < fsk_kernel_count; k++) {
+		ast_cli(a->fd, " %8s", fsk_kernels[k].name);
+	}
+	ast_cli(a->fd, "  (ns/sample)\n");
+	i = ao2_iterator_init(profiles, 0);
+	while ((profile = ao2_iterator_next(&i))) {
+		kernel = __atomic_load_n(&profile->mod.kernel, __ATOMIC_RELAXED);
+		ast_cli(a->fd, "%-16s %-8s", profile->name, kernel->name);
+		for (k = 0; k < fsk_kernel_count; k++) {
+			if (profile->kernel_ns[k] > 0) {
+				ast_cli(a->fd, " %8.2f", profile->kernel_ns[k]);
+			} else {
+				ast_cli(a->fd, " %8s", "-");
+			}
+		}
+		ast_cli(a->fd, "\n");
+		ao2_ref(profile, -1);
+	}
+	ao2_iterator_destroy(&i);
+	ao2_ref(profiles, -1);
+	return CLI_SUCCESS;
+}
+
+static char *handle_fsk_tune_kernels(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_container *profiles;
+	struct ao2_iterator i;
+	struct fsk_profile *profile;
+	const struct fsk_kernel *pinned = NULL;
+	int k;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "fsk tune kernels";
+		e->usage =
+			"Usage: fsk tune kernels [auto|<kernel>]\n"
+			"       Benchmark the modulator kernels again on every FSK profile.\n"
+			"       With a kernel name, pin every profile to that kernel where it is\n"
+			"       usable; 'auto' lets the benchmark choose again.\n";
+		return NULL;
+	case CLI_GENERATE:
+		if (a->pos == 3) {
+			if (!strncasecmp(a->word, "auto", strlen(a->word)) && a->n == 0) {
+				return ast_strdup("auto");
+			}
+			for (k = 0; k < fsk_kernel_count; k++) {
+				if (!strncasecmp(a->word, fsk_kernels[k].name, strlen(a->word)) && a->n == k + 1) {
+					return ast_strdup(fsk_kernels[k].name);
+				}
+			}
+		}
+		return NULL;
+	}
+	if (a->argc != 3 && a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc == 4 && strcasecmp(a->argv[3], "auto")) {
+		for (k = 0; k < fsk_kernel_count; k++) {
+			if (!strcasecmp(a->argv[3], fsk_kernels[k].name)) {
+				pinned = &fsk_kernels[k];
+			}
+		}
+		if (!pinned) {
+			ast_cli(a->fd, "No FSK kernel '%s'\n", a->argv[3]);
+			return CLI_FAILURE;
+		}
+		if (pinned->supported && !pinned->supported()) {
+			ast_cli(a->fd, "This host does not run the %s kernel\n", pinned->name);
+			return CLI_FAILURE;
+		}
+	}
+	if (a->argc == 4) {
+		__atomic_store_n(&fsk_kernel_pinned, pinned, __ATOMIC_RELAXED);
+	}
+	if (!(profiles = ao2_global_obj_ref(fsk_profiles))) {
+		return CLI_FAILURE;
+	}
+	i = ao2_iterator_init(profiles, 0);
+	while ((profile = ao2_iterator_next(&i))) {
+		fsk_profile_tune(profile);
+		ast_cli(a->fd, "%-16s %s\n", profile->name, __atomic_load_n(&profile->mod.kernel, __ATOMIC_RELAXED)->name);
+		ao2_ref(profile, -1);
+	}
+	ao2_iterator_destroy(&i);
+	ao2_ref(profiles, -1);
+	return CLI_SUCCESS;
+}
+
+static int fsk_profiles_init(void)
+{
+	fsk_framing_init(&fsk_framing_8n1, 8, 1);
+	fsk_profile_103 = fsk_profile_builtin("103", FSK_BELL103CH1, FSK_BELL103CH2);
+	fsk_profile_202 = fsk_profile_builtin("202", FSK_BELL202, FSK_BELL202);
+	fsk_profile_v23 = fsk_profile_builtin("v23", FSK_V23CH1, FSK_V23CH1);
+	return fsk_profile_103 && fsk_profile_202 && fsk_profile_v23 ? 0 : -1;
+}
+
+/* Profiles a ladder can step through */
+#define FSK_LADDER_RUNGS    8
+/* Largest payload of a ladder block, the length field is two bytes */
+#define FSK_LADDER_BLOCK_MAX 4096
+/* Block header: type, sequence, rung, length; then the payload and a CRC-16 */
+#define FSK_LADDER_HEADER   5
+#define FSK_LADDER_FRAME_MAX (FSK_LADDER_HEADER + FSK_LADDER_BLOCK_MAX + 2)
+/* Mark ahead of each ladder frame for the peer's carrier detect, in blocks of BLOCK_LEN */
+#define FSK_LADDER_MARK_BLOCKS 4
+/* Quiet on every rung before a lost block is answered, so the NAK does not talk over the sender */
+#define FSK_LADDER_GUARD_MS 200
+/* Longest a lost block waits for that quiet, under a carrier that does not go away */
+#define FSK_LADDER_GUARD_MAX_MS 10000
+
+/* Ladder frame types, data from the sender and control from the receiver */
+#define FSK_LADDER_DATA     0x31
+#define FSK_LADDER_LAST     0x32        /*!< data that ends the message */
+#define FSK_LADDER_ACK      0x36
+#define FSK_LADDER_NAK      0x37
+
+/*!
+ * \brief Profiles an adaptive transfer steps between, from a type = ladder section of fsk.conf
+ *
+ * The message is sent in blocks, each answered in band by the receiver on the
+ * slowest rung with an ACK or NAK that names the rung of the next block. The
+ * receiver picks it from the quality of the block it got: a rung down when
+ * the expected bit error rate is above down_ber or the block was lost, a rung
+ * up after up_blocks blocks in a row below up_ber. Both directions use the
+ * transmit side of the rung's profile, half duplex.
+ */
+struct fsk_ladder {
+	struct fsk_profile *rungs[FSK_LADDER_RUNGS]; /*!< slowest first */
+	int count;
+	int start;                      /*!< rung of the first block */
+	int block;                      /*!< payload bytes per block */
+	double up_ber;
+	int up_blocks;
+	double down_ber;
+	int answer_ms;                  /*!< how long a sender waits for the answer to a block */
+	int attempts;                   /*!< of a block before the transfer fails */
+	char name[0];
+};
+
+/*! \brief Ladders by name, replaced as a whole on reload */
+static AO2_GLOBAL_OBJ_STATIC(fsk_ladders);
+
+/*! \brief What an adaptive transfer did, for the channel variables */
+struct fsk_ladder_result {
+	const char *status;
+	int rung;                       /*!< last rung used */
+	int blocks;
+	int retries;
+	int steps;                      /*!< rung changes */
+	int64_t ms;
+	size_t bytes;
+};
+
+static int fsk_ladder_hash_fn(const void *obj, const int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? obj : ((const struct fsk_ladder *) obj)->name;
+
+	return ast_str_case_hash(name);
+}
+
+static int fsk_ladder_cmp_fn(void *obj, void *arg, int flags)
+{
+	const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? arg : ((const struct fsk_ladder *) arg)->name;
+
+	return strcasecmp(((struct fsk_ladder *) obj)->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static void fsk_ladder_destructor(void *obj)
+{
+	struct fsk_ladder *ladder = obj;
+	int i;
+
+	for (i = 0; i < ladder->count; i++) {
+		ao2_ref(ladder->rungs[i], -1);
+	}
+}
+
+/*! \return a reference, NULL if name is not a ladder */
+static struct fsk_ladder *fsk_ladder_find(const char *name)
+{
+	struct ao2_container *ladders;
+	struct fsk_ladder *ladder = NULL;
+
+	if (ast_strlen_zero(name) || !(ladders = ao2_global_obj_ref(fsk_ladders))) {
+		return NULL;
+	}
+	ladder = ao2_find(ladders, name, OBJ_SEARCH_KEY);
+	ao2_ref(ladders, -1);
+	return ladder;
+}
+
+/*!
+ * \brief Build a ladder from a section of fsk.conf
+ *
+ * \code
+ * [auto]
+ * type = ladder
+ * rungs = 103,202,fast     ; profiles, slowest first
+ * start = 202              ; rung of the first block, default the slowest
+ * block = 256              ; payload bytes per block
+ * up_ber = 1e-7            ; step up after up_blocks blocks below this
+ * up_blocks = 3
+ * down_ber = 1e-4          ; step down after a block above this
+ * answer = 2000            ; ms the sender waits for the answer to a block
+ * attempts = 4             ; of a block before giving up
+ * \endcode
+ */
+static struct fsk_ladder *fsk_ladder_load(struct ast_config *config, const char *name, struct ao2_container *profiles)
+{
+	struct fsk_ladder *ladder;
+	struct ast_variable *var;
+	const char *start = NULL;
+	char *rungs = NULL;
+	char *rung;
+	int i;
+
+	ladder = ao2_alloc_options(sizeof(*ladder) + strlen(name) + 1, fsk_ladder_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!ladder) {
+		return NULL;
+	}
+	strcpy(ladder->name, name); /* safe */
+	ladder->block = 256;
+	ladder->up_ber = 1e-7;
+	ladder->up_blocks = 3;
+	ladder->down_ber = 1e-4;
+	ladder->answer_ms = 2000;
+	ladder->attempts = 4;
+	for (var = ast_variable_browse(config, name); var; var = var->next) {
+		if (!strcasecmp(var->name, "type")) {
+			continue;
+		} else if (!strcasecmp(var->name, "rungs")) {
+			rungs = ast_strdupa(var->value);
+		} else if (!strcasecmp(var->name, "start")) {
+			start = ast_strdupa(var->value);
+		} else if (!strcasecmp(var->name, "block")) {
+			ladder->block = atoi(var->value);
+		} else if (!strcasecmp(var->name, "up_ber")) {
+			ladder->up_ber = atof(var->value);
+		} else if (!strcasecmp(var->name, "up_blocks")) {
+			ladder->up_blocks = atoi(var->value);
+		} else if (!strcasecmp(var->name, "down_ber")) {
+			ladder->down_ber = atof(var->value);
+		} else if (!strcasecmp(var->name, "answer")) {
+			ladder->answer_ms = atoi(var->value);
+		} else if (!strcasecmp(var->name, "attempts")) {
+			ladder->attempts = atoi(var->value);
+		} else {
+			ast_log(LOG_WARNING, "Unknown setting '%s' of FSK ladder '%s' at line %d of %s\n",
+				var->name, name, var->lineno, fsk_config_file);
+		}
+	}
+	while (rungs && (rung = strsep(&rungs, ","))) {
+		rung = ast_strip(rung);
+		if (ladder->count == FSK_LADDER_RUNGS) {
+			ast_log(LOG_WARNING, "FSK ladder '%s' has more than %d rungs\n", name, FSK_LADDER_RUNGS);
+			ao2_ref(ladder, -1);
+			return NULL;
+		}
+		if (!(ladder->rungs[ladder->count] = ao2_find(profiles, rung, OBJ_SEARCH_KEY))) {
+			ast_log(LOG_WARNING, "FSK ladder '%s' has rung '%s', which is not a profile\n", name, rung);
+			ao2_ref(ladder, -1);
+			return NULL;
+		}
+		/* frames are bytes */
+		if (ladder->rungs[ladder->count++]->framing.data_bits != 8) {
+			ast_log(LOG_WARNING, "FSK ladder '%s' needs rungs with 8 data bits, '%s' has not\n", name, rung);
+			ao2_ref(ladder, -1);
+			return NULL;
+		}
+	}
+	if (!ladder->count) {
+		ast_log(LOG_WARNING, "FSK ladder '%s' has no rungs\n", name);
+		ao2_ref(ladder, -1);
+		return NULL;
+	}
+	for (i = 0; start && i < ladder->count && strcasecmp(ladder->rungs[i]->name, start); i++);
+	if (start && i == ladder->count) {
+		ast_log(LOG_WARNING, "FSK ladder '%s' starts at '%s', which is not one of its rungs\n", name, start);
+		ao2_ref(ladder, -1);
+		return NULL;
+	}
+	ladder->start = start ? i : 0;
+	if (ladder->block < 1 || ladder->block > FSK_LADDER_BLOCK_MAX || ladder->up_blocks < 1 || ladder->answer_ms < 100
+		|| ladder->attempts < 1 || ladder->up_ber <= 0 || ladder->down_ber <= ladder->up_ber) {
+		ast_log(LOG_WARNING, "FSK ladder '%s' needs block from 1 to %d, answer of at least 100 ms, up_blocks and attempts of at least 1,"
+			" and down_ber above up_ber\n", name, FSK_LADDER_BLOCK_MAX);
+		ao2_ref(ladder, -1);
+		return NULL;
+	}
+	return ladder;
+}
+
+/*! \brief Replace the ladders with those of a configuration, once its profiles are loaded */
+static int fsk_ladders_load(struct ast_config *config)
+{
+	struct ao2_container *ladders;
+	struct ao2_container *profiles;
+	struct fsk_ladder *ladder;
+	struct fsk_profile *profile;
+	const char *category = NULL;
+	const char *type;
+
+	ladders = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, FSK_PROFILE_BUCKETS,
+		fsk_ladder_hash_fn, NULL, fsk_ladder_cmp_fn);
+	if (!ladders) {
+		return -1;
+	}
+	profiles = ao2_global_obj_ref(fsk_profiles);
+	while (config && profiles && (category = ast_category_browse(config, category))) {
+		type = ast_variable_retrieve(config, category, "type");
+		if (!type || strcasecmp(type, "ladder")) {
+			continue;
+		}
+		/* the modem argument of the applications names either */
+		if ((profile = ao2_find(profiles, category, OBJ_SEARCH_KEY))) {
+			ast_log(LOG_WARNING, "FSK ladder '%s' has the name of a profile, ignoring section [%s]\n", category, category);
+			ao2_ref(profile, -1);
+			continue;
+		}
+		if ((ladder = fsk_ladder_load(config, category, profiles))) {
+			ao2_link(ladders, ladder);
+			ao2_ref(ladder, -1);
+		}
+	}
+	ao2_cleanup(profiles);
+	ao2_global_obj_replace_unref(fsk_ladders, ladders);
+	ao2_ref(ladders, -1);
+	return 0;
+}
+
+static void fsk_profiles_destroy(void)
+{
+	ao2_global_obj_release(fsk_profiles);
+	ao2_global_obj_release(fsk_ladders);
+	ao2_global_obj_release(fsk_shapings);
+	ao2_cleanup(fsk_profile_103);
+	ao2_cleanup(fsk_profile_202);
+	ao2_cleanup(fsk_profile_v23);
+	fsk_profile_103 = fsk_profile_202 = fsk_profile_v23 = NULL;
+}
+
+static char *handle_fsk_show_profiles(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_container *profiles;
+	struct ao2_container *shapings;
+	struct ao2_container *ladders;
+	struct ao2_iterator i;
+	struct fsk_profile *profile;
+	struct fsk_shaping *shaping;
+	struct fsk_ladder *ladder;
+	char rungs[256];
+	int n;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "fsk show profiles";
+		e->usage =
+			"Usage: fsk show profiles\n"
+			"       List the FSK modem profiles and ladders the applications accept,\n"
+			"       and the transmit shapings SendFSK applies.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+	if (!(profiles = ao2_global_obj_ref(fsk_profiles))) {
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "%-16s %11s %11s %5s %5s %7s %4s %4s\n", "Profile", "TX mark/sp", "RX mark/sp", "Baud", "Level", "Framing", "CRC", "Key");
+	i = ao2_iterator_init(profiles, 0);
+	while ((profile = ao2_iterator_next(&i))) {
+		ast_cli(a->fd, "%-16s %5d/%-5d %5d/%-5d %5d %5d %5dN%d %4s %4d\n", profile->name,
+			profile->tx_spec.freq_one, profile->tx_spec.freq_zero, profile->rx_spec.freq_one, profile->rx_spec.freq_zero,
+			FSK_SPEC_BAUD(&profile->tx_spec), profile->tx_spec.tx_level, profile->framing.data_bits, profile->framing.stop_bits,
+			AST_YESNO(profile->crc), profile->key);
+		ao2_ref(profile, -1);
+	}
+	ao2_iterator_destroy(&i);
+	ao2_ref(profiles, -1);
+	if ((shapings = ao2_global_obj_ref(fsk_shapings)) && ao2_container_count(shapings)) {
+		ast_cli(a->fd, "\n%-16s %6s %6s %6s %4s %s\n", "Shaping", "Tilt", "Space", "Mark", "Taps", "Codecs");
+		i = ao2_iterator_init(shapings, 0);
+		while ((shaping = ao2_iterator_next(&i))) {
+			ast_cli(a->fd, "%-16s %6.1f %6.1f %6.1f %4d %s\n", shaping->name, shaping->shape.taps ? 0 : shaping->tilt,
+				shaping->shape.gain[0], shaping->shape.gain[1], shaping->shape.taps, S_OR(shaping->codecs, "-"));
+			ao2_ref(shaping, -1);
+		}
+		ao2_iterator_destroy(&i);
+	}
+	ao2_cleanup(shapings);
+	if (!(ladders = ao2_global_obj_ref(fsk_ladders))) {
+		return CLI_SUCCESS;
+	}
+	ast_cli(a->fd, "\n%-16s %-8s %5s %9s %9s %s\n", "Ladder", "Start", "Block", "Up BER", "Down BER", "Rungs");
+	i = ao2_iterator_init(ladders, 0);
+	while ((ladder = ao2_iterator_next(&i))) {
+		rungs[0] = '\0';
+		for (n = 0; n < ladder->count; n++) {
+			snprintf(rungs + strlen(rungs), sizeof(rungs) - strlen(rungs), "%s%s", n ? "," : "", ladder->rungs[n]->name);
+		}
+		ast_cli(a->fd, "%-16s %-8s %5d %9.1e %9.1e %s\n", ladder->name, ladder->rungs[ladder->start]->name,
+			ladder->block, ladder->up_ber, ladder->down_ber, rungs);
+		ao2_ref(ladder, -1);
+	}
+	ao2_iterator_destroy(&i);
+	ao2_ref(ladders, -1);
+	return CLI_SUCCESS;
+}
+
+/*! \brief Samples of a direction still held, oldest first */
+static int fsk_recorder_write_audio(const struct fsk_recorder *rec, int tx, FILE *fp)
+{
+	uint64_t kept = MIN(rec->total[tx], (uint64_t) rec->len);
+	size_t pos = (rec->total[tx] - kept) % rec->len;
+	size_t first = MIN((size_t) kept, rec->len - pos);
+
+	if (fwrite(rec->audio[tx] + pos, sizeof(int16_t), first, fp) != first
+		|| fwrite(rec->audio[tx], sizeof(int16_t), kept - first, fp) != kept - first) {
+		return -1;
+	}
+	return 0;
+}
+
+static FILE *fsk_recorder_open(const char *base, const char *suffix)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s%s", base, suffix);
+	if (!(fp = fopen(path, "w"))) {
+		ast_log(LOG_WARNING, "Unable to create '%s': %s\n", path, strerror(errno));
+	}
+	return fp;
+}
+
+/*!
+ * \brief Dump what the recorder of a failed session holds, and set FSKRECORDING to where
+ *
+ * Writes <base>.rx.sln and <base>.tx.sln, 8 kHz signed linear, <base>.frames
+ * with the time, direction, length and position in its .sln of each frame
+ * whose audio is still held, and whether it went through the demodulator,
+ * so the receive can be replayed as it happened, and <base>.meta with the
+ * circumstances as key=value lines.
+ *
+ * \param reason why the session is considered failed
+ * \param extra further key=value lines for the sidecar, may be NULL
+ */
+static void fsk_recorder_dump(struct ast_channel *chan, struct fsk_session *session, const char *app, const char *reason, const char *extra)
+{
+	struct fsk_recorder *rec = session->recorder;
+	const struct fsk_recorder_frame *frame;
+	char directory[PATH_MAX];
+	char base[PATH_MAX];
+	struct timeval now = ast_tvnow();
+	uint64_t kept[2];
+	uint64_t first;
+	uint64_t n;
+	FILE *fp;
+	int res = 0;
+	int tx;
+
+	if (!rec || !rec->frames) {
+		return;
+	}
+	ast_rwlock_rdlock(&fsk_recorder_lock);
+	ast_copy_string(directory, fsk_recorder_cfg.directory, sizeof(directory));
+	ast_rwlock_unlock(&fsk_recorder_lock);
+	if (ast_mkdir(directory, 0755)) {
+		ast_log(LOG_WARNING, "Unable to create FSK recorder directory '%s': %s\n", directory, strerror(errno));
+		return;
+	}
+	snprintf(base, sizeof(base), "%s/%s-%ld-%s", directory, ast_channel_uniqueid(chan), (long) now.tv_sec, app);
+
+	for (tx = 0; tx < 2; tx++) {
+		kept[tx] = MIN(rec->total[tx], (uint64_t) rec->len);
+		if (!(fp = fsk_recorder_open(base, tx ? ".tx.sln" : ".rx.sln"))) {
+			return;
+		}
+		res |= fsk_recorder_write_audio(rec, tx, fp);
+		res |= fclose(fp);
+	}
+
+	if (!(fp = fsk_recorder_open(base, ".frames"))) {
+		return;
+	}
+	fprintf(fp, "# offset_us direction samples position demodulated\n");
+	for (n = rec->frames > rec->nframes ? rec->frames - rec->nframes : 0; n < rec->frames; n++) {
+		frame = &rec->frame[n % rec->nframes];
+		first = rec->total[frame->tx] - kept[frame->tx];
+		if (frame->sample < first) {
+			continue;
+		}
+		fprintf(fp, "%" PRId64 " %s %u %" PRIu64 " %u\n", frame->offset_us, frame->tx ? "tx" : "rx",
+			frame->samples, frame->sample - first, frame->demodulated);
+	}
+	res |= fclose(fp);
+
+	if (!(fp = fsk_recorder_open(base, ".meta"))) {
+		return;
+	}
+	ao2_lock(session);
+	fprintf(fp, "app=%s\nreason=%s\nchannel=%s\nuniqueid=%s\ncaller=%s\nrx_profile=%s\ntx_profile=%s\n",
+		app, reason, ast_channel_name(chan), ast_channel_uniqueid(chan),
+		S_COR(ast_channel_caller(chan)->id.number.valid, ast_channel_caller(chan)->id.number.str, ""),
+		session->rx_profile ? session->rx_profile->name : "", session->tx_profile ? session->tx_profile->name : "");
+	if (session->tx_shaping) {
+		fprintf(fp, "tx_shaping=%s\ncodec=%s\n", session->tx_shaping->name, session->codec);
+	}
+	/* enough to set the demodulator up again without the profile */
+	if (session->rx_profile) {
+		fprintf(fp, "rx_mark=%d\nrx_space=%d\nrx_baud_rate=%d\nrx_min_level=%d\ndata_bits=%d\nstop_bits=%d\n",
+			session->rx_profile->rx_spec.freq_one, session->rx_profile->rx_spec.freq_zero, session->rx_profile->rx_spec.baud_rate,
+			session->rx_profile->rx_spec.min_level, session->rx_profile->framing.data_bits, session->rx_profile->framing.stop_bits);
+		if (session->in.rcv.agc) {
+			fprintf(fp, "agc=%g,%g,%g,%g,%g,%g,%d\n", session->in.agc.params.target, session->in.agc.params.max_gain,
+				session->in.agc.params.attack_ms, session->in.agc.params.decay_ms, session->in.agc.params.margin,
+				session->in.agc.params.floor, session->in.agc.params.dc);
+		}
+	}
+	ao2_unlock(session);
+	/* once the ring has wrapped, the demodulator state at its start is lost */
+	fprintf(fp, "rate=%d\nrecorder_start=%ld.%06ld\ndumped=%ld.%06ld\nrx_samples=%" PRIu64 "\ntx_samples=%" PRIu64 "\ncomplete=%s\n",
+		FSK_DSP_SAMPLE_RATE, (long) rec->start.tv_sec, (long) rec->start.tv_usec, (long) now.tv_sec, (long) now.tv_usec,
+		kept[0], kept[1], rec->total[0] <= rec->len && rec->frames <= rec->nframes ? "yes" : "no");
+	if (extra) {
+		fputs(extra, fp);
+	}
+	res |= fclose(fp);
+
+	if (res) {
+		ast_log(LOG_WARNING, "FSK recording of %s in '%s' is incomplete\n", ast_channel_name(chan), base);
+	}
+	ast_verb(3, "FSK session on %s failed (%s), recording dumped to '%s'\n", ast_channel_name(chan), reason, base);
+	pbx_builtin_setvar_helper(chan, "FSKRECORDING", base);
+}
+
+static char *handle_fsk_show_admission(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct fsk_admission_stats stats;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "fsk show admission";
+		e->usage =
+			"Usage: fsk show admission\n"
+			"       Show FSK sessions running and queued against the limits of the [admission]\n"
+			"       section of fsk.conf. Load and costs are in percent of one CPU core.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	fsk_admission_stats(&stats);
+	ast_cli(a->fd, "Sessions:         %u (limit %u)\n", stats.sessions, stats.max_sessions);
+	ast_cli(a->fd, "Queued:           %u\n", stats.queued);
+	ast_cli(a->fd, "Load:             %.2f%% (budget %.2f%%)\n", stats.load, stats.cpu_budget);
+	ast_cli(a->fd, "Session cost:     %.3f%%\n", stats.session_cost);
+	ast_cli(a->fd, "Utilization:      %.1f%%\n", stats.utilization);
+	ast_cli(a->fd, "Admitted:         %lu\n", stats.admitted);
+	ast_cli(a->fd, "Queued so far:    %lu\n", stats.waited);
+	ast_cli(a->fd, "Rejected:         %lu\n", stats.rejected);
+	ast_cli(a->fd, "Queue timeouts:   %lu\n", stats.timeouts);
+	return CLI_SUCCESS;
+}
+
+static int fsk_admission_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+	struct fsk_admission_stats stats;
+
+	fsk_admission_stats(&stats);
+	if (ast_strlen_zero(data) || !strcasecmp(data, "utilization")) {
+		snprintf(buf, len, "%.1f", stats.utilization);
+	} else if (!strcasecmp(data, "sessions")) {
+		snprintf(buf, len, "%u", stats.sessions);
+	} else if (!strcasecmp(data, "queued")) {
+		snprintf(buf, len, "%u", stats.queued);
+	} else if (!strcasecmp(data, "load")) {
+		snprintf(buf, len, "%.2f", stats.load);
+	} else if (!strcasecmp(data, "max_sessions")) {
+		snprintf(buf, len, "%u", stats.max_sessions);
+	} else if (!strcasecmp(data, "cpu_budget")) {
+		snprintf(buf, len, "%.2f", stats.cpu_budget);
+	} else {
+		ast_log(LOG_WARNING, "Unknown FSK_ADMISSION item '%s'\n", data);
+		return -1;
+	}
+	return 0;
+}
+
+static struct ast_custom_function fsk_admission_function = {
+	.name = "FSK_ADMISSION",
+	.read = fsk_admission_read,
+};
+
+static int manager_fsk_admission(struct mansession *s, const struct message *m)
+{
+	struct fsk_admission_stats stats;
+
+	fsk_admission_stats(&stats);
+	astman_start_ack(s, m);
+	astman_append(s, "Sessions: %u\r\nQueued: %u\r\nMaxSessions: %u\r\nLoad: %.2f\r\nCPUBudget: %.2f\r\n"
+		"SessionCost: %.3f\r\nUtilization: %.1f\r\nAdmitted: %lu\r\nWaited: %lu\r\nRejected: %lu\r\nTimeouts: %lu\r\n\r\n",
+		stats.sessions, stats.queued, stats.max_sessions, stats.load, stats.cpu_budget,
+		stats.session_cost, stats.utilization, stats.admitted, stats.waited, stats.rejected, stats.timeouts);
+	return 0;
+}
+
+/*! \brief Note the codec a channel sends with, before preparing a profile on it, on every path that sends */
+static void fsk_session_codec(struct fsk_session *session, struct ast_channel *chan)
+{
+	char codec[sizeof(session->codec)] = "";
+	struct ast_format *format;
+
+	ast_channel_lock(chan);
+	if ((format = ast_channel_rawwriteformat(chan))) {
+		ast_copy_string(codec, ast_format_get_name(format), sizeof(codec));
+	}
+	ast_channel_unlock(chan);
+	ao2_lock(session);
+	ast_copy_string(session->codec, codec, sizeof(session->codec));
+	ao2_unlock(session);
+}
+
+static int fsk_session_tx_prepare(struct fsk_session *session, struct fsk_profile *profile)
+{
+	struct fsk_shaping *shaping = fsk_shaping_pick(profile, session->codec);
+	const struct fsk_mod_params *mod = &profile->mod;
+	struct fsk_shape shape;
+
+	if (session->tx && session->tx_profile == profile && session->tx_shaping == shaping) {
+		ao2_cleanup(shaping);
+		return 0;
+	}
+	/* the profile's own tables, rescaled; the tilt depends on its tones */
+	if (shaping && (session->shaped || (session->shaped = ast_malloc(sizeof(*session->shaped))))) {
+		shape = shaping->shape;
+		if (!shape.taps && shaping->tilt) {
+			fsk_shape_tilt(&shape, profile->tx_spec.freq_zero, profile->tx_spec.freq_one, shaping->tilt);
+		}
+		memcpy(session->shaped, &profile->mod, sizeof(*session->shaped));
+		fsk_mod_params_shape(session->shaped, profile->tx_spec.tx_level, &shape);
+		mod = session->shaped;
+	} else if (shaping) {
+		ao2_ref(shaping, -1);
+		shaping = NULL;
+	}
+	ao2_replace(session->tx_shaping, shaping);
+	ao2_cleanup(shaping);
+	ao2_replace(session->tx_profile, profile);
+	fsk_mod_init(&session->tx_state, mod, (fsk_get_bit_fn) put_bit, &session->out);
+	session->out.framing = &profile->framing;
+	session->out.current_bit_no = 0;
+	session->tx = &session->tx_state;
+	return 0;
+}
+
+static int fsk_session_rx_prepare(struct fsk_session *session, struct fsk_profile *profile)
+{
+	if (session->rx && session->rx_profile == profile) {
+		return 0;
+	}
+	/* spandsp keeps the demodulator private, it is set up from the spec rather than copied */
+	if (!fsk_rx_init(&session->rx_state, &profile->rx_spec, profile->framing.data_bits + 2, fsk_receive_put_bit, &session->in.rcv)) {
+		session->rx = NULL;
+		return -1;
+	}
+	ao2_replace(session->rx_profile, profile);
+	fsk_rx_set_modem_status_handler(&session->rx_state, fsk_receive_status, &session->in.rcv);
+	session->in.rcv.carrier = 0;
+	session->in.rcv.data_mask = (1 << profile->framing.data_bits) - 1;
+	session->in.rcv.byte = rx_byte;
+	session->in.rcv.carrier_change = rx_carrier;
+	/* left reset when not measured, so the quality variables come out cleared */
+	fsk_quality_init(&session->in.quality, profile->rx_spec.freq_zero, profile->rx_spec.freq_one, profile->rx_spec.baud_rate);
+	session->in.rcv.quality = profile->quality ? &session->in.quality : NULL;
+	session->in.rcv.agc = fsk_agc_setup(&session->in.agc, &profile->rx_spec);
+	session->rx = &session->rx_state;
+	return 0;
+}
+
+/*!
+ * \brief Modulate until the session has nothing left to send
+ * \param f voice frame wrapping a BLOCK_LEN sample buffer
+ * \param ticket admission the modulator time is charged to, may be NULL
+ * \retval 0 on success
+ * \retval -1 on hangup or write failure
+ */
+static int fsk_session_transmit(struct ast_channel *chan, struct fsk_session *session, struct ast_frame *f,
+	struct fsk_admission_ticket *ticket)
+{
+	struct ast_frame *fr;
+	uint64_t busy;
+	int pending;
+	int samples;
+
+	ao2_lock(session);
+	pending = fsk_tx_pending(&session->out);
+	ao2_unlock(session);
+	while (pending) {
+		ast_waitfor(chan, 1000);
+		fr = ast_read(chan);
+		if (!fr) {
+			ast_debug(1, "Null == hangup() detected\n");
+			return -1;
+		}
+		if (fr->frametype == AST_FRAME_DTMF) {
+			ast_debug(1, "User pressed a key\n");
+		}
+		fsk_recorder_put_frame(session->recorder, fr, 0);
+		ast_frfree(fr);
+		busy = fsk_admission_clock();
+		ao2_lock(session);
+		samples = fsk_mod(session->tx, f->data.ptr, BLOCK_LEN);
+		pending = fsk_tx_pending(&session->out);
+		ao2_unlock(session);
+		fsk_recorder_put(session->recorder, 1, 0, f->data.ptr, samples);
+		fsk_admission_charge(ticket, busy);
+		if (ast_write(chan, f) < 0) {
+			ast_debug(1, "Failed to write %d samples\n", samples);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*!
+ * \brief Either hold the carrier for the next call, or close the transmission and the session
+ * \param ticket admission of the application, that the held carrier goes on with
+ */
+static void fsk_session_transmit_done(struct ast_channel *chan, struct fsk_session *session, struct ast_frame *f, int persistent,
+	struct fsk_admission_ticket *ticket)
+{
+	struct ast_frame *fr;
+
+	if (persistent) {
+		fsk_session_carrier_hold(chan, session, ticket);
+		return;
+	}
+	memset(f->data.ptr, 0, f->datalen);
+	ast_waitfor(chan, -1);
+	fr = ast_read(chan);
+	if (fr != NULL) {
+		ast_write(chan, f);
+		ast_frfree(fr);
+	} else {
+		ast_log(LOG_WARNING, "ast_read returned NULL value.\n");
+	}
+	fsk_session_end(chan);
+}
+
+/*
+ * Sealed payload layout: version, key id, nonce, ciphertext, tag
+ *
+ * The 30 bytes around the ciphertext are 300 bits on the line, a second per
+ * message at Bell 103. They are kept whole: a counter nonce would have to
+ * survive restarts and be shared by every sender on a key, and GCM loses
+ * forgery resistance faster than the tag length suggests once it is cut.
+ */
+#define FSK_SEAL_VERSION    1
+#define FSK_SEAL_NONCE      12
+#define FSK_SEAL_TAG        16
+#define FSK_SEAL_HEADER     (2 + FSK_SEAL_NONCE)
+#define FSK_SEAL_OVERHEAD   (FSK_SEAL_HEADER + FSK_SEAL_TAG)
+
+/*! \brief Outcome of opening a sealed payload, reported in FSKAUTH */
+enum fsk_auth {
+	FSK_AUTH_OK,
+	FSK_AUTH_FAILED,                /*!< tampered with, or sealed with another key */
+	FSK_AUTH_NOKEY,                 /*!< the key id is not in the keyring */
+	FSK_AUTH_MALFORMED,             /*!< too short, or of an unknown version */
+};
+
+static const char * const fsk_auth_names[] = {
+	[FSK_AUTH_OK] = "OK",
+	[FSK_AUTH_FAILED] = "FAILED",
+	[FSK_AUTH_NOKEY] = "NOKEY",
+	[FSK_AUTH_MALFORMED] = "MALFORMED",
+};
+
+struct fsk_key {
+	int len;                        /*!< 16, 24 or 32, 0 if the slot is unused */
+	unsigned char key[32];
+};
+
+/*! \brief AES keys by id, from the [keys] section of fsk.conf */
+static struct fsk_key fsk_keyring[256];
+AST_RWLOCK_DEFINE_STATIC(fsk_keyring_lock);
+
+static const EVP_CIPHER *fsk_key_cipher(int len)
+{
+	return len == 32 ? EVP_aes_256_gcm() : len == 24 ? EVP_aes_192_gcm() : EVP_aes_128_gcm();
+}
+
+static int fsk_key_get(unsigned int id, struct fsk_key *key)
+{
+	if (id >= ARRAY_LEN(fsk_keyring)) {
+		return -1;
+	}
+	ast_rwlock_rdlock(&fsk_keyring_lock);
+	*key = fsk_keyring[id];
+	ast_rwlock_unlock(&fsk_keyring_lock);
+	return key->len ? 0 : -1;
+}
+
+/*!
+ * \brief Encrypt and authenticate a payload with AES-GCM
+ *
+ * The version, key id and nonce are authenticated along with the payload.
+ * OpenSSL picks AES-NI and carry-less multiply code when the CPU has them.
+ *
+ * \param sealed heap buffer of len + FSK_SEAL_OVERHEAD bytes on success
+ */
+static int fsk_seal(unsigned int id, const void *data, size_t len, unsigned char **sealed)
+{
+	struct fsk_key key;
+	EVP_CIPHER_CTX *ctx;
+	unsigned char *out;
+	int n;
+	int res = -1;
+
+	if (fsk_key_get(id, &key)) {
+		ast_log(LOG_WARNING, "No key %u in the FSK keyring\n", id);
+		return -1;
+	}
+	if (len > INT_MAX - FSK_SEAL_OVERHEAD || !(out = ast_malloc(len + FSK_SEAL_OVERHEAD))) {
+		return -1;
+	}
+	out[0] = FSK_SEAL_VERSION;
+	out[1] = id;
+	if (RAND_bytes(out + 2, FSK_SEAL_NONCE) != 1 || !(ctx = EVP_CIPHER_CTX_new())) {
+		ast_free(out);
+		return -1;
+	}
+	if (EVP_EncryptInit_ex(ctx, fsk_key_cipher(key.len), NULL, key.key, out + 2) == 1
+		&& EVP_EncryptUpdate(ctx, NULL, &n, out, FSK_SEAL_HEADER) == 1
+		&& EVP_EncryptUpdate(ctx, out + FSK_SEAL_HEADER, &n, data, len) == 1
+		&& EVP_EncryptFinal_ex(ctx, out + FSK_SEAL_HEADER + n, &n) == 1
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, FSK_SEAL_TAG, out + FSK_SEAL_HEADER + len) == 1) {
+		res = 0;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	OPENSSL_cleanse(&key, sizeof(key));
+	if (res) {
+		ast_free(out);
+		return -1;
+	}
+	*sealed = out;
+	return 0;
+}
+
+/*!
+ * \brief Verify and decrypt a sealed payload in place
+ * \param len in: sealed length, out: plaintext length, the plaintext starts at data
+ */
+static enum fsk_auth fsk_unseal(unsigned char *data, size_t *len)
+{
+	struct fsk_key key;
+	EVP_CIPHER_CTX *ctx;
+	size_t plain = *len - FSK_SEAL_OVERHEAD;
+	unsigned char tag[FSK_SEAL_TAG];
+	int n;
+	int ok = 0;
+
+	if (*len < FSK_SEAL_OVERHEAD || data[0] != FSK_SEAL_VERSION) {
+		return FSK_AUTH_MALFORMED;
+	}
+	if (fsk_key_get(data[1], &key)) {
+		return FSK_AUTH_NOKEY;
+	}
+	if (!(ctx = EVP_CIPHER_CTX_new())) {
+		return FSK_AUTH_FAILED;
+	}
+	memcpy(tag, data + FSK_SEAL_HEADER + plain, FSK_SEAL_TAG);
+	/* GCM is a stream mode, decrypting onto the ciphertext one block behind is safe */
+	if (EVP_DecryptInit_ex(ctx, fsk_key_cipher(key.len), NULL, key.key, data + 2) == 1
+		&& EVP_DecryptUpdate(ctx, NULL, &n, data, FSK_SEAL_HEADER) == 1
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, FSK_SEAL_TAG, tag) == 1
+		&& EVP_DecryptUpdate(ctx, data + FSK_SEAL_HEADER, &n, data + FSK_SEAL_HEADER, plain) == 1
+		&& EVP_DecryptFinal_ex(ctx, data + FSK_SEAL_HEADER + n, &n) == 1) {
+		ok = 1;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	OPENSSL_cleanse(&key, sizeof(key));
+	if (!ok) {
+		/* never hand out plaintext that failed authentication */
+		memset(data, 0, *len);
+		*len = 0;
+		return FSK_AUTH_FAILED;
+	}
+	memmove(data, data + FSK_SEAL_HEADER, plain);
+	*len = plain;
+	return FSK_AUTH_OK;
+}
+
+/*! \brief Replace the keyring with the [keys] section of a configuration */
+static void fsk_keyring_load(struct ast_config *config)
+{
+	struct fsk_key *keyring;
+	struct ast_variable *var;
+	unsigned int id;
+	unsigned int byte;
+	size_t hex;
+	int i;
+
+	if (!(keyring = ast_calloc(ARRAY_LEN(fsk_keyring), sizeof(*keyring)))) {
+		return;
+	}
+	for (var = config ? ast_variable_browse(config, "keys") : NULL; var; var = var->next) {
+		hex = strlen(var->value);
+		if (sscanf(var->name, "%30u", &id) != 1 || id >= ARRAY_LEN(fsk_keyring)
+			|| (hex != 32 && hex != 48 && hex != 64)) {
+			ast_log(LOG_WARNING, "Invalid key '%s' at line %d of %s, ids are 0 to 255 and keys 32, 48 or 64 hex digits\n",
+				var->name, var->lineno, fsk_config_file);
+			continue;
+		}
+		for (i = 0; i < hex / 2; i++) {
+			if (sscanf(var->value + i * 2, "%2x", &byte) != 1) {
+				break;
+			}
+			keyring[id].key[i] = byte;
+		}
+		if (i == hex / 2) {
+			keyring[id].len = hex / 2;
+		} else {
+			ast_log(LOG_WARNING, "Invalid key '%s' at line %d of %s\n", var->name, var->lineno, fsk_config_file);
+			OPENSSL_cleanse(&keyring[id], sizeof(keyring[id]));
+		}
+	}
+	ast_rwlock_wrlock(&fsk_keyring_lock);
+	memcpy(fsk_keyring, keyring, sizeof(fsk_keyring));
+	ast_rwlock_unlock(&fsk_keyring_lock);
+	OPENSSL_cleanse(keyring, ARRAY_LEN(fsk_keyring) * sizeof(*keyring));
+	ast_free(keyring);
+}
+
+/*!
+ * \brief Resolve the SendFSK data argument to the bytes to be sent
+ * \param arg data argument, inline payloads are used in place
+ * \retval 0 on success
+ * \retval -1 if the referenced payload cannot be read
+ */
+static int fsk_payload_open(struct ast_channel *chan, struct fsk_payload *payload, const char *arg, const struct ast_flags *flags)
+{
+	struct stat st;
+	const char *value;
+	int fd;
+
+	memset(payload, 0, sizeof(*payload));
+	if (ast_test_flag(flags, OPT_PAYLOAD_SOCKET)) {
+		if (!(payload->source = fsk_source_alloc(arg))) {
+			return -1;
+		}
+		payload->data = "";
+	} else if (ast_test_flag(flags, OPT_PAYLOAD_FILE)) {
+		if ((fd = open(arg, O_RDONLY)) < 0) {
+			ast_log(LOG_WARNING, "Unable to open '%s': %s\n", arg, strerror(errno));
+			return -1;
+		}
+		if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size > INT_MAX) {
+			ast_log(LOG_WARNING, "'%s' is not a regular file SendFSK can send\n", arg);
+			close(fd);
+			return -1;
+		}
+		payload->len = st.st_size;
+		if (payload->len) {
+			payload->map = mmap(NULL, payload->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (payload->map == MAP_FAILED) {
+			ast_log(LOG_WARNING, "Unable to map '%s': %s\n", arg, strerror(errno));
+			payload->map = NULL;
+			return -1;
+		}
+		/* pages are faulted in as the modulator gets to them */
+		if (payload->map) {
+			madvise(payload->map, payload->len, MADV_SEQUENTIAL);
+		}
+		payload->data = payload->map ? payload->map : "";
+	} else if (ast_test_flag(flags, OPT_PAYLOAD_VAR)) {
+		/* the value is only stable while the channel is locked */
+		ast_channel_lock(chan);
+		value = pbx_builtin_getvar_helper(chan, arg);
+		payload->copy = ast_strdup(S_OR(value, ""));
+		ast_channel_unlock(chan);
+		if (!payload->copy) {
+			return -1;
+		}
+		payload->data = payload->copy;
+		payload->len = strlen(payload->copy);
+	} else {
+		payload->data = arg;
+		payload->len = strlen(arg);
+	}
+	return 0;
+}
+
+static void fsk_payload_close(struct fsk_payload *payload)
+{
+	if (payload->source) {
+		fsk_source_close(payload->source);
+	}
+	if (payload->map) {
+		munmap(payload->map, payload->len);
+	}
+	ast_free(payload->copy);
+	ast_free(payload->sealed);
+	memset(payload, 0, sizeof(*payload));
+}
+
+/*! \brief A demodulator of an adaptive transfer, listening on one rung */
+struct fsk_ladder_rx {
+	struct fsk_receive rcv;         /* first, the byte callback gets back here from it */
+	struct fsk_quality quality;
+	struct fsk_agc agc;
+	fsk_rx_state_t *rx;
+	int rung;                       /* -1 until listening */
+	int data;                       /* takes data frames, else answers */
+	int len;
+	unsigned char frame[FSK_LADDER_FRAME_MAX];
+};
+
+static void fsk_ladder_rx_byte(struct fsk_receive *rcv, unsigned char byte)
+{
+	struct fsk_ladder_rx *lrx = (struct fsk_ladder_rx *) rcv;
+
+	/* drop what cannot start a frame for us, line noise and the echo of our own frames included */
+	if (!lrx->len && (lrx->data ? byte != FSK_LADDER_DATA && byte != FSK_LADDER_LAST : byte != FSK_LADDER_ACK && byte != FSK_LADDER_NAK)) {
+		return;
+	}
+	if (lrx->len < FSK_LADDER_FRAME_MAX) {
+		lrx->frame[lrx->len++] = byte;
+	}
+}
+
+static void fsk_ladder_rx_free(struct fsk_ladder_rx *lrx)
+{
+	if (lrx->rx) {
+		fsk_rx_free(lrx->rx);
+		lrx->rx = NULL;
+	}
+	lrx->rung = -1;
+}
+
+/*! \brief Have a demodulator listen on a rung, both directions being on the transmit side of its profile */
+static int fsk_ladder_rx_listen(struct fsk_ladder_rx *lrx, const struct fsk_ladder *ladder, int rung)
+{
+	struct fsk_profile *profile = ladder->rungs[rung];
+
+	if (lrx->rung == rung) {
+		return 0;
+	}
+	fsk_ladder_rx_free(lrx);
+	memset(&lrx->rcv, 0, sizeof(lrx->rcv));
+	if (!(lrx->rx = fsk_rx_init(NULL, &profile->tx_spec, profile->framing.data_bits + 2, fsk_receive_put_bit, &lrx->rcv))) {
+		return -1;
+	}
+	fsk_rx_set_modem_status_handler(lrx->rx, fsk_receive_status, &lrx->rcv);
+	lrx->rcv.data_mask = 0xff;
+	lrx->rcv.byte = fsk_ladder_rx_byte;
+	fsk_quality_init(&lrx->quality, profile->tx_spec.freq_zero, profile->tx_spec.freq_one, profile->tx_spec.baud_rate);
+	lrx->rcv.quality = &lrx->quality;
+	lrx->rcv.agc = fsk_agc_setup(&lrx->agc, &profile->tx_spec);
+	lrx->rung = rung;
+	return 0;
+}
+
+/*! \return length of the frame being received once its header is in, 0 before, -1 if it cannot be one */
+static int fsk_ladder_frame_len(const struct fsk_ladder_rx *lrx)
+{
+	int len;
+
+	if (lrx->len < FSK_LADDER_HEADER) {
+		return 0;
+	}
+	len = (lrx->frame[3] << 8) | lrx->frame[4];
+	return len > FSK_LADDER_BLOCK_MAX ? -1 : FSK_LADDER_HEADER + len + 2;
+}
+
+/*! \return length of the frame built */
+static int fsk_ladder_frame(unsigned char *frame, int type, int seq, int rung, const unsigned char *payload, int len)
+{
+	uint16_t crc;
+
+	frame[0] = type;
+	frame[1] = seq;
+	frame[2] = rung;
+	frame[3] = len >> 8;
+	frame[4] = len;
+	if (len) {
+		memcpy(frame + FSK_LADDER_HEADER, payload, len);
+	}
+	crc = crc_itu16_calc(frame, FSK_LADDER_HEADER + len, 0xffff) ^ 0xffff;
+	frame[FSK_LADDER_HEADER + len] = crc;
+	frame[FSK_LADDER_HEADER + len + 1] = crc >> 8;
+	return FSK_LADDER_HEADER + len + 2;
+}
+
+/*! \brief Send a ladder frame on a rung, preceded by mark */
+static int fsk_ladder_send(struct ast_channel *chan, struct fsk_session *session, struct fsk_profile *profile,
+	unsigned char *frame, int len, struct fsk_admission_ticket *ticket)
+{
+	int16_t amp[BLOCK_LEN];
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "FSKLadder",
+		.datalen = BLOCK_LEN * 2,
+		.samples = BLOCK_LEN,
+		.data.ptr = amp,
+	};
+	struct ast_frame *fr;
+	uint64_t busy;
+	int res;
+	int i;
+
+	f.subclass.format = ast_format_slin;
+	fsk_session_codec(session, chan);
+	ao2_lock(session);
+	fsk_session_tx_prepare(session, profile);
+	session->out.buffer = NULL;
+	session->out.bytes2send = 0;
+	session->out.ptr = 0;
+	session->out.source = NULL;
+	session->out.current_bit_no = 0;
+	session->out.crc = 0;
+	ao2_unlock(session);
+	for (i = 0; i < FSK_LADDER_MARK_BLOCKS; i++) {
+		if (ast_waitfor(chan, 1000) < 0 || !(fr = ast_read(chan))) {
+			return -1;
+		}
+		fsk_recorder_put_frame(session->recorder, fr, 0);
+		ast_frfree(fr);
+		busy = fsk_admission_clock();
+		fsk_mod(session->tx, amp, BLOCK_LEN);
+		fsk_admission_charge(ticket, busy);
+		fsk_recorder_put(session->recorder, 1, 0, amp, BLOCK_LEN);
+		if (ast_write(chan, &f) < 0) {
+			return -1;
+		}
+	}
+	ao2_lock(session);
+	session->out.buffer = (char *) frame;
+	session->out.bytes2send = len;
+	ao2_unlock(session);
+	res = fsk_session_transmit(chan, session, &f, ticket);
+	ao2_lock(session);
+	session->out.buffer = NULL;
+	session->out.bytes2send = 0;
+	session->out.ptr = 0;
+	ao2_unlock(session);
+	return res;
+}
+
+enum fsk_ladder_heard {
+	FSK_LADDER_HANGUP = -1,
+	FSK_LADDER_NOTHING,
+	FSK_LADDER_FRAME,
+	FSK_LADDER_DAMAGED,             /*!< a frame started and was lost, only reported to receivers */
+};
+
+/*!
+ * \brief Listen for a ladder frame on one or more rungs at once
+ * \param lrx demodulators, the first on the rung the peer was told to use
+ * \param timeout ms without carrier after which to give up, -1 for ever
+ * \param which set to the demodulator that got a frame
+ *
+ * A lost frame is reported once no demodulator has had carrier for
+ * FSK_LADDER_GUARD_MS. One lost on another rung than the first is put down to
+ * the sender's signal leaking into it, unless the first has heard nothing.
+ * Carrier only stretches the timeout by FSK_LADDER_GUARD_MAX_MS, so a line
+ * that never goes quiet still gives up.
+ */
+static enum fsk_ladder_heard fsk_ladder_listen(struct ast_channel *chan, struct fsk_session *session, struct fsk_ladder_rx *lrx,
+	int count, int timeout, struct fsk_admission_ticket *ticket, int *which)
+{
+	int16_t silence[BLOCK_LEN] = { 0, };
+	struct ast_frame out = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "FSKLadder",
+		.datalen = BLOCK_LEN * 2,
+		.samples = BLOCK_LEN,
+		.data.ptr = silence,
+	};
+	struct ast_frame *f;
+	uint64_t busy;
+	uint16_t crc;
+	int forever = timeout < 0;
+	int limit = timeout + FSK_LADDER_GUARD_MAX_MS;  /* ms in all, carrier or not */
+	int commanded = 0;              /* the first demodulator has had carrier or started a frame */
+	int damaged = -1;               /* ms since a frame was lost, -1 while none is */
+	int quiet = 0;                  /* ms without carrier on any rung */
+	int carrier;
+	int ms;
+	int len;
+	int i;
+
+	out.subclass.format = ast_format_slin;
+	for (i = 0; i < count; i++) {
+		lrx[i].len = 0;
+		fsk_receive_start(&lrx[i].rcv, 0, 1);
+	}
+	for (;;) {
+		if (ast_waitfor(chan, 1000) < 0 || !(f = ast_read(chan))) {
+			return FSK_LADDER_HANGUP;
+		}
+		carrier = 0;
+		if (f->frametype == AST_FRAME_VOICE) {
+			busy = fsk_admission_clock();
+			for (i = 0; i < count; i++) {
+				fsk_receive_feed(lrx[i].rx, &lrx[i].rcv, f->data.ptr, f->samples);
+				carrier |= lrx[i].rcv.carrier;
+			}
+			fsk_admission_charge(ticket, busy);
+			commanded |= lrx[0].rcv.carrier || lrx[0].len;
+			ms = MAX(f->samples / 8, 1);
+			limit -= ms;
+			if (!carrier) {
+				timeout -= ms;
+				quiet += ms;
+			} else {
+				quiet = 0;
+			}
+			if (damaged >= 0) {
+				damaged += ms;
+			}
+		}
+		fsk_recorder_put_frame(session->recorder, f, f->frametype == AST_FRAME_VOICE);
+		ast_frfree(f);
+		fsk_recorder_put(session->recorder, 1, 0, silence, BLOCK_LEN);
+		if (ast_write(chan, &out) < 0) {
+			return FSK_LADDER_HANGUP;
+		}
+		for (i = 0; i < count; i++) {
+			len = fsk_ladder_frame_len(&lrx[i]);
+			if (len > 0 && lrx[i].len >= len) {
+				crc = crc_itu16_calc(lrx[i].frame, len - 2, 0xffff) ^ 0xffff;
+				if (lrx[i].frame[len - 2] == (crc & 0xff) && lrx[i].frame[len - 1] == crc >> 8) {
+					*which = i;
+					return FSK_LADDER_FRAME;
+				}
+				ast_debug(1, "Bad CRC on FSK ladder frame 0x%02x\n", lrx[i].frame[0]);
+			} else if (len >= 0 && !lrx[i].rcv.eof) {
+				continue;
+			}
+			/* a frame lost or cut short by carrier loss, or a blip */
+			if (lrx[i].data && lrx[i].len && (!i || !commanded) && damaged < 0) {
+				ast_debug(1, "FSK ladder frame lost on rung %d, answering once the line is quiet\n", lrx[i].rung);
+				damaged = 0;
+			}
+			lrx[i].len = 0;
+			fsk_receive_start(&lrx[i].rcv, 0, 1);
+		}
+		if (damaged >= 0) {
+			if (quiet >= FSK_LADDER_GUARD_MS || damaged >= FSK_LADDER_GUARD_MAX_MS) {
+				return FSK_LADDER_DAMAGED;
+			}
+		} else if (!forever && (timeout <= 0 || limit <= 0)) {
+			return FSK_LADDER_NOTHING;
+		}
+	}
+}
+
+/*!
+ * \brief Send a message over a ladder, as SendFSK does
+ * \retval 0 the transfer is over, result says how
+ * \retval -1 on hangup
+ */
+static int fsk_ladder_transmit(struct ast_channel *chan, struct fsk_session *session, struct fsk_ladder *ladder,
+	const unsigned char *data, size_t len, struct fsk_admission_ticket *ticket, struct fsk_ladder_result *result)
+{
+	struct fsk_ladder_rx *answer;
+	unsigned char *frame;
+	struct timeval start = ast_tvnow();
+	size_t pos = 0;
+	int rung = ladder->start;
+	int failures = 0;
+	int seq = 0;
+	int heard;
+	int which;
+	int next;
+	int last;
+	int res = 0;
+	int n;
+
+	memset(result, 0, sizeof(*result));
+	result->status = "FAILED";
+	result->rung = rung;
+	frame = ast_malloc(FSK_LADDER_FRAME_MAX);
+	answer = ast_calloc(1, sizeof(*answer));
+	/* answers always come on the slowest rung */
+	if (!frame || !answer || (answer->rung = -1, fsk_ladder_rx_listen(answer, ladder, 0))) {
+		ast_free(frame);
+		if (answer) {
+			fsk_ladder_rx_free(answer);
+			ast_free(answer);
+		}
+		return 0;
+	}
+	for (;;) {
+		n = MIN((size_t) ladder->block, len - pos);
+		last = pos + n >= len;
+		result->rung = rung;
+		if (fsk_ladder_send(chan, session, ladder->rungs[rung], frame,
+			fsk_ladder_frame(frame, last ? FSK_LADDER_LAST : FSK_LADDER_DATA, seq, rung, data + pos, n), ticket)) {
+			res = -1;
+			break;
+		}
+		heard = fsk_ladder_listen(chan, session, answer, 1, ladder->answer_ms, ticket, &which);
+		if (heard == FSK_LADDER_HANGUP) {
+			res = -1;
+			break;
+		}
+		if (heard == FSK_LADDER_FRAME && answer->frame[1] == (seq & 0xff)) {
+			next = MIN(answer->frame[2], ladder->count - 1);
+			if (answer->frame[0] == FSK_LADDER_ACK) {
+				pos += n;
+				seq++;
+				failures = 0;
+				result->blocks++;
+				if (last) {
+					result->status = "OK";
+					break;
+				}
+			} else {
+				failures++;
+				result->retries++;
+			}
+		} else {
+			/* no answer, or one to a block before: again, where the receiver always listens */
+			next = 0;
+			failures++;
+			result->retries++;
+		}
+		if (next != rung) {
+			ast_debug(1, "FSK ladder '%s' goes from %s to %s\n", ladder->name, ladder->rungs[rung]->name, ladder->rungs[next]->name);
+			result->steps++;
+			rung = next;
+		}
+		if (failures >= ladder->attempts) {
+			break;
+		}
+	}
+	if (res) {
+		result->status = "HANGUP";
+	}
+	result->bytes = pos;
+	result->ms = ast_tvdiff_ms(ast_tvnow(), start);
+	fsk_ladder_rx_free(answer);
+	ast_free(answer);
+	ast_free(frame);
+	return res;
+}
+
+/*!
+ * \brief Receive a message over a ladder into the receive core of the session, as ReceiveFSK does
+ * \retval 0 the transfer is over, result says how
+ * \retval -1 on hangup
+ */
+static int fsk_ladder_receive(struct ast_channel *chan, struct fsk_session *session, struct fsk_ladder *ladder,
+	struct fsk_admission_ticket *ticket, struct fsk_ladder_result *result)
+{
+	/* on the rung asked for, and on the slowest one, where a sender that heard no answer goes */
+	struct fsk_ladder_rx *lrx;
+	struct fsk_quality_report quality;
+	unsigned char answer[FSK_LADDER_HEADER + 2];
+	const unsigned char *frame;
+	struct timeval start = ast_tvnow();
+	int rung = ladder->start;
+	int timeout = -1;               /* the first block may take as long as the peer does */
+	int clean = 0;                  /* blocks in a row below up_ber */
+	int done = 0;
+	int seq = 0;
+	int heard;
+	int which;
+	int next;
+	int type;
+	int res = 0;
+	int got;
+	int n;
+	int i;
+
+	memset(result, 0, sizeof(*result));
+	result->status = "FAILED";
+	result->rung = rung;
+	if (!(lrx = ast_calloc(2, sizeof(*lrx)))) {
+		return 0;
+	}
+	lrx[0].rung = lrx[1].rung = -1;
+	lrx[0].data = lrx[1].data = 1;
+	for (;;) {
+		if (fsk_ladder_rx_listen(&lrx[0], ladder, rung) || fsk_ladder_rx_listen(&lrx[1], ladder, 0)) {
+			break;
+		}
+		heard = fsk_ladder_listen(chan, session, lrx, rung ? 2 : 1, timeout, ticket, &which);
+		if (heard == FSK_LADDER_HANGUP) {
+			res = -1;
+			break;
+		}
+		if (heard == FSK_LADDER_NOTHING) {
+			result->status = done ? "OK" : "TIMEOUT";
+			break;
+		}
+		if (heard == FSK_LADDER_FRAME) {
+			frame = lrx[which].frame;
+			got = lrx[which].rung;
+			n = (frame[3] << 8) | frame[4];
+			/* else a block already taken, whose answer was lost */
+			if (frame[1] == (seq & 0xff) && !done) {
+				for (i = 0; i < n; i++) {
+					fsk_receive_put_bit(&session->in.rcv, frame[FSK_LADDER_HEADER + i]);
+				}
+				session->in.quality = lrx[which].quality;
+				seq++;
+				result->blocks++;
+				result->bytes += n;
+				done = frame[0] == FSK_LADDER_LAST;
+			}
+			fsk_quality_report(&lrx[which].quality, &quality);
+			next = got;
+			if (quality.ber > ladder->down_ber) {
+				next = MAX(got - 1, 0);
+				clean = 0;
+			} else if (quality.ber < ladder->up_ber && ++clean >= ladder->up_blocks) {
+				next = MIN(got + 1, ladder->count - 1);
+				clean = 0;
+			}
+			type = FSK_LADDER_ACK;
+			n = fsk_ladder_frame(answer, type, frame[1], next, NULL, 0);
+		} else {
+			next = MAX(rung - 1, 0);
+			clean = 0;
+			result->retries++;
+			type = FSK_LADDER_NAK;
+			n = fsk_ladder_frame(answer, type, seq, next, NULL, 0);
+		}
+		if (fsk_ladder_send(chan, session, ladder->rungs[0], answer, n, ticket)) {
+			res = -1;
+			break;
+		}
+		if (next != rung) {
+			ast_debug(1, "FSK ladder '%s' goes from %s to %s\n", ladder->name, ladder->rungs[rung]->name, ladder->rungs[next]->name);
+			result->steps++;
+			rung = next;
+		}
+		result->rung = rung;
+		/* the sender goes on right away, or sends again once it has waited for the answer */
+		timeout = ladder->answer_ms * 2;
+	}
+	if (res) {
+		result->status = "HANGUP";
+	}
+	result->ms = ast_tvdiff_ms(ast_tvnow(), start);
+	fsk_ladder_rx_free(&lrx[0]);
+	fsk_ladder_rx_free(&lrx[1]);
+	ast_free(lrx);
+	return res;
+}
+
+static void fsk_ladder_setvars(struct ast_channel *chan, const struct fsk_ladder *ladder, const struct fsk_ladder_result *result)
+{
+	char value[32];
+
+	pbx_builtin_setvar_helper(chan, "FSKLADDERSTATUS", result->status);
+	pbx_builtin_setvar_helper(chan, "FSKLADDERPROFILE", ladder->rungs[result->rung]->name);
+	snprintf(value, sizeof(value), "%d", result->retries);
+	pbx_builtin_setvar_helper(chan, "FSKLADDERRETRIES", value);
+	snprintf(value, sizeof(value), "%d", result->steps);
+	pbx_builtin_setvar_helper(chan, "FSKLADDERSTEPS", value);
+	snprintf(value, sizeof(value), "%.0f", result->ms > 0 ? result->bytes * 8000.0 / result->ms : 0.0);
+	pbx_builtin_setvar_helper(chan, "FSKLADDERGOODPUT", value);
+}
+
+static int fskTX_exec(struct ast_channel *chan, const char *data) { /* SendFSK */
+	char *argcopy = NULL;
+	struct fsk_session *session;
+	struct fsk_payload payload;
+	transmit_buffer_t *out;
+	int16_t caller_amp[BLOCK_LEN];
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "SendFSK",
+		.datalen = BLOCK_LEN * 2,
+		.samples = BLOCK_LEN,
+		.data.ptr = &caller_amp,
+	};
+	struct ast_flags flags = {0};
+	char *opts[OPT_ARG_SEND_ARRAY_SIZE] = { NULL, };
+	struct ast_format * native_format;
+	unsigned int sampling_rate;
+	struct ast_format * write_format;
+	struct fsk_profile *profile;
+	struct fsk_ladder *ladder;
+	struct fsk_ladder_result result;
+	struct fsk_admission_ticket ticket;
+	unsigned char *framed = NULL;
+	const char *shaping;
+	unsigned int key_id = 0;
+	uint16_t crc;
+	int persistent;
+	int res = 0;
+
+	AST_DECLARE_APP_ARGS(arglist,
+		AST_APP_ARG(modem);
 		AST_APP_ARG(data);
+		AST_APP_ARG(options);
+	);
+
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "SendFSK requires an argument\n");
+		return -1;
+	}
+	if (chan == NULL) {
+		ast_log(LOG_ERROR, "SendFSK channel is NULL. Giving up.\n");
+		return -1;
+	}
+	/* a dump of an earlier session on the channel is not about this one */
+	pbx_builtin_setvar_helper(chan, "FSKRECORDING", "");
+
+	native_format = ast_format_cap_get_format(ast_channel_nativeformats(chan), 0);
+	sampling_rate = ast_format_get_sample_rate(native_format);
+	write_format = ast_format_cache_get_slin_by_rate(sampling_rate);
+	f.subclass.format = write_format;
+
+	/* inline payloads can be large, keep them off the stack */
+	if (!(argcopy = ast_strdup(data))) {
+		return -1;
+	}
+	AST_STANDARD_APP_ARGS(arglist, argcopy);
+
+	/* a ladder starts on one of its profiles and takes its settings */
+	if ((ladder = fsk_ladder_find(arglist.modem))) {
+		profile = ao2_bump(ladder->rungs[ladder->start]);
+	} else if (!(profile = fsk_profile_find(arglist.modem))) {
+		ast_free(argcopy);
+		return -1;
+	}
+	if (!ast_strlen_zero(arglist.options)) {
+		ast_app_parse_options(send_app_options, &flags, opts, arglist.options);
+	}
+	if (ladder && (ast_test_flag(&flags, OPT_PAYLOAD_SOCKET) || ast_set_read_format(chan, ast_format_slin) < 0)) {
+		ast_log(LOG_WARNING, "SendFSK over ladder '%s' needs a payload of known length and a linear read path\n", ladder->name);
+		ao2_ref(ladder, -1);
+		ao2_ref(profile, -1);
+		ast_free(argcopy);
+		return -1;
+	}
+	persistent = ast_test_flag(&flags, OPT_PERSIST) ? 1 : 0;
+	if (profile->crc) {
+		ast_set_flag(&flags, OPT_CRC);
+	}
+	if (profile->key >= 0 && !ast_test_flag(&flags, OPT_ENCRYPT)) {
+		ast_set_flag(&flags, OPT_ENCRYPT);
+		key_id = profile->key;
+	} else if (ast_test_flag(&flags, OPT_ENCRYPT)
+		&& (ast_strlen_zero(opts[OPT_ARG_ENCRYPT]) || sscanf(opts[OPT_ARG_ENCRYPT], "%30u", &key_id) != 1)) {
+		ast_log(LOG_WARNING, "SendFSK option e requires a key id\n");
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		ast_free(argcopy);
+		return -1;
+	}
+	if (ast_test_flag(&flags, OPT_ENCRYPT) && ast_test_flag(&flags, OPT_PAYLOAD_SOCKET)) {
+		ast_log(LOG_WARNING, "SendFSK cannot encrypt a streamed payload\n");
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		ast_free(argcopy);
+		return -1;
+	}
+
+	if ((res = fsk_session_admission_enter(chan, &ticket))) {
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		ast_free(argcopy);
+		return res < 0 ? -1 : 0;
+	}
+	if (fsk_payload_open(chan, &payload, S_OR(arglist.data, ""), &flags)) {
+		fsk_admission_leave(&ticket);
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		ast_free(argcopy);
+		return -1;
+	}
+	if (ast_test_flag(&flags, OPT_ENCRYPT)) {
+		if (fsk_seal(key_id, payload.data, payload.len, &payload.sealed)) {
+			fsk_payload_close(&payload);
+			fsk_admission_leave(&ticket);
+			ao2_cleanup(ladder);
+			ao2_ref(profile, -1);
+			ast_free(argcopy);
+			return -1;
+		}
+		payload.data = (const char *) payload.sealed;
+		payload.len += FSK_SEAL_OVERHEAD;
+	}
+
+	/* blocks carry no CRC of the message, what the receiver checks with 'c' goes at the end of the last one */
+	if (ladder && ast_test_flag(&flags, OPT_CRC)) {
+		if (!(framed = ast_malloc(payload.len + 2))) {
+			fsk_payload_close(&payload);
+			fsk_admission_leave(&ticket);
+			ao2_ref(ladder, -1);
+			ao2_ref(profile, -1);
+			ast_free(argcopy);
+			return -1;
+		}
+		memcpy(framed, payload.data, payload.len);
+		crc = crc_itu16_calc(framed, payload.len, 0xffff) ^ 0xffff;
+		framed[payload.len] = crc & 0xff;
+		framed[payload.len + 1] = crc >> 8;
+	}
+
+	ast_debug(1, "Modem profile is '%s', %zu bytes to send\n", profile->name, payload.len);
+
+	/* a session left on the channel by a previous 'p' call is reused, and closed unless 'p' is given again */
+	session = fsk_session_find(chan, persistent);
+	if (!session && !(session = fsk_session_alloc())) {
+		fsk_payload_close(&payload);
+		fsk_admission_leave(&ticket);
+		ast_free(framed);
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		ast_free(argcopy);
+		return -1;
+	}
+	fsk_session_carrier_pause(chan, session);
+	fsk_session_codec(session, chan);
+
+	ao2_lock(session);
+	out = &session->out;
+	out->buffer = (char *) payload.data;
+	out->bytes2send = payload.len;
+	out->source = payload.source;
+	out->current_bit_no = 0;
+	out->ptr = 0;
+	out->crc = ast_test_flag(&flags, OPT_CRC) ? 1 : 0;
+	out->crc_value = 0xffff;
+	fsk_session_tx_prepare(session, profile);
+	shaping = session->tx_shaping ? ast_strdupa(session->tx_shaping->name) : "";
+	ao2_unlock(session);
+	ao2_ref(profile, -1);
+	pbx_builtin_setvar_helper(chan, "FSKSHAPING", shaping);
+
+	memset(caller_amp, 0, sizeof(*caller_amp));
+	if (ladder) {
+		res = fsk_ladder_transmit(chan, session, ladder, framed ? framed : (const unsigned char *) payload.data,
+			payload.len + (framed ? 2 : 0), &ticket, &result);
+		fsk_ladder_setvars(chan, ladder, &result);
+		if (res || strcmp(result.status, "OK")) {
+			fsk_recorder_dump(chan, session, app_fskTX, res ? "hangup" : "ladder", NULL);
+		}
+		ao2_ref(ladder, -1);
+	} else {
+		res = fsk_session_transmit(chan, session, &f, &ticket);
+		if (res) {
+			fsk_recorder_dump(chan, session, app_fskTX, "hangup", NULL);
+		}
+	}
+
+	/* the payload is released below, never leave it reachable from the session */
+	ao2_lock(session);
+	out->buffer = NULL;
+	out->bytes2send = 0;
+	out->ptr = 0;
+	out->source = NULL;
+	out->current_bit_no = 0;
+	out->crc = 0;
+	ao2_unlock(session);
+	fsk_payload_close(&payload);
+	ast_free(framed);
+	ast_free(argcopy);
+
+	fsk_session_transmit_done(chan, session, &f, persistent && !res, &ticket);
+	fsk_admission_leave(&ticket);
+	ao2_ref(session, -1);
+	ast_debug(1, "SendFSK Completed.\n");
+	return 0;
+}
+
+/* Jobs the outbound spool keeps in memory, further job files wait on disk */
+#define FSK_OUTBOUND_BACKLOG 1024
+
+/*! \brief Outbound spool settings, from the [outbound] and [trunks] sections of fsk.conf */
+struct fsk_outbound_config {
+	int enabled;
+	char directory[PATH_MAX];
+	unsigned int workers;
+	unsigned int scan_interval;     /*!< ms between directory scans */
+	unsigned int trunk_limit;       /*!< calls per trunk not listed in [trunks], 0 is unlimited */
+};
+
+/*! \brief Calls in progress through a trunk, and its limit */
+struct fsk_outbound_trunk {
+	AST_LIST_ENTRY(fsk_outbound_trunk) list;
+	unsigned int limit;
+	unsigned int active;
+	unsigned long sent;
+	unsigned long failed;
+	char name[0];
+};
+
+/*! \brief A payload framed once and shared by every job sending it */
+struct fsk_outbound_payload {
+	struct fsk_queue_entry *rendered;
+	size_t len;
+	char data[0];
+};
+
+struct fsk_outbound_job {
+	AST_LIST_ENTRY(fsk_outbound_job) list;
+	unsigned int id;
+	struct fsk_outbound_payload *payload;
+	struct fsk_outbound_trunk *trunk;
+	char *tech;
+	char *resource;
+	char *cid_num;
+	char *cid_name;
+	char modem[80];                 /*!< profile name */
+	unsigned int max_retries;
+	unsigned int retry_time;        /*!< s between attempts */
+	unsigned int wait_time;         /*!< s to wait for an answer */
+	unsigned int attempts;
+	time_t next_attempt;
+	int sent;                       /*!< set by SendFSKQueue once the payload went out */
+	char reason[64];
+	char name[0];                   /*!< job file name */
+};
+
+/*!
+ * \brief Bulk delivery from job files
+ *
+ * A dispatcher thread claims job files by moving them into active/ and
+ * queues them in memory. Worker threads originate the calls, subject to
+ * the per trunk limits, and run SendFSKQueue on answer with the payload
+ * framed beforehand. Job files end up in done/ or failed/ with the
+ * outcome appended. When the number of workers is lowered the extra ones
+ * leave once their call is over.
+ */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	struct fsk_outbound_config cfg;
+	AST_LIST_HEAD_NOLOCK(, fsk_outbound_job) waiting;
+	AST_LIST_HEAD_NOLOCK(, fsk_outbound_trunk) trunks;
+	unsigned int queued;
+	unsigned int next_id;
+	int running;
+	pthread_t dispatcher;
+	unsigned int nworkers;          /*!< worker threads alive, more than cfg.workers while the extra ones finish their calls */
+	struct timeval started;
+	unsigned long attempts;
+	unsigned long sent;
+	unsigned long failed;
+	unsigned long retried;
+	unsigned long rendered;
+	unsigned long reused;
+	int64_t call_ms;
+} outbound;
+
+static struct ao2_container *outbound_jobs;     /*!< jobs being attempted, by id, for SendFSKQueue */
+static struct ao2_container *outbound_payloads; /*!< rendered payloads, by content */
+
+static int fsk_outbound_job_hash(const void *obj, const int flags)
+{
+	return (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? *(const unsigned int *) obj
+		: ((const struct fsk_outbound_job *) obj)->id;
+}
+
+static int fsk_outbound_job_cmp(void *obj, void *arg, int flags)
+{
+	unsigned int id = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY ? *(unsigned int *) arg
+		: ((struct fsk_outbound_job *) arg)->id;
+
+	return ((struct fsk_outbound_job *) obj)->id == id ? CMP_MATCH : 0;
+}
+
+static void fsk_outbound_job_destructor(void *obj)
+{
+	struct fsk_outbound_job *job = obj;
+
+	ao2_cleanup(job->payload);
+	ast_free(job->tech);
+	ast_free(job->cid_num);
+	ast_free(job->cid_name);
+}
+
+static int fsk_outbound_payload_hash(const void *obj, const int flags)
+{
+	const struct fsk_outbound_payload *payload = obj;
+
+	/* lookups pass a stack payload with data filled in, so both cases hash the content */
+	return ast_str_hash(payload->data);
+}
+
+static int fsk_outbound_payload_cmp(void *obj, void *arg, int flags)
+{
+	struct fsk_outbound_payload *left = obj;
+	struct fsk_outbound_payload *right = arg;
+
+	return left->len == right->len && !memcmp(left->data, right->data, left->len) ? CMP_MATCH : 0;
+}
+
+static void fsk_outbound_payload_destructor(void *obj)
+{
+	struct fsk_outbound_payload *payload = obj;
+
+	ast_free(payload->rendered);
+}
+
+/*! \brief Find the framed copy of a payload, or frame it */
+static struct fsk_outbound_payload *fsk_outbound_payload_get(const char *data, size_t len)
+{
+	struct fsk_outbound_payload *key;
+	struct fsk_outbound_payload *payload;
+
+	key = ast_alloca(sizeof(*key) + len + 1);
+	key->len = len;
+	memcpy(key->data, data, len);
+	key->data[len] = '\0';
+
+	ao2_lock(outbound_payloads);
+	payload = ao2_find(outbound_payloads, key, OBJ_SEARCH_OBJECT | OBJ_NOLOCK);
+	if (payload) {
+		ao2_unlock(outbound_payloads);
+		__atomic_add_fetch(&outbound.reused, 1, __ATOMIC_RELAXED);
+		return payload;
+	}
+	payload = ao2_alloc(sizeof(*payload) + len + 1, fsk_outbound_payload_destructor);
+	if (payload) {
+		payload->len = len;
+		memcpy(payload->data, key->data, len + 1);
+		payload->rendered = fsk_queue_entry_render(payload->data, len, &fsk_framing_8n1);
+		if (payload->rendered) {
+			ao2_link_flags(outbound_payloads, payload, OBJ_NOLOCK);
+			__atomic_add_fetch(&outbound.rendered, 1, __ATOMIC_RELAXED);
+		} else {
+			ao2_ref(payload, -1);
+			payload = NULL;
+		}
+	}
+	ao2_unlock(outbound_payloads);
+	return payload;
+}
+
+static int fsk_outbound_payload_unused(void *obj, void *arg, int flags)
+{
+	/* only the container still holds it */
+	return ao2_ref(obj, 0) == 1 ? CMP_MATCH : 0;
+}
+
+/*! \brief Called with outbound.lock held */
+static struct fsk_outbound_trunk *fsk_outbound_trunk_get(const char *name)
+{
+	struct fsk_outbound_trunk *trunk;
+
+	AST_LIST_TRAVERSE(&outbound.trunks, trunk, list) {
+		if (!strcasecmp(trunk->name, name)) {
+			return trunk;
+		}
+	}
+	trunk = ast_calloc(1, sizeof(*trunk) + strlen(name) + 1);
+	if (trunk) {
+		strcpy(trunk->name, name); /* safe */
+		trunk->limit = outbound.cfg.trunk_limit;
+		AST_LIST_INSERT_TAIL(&outbound.trunks, trunk, list);
+	}
+	return trunk;
+}
+
+static int fsk_outbound_mkdirs(const char *directory)
+{
+	char path[PATH_MAX];
+	static const char * const subdirs[] = { "active", "done", "failed" };
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(subdirs); i++) {
+		snprintf(path, sizeof(path), "%s/%s", directory, subdirs[i]);
+		if (ast_mkdir(path, 0755)) {
+			ast_log(LOG_WARNING, "Unable to create outbound spool directory '%s': %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Append the outcome to a claimed job file and move it to done/ or failed/ */
+static void fsk_outbound_retire(const char *directory, const char *name, int sent, unsigned int attempts, const char *reason)
+{
+	char from[PATH_MAX];
+	char to[PATH_MAX];
+	FILE *fp;
+
+	snprintf(from, sizeof(from), "%s/active/%s", directory, name);
+	snprintf(to, sizeof(to), "%s/%s/%s", directory, sent ? "done" : "failed", name);
+	if ((fp = fopen(from, "a"))) {
+		fprintf(fp, "\nStatus: %s\nAttempts: %u\nReason: %s\nCompleted: %ld\n",
+			sent ? "Sent" : "Failed", attempts, reason, (long) time(NULL));
+		fclose(fp);
+	}
+	if (rename(from, to)) {
+		ast_log(LOG_WARNING, "Unable to move job file '%s' to '%s': %s\n", from, to, strerror(errno));
+	}
+}
+
+static int fsk_outbound_read_file(const char *path, char **data, size_t *len)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size > 65536 || !(*data = ast_malloc(st.st_size + 1))) {
+		close(fd);
+		return -1;
+	}
+	if (read(fd, *data, st.st_size) != st.st_size) {
+		ast_free(*data);
+		close(fd);
+		return -1;
+	}
+	(*data)[st.st_size] = '\0';
+	*len = st.st_size;
+	close(fd);
+	return 0;
+}
+
+/*!
+ * \brief Cut a comment off a job file line, as Asterisk does with call files
+ *
+ * A '#' starts a comment at the start of the line or after a blank, a ';'
+ * anywhere unless written "\;".
+ */
+static void fsk_outbound_strip_comment(char *line)
+{
+	char *c;
+
+	for (c = line; (c = strchr(c, '#')); c++) {
+		if (c == line || c[-1] == ' ' || c[-1] == '\t') {
+			*c = '\0';
+			break;
+		}
+	}
+	for (c = line; (c = strchr(c, ';')); ) {
+		if (c > line && c[-1] == '\\') {
+			memmove(c - 1, c, strlen(c) + 1);
+		} else {
+			*c = '\0';
+			break;
+		}
+	}
+}
+
+/*!
+ * \brief Parse a claimed job file
+ *
+ * Job files hold "Key: value" lines, as call files do. Destination and
+ * either Payload or PayloadFile are required.
+ */
+static struct fsk_outbound_job *fsk_outbound_job_load(const char *directory, const char *name, const char **error)
+{
+	struct fsk_outbound_job *job;
+	struct fsk_profile *profile;
+	char path[PATH_MAX];
+	char line[1024];
+	char trunk[80] = "";
+	char *payload = NULL;
+	size_t payload_len = 0;
+	char *key;
+	char *value;
+	char *resource;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/active/%s", directory, name);
+	if (!(fp = fopen(path, "r"))) {
+		*error = "Unreadable";
+		return NULL;
+	}
+	job = ao2_alloc(sizeof(*job) + strlen(name) + 1, fsk_outbound_job_destructor);
+	if (!job) {
+		fclose(fp);
+		*error = "Out of memory";
+		return NULL;
+	}
+	strcpy(job->name, name); /* safe */
+	ast_copy_string(job->modem, "202", sizeof(job->modem));
+	job->retry_time = 300;
+	job->wait_time = 45;
+	*error = NULL;
+
+	while (!*error && fgets(line, sizeof(line), fp)) {
+		fsk_outbound_strip_comment(line);
+		value = line;
+		key = strsep(&value, ":");
+		if (!value) {
+			continue;
+		}
+		key = ast_strip(key);
+		value = ast_strip(value);
+		if (!strcasecmp(key, "Destination")) {
+			ast_free(job->tech);
+			job->tech = ast_strdup(value);
+		} else if (!strcasecmp(key, "Payload")) {
+			ast_free(payload);
+			payload_len = strlen(value);
+			payload = ast_strdup(value);
+		} else if (!strcasecmp(key, "PayloadFile")) {
+			ast_free(payload);
+			payload = NULL;
+			if (fsk_outbound_read_file(value, &payload, &payload_len)) {
+				*error = "PayloadFile unreadable";
+			}
+		} else if (!strcasecmp(key, "Modem")) {
+			if (!(profile = fsk_profile_find(value))) {
+				*error = "Unknown modem";
+			}
+			ao2_cleanup(profile);
+			ast_copy_string(job->modem, value, sizeof(job->modem));
+		} else if (!strcasecmp(key, "MaxRetries")) {
+			sscanf(value, "%30u", &job->max_retries);
+		} else if (!strcasecmp(key, "RetryTime")) {
+			sscanf(value, "%30u", &job->retry_time);
+		} else if (!strcasecmp(key, "WaitTime")) {
+			sscanf(value, "%30u", &job->wait_time);
+		} else if (!strcasecmp(key, "Trunk")) {
+			ast_copy_string(trunk, value, sizeof(trunk));
+		} else if (!strcasecmp(key, "CallerID")) {
+			char *cid = ast_strdupa(value);
+			char *cid_name;
+			char *cid_num;
+
+			ast_callerid_parse(cid, &cid_name, &cid_num);
+			ast_free(job->cid_name);
+			ast_free(job->cid_num);
+			job->cid_name = ast_strdup(cid_name);
+			job->cid_num = ast_strdup(cid_num);
+		} else if (!strcasecmp(key, "Status")) {
+			/* a retired job dropped back into the spool, attempt it again */
+			break;
+		}
+	}
+	fclose(fp);
+
+	if (!*error && (!job->tech || !(resource = strchr(job->tech, '/')) || !resource[1])) {
+		*error = "Missing or invalid Destination";
+	} else if (!*error && !payload) {
+		*error = "Missing Payload";
+	}
+	if (!*error) {
+		*resource++ = '\0';
+		job->resource = resource;
+		if (ast_strlen_zero(trunk)) {
+			/* Dial style PJSIP/number@endpoint goes by endpoint, anything else by technology */
+			ast_copy_string(trunk, strchr(resource, '@') ? strchr(resource, '@') + 1 : job->tech, sizeof(trunk));
+		}
+		if (!(job->payload = fsk_outbound_payload_get(payload, payload_len))) {
+			*error = "Out of memory";
+		}
+	}
+	ast_free(payload);
+	if (*error) {
+		ao2_ref(job, -1);
+		return NULL;
+	}
+
+	ast_mutex_lock(&outbound.lock);
+	job->id = ++outbound.next_id;
+	job->trunk = fsk_outbound_trunk_get(trunk);
+	ast_mutex_unlock(&outbound.lock);
+	if (!job->trunk) {
+		*error = "Out of memory";
+		ao2_ref(job, -1);
+		return NULL;
+	}
+	return job;
+}
+
+static int fsk_outbound_job_filter(const struct dirent *entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+/*! \brief Claim new job files, and put back those a previous run left in active/ when recovering */
+static void fsk_outbound_scan(const struct fsk_outbound_config *cfg, int recover)
+{
+	struct dirent **entries;
+	struct fsk_outbound_job *job;
+	char from[PATH_MAX];
+	char to[PATH_MAX];
+	struct stat st;
+	const char *error;
+	unsigned int room;
+	int count;
+	int i;
+
+	if (recover) {
+		snprintf(from, sizeof(from), "%s/active", cfg->directory);
+		count = scandir(from, &entries, fsk_outbound_job_filter, NULL);
+		for (i = 0; i < count; i++) {
+			snprintf(from, sizeof(from), "%s/active/%s", cfg->directory, entries[i]->d_name);
+			snprintf(to, sizeof(to), "%s/%s", cfg->directory, entries[i]->d_name);
+			rename(from, to);
+			ast_std_free(entries[i]);
+		}
+		if (count >= 0) {
+			ast_std_free(entries);
+		}
+	}
+
+	ast_mutex_lock(&outbound.lock);
+	room = outbound.queued < FSK_OUTBOUND_BACKLOG ? FSK_OUTBOUND_BACKLOG - outbound.queued : 0;
+	ast_mutex_unlock(&outbound.lock);
+	if (!room) {
+		return;
+	}
+
+	/* oldest first, job files are expected to be named in submission order */
+	count = scandir(cfg->directory, &entries, fsk_outbound_job_filter, alphasort);
+	for (i = 0; i < count; i++) {
+		snprintf(from, sizeof(from), "%s/%s", cfg->directory, entries[i]->d_name);
+		snprintf(to, sizeof(to), "%s/active/%s", cfg->directory, entries[i]->d_name);
+		if (!room || stat(from, &st) || !S_ISREG(st.st_mode) || rename(from, to)) {
+			ast_std_free(entries[i]);
+			continue;
+		}
+		job = fsk_outbound_job_load(cfg->directory, entries[i]->d_name, &error);
+		if (!job) {
+			ast_log(LOG_WARNING, "Rejecting FSK job '%s': %s\n", entries[i]->d_name, error);
+			fsk_outbound_retire(cfg->directory, entries[i]->d_name, 0, 0, error);
+		} else {
+			ast_mutex_lock(&outbound.lock);
+			AST_LIST_INSERT_TAIL(&outbound.waiting, job, list);
+			outbound.queued++;
+			ast_cond_signal(&outbound.cond);
+			ast_mutex_unlock(&outbound.lock);
+			room--;
+		}
+		ast_std_free(entries[i]);
+	}
+	if (count >= 0) {
+		ast_std_free(entries);
+	}
+	ao2_callback(outbound_payloads, OBJ_MULTIPLE | OBJ_UNLINK | OBJ_NODATA, fsk_outbound_payload_unused, NULL);
+}
+
+static void *fsk_outbound_dispatcher(void *unused)
+{
+	struct fsk_outbound_config cfg;
+	struct timespec ts;
+	int recover = 1;
+
+	ast_mutex_lock(&outbound.lock);
+	while (outbound.running) {
+		cfg = outbound.cfg;
+		ast_mutex_unlock(&outbound.lock);
+
+		if (!fsk_outbound_mkdirs(cfg.directory)) {
+			fsk_outbound_scan(&cfg, recover);
+			recover = 0;
+		}
+
+		ast_mutex_lock(&outbound.lock);
+		if (!outbound.running) {
+			break;
+		}
+		ts = ast_tsnow();
+		ts.tv_sec += cfg.scan_interval / 1000;
+		ts.tv_nsec += (cfg.scan_interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		ast_cond_timedwait(&outbound.cond, &outbound.lock, &ts);
+	}
+	ast_mutex_unlock(&outbound.lock);
+	return NULL;
+}
+
+/*! \brief Called with outbound.lock held, the first due job whose trunk has room */
+static struct fsk_outbound_job *fsk_outbound_next(time_t now, time_t *wake)
+{
+	struct fsk_outbound_job *job;
+
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&outbound.waiting, job, list) {
+		if (job->next_attempt > now) {
+			if (!*wake || job->next_attempt < *wake) {
+				*wake = job->next_attempt;
+			}
+			continue;
+		}
+		if (job->trunk->limit && job->trunk->active >= job->trunk->limit) {
+			continue;
+		}
+		AST_LIST_REMOVE_CURRENT(list);
+		job->trunk->active++;
+		return job;
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	return NULL;
+}
+
+static const char *fsk_outbound_reason(int reason)
+{
+	switch (reason) {
+	case AST_CONTROL_BUSY:
+		return "busy";
+	case AST_CONTROL_CONGESTION:
+		return "congestion";
+	case AST_CONTROL_HANGUP:
+		return "hangup";
+	case AST_CONTROL_RING:
+	case AST_CONTROL_RINGING:
+	case 0:
+		return "no answer";
+	default:
+		return "failed";
+	}
+}
+
+static void fsk_outbound_attempt(struct fsk_outbound_job *job)
+{
+	struct ast_format_cap *cap;
+	char appdata[128];
+	int reason = 0;
+	int res;
+
+	job->sent = 0;
+	if (!(cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT))) {
+		ast_copy_string(job->reason, "Out of memory", sizeof(job->reason));
+		return;
+	}
+	ast_format_cap_append(cap, ast_format_slin, 0);
+	snprintf(appdata, sizeof(appdata), "%s,j(%u)", job->modem, job->id);
+
+	ao2_link(outbound_jobs, job);
+	res = ast_pbx_outgoing_app(job->tech, cap, job->resource, job->wait_time * 1000,
+		"SendFSKQueue", appdata, &reason, AST_OUTGOING_WAIT_COMPLETE,
+		job->cid_num, job->cid_name, NULL, NULL, NULL, NULL);
+	ao2_unlink(outbound_jobs, job);
+	ao2_ref(cap, -1);
+
+	if (job->sent) {
+		ast_copy_string(job->reason, "Sent", sizeof(job->reason));
+	} else if (res || reason != AST_CONTROL_ANSWER) {
+		snprintf(job->reason, sizeof(job->reason), "Not answered (%s)", fsk_outbound_reason(reason));
+	} else {
+		ast_copy_string(job->reason, "Hangup during transmission", sizeof(job->reason));
+	}
+}
+
+static void *fsk_outbound_worker(void *unused)
+{
+	struct fsk_outbound_job *job;
+	struct timespec ts;
+	struct timeval begin;
+	time_t wake;
+	int retire;
+
+	ast_mutex_lock(&outbound.lock);
+	while (outbound.running && outbound.nworkers <= outbound.cfg.workers) {
+		wake = 0;
+		if (!(job = fsk_outbound_next(time(NULL), &wake))) {
+			ts = ast_tsnow();
+			ts.tv_sec = wake && wake < ts.tv_sec + 1 ? wake : ts.tv_sec + 1;
+			ast_cond_timedwait(&outbound.cond, &outbound.lock, &ts);
+			continue;
+		}
+		outbound.attempts++;
+		ast_mutex_unlock(&outbound.lock);
+
+		begin = ast_tvnow();
+		job->attempts++;
+		fsk_outbound_attempt(job);
+		ast_debug(1, "FSK job '%s' to %s/%s, attempt %u: %s\n", job->name, job->tech, job->resource, job->attempts, job->reason);
+
+		ast_mutex_lock(&outbound.lock);
+		outbound.call_ms += ast_tvdiff_ms(ast_tvnow(), begin);
+		job->trunk->active--;
+		retire = job->sent || job->attempts > job->max_retries;
+		if (job->sent) {
+			outbound.sent++;
+			job->trunk->sent++;
+		} else if (retire) {
+			outbound.failed++;
+			job->trunk->failed++;
+		} else {
+			outbound.retried++;
+			job->next_attempt = time(NULL) + job->retry_time;
+			AST_LIST_INSERT_TAIL(&outbound.waiting, job, list);
+		}
+		if (retire) {
+			outbound.queued--;
+		}
+		/* a trunk slot is free */
+		ast_cond_broadcast(&outbound.cond);
+		if (retire) {
+			char directory[PATH_MAX];
+
+			ast_copy_string(directory, outbound.cfg.directory, sizeof(directory));
+			ast_mutex_unlock(&outbound.lock);
+			fsk_outbound_retire(directory, job->name, job->sent, job->attempts, job->reason);
+			ao2_ref(job, -1);
+			ast_mutex_lock(&outbound.lock);
+		}
+	}
+	outbound.nworkers--;
+	ast_cond_broadcast(&outbound.cond);
+	ast_mutex_unlock(&outbound.lock);
+	return NULL;
+}
+
+/*! \brief Called with outbound.lock held, start workers up to the configured number */
+static void fsk_outbound_spawn(void)
+{
+	while (outbound.nworkers < outbound.cfg.workers) {
+		if (fsk_thread_start(fsk_outbound_worker, NULL)) {
+			ast_log(LOG_WARNING, "Started only %u of %u FSK outbound workers\n", outbound.nworkers, outbound.cfg.workers);
+			break;
+		}
+		outbound.nworkers++;
+	}
+}
+
+static void fsk_outbound_stop(void)
+{
+	struct fsk_outbound_job *job;
+
+	ast_mutex_lock(&outbound.lock);
+	if (!outbound.running) {
+		ast_mutex_unlock(&outbound.lock);
+		return;
+	}
+	outbound.running = 0;
+	ast_cond_broadcast(&outbound.cond);
+	ast_mutex_unlock(&outbound.lock);
+
+	/*
+	 * calls in progress are completed, the job files of the others are
+	 * recovered on start, which must not find a call still going on
+	 */
+	pthread_join(outbound.dispatcher, NULL);
+
+	ast_mutex_lock(&outbound.lock);
+	while (outbound.nworkers) {
+		ast_cond_wait(&outbound.cond, &outbound.lock);
+	}
+	while ((job = AST_LIST_REMOVE_HEAD(&outbound.waiting, list))) {
+		ao2_ref(job, -1);
+	}
+	outbound.queued = 0;
+	ast_mutex_unlock(&outbound.lock);
+}
+
+static void fsk_outbound_start(void)
+{
+	ast_mutex_lock(&outbound.lock);
+	if (outbound.running || !outbound.cfg.enabled) {
+		ast_mutex_unlock(&outbound.lock);
+		return;
+	}
+	outbound.running = 1;
+	outbound.started = ast_tvnow();
+	if (ast_pthread_create_background(&outbound.dispatcher, NULL, fsk_outbound_dispatcher, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start FSK outbound spool\n");
+		outbound.running = 0;
+		ast_mutex_unlock(&outbound.lock);
+		return;
+	}
+	fsk_outbound_spawn();
+	ast_mutex_unlock(&outbound.lock);
+}
+
+static char *handle_fsk_show_outbound(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct fsk_outbound_trunk *trunk;
+	int64_t elapsed;
+	unsigned long attempts;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "fsk show outbound";
+		e->usage =
+			"Usage: fsk show outbound\n"
+			"       Show the state and throughput of the FSK outbound spool.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&outbound.lock);
+	if (!outbound.running) {
+		ast_mutex_unlock(&outbound.lock);
+		ast_cli(a->fd, "FSK outbound spool is disabled\n");
+		return CLI_SUCCESS;
+	}
+	elapsed = ast_tvdiff_ms(ast_tvnow(), outbound.started);
+	attempts = outbound.attempts;
+	ast_cli(a->fd, "Directory:        %s\n", outbound.cfg.directory);
+	ast_cli(a->fd, "Workers:          %u\n", outbound.nworkers);
+	ast_cli(a->fd, "Jobs in memory:   %u\n", outbound.queued);
+	ast_cli(a->fd, "Attempts:         %lu\n", attempts);
+	ast_cli(a->fd, "Sent:             %lu\n", outbound.sent);
+	ast_cli(a->fd, "Failed:           %lu\n", outbound.failed);
+	ast_cli(a->fd, "Retried:          %lu\n", outbound.retried);
+	ast_cli(a->fd, "Sent per minute:  %.1f\n", elapsed > 0 ? outbound.sent * 60000.0 / elapsed : 0.0);
+	ast_cli(a->fd, "Mean call time:   %" PRId64 " ms\n", attempts ? outbound.call_ms / (int64_t) attempts : 0);
+	ast_cli(a->fd, "Payloads framed:  %lu (reused %lu times)\n", outbound.rendered, outbound.reused);
+	ast_cli(a->fd, "\n%-24s %6s %6s %10s %10s\n", "Trunk", "Active", "Limit", "Sent", "Failed");
+	AST_LIST_TRAVERSE(&outbound.trunks, trunk, list) {
+		ast_cli(a->fd, "%-24s %6u %6u %10lu %10lu\n", trunk->name, trunk->active, trunk->limit, trunk->sent, trunk->failed);
+	}
+	ast_mutex_unlock(&outbound.lock);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry fsk_cli[] = {
+	AST_CLI_DEFINE(handle_fsk_show_outbound, "Show FSK outbound spool status"),
+	AST_CLI_DEFINE(handle_fsk_show_profiles, "List FSK modem profiles"),
+	AST_CLI_DEFINE(handle_fsk_show_kernels, "Show FSK modulator kernels"),
+	AST_CLI_DEFINE(handle_fsk_tune_kernels, "Benchmark or pin FSK modulator kernels"),
+	AST_CLI_DEFINE(handle_fsk_show_admission, "Show FSK session admission and load"),
+};
+
+static int fskTXQueue_exec(struct ast_channel *chan, const char *data) { /* SendFSKQueue */
+	char *argcopy;
+	struct fsk_session *session;
+	int16_t caller_amp[BLOCK_LEN];
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "SendFSKQueue",
+		.datalen = BLOCK_LEN * 2,
+		.samples = BLOCK_LEN,
+		.data.ptr = &caller_amp,
+	};
+	struct ast_flags flags = {0};
+	char *opts[OPT_ARG_QUEUE_ARRAY_SIZE] = { NULL, };
+	struct fsk_outbound_job *job = NULL;
+	struct fsk_queue_entry *entry = NULL;
+	struct fsk_profile *profile;
+	struct fsk_admission_ticket ticket = { .admitted = 0 };
+	unsigned int id;
+	int persistent;
+	int res;
+
+	AST_DECLARE_APP_ARGS(arglist,
+		AST_APP_ARG(modem);
+		AST_APP_ARG(options);
+	);
+
+	argcopy = ast_strdupa(S_OR(data, ""));
+	AST_STANDARD_APP_ARGS(arglist, argcopy);
+
+	if (!ast_strlen_zero(arglist.options)) {
+		ast_app_parse_options(queue_app_options, &flags, opts, arglist.options);
+	}
+	persistent = ast_test_flag(&flags, OPT_PERSIST | OPT_BACKGROUND) ? 1 : 0;
+	pbx_builtin_setvar_helper(chan, "FSKRECORDING", "");
+
+	if (ast_test_flag(&flags, OPT_OUTBOUND_JOB)) {
+		if (ast_strlen_zero(opts[OPT_ARG_OUTBOUND_JOB]) || sscanf(opts[OPT_ARG_OUTBOUND_JOB], "%30u", &id) != 1
+			|| !(job = ao2_find(outbound_jobs, &id, OBJ_SEARCH_KEY))) {
+			ast_log(LOG_WARNING, "No FSK outbound job '%s'\n", S_OR(opts[OPT_ARG_OUTBOUND_JOB], ""));
+			return -1;
+		}
+		/* background sending would leave the job with no outcome */
+		ast_clear_flag(&flags, OPT_BACKGROUND);
+	}
+	if (!(profile = fsk_profile_find(arglist.modem))) {
+		ao2_cleanup(job);
+		return -1;
+	}
+
+	if (!(session = fsk_session_find(chan, persistent || job))) {
+		ast_debug(1, "No FSK queue on %s, nothing to send\n", ast_channel_name(chan));
+		ao2_ref(profile, -1);
+		return 0;
+	}
+	/* a background drain hands its slot to the carrier that modulates the queue */
+	if ((res = fsk_session_admission_enter(chan, &ticket))) {
+		ao2_ref(session, -1);
+		ao2_ref(profile, -1);
+		ao2_cleanup(job);
+		return res < 0 ? -1 : 0;
+	}
+	fsk_session_carrier_pause(chan, session);
+	fsk_session_codec(session, chan);
+
+	ao2_lock(session);
+	if (job) {
+		/* framed once for every job carrying this payload, a copy is all it takes */
+		entry = ast_malloc(sizeof(*entry) + (job->payload->rendered->bits + 7) / 8);
+		if (entry) {
+			memcpy(entry, job->payload->rendered, sizeof(*entry) + (job->payload->rendered->bits + 7) / 8);
+			AST_LIST_INSERT_HEAD(&session->out.queue, entry, list);
+			session->out.queued++;
+		}
+	}
+	if (job && !entry) {
+		ao2_unlock(session);
+		fsk_admission_leave(&ticket);
+		ao2_ref(session, -1);
+		ao2_ref(profile, -1);
+		ao2_ref(job, -1);
+		return -1;
+	}
+	fsk_session_tx_prepare(session, profile);
+	session->out.draining = 1;
+	ao2_unlock(session);
+	ao2_ref(profile, -1);
+
+	if (ast_test_flag(&flags, OPT_BACKGROUND)) {
+		res = fsk_session_carrier_hold(chan, session, &ticket);
+		fsk_admission_leave(&ticket);
+		ao2_ref(session, -1);
+		return res;
+	}
+
+	f.subclass.format = ast_format_slin;
+	res = fsk_session_transmit(chan, session, &f, &ticket);
+	if (res) {
+		fsk_recorder_dump(chan, session, app_fskTXQueue, "hangup", NULL);
+	}
+	if (job) {
+		job->sent = !res;
+		ao2_ref(job, -1);
+	}
+
+	ao2_lock(session);
+	session->out.draining = 0;
+	ao2_unlock(session);
+
+	fsk_session_transmit_done(chan, session, &f, persistent && !res, &ticket);
+	fsk_admission_leave(&ticket);
+	ao2_ref(session, -1);
+	return 0;
+}
+
+static int fsk_queue_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+	struct ast_channel *target = chan;
+	struct fsk_session *session;
+	int queued = 0;
+
+	if (!ast_strlen_zero(data) && !(target = ast_channel_get_by_name(data))) {
+		ast_log(LOG_WARNING, "Channel '%s' not found\n", data);
+		return -1;
+	}
+	if (!target) {
+		return -1;
+	}
+	if ((session = fsk_session_find(target, 0))) {
+		ao2_lock(session);
+		queued = session->out.queued + (session->out.framed ? 1 : 0);
+		ao2_unlock(session);
+		ao2_ref(session, -1);
+	}
+	if (target != chan) {
+		ast_channel_unref(target);
+	}
+	snprintf(buf, len, "%d", queued);
+	return 0;
+}
+
+static int fsk_queue_write(struct ast_channel *chan, const char *cmd, char *data, const char *value)
+{
+	struct ast_channel *target = chan;
+	struct fsk_session *session;
+	struct fsk_queue_entry *entry;
+	int res = -1;
+
+	if (!ast_strlen_zero(data) && !(target = ast_channel_get_by_name(data))) {
+		ast_log(LOG_WARNING, "Channel '%s' not found\n", data);
+		return -1;
+	}
+	if (!target) {
+		return -1;
+	}
+	if (ast_strlen_zero(value)) {
+		ast_log(LOG_WARNING, "FSK_QUEUE needs something to send\n");
+		if (target != chan) {
+			ast_channel_unref(target);
+		}
+		return -1;
+	}
+
+	/* framing happens here, off the channel that plays the queue */
+	entry = fsk_queue_entry_render(value, strlen(value), &fsk_framing_8n1);
+	session = entry ? fsk_session_find(target, 1) : NULL;
+	if (session) {
+		ao2_lock(session);
+		if (session->out.queued < FSK_QUEUE_MAX) {
+			AST_LIST_INSERT_TAIL(&session->out.queue, entry, list);
+			session->out.queued++;
+			entry = NULL;
+			res = 0;
+		} else {
+			ast_log(LOG_WARNING, "FSK queue on %s is full\n", ast_channel_name(target));
+		}
+		ao2_unlock(session);
+		ao2_ref(session, -1);
+	}
+	ast_free(entry);
+	if (target != chan) {
+		ast_channel_unref(target);
+	}
+	return res;
+}
+
+static struct ast_custom_function fsk_queue_function = {
+	.name = "FSK_QUEUE",
+	.read = fsk_queue_read,
+	.write = fsk_queue_write,
+};
+
+static int fskRX_exec(struct ast_channel *chan, const char *data) { /* ReceiveFSK */
+	struct fsk_session *session;
+	receive_buffer_t *in;
+	char *argcopy = NULL;
+	struct ast_frame *f;
+	struct ast_flags flags = {0};
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	struct ast_silence_generator *silgen = NULL;
+	int16_t output_frame[BLOCK_LEN];
+	char received[16];
+	char *start;
+	struct timeval rx_start = ast_tvnow();
+	enum fsk_auth auth;
+	size_t plain;
+	int crc_ok = 0;
+	struct fsk_profile *profile;
+	struct fsk_ladder *ladder;
+	struct fsk_ladder_result result;
+	struct fsk_admission_ticket ticket;
+	const char *failure = NULL;
+	char meta[256];
+	uint64_t busy;
+	int silence_flag = 0;
+	int persistent;
+	int idle_eom_samples;
+	int res = 0;
+
+	AST_DECLARE_APP_ARGS(arglist,
+		AST_APP_ARG(variable);
+		AST_APP_ARG(modem);
+		AST_APP_ARG(options);
+	);
+
+	argcopy = ast_strdupa(data);
+	AST_STANDARD_APP_ARGS(arglist, argcopy);
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "ReceiveFSK requires at least a variable as argument\n");
+		return -1;
+	}
+	if (chan == NULL)          {
+		ast_log(LOG_ERROR, "ReceiveFSK channel is NULL. Giving up.\n");
+		return -1;
+	}
+	pbx_builtin_setvar_helper(chan, "FSKRECORDING", "");
+	if (ast_channel_state(chan) != AST_STATE_UP) { /* answer channel if unanswered */
+		res = ast_answer(chan);
+		if (res) {
+			ast_log(LOG_WARNING, "Failed to answer channel\n");
+			return -1;
+		}
+	}
+
+	if ((ladder = fsk_ladder_find(arglist.modem))) {
+		profile = ao2_bump(ladder->rungs[ladder->start]);
+	} else if (!(profile = fsk_profile_find(arglist.modem))) {
+		return -1;
+	}
+
+	pbx_builtin_setvar_helper(chan, arglist.variable, ""); /* initialize variable */
+	ast_debug(1, "Modem profile is '%s'\n", profile->name);
+	if ((res = ast_set_read_format(chan, ast_format_slin)) < 0) {
+		ast_log(LOG_WARNING, "Unable to set channel to linear mode, giving up\n");
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		return -1;
+	}
+
+	memset(output_frame, 0, sizeof(output_frame));
+
+	if (!ast_strlen_zero(arglist.options)) {
+		ast_debug(1, "This instance has flags\n");
+		ast_app_parse_options(read_app_options, &flags, opts, arglist.options);
+		if (ast_test_flag(&flags, OPT_SILENCE )) {
+			silence_flag = 1;
+		}
+	}
+	persistent = ast_test_flag(&flags, OPT_PERSIST) ? 1 : 0;
+	if (profile->crc) {
+		ast_set_flag(&flags, OPT_CRC);
+	}
+	if (profile->key >= 0) {
+		ast_set_flag(&flags, OPT_ENCRYPT);
+	}
+	if (profile->sink && !ast_test_flag(&flags, OPT_SINK_FILE | OPT_SINK_SOCKET)) {
+		if (!strncmp(profile->sink, "file:", 5)) {
+			ast_set_flag(&flags, OPT_SINK_FILE);
+			opts[OPT_ARG_SINK_FILE] = profile->sink + 5;
+		} else {
+			ast_set_flag(&flags, OPT_SINK_SOCKET);
+			opts[OPT_ARG_SINK_SOCKET] = profile->sink + 7;
+		}
+	}
+	/* streamed bytes go out before the message can be authenticated */
+	if (ast_test_flag(&flags, OPT_ENCRYPT) && ast_test_flag(&flags, OPT_SINK_FILE | OPT_SINK_SOCKET | OPT_SINK_SHM | OPT_AMI)) {
+		ast_log(LOG_WARNING, "ReceiveFSK cannot decrypt a streamed message\n");
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		return -1;
+	}
+
+	if ((res = fsk_admission_enter(chan, &ticket))) {
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		return res < 0 ? -1 : 0;
+	}
+	session = fsk_session_find(chan, persistent);
+	if (!session && !(session = fsk_session_alloc())) {
+		fsk_admission_leave(&ticket);
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		return -1;
+	}
+	if (session->rx_hook >= 0) {
+		ast_log(LOG_WARNING, "A background FSK receive is running on %s\n", ast_channel_name(chan));
+		fsk_admission_leave(&ticket);
+		ao2_ref(session, -1);
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		return -1;
+	}
+
+	ao2_lock(session);
+	in = &session->in;
+	fsk_receive_start(&in->rcv, ast_test_flag(&flags, OPT_CRC) ? 1 : 0, ast_test_flag(&flags, OPT_HANGOUT) ? 0 : 1);
+	in->size = 65536;
+	if (ast_test_flag(&flags, OPT_SINK_FILE) && !ast_strlen_zero(opts[OPT_ARG_SINK_FILE])) {
+		in->sink = fsk_sink_alloc(opts[OPT_ARG_SINK_FILE], 0);
+		in->buffer = NULL;
+	} else if (ast_test_flag(&flags, OPT_SINK_SOCKET) && !ast_strlen_zero(opts[OPT_ARG_SINK_SOCKET])) {
+		in->sink = fsk_sink_alloc(opts[OPT_ARG_SINK_SOCKET], 1);
+		in->buffer = NULL;
+	} else {
+		in->sink = NULL;
+		in->buffer = (char *) ast_malloc(in->size);
+	}
+	if ((!in->buffer && !in->sink) || fsk_session_rx_prepare(session, profile)) {
+		ao2_unlock(session);
+		fsk_admission_leave(&ticket);
+		ao2_ref(session, -1);
+		ao2_cleanup(ladder);
+		ao2_ref(profile, -1);
+		return -1;
+	}
+	if (in->buffer) {
+		memset(in->buffer, 0, in->size); /* Reserve 64KB space for receive buffer and set to 0 its pointer. */
+	}
+	in->ptr = 0;
+	in->shm = ast_test_flag(&flags, OPT_SINK_SHM) && fsk_shm;
+	if (in->shm) {
+		in->shm_session = __atomic_add_fetch(&fsk_shm_sessions, 1, __ATOMIC_RELAXED);
+		in->shm_seq = 0;
+		in->shm_len = 0;
+	}
+	in->ami = ast_test_flag(&flags, OPT_AMI) ? chan : NULL;
+	if (in->ami) {
+		in->ami_receive = __atomic_add_fetch(&fsk_ami_receives, 1, __ATOMIC_RELAXED);
+		in->ami_seq = 0;
+		in->ami_len = 0;
+	}
+	ao2_unlock(session);
+	ast_debug(1, "output buffer allocated\n");
+
+	if (in->shm && ast_asprintf(&start, "%s %s", ast_channel_uniqueid(chan), ast_channel_name(chan)) >= 0) {
+		fsk_shm_publish(in->shm_session, &in->shm_seq, FSK_SHM_START, start, strlen(start));
+		ast_free(start);
+	}
+
+	if (in->rcv.carrier) {
+		ast_debug(1, "Carrier already locked, skipping acquisition\n");
+	}
+	idle_eom_samples = profile->eom_samples;
+	ao2_ref(profile, -1);
+
+	/* while our own carrier is held its generator owns the write path */
+	if (ladder) {
+		/* answers are ours to send, with silence in between */
+		fsk_session_carrier_pause(chan, session);
+		res = fsk_ladder_receive(chan, session, ladder, &ticket, &result);
+		fsk_ladder_setvars(chan, ladder, &result);
+		if (!res && strcmp(result.status, "OK")) {
+			failure = "ladder";
+		}
+		f = res ? NULL : &ast_null_frame;
+	} else if (silence_flag && !session->carrier) {
+		silgen = ast_channel_start_silence_generator(chan);
+	}
+	while (!ladder && ast_waitfor(chan, -1) > -1) {
+		f = ast_read(chan);
+		if (!f) {
+			res = -1;
+			break;
+		}
+		if (f->frametype == AST_FRAME_VOICE){
+			busy = fsk_admission_clock();
+			fsk_receive_feed(session->rx, &in->rcv, f->data.ptr, f->samples);
+			fsk_admission_charge(&ticket, busy);
+			fsk_recorder_put_frame(session->recorder, f, 1);
+			if (in->shm) {
+				fsk_shm_flush(in);
+			}
+			if (in->ami) {
+				fsk_ami_poll(in);
+			}
+		}
+		if (in->rcv.eof) {
+			ast_log(LOG_NOTICE, "FSK_eof\n");
+			break;
+		}
+		if (persistent && fsk_receive_idle(&in->rcv, idle_eom_samples)) {
+			ast_debug(1, "Peer back to mark-idle, message complete\n");
+			ast_frfree(f);
+			break;
+		}
+		if (session->carrier) {
+			ast_frfree(f);
+			continue;
+		}
+		f->subclass.format = ast_format_slin;
+		f->datalen = BLOCK_LEN;
+		f->samples = BLOCK_LEN / 2;
+		f->offset = AST_FRIENDLY_OFFSET;
+		f->src = __PRETTY_FUNCTION__;
+		f->data.ptr = &output_frame;
+		fsk_recorder_put(session->recorder, 1, 0, output_frame, f->samples);
+		if (ast_write(chan, f) < 0) {
+			res = -1;
+			ast_frfree(f);
+			break;
+		}
+		ast_frfree(f);
+	}
+	if (!f) {
+		ast_debug(1, "Got hangup\n");
+		res = -1;
+		/* a hangup on a carrier still sending is a message cut short */
+		if ((ladder || in->rcv.carrier) && in->rcv.received) {
+			failure = "hangup";
+		}
+	} else if (persistent && in->rcv.eof && in->rcv.received) {
+		/* a persistent receive ends when the peer goes back to mark-idle, not on carrier loss */
+		failure = "carrier";
+	}
+	if (in->rcv.crc) {
+		crc_ok = fsk_receive_crc_ok(&in->rcv);
+		pbx_builtin_setvar_helper(chan, "FSKCRC", crc_ok ? "OK" : "ERROR");
+		if (!crc_ok && !failure) {
+			failure = "crc";
+		}
+		if (in->buffer && in->ptr >= 2) {
+			in->ptr -= 2;
+			in->buffer[in->ptr] = '\0';
+		}
+	}
+	if (ast_test_flag(&flags, OPT_SPOOL)) {
+		switch (fsk_spool_received(chan, in, rx_start, crc_ok)) {
+		case 0:
+			pbx_builtin_setvar_helper(chan, "FSKSPOOL", "OK");
+			break;
+		case 1:
+			pbx_builtin_setvar_helper(chan, "FSKSPOOL", "DISABLED");
+			break;
+		default:
+			pbx_builtin_setvar_helper(chan, "FSKSPOOL", "FAILED");
+		}
+	}
+	if (ast_test_flag(&flags, OPT_ENCRYPT) && in->buffer) {
+		plain = in->ptr;
+		auth = fsk_unseal((unsigned char *) in->buffer, &plain);
+		in->ptr = plain;
+		in->buffer[in->ptr] = '\0';
+		if (auth != FSK_AUTH_OK) {
+			ast_log(LOG_NOTICE, "FSK message on %s failed authentication: %s\n", ast_channel_name(chan), fsk_auth_names[auth]);
+			in->ptr = 0;
+			in->buffer[0] = '\0';
+			if (!failure) {
+				failure = "auth";
+			}
+		}
+		pbx_builtin_setvar_helper(chan, "FSKAUTH", fsk_auth_names[auth]);
+	}
+	snprintf(received, sizeof(received), "%d", in->rcv.received);
+	fsk_quality_setvars(chan, in);
+	if (failure) {
+		snprintf(meta, sizeof(meta), "bytes=%d\ncarrier=%s\ncrc=%s\nquit_on_carrier_lost=%d\neom_samples=%d\n",
+			in->rcv.received, in->rcv.carrier ? "up" : "down", in->rcv.crc ? (crc_ok ? "ok" : "error") : "none",
+			in->rcv.quit_on_carrier_lost, persistent ? idle_eom_samples : 0);
+		fsk_recorder_dump(chan, session, app_fskRX, failure, meta);
+	}
+	if (in->shm) {
+		fsk_shm_flush(in);
+		fsk_shm_publish(in->shm_session, &in->shm_seq, FSK_SHM_END, received, strlen(received));
+		in->shm = 0;
+	}
+	if (in->ami) {
+		fsk_ami_end(in);
+		in->ami = NULL;
+	}
+	if (in->sink) {
+		pbx_builtin_setvar_helper(chan, arglist.variable, received);
+		fsk_sink_close(in->sink);
+		in->sink = NULL;
+	} else {
+		ast_debug(1, "received buffer is: %s\n", in->buffer);
+		pbx_builtin_setvar_helper(chan, arglist.variable, in->buffer);
+		ast_free(in->buffer);
+		in->buffer = NULL;
+	}
+	if (silgen) {
+		ast_channel_stop_silence_generator(chan, silgen);
+	}
+	if (!persistent) {
+		fsk_session_end(chan);
+	}
+	fsk_admission_leave(&ticket);
+	ao2_cleanup(ladder);
+	ao2_ref(session, -1);
+	return 0;
+}
+
+/* CAS of a Type II caller ID, 2130 Hz and 2750 Hz for 80 ms */
+#define FSK_CID_CAS_SAMPLES 640
+#define FSK_CID_CAS_LEVEL   2000
+/* Mark ahead of the message, 80 ms */
+#define FSK_CID_MARK_SAMPLES 640
+/* Channel seizure of the V.23 variant, 300 bits of alternating 0 and 1 */
+#define FSK_CID_SEIZURE_BITS 300
+/* What CPE gets to answer the CAS with its ACK */
+#define FSK_CID_ACK_MS      160
+/* Quiet between ACK and data, the CPE expects the data 50 to 500 ms after its ACK */
+#define FSK_CID_GAP_MS      60
+
+#define FSK_CID_MDMF        0x80
+#define FSK_CID_PARM_DATETIME 0x01
+#define FSK_CID_PARM_NUMBER 0x02
+#define FSK_CID_PARM_NUMBER_ABSENT 0x04
+#define FSK_CID_PARM_NAME   0x07
+#define FSK_CID_PARM_NAME_ABSENT 0x08
+
+/*! \brief Modulated preamble of a caller ID burst, and the modulator state at its end */
+struct fsk_cid_preamble {
+	int16_t *samples;
+	int len;
+	fsk_tx_state_t state;           /*!< copied per call so the message carries on phase continuous */
+};
+
+/*! \brief Rendered once at load, only the message is modulated per call */
+static struct {
+	int16_t cas[FSK_CID_CAS_SAMPLES];
+	struct fsk_cid_preamble preamble[2][2]; /*!< [V.23][with channel seizure] */
+} fsk_cid;
+
+struct fsk_cid_preamble_bits {
+	int seizure;
+};
+
+static int fsk_cid_preamble_bit(void *user_data)
+{
+	struct fsk_cid_preamble_bits *bits = user_data;
+
+	if (bits->seizure > 0) {
+		return bits->seizure-- & 1;
+	}
+	return 1;
+}
+
+static int fsk_cid_render_preamble(struct fsk_cid_preamble *preamble, int modem, int seizure)
+{
+	struct fsk_cid_preamble_bits bits = { .seizure = seizure ? FSK_CID_SEIZURE_BITS : 0 };
+
+	preamble->len = FSK_CID_MARK_SAMPLES;
+	if (seizure) {
+		preamble->len += FSK_CID_SEIZURE_BITS * 8000 / FSK_SPEC_BAUD(&preset_fsk_specs[modem]);
+	}
+	if (!(preamble->samples = ast_malloc(preamble->len * sizeof(int16_t)))) {
+		return -1;
+	}
+	if (!fsk_tx_init(&preamble->state, &preset_fsk_specs[modem], fsk_cid_preamble_bit, &bits)) {
+		return -1;
+	}
+	fsk_tx(&preamble->state, preamble->samples, preamble->len);
+	/* the bit source is gone, calls put theirs in place */
+	fsk_tx_set_get_bit(&preamble->state, NULL, NULL);
+	return 0;
+}
+
+static void fsk_cid_unload(void)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			ast_free(fsk_cid.preamble[i][j].samples);
+			fsk_cid.preamble[i][j].samples = NULL;
+		}
+	}
+}
+
+static int fsk_cid_load(void)
+{
+	int i;
+
+	for (i = 0; i < FSK_CID_CAS_SAMPLES; i++) {
+		fsk_cid.cas[i] = FSK_CID_CAS_LEVEL * (sin(2 * M_PI * 2130 * i / 8000) + sin(2 * M_PI * 2750 * i / 8000));
+	}
+	if (fsk_cid_render_preamble(&fsk_cid.preamble[0][0], FSK_BELL202, 0)
+		|| fsk_cid_render_preamble(&fsk_cid.preamble[0][1], FSK_BELL202, 1)
+		|| fsk_cid_render_preamble(&fsk_cid.preamble[1][0], FSK_V23CH1, 0)
+		|| fsk_cid_render_preamble(&fsk_cid.preamble[1][1], FSK_V23CH1, 1)) {
+		fsk_cid_unload();
+		return -1;
+	}
+	return 0;
+}
+
+static int fsk_cid_param(unsigned char *msg, int len, int type, const char *value, int max)
+{
+	int n = MIN((int) strlen(value), max);
+
+	msg[len++] = type;
+	msg[len++] = n;
+	memcpy(msg + len, value, n);
+	return len + n;
+}
+
+/*! \brief Build an MDMF message, checksum included, into msg of at least 64 bytes */
+static int fsk_cid_mdmf(unsigned char *msg, const char *number, const char *name)
+{
+	struct ast_tm tm;
+	char datetime[9];
+	unsigned char sum = 0;
+	int len = 2;
+	int i;
+
+	ast_localtime(&(struct timeval) { .tv_sec = time(NULL) }, &tm, NULL);
+	snprintf(datetime, sizeof(datetime), "%02d%02d%02d%02d", tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min);
+	len = fsk_cid_param(msg, len, FSK_CID_PARM_DATETIME, datetime, 8);
+	if (ast_strlen_zero(number)) {
+		len = fsk_cid_param(msg, len, FSK_CID_PARM_NUMBER_ABSENT, "O", 1);
+	} else if (!strcasecmp(number, "P") || !strcasecmp(number, "O")) {
+		/* private or out of area */
+		len = fsk_cid_param(msg, len, FSK_CID_PARM_NUMBER_ABSENT, number, 1);
+	} else {
+		len = fsk_cid_param(msg, len, FSK_CID_PARM_NUMBER, number, 20);
+	}
+	if (ast_strlen_zero(name)) {
+		len = fsk_cid_param(msg, len, FSK_CID_PARM_NAME_ABSENT, "O", 1);
+	} else if (!strcasecmp(name, "P") || !strcasecmp(name, "O")) {
+		len = fsk_cid_param(msg, len, FSK_CID_PARM_NAME_ABSENT, name, 1);
+	} else {
+		len = fsk_cid_param(msg, len, FSK_CID_PARM_NAME, name, 15);
+	}
+	msg[0] = FSK_CID_MDMF;
+	msg[1] = len - 2;
+	for (i = 0; i < len; i++) {
+		sum += msg[i];
+	}
+	msg[len++] = -sum;
+	return len;
+}
+
+/*!
+ * \brief Render a whole caller ID burst, so that nothing is left to compute once the ACK is in
+ * \return number of samples, or -1
+ */
+static int fsk_cid_render(int16_t **burst, const unsigned char *msg, int len, int v23, int seizure)
+{
+	const struct fsk_cid_preamble *preamble = &fsk_cid.preamble[v23][seizure];
+	fsk_tx_state_t tx;
+	transmit_buffer_t out = {
+		.buffer = (char *) msg,
+		.bytes2send = len,
+		.framing = &fsk_framing_8n1,
+	};
+	int modem = v23 ? FSK_V23CH1 : FSK_BELL202;
+	int samples;
+
+	/* the message, and a couple of mark bits so the last stop bit is not cut */
+	samples = (len * 10 + 2) * 8000 / FSK_SPEC_BAUD(&preset_fsk_specs[modem]) + 1;
+	if (!(*burst = ast_malloc((preamble->len + samples) * sizeof(int16_t)))) {
+		return -1;
+	}
+	memcpy(*burst, preamble->samples, preamble->len * sizeof(int16_t));
+	memcpy(&tx, &preamble->state, sizeof(tx));
+	fsk_tx_set_get_bit(&tx, (get_bit_func_t) put_bit, &out);
+	fsk_tx(&tx, *burst + preamble->len, samples);
+	return preamble->len + samples;
+}
+
+/*!
+ * \brief Play samples paced by the frames read from the channel, silence if samples is NULL
+ * \param dsp if not NULL, stop as soon as it detects one of the digits in stop
+ * \param ticket admission the digit detection is charged to
+ * \return the detected digit, 0 once played, -1 on hangup
+ */
+static int fsk_cid_play(struct ast_channel *chan, const int16_t *samples, int len, struct ast_dsp *dsp, const char *stop,
+	struct fsk_admission_ticket *ticket)
+{
+	int16_t buf[BLOCK_LEN];
+	struct ast_frame out = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "CidT2FSK",
+		.data.ptr = buf,
+	};
+	struct ast_frame *f;
+	uint64_t busy;
+	int pos = 0;
+	int chunk;
+	int digit;
+
+	out.subclass.format = ast_format_slin;
+	while (pos < len) {
+		if (ast_waitfor(chan, 1000) < 0 || !(f = ast_read(chan))) {
+			return -1;
+		}
+		if (f->frametype != AST_FRAME_VOICE) {
+			ast_frfree(f);
+			continue;
+		}
+		if (dsp) {
+			busy = fsk_admission_clock();
+			f = ast_dsp_process(chan, dsp, f);
+			fsk_admission_charge(ticket, busy);
+		}
+		if (dsp && f && f->frametype == AST_FRAME_DTMF && strchr(stop, f->subclass.integer)) {
+			digit = f->subclass.integer;
+			ast_frfree(f);
+			return digit;
+		}
+		if (f) {
+			ast_frfree(f);
+		}
+		chunk = MIN(len - pos, BLOCK_LEN);
+		if (samples) {
+			memcpy(buf, samples + pos, chunk * sizeof(int16_t));
+		} else {
+			memset(buf, 0, chunk * sizeof(int16_t));
+		}
+		out.samples = chunk;
+		out.datalen = chunk * 2;
+		if (ast_write(chan, &out) < 0) {
+			return -1;
+		}
+		pos += chunk;
+	}
+	return 0;
+}
+
+/*! \brief Put back the formats CidT2FSK found the channel in, and drop them */
+static void fsk_cid_formats_restore(struct ast_channel *chan, struct ast_format *read, struct ast_format *write)
+{
+	if (ast_set_read_format(chan, read) || ast_set_write_format(chan, write)) {
+		ast_log(LOG_WARNING, "Unable to restore the formats of %s\n", ast_channel_name(chan));
+	}
+	ao2_ref(read, -1);
+	ao2_ref(write, -1);
+}
+
+static int fskCidT2_exec(struct ast_channel *chan, const char *data) { /* CidT2FSK */
+	struct ast_flags flags = {0};
+	struct fsk_admission_ticket ticket;
+	struct ast_format *read_format;
+	struct ast_format *write_format;
+	struct ast_dsp *dsp;
+	unsigned char msg[64];
+	uint64_t busy;
+	int16_t *burst;
+	char *argcopy;
+	const char *status;
+	int len;
+	int samples;
+	int res;
+
+	AST_DECLARE_APP_ARGS(arglist,
+		AST_APP_ARG(number);
+		AST_APP_ARG(name);
+		AST_APP_ARG(options);
+	);
+
+	argcopy = ast_strdupa(S_OR(data, ""));
+	AST_STANDARD_APP_ARGS(arglist, argcopy);
+	if (!ast_strlen_zero(arglist.options)) {
+		ast_app_parse_options(cid_app_options, &flags, NULL, arglist.options);
+	}
+	if (ast_channel_state(chan) != AST_STATE_UP) {
+		ast_log(LOG_WARNING, "CidT2FSK needs a call in progress on %s\n", ast_channel_name(chan));
+		pbx_builtin_setvar_helper(chan, "CIDT2STATUS", "FAILED");
+		return 0;
+	}
+	if ((res = fsk_admission_enter(chan, &ticket))) {
+		if (res > 0) {
+			pbx_builtin_setvar_helper(chan, "CIDT2STATUS", "FAILED");
+		}
+		return res < 0 ? -1 : 0;
+	}
+	read_format = ao2_bump(ast_channel_readformat(chan));
+	write_format = ao2_bump(ast_channel_writeformat(chan));
+	if (ast_set_read_format(chan, ast_format_slin) || ast_set_write_format(chan, ast_format_slin)) {
+		ast_log(LOG_WARNING, "Unable to set channel to linear mode, giving up\n");
+		fsk_admission_leave(&ticket);
+		fsk_cid_formats_restore(chan, read_format, write_format);
+		return -1;
+	}
+
+	len = fsk_cid_mdmf(msg, arglist.number, arglist.name);
+	busy = fsk_admission_clock();
+	samples = fsk_cid_render(&burst, msg, len, ast_test_flag(&flags, OPT_CID_V23) ? 1 : 0,
+		ast_test_flag(&flags, OPT_CID_SEIZURE) ? 1 : 0);
+	fsk_admission_charge(&ticket, busy);
+	if (samples < 0 || !(dsp = ast_dsp_new())) {
+		if (samples >= 0) {
+			ast_free(burst);
+		}
+		fsk_admission_leave(&ticket);
+		fsk_cid_formats_restore(chan, read_format, write_format);
+		pbx_builtin_setvar_helper(chan, "CIDT2STATUS", "FAILED");
+		return 0;
+	}
+	ast_dsp_set_features(dsp, DSP_FEATURE_DIGIT_DETECT);
+	ast_dsp_set_digitmode(dsp, DSP_DIGITMODE_DTMF);
+
+	res = fsk_cid_play(chan, fsk_cid.cas, FSK_CID_CAS_SAMPLES, NULL, NULL, &ticket);
+	if (!res) {
+		/* ACK is DTMF A, or D from ADSI CPE */
+		res = fsk_cid_play(chan, NULL, FSK_CID_ACK_MS * 8, dsp, "AD", &ticket);
+	}
+	if (res > 0 || (!res && ast_test_flag(&flags, OPT_CID_NOACK))) {
+		ast_debug(1, "CAS acknowledged with '%c' on %s\n", res > 0 ? res : '-', ast_channel_name(chan));
+		res = fsk_cid_play(chan, NULL, FSK_CID_GAP_MS * 8, NULL, NULL, &ticket);
+		if (!res) {
+			res = fsk_cid_play(chan, burst, samples, NULL, NULL, &ticket);
+		}
+		status = res ? "HANGUP" : "SUCCESS";
+	} else {
+		status = res ? "HANGUP" : "NOACK";
+	}
+	ast_dsp_free(dsp);
+	ast_free(burst);
+	fsk_admission_leave(&ticket);
+	fsk_cid_formats_restore(chan, read_format, write_format);
+	pbx_builtin_setvar_helper(chan, "CIDT2STATUS", status);
+	return res < 0 ? -1 : 0;
+}
+
+/* ETSI ES 201 912 protocol 1 data link message types */
+#define FSK_SMS_DATA        0x11
+#define FSK_SMS_ERROR       0x12
+#define FSK_SMS_EST         0x13
+#define FSK_SMS_REL         0x14
+#define FSK_SMS_ACK         0x15
+#define FSK_SMS_NACK        0x16
+/* Set in the type of the last message of a sequence, which is all of ours */
+#define FSK_SMS_LAST        0x80
+#define FSK_SMS_TYPE_MASK   0x7f
+
+/* Largest data link payload, the length is a single octet */
+#define FSK_SMS_PAYLOAD_MAX 255
+/* Mark ahead of each data link message, 80 bits at 1200 baud rounded up to whole blocks */
+#define FSK_SMS_MARK_BLOCKS 4
+/* How long a peer gets to answer a message, and how many times a message is sent */
+#define FSK_SMS_ANSWER_MS   3000
+#define FSK_SMS_ATTEMPTS    3
+
+/* TP-MTI of the transfer layer PDUs carried in SMS_DATA */
+#define FSK_SMS_TP_DELIVER  0x00
+#define FSK_SMS_TP_SUBMIT   0x01
+
+/*! \brief A transfer layer message, as far as the applications look into it */
+struct fsk_sms {
+	int type;                       /*!< FSK_SMS_TP_DELIVER or FSK_SMS_TP_SUBMIT */
+	char number[21];                /*!< originator of a DELIVER, destination of a SUBMIT */
+	char timestamp[20];             /*!< service centre time stamp of a DELIVER, YYYY-MM-DD hh:mm:ss */
+	char text[161];
+};
+
+/*
+ * GSM 03.38 default alphabet to ASCII, for the characters that have an
+ * ASCII counterpart; the others read as '?'
+ */
+static const char fsk_sms_gsm7[128] =
+	"@?$???????\n??\r???_??????????????"
+	" !\"#?%&'()*+,-./0123456789:;<=>?"
+	"?ABCDEFGHIJKLMNOPQRSTUVWXYZ?????"
+	"?abcdefghijklmnopqrstuvwxyz?????";
+
+static int fsk_sms_ascii2gsm(char c)
+{
+	const char *p;
+
+	switch (c) {
+	case '@':
+		return 0x00;
+	case '$':
+		return 0x02;
+	case '_':
+		return 0x11;
+	case '?':
+		return 0x3f;
+	}
+	p = memchr(fsk_sms_gsm7 + 1, c, sizeof(fsk_sms_gsm7) - 1);
+	return p ? p - fsk_sms_gsm7 : 0x3f;
+}
+
+/*! \brief Pack text as GSM 7 bit septets, return the number of septets */
+static int fsk_sms_pack(const char *text, unsigned char *ud, int *octets)
+{
+	int septets = MIN((int) strlen(text), 160);
+	int bit = 0;
+	int i;
+	int c;
+
+	memset(ud, 0, 140);
+	for (i = 0; i < septets; i++, bit += 7) {
+		c = fsk_sms_ascii2gsm(text[i]);
+		ud[bit / 8] |= c << (bit % 8);
+		if (bit % 8 > 1) {
+			ud[bit / 8 + 1] |= c >> (8 - bit % 8);
+		}
+	}
+	*octets = (septets * 7 + 7) / 8;
+	return septets;
+}
+
+static void fsk_sms_unpack(const unsigned char *ud, int septets, char *text)
+{
+	int bit;
+	int c;
+	int i;
+
+	for (i = 0, bit = 0; i < septets; i++, bit += 7) {
+		c = ud[bit / 8] >> (bit % 8);
+		if (bit % 8 > 1) {
+			c |= ud[bit / 8 + 1] << (8 - bit % 8);
+		}
+		text[i] = fsk_sms_gsm7[c & 0x7f];
+	}
+	text[septets] = '\0';
+}
+
+/*! \brief Encode an address field, return its length in octets */
+static int fsk_sms_address(const char *number, unsigned char *out)
+{
+	int international = *number == '+';
+	int digits = 0;
+	int i;
+
+	number += international;
+	out[1] = international ? 0x91 : 0x81;
+	for (i = 0; number[i] && digits < 20; i++) {
+		if (!isdigit(number[i])) {
+			continue;
+		}
+		if (digits % 2) {
+			out[2 + digits / 2] |= (number[i] - '0') << 4;
+		} else {
+			out[2 + digits / 2] = 0xf0 | (number[i] - '0');
+		}
+		digits++;
+	}
+	out[0] = digits;
+	return 2 + (digits + 1) / 2;
+}
+
+/*! \brief Decode an address field, return its length in octets or -1 */
+static int fsk_sms_address_parse(const unsigned char *in, int len, char *number)
+{
+	int digits = in[0];
+	int size = 2 + (digits + 1) / 2;
+	int i;
+
+	if (len < 2 || digits > 20 || size > len) {
+		return -1;
+	}
+	if ((in[1] & 0x70) == 0x10) {
+		*number++ = '+';
+	}
+	for (i = 0; i < digits; i++) {
+		*number++ = '0' + ((i % 2 ? in[2 + i / 2] >> 4 : in[2 + i / 2]) & 0x0f);
+	}
+	*number = '\0';
+	return size;
+}
+
+static int fsk_sms_bcd(unsigned char octet)
+{
+	return (octet & 0x0f) * 10 + (octet >> 4);
+}
+
+/*! \brief Build the transfer layer PDU for an SMS_DATA message */
+static int fsk_sms_build(unsigned char *pdu, int type, const char *number, const char *text)
+{
+	struct ast_tm tm;
+	int octets;
+	int len = 0;
+
+	if (type == FSK_SMS_TP_SUBMIT) {
+		pdu[len++] = FSK_SMS_TP_SUBMIT;
+		pdu[len++] = 0;             /* TP-MR */
+		len += fsk_sms_address(number, pdu + len);
+		pdu[len++] = 0;             /* TP-PID */
+		pdu[len++] = 0;             /* TP-DCS, default alphabet */
+	} else {
+		pdu[len++] = FSK_SMS_TP_DELIVER | 0x04; /* no more messages */
+		len += fsk_sms_address(number, pdu + len);
+		pdu[len++] = 0;
+		pdu[len++] = 0;
+		ast_localtime(&(struct timeval) { .tv_sec = time(NULL) }, &tm, NULL);
+		pdu[len++] = ((tm.tm_year % 100) % 10) << 4 | (tm.tm_year % 100) / 10;
+		pdu[len++] = ((tm.tm_mon + 1) % 10) << 4 | (tm.tm_mon + 1) / 10;
+		pdu[len++] = (tm.tm_mday % 10) << 4 | tm.tm_mday / 10;
+		pdu[len++] = (tm.tm_hour % 10) << 4 | tm.tm_hour / 10;
+		pdu[len++] = (tm.tm_min % 10) << 4 | tm.tm_min / 10;
+		pdu[len++] = (tm.tm_sec % 10) << 4 | tm.tm_sec / 10;
+		pdu[len++] = 0;             /* time zone */
+	}
+	pdu[len] = fsk_sms_pack(text, pdu + len + 1, &octets);
+	return len + 1 + octets;
+}
+
+/*!
+ * \brief Parse the transfer layer PDU of an SMS_DATA message
+ * \retval 0 on success
+ * \retval -1 if the PDU is malformed or uses features this parser does not know
+ */
+static int fsk_sms_parse(const unsigned char *pdu, int len, struct fsk_sms *sms)
+{
+	int pos = 1;
+	int res;
+	int dcs;
+	int udl;
+
+	if (len < 1) {
+		return -1;
+	}
+	memset(sms, 0, sizeof(*sms));
+	sms->type = pdu[0] & 0x03;
+	if (sms->type == FSK_SMS_TP_SUBMIT) {
+		pos++;                      /* TP-MR */
+	} else if (sms->type != FSK_SMS_TP_DELIVER) {
+		return -1;
+	}
+	if ((res = fsk_sms_address_parse(pdu + pos, len - pos, sms->number)) < 0) {
+		return -1;
+	}
+	pos += res + 1;                 /* TP-PID */
+	if (pos >= len) {
+		return -1;
+	}
+	dcs = pdu[pos++];
+	if (sms->type == FSK_SMS_TP_DELIVER) {
+		if (pos + 7 > len) {
+			return -1;
+		}
+		snprintf(sms->timestamp, sizeof(sms->timestamp), "20%02d-%02d-%02d %02d:%02d:%02d",
+			fsk_sms_bcd(pdu[pos]), fsk_sms_bcd(pdu[pos + 1]), fsk_sms_bcd(pdu[pos + 2]),
+			fsk_sms_bcd(pdu[pos + 3]), fsk_sms_bcd(pdu[pos + 4]), fsk_sms_bcd(pdu[pos + 5]));
+		pos += 7;
+	} else {
+		switch (pdu[0] & 0x18) {    /* TP-VPF */
+		case 0x10:
+			pos += 1;
+			break;
+		case 0x08:
+		case 0x18:
+			pos += 7;
+			break;
+		}
+	}
+	if (pos >= len || (pdu[0] & 0x40) || (dcs & 0x0c)) {
+		/* user data header and 8 bit or UCS2 data are not understood */
+		return -1;
+	}
+	udl = pdu[pos++];
+	if (udl > 160 || pos + (udl * 7 + 7) / 8 > len) {
+		return -1;
+	}
+	fsk_sms_unpack(pdu + pos, udl, sms->text);
+	return 0;
+}
+
+/*! \brief Send one data link message, preceded by mark */
+static int fsk_sms_send_dll(struct ast_channel *chan, struct fsk_session *session, int type, const unsigned char *payload, int len)
+{
+	unsigned char msg[FSK_SMS_PAYLOAD_MAX + 3];
+	unsigned char sum = 0;
+	int16_t amp[BLOCK_LEN];
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "SendFSKSMS",
+		.datalen = BLOCK_LEN * 2,
+		.samples = BLOCK_LEN,
+		.data.ptr = amp,
+	};
+	struct ast_frame *fr;
+	uint64_t busy;
+	int i;
+
+	msg[0] = type | FSK_SMS_LAST;
+	msg[1] = len;
+	memcpy(msg + 2, payload, len);
+	for (i = 0; i < len + 2; i++) {
+		sum += msg[i];
+	}
+	msg[len + 2] = -sum;
+
+	f.subclass.format = ast_format_slin;
+	ao2_lock(session);
+	memset(&session->out, 0, sizeof(session->out));
+	session->out.framing = &session->tx_profile->framing;
+	ao2_unlock(session);
+	for (i = 0; i < FSK_SMS_MARK_BLOCKS; i++) {
+		if (ast_waitfor(chan, 1000) < 0 || !(fr = ast_read(chan))) {
+			return -1;
+		}
+		fsk_recorder_put_frame(session->recorder, fr, 0);
+		ast_frfree(fr);
+		busy = fsk_admission_clock();
+		fsk_mod(session->tx, amp, BLOCK_LEN);
+		fsk_admission_charge(&session->ticket, busy);
+		fsk_recorder_put(session->recorder, 1, 0, amp, BLOCK_LEN);
+		if (ast_write(chan, &f) < 0) {
+			return -1;
+		}
+	}
+	ao2_lock(session);
+	session->out.buffer = (char *) msg;
+	session->out.bytes2send = len + 3;
+	ao2_unlock(session);
+	i = fsk_session_transmit(chan, session, &f, &session->ticket);
+	ao2_lock(session);
+	session->out.buffer = NULL;
+	session->out.bytes2send = 0;
+	ao2_unlock(session);
+	return i;
+}
+
+/*!
+ * \brief Wait for a data link message with a valid checksum
+ * \param timeout ms by the clock, whether or not the channel passes frames
+ * \return message type, 0 on timeout, -1 on hangup
+ */
+static int fsk_sms_receive_dll(struct ast_channel *chan, struct fsk_session *session, unsigned char *payload, int *len, int timeout)
+{
+	receive_buffer_t *in = &session->in;
+	unsigned char *msg;
+	unsigned char sum;
+	int16_t silence[BLOCK_LEN] = { 0, };
+	struct ast_frame out = {
+		.frametype = AST_FRAME_VOICE,
+		.src = "ReceiveFSKSMS",
+		.datalen = BLOCK_LEN * 2,
+		.samples = BLOCK_LEN,
+		.data.ptr = silence,
+	};
+	struct ast_frame *f;
+	struct timeval start = ast_tvnow();
+	uint64_t busy;
+	int type = 0;
+	int ms;
+	int i;
+
+	out.subclass.format = ast_format_slin;
+	in->ptr = 0;
+	in->rcv.eof = 0;
+	msg = (unsigned char *) in->buffer;
+	while ((ms = timeout - ast_tvdiff_ms(ast_tvnow(), start)) > 0) {
+		if ((ms = ast_waitfor(chan, MIN(ms, 1000))) < 0) {
+			return -1;
+		}
+		if (!ms) {
+			continue;
+		}
+		if (!(f = ast_read(chan))) {
+			return -1;
+		}
+		if (f->frametype == AST_FRAME_VOICE) {
+			busy = fsk_admission_clock();
+			fsk_receive_feed(session->rx, &in->rcv, f->data.ptr, f->samples);
+			fsk_admission_charge(&session->ticket, busy);
+		}
+		fsk_recorder_put_frame(session->recorder, f, f->frametype == AST_FRAME_VOICE);
+		ast_frfree(f);
+		fsk_recorder_put(session->recorder, 1, 0, silence, BLOCK_LEN);
+		if (ast_write(chan, &out) < 0) {
+			return -1;
+		}
+		/* drop what cannot start a message, line noise included */
+		while (in->ptr && ((msg[0] & FSK_SMS_TYPE_MASK) < FSK_SMS_DATA || (msg[0] & FSK_SMS_TYPE_MASK) > FSK_SMS_NACK)) {
+			memmove(msg, msg + 1, --in->ptr);
+		}
+		if (in->ptr < 2 || in->ptr < msg[1] + 3) {
+			continue;
+		}
+		for (i = 0, sum = 0; i < msg[1] + 3; i++) {
+			sum += msg[i];
+		}
+		if (sum) {
+			ast_debug(1, "Bad checksum on SMS data link message 0x%02x\n", msg[0]);
+			type = FSK_SMS_ERROR;
+		} else if ((msg[0] & FSK_SMS_TYPE_MASK) == FSK_SMS_EST) {
+			/* the peer is ready for our data: we send it or wait for theirs either way */
+			ast_debug(1, "SMS data link established by the peer\n");
+			in->ptr = 0;
+			continue;
+		} else {
+			type = msg[0] & FSK_SMS_TYPE_MASK;
+			memcpy(payload, msg + 2, msg[1]);
+			*len = msg[1];
+		}
+		in->ptr = 0;
+		return type;
+	}
+	return 0;
+}
+
+/*!
+ * \brief A private half duplex V.23 session, both directions on the forward channel
+ *
+ * Admitted as SendFSK is, the session holds the slot until fsk_sms_session_free().
+ *
+ * \param res set to 1 if the channel was turned away, -1 on hangup while queued, 0 otherwise
+ */
+static struct fsk_session *fsk_sms_session(struct ast_channel *chan, int *res)
+{
+	struct fsk_admission_ticket ticket;
+	struct fsk_session *session;
+
+	if ((*res = fsk_admission_enter(chan, &ticket))) {
+		return NULL;
+	}
+	if (ast_set_read_format(chan, ast_format_slin) || ast_set_write_format(chan, ast_format_slin)) {
+		ast_log(LOG_WARNING, "Unable to set channel to linear mode, giving up\n");
+		fsk_admission_leave(&ticket);
+		return NULL;
+	}
+	if (!(session = fsk_session_alloc())) {
+		fsk_admission_leave(&ticket);
+		return NULL;
+	}
+	session->ticket = ticket;
+	/* rx_byte() keeps the last byte of the buffer free */
+	session->in.size = FSK_SMS_PAYLOAD_MAX + 4;
+	session->in.buffer = ast_calloc(1, session->in.size);
+	fsk_session_codec(session, chan);
+	if (!session->in.buffer || fsk_session_tx_prepare(session, fsk_profile_v23) || fsk_session_rx_prepare(session, fsk_profile_v23)) {
+		ast_free(session->in.buffer);
+		session->in.buffer = NULL;
+		ao2_ref(session, -1);
+		return NULL;
+	}
+	return session;
+}
+
+static void fsk_sms_session_free(struct fsk_session *session)
+{
+	ast_free(session->in.buffer);
+	session->in.buffer = NULL;
+	fsk_admission_leave(&session->ticket);
+	ao2_ref(session, -1);
+}
+
+static int fskSMSTX_exec(struct ast_channel *chan, const char *data) { /* SendFSKSMS */
+	struct fsk_session *session;
+	struct ast_flags flags = {0};
+	unsigned char pdu[FSK_SMS_PAYLOAD_MAX];
+	unsigned char reply[FSK_SMS_PAYLOAD_MAX];
+	const char *status = "TIMEOUT";
+	char *argcopy;
+	int attempt;
+	int reply_len;
+	int len;
+	int res = 0;
+
+	AST_DECLARE_APP_ARGS(arglist,
+		AST_APP_ARG(number);
+		AST_APP_ARG(text);
+		AST_APP_ARG(options);
+	);
+
+	argcopy = ast_strdupa(S_OR(data, ""));
+	AST_STANDARD_APP_ARGS(arglist, argcopy);
+	if (ast_strlen_zero(arglist.number)) {
+		ast_log(LOG_WARNING, "SendFSKSMS requires a number\n");
+		return -1;
+	}
+	if (!ast_strlen_zero(arglist.options)) {
+		ast_app_parse_options(sms_app_options, &flags, NULL, arglist.options);
+	}
+	pbx_builtin_setvar_helper(chan, "FSKRECORDING", "");
+	if (ast_channel_state(chan) != AST_STATE_UP && ast_answer(chan)) {
+		return -1;
+	}
+	if (!(session = fsk_sms_session(chan, &res))) {
+		if (res < 0) {
+			return -1;
+		}
+		pbx_builtin_setvar_helper(chan, "FSKSMSSTATUS", "ERROR");
+		return 0;
+	}
+	len = fsk_sms_build(pdu, ast_test_flag(&flags, OPT_SMS_SUBMIT) ? FSK_SMS_TP_SUBMIT : FSK_SMS_TP_DELIVER,
+		arglist.number, S_OR(arglist.text, ""));
+
+	for (attempt = 0; attempt < FSK_SMS_ATTEMPTS; attempt++) {
+		if (fsk_sms_send_dll(chan, session, FSK_SMS_DATA, pdu, len)
+			|| (res = fsk_sms_receive_dll(chan, session, reply, &reply_len, FSK_SMS_ANSWER_MS)) < 0) {
+			res = -1;
+			break;
+		}
+		if (res == FSK_SMS_ACK || res == FSK_SMS_NACK) {
+			break;
+		}
+		/* nothing or garbage back, the peer may not have got it either */
+	}
+	if (res < 0) {
+		status = "HANGUP";
+	} else if (res == FSK_SMS_ACK || res == FSK_SMS_NACK) {
+		status = res == FSK_SMS_ACK ? "ACK" : "NACK";
+		if (fsk_sms_send_dll(chan, session, FSK_SMS_REL, NULL, 0)) {
+			res = -1;
+		}
+	} else {
+		fsk_recorder_dump(chan, session, app_smsTX, "timeout", NULL);
+	}
+	fsk_sms_session_free(session);
+	pbx_builtin_setvar_helper(chan, "FSKSMSSTATUS", status);
+	return res < 0 ? -1 : 0;
+}
+
+static int fsk_sms_spool(struct ast_channel *chan, const struct fsk_sms *sms, const unsigned char *pdu, int len)
+{
+	struct ast_str *meta;
+	int res;
+
+	if (!(meta = ast_str_create(256))) {
+		return -1;
+	}
+	ast_channel_lock(chan);
+	ast_str_set(&meta, 0, "channel=%s\nuniqueid=%s\n", ast_channel_name(chan), ast_channel_uniqueid(chan));
+	ast_channel_unlock(chan);
+	ast_str_append(&meta, 0, "type=sms-%s\nnumber=%s\ntimestamp=%s\nreceived=%ld\nbytes=%d\n",
+		sms->type == FSK_SMS_TP_SUBMIT ? "submit" : "deliver", sms->number, sms->timestamp,
+		(long) time(NULL), len);
+	res = fsk_spool_append(ast_str_buffer(meta), pdu, len);
+	ast_free(meta);
+	return res;
+}
+
+static int fskSMSRX_exec(struct ast_channel *chan, const char *data) { /* ReceiveFSKSMS */
+	struct fsk_session *session;
+	struct ast_flags flags = {0};
+	char *opts[OPT_ARG_SMS_ARRAY_SIZE] = { NULL, };
+	unsigned char pdu[FSK_SMS_PAYLOAD_MAX];
+	unsigned char report[2] = { 0, 0 };
+	unsigned char release[FSK_SMS_PAYLOAD_MAX];
+	struct fsk_sms sms;
+	const char *status = "TIMEOUT";
+	char *argcopy;
+	int timeout = 10000;
+	int release_len;
+	int len = 0;
+	int res;
+
+	AST_DECLARE_APP_ARGS(arglist,
+		AST_APP_ARG(options);
 	);
 
-	native_format = ast_format_cap_get_format(ast_channel_nativeformats(chan), 0);
-	sampling_rate = ast_format_get_sample_rate(native_format);
-	write_format = ast_format_cache_get_slin_by_rate(sampling_rate);
-	f.subclass.format = write_format;
+	argcopy = ast_strdupa(S_OR(data, ""));
+	AST_STANDARD_APP_ARGS(arglist, argcopy);
+	if (!ast_strlen_zero(arglist.options)) {
+		ast_app_parse_options(sms_app_options, &flags, opts, arglist.options);
+	}
+	if (ast_test_flag(&flags, OPT_SMS_TIMEOUT) && !ast_strlen_zero(opts[OPT_ARG_SMS_TIMEOUT])) {
+		timeout = atoi(opts[OPT_ARG_SMS_TIMEOUT]) * 1000;
+	}
+	pbx_builtin_setvar_helper(chan, "FSKRECORDING", "");
+	if (ast_channel_state(chan) != AST_STATE_UP && ast_answer(chan)) {
+		return -1;
+	}
+	if (!(session = fsk_sms_session(chan, &res))) {
+		if (res < 0) {
+			return -1;
+		}
+		pbx_builtin_setvar_helper(chan, "FSKSMSSTATUS", "ERROR");
+		return 0;
+	}
+
+	while ((res = fsk_sms_receive_dll(chan, session, pdu, &len, timeout)) > 0) {
+		if (res == FSK_SMS_DATA && !fsk_sms_parse(pdu, len, &sms)) {
+			break;
+		}
+		if (res == FSK_SMS_DATA || res == FSK_SMS_ERROR) {
+			/* the sender repeats the message on NACK */
+			report[1] = 0xff;       /* unspecified error */
+			if (fsk_sms_send_dll(chan, session, FSK_SMS_NACK, report, sizeof(report))) {
+				res = -1;
+				break;
+			}
+			status = "ERROR";
+		}
+	}
+	if (res == FSK_SMS_DATA) {
+		report[1] = 0;
+		status = "OK";
+		if (fsk_sms_send_dll(chan, session, FSK_SMS_ACK, report, sizeof(report))) {
+			res = -1;
+		} else {
+			/* the release is a courtesy, the message is ours either way */
+			fsk_sms_receive_dll(chan, session, release, &release_len, FSK_SMS_ANSWER_MS);
+		}
+		pbx_builtin_setvar_helper(chan, "FSKSMS_TYPE", sms.type == FSK_SMS_TP_SUBMIT ? "SUBMIT" : "DELIVER");
+		pbx_builtin_setvar_helper(chan, "FSKSMS_NUMBER", sms.number);
+		pbx_builtin_setvar_helper(chan, "FSKSMS_TIMESTAMP", sms.timestamp);
+		pbx_builtin_setvar_helper(chan, "FSKSMS_TEXT", sms.text);
+		if (ast_test_flag(&flags, OPT_SMS_SPOOL)) {
+			switch (fsk_sms_spool(chan, &sms, pdu, len)) {
+			case 0:
+				pbx_builtin_setvar_helper(chan, "FSKSPOOL", "OK");
+				break;
+			case 1:
+				pbx_builtin_setvar_helper(chan, "FSKSPOOL", "DISABLED");
+				break;
+			default:
+				pbx_builtin_setvar_helper(chan, "FSKSPOOL", "FAILED");
+			}
+		}
+	} else if (res < 0) {
+		status = "HANGUP";
+	} else {
+		fsk_recorder_dump(chan, session, app_smsRX, !strcmp(status, "ERROR") ? "checksum" : "timeout", NULL);
+	}
+	fsk_sms_session_free(session);
+	pbx_builtin_setvar_helper(chan, "FSKSMSSTATUS", status);
+	return res < 0 ? -1 : 0;
+}
+
+/* Flags of a framehook receive */
+#define FSK_HOOK_UNTIL_HANGUP (1 << 0)
+#define FSK_HOOK_RELAY      (1 << 1)    /*!< received bytes replace the audio as text frames, text written is modulated */
+#define FSK_HOOK_T140       (1 << 2)    /*!< relayed text frames are T.140 */
+
+/*! \brief State of a receive running from a framehook, started by the FSKReceive action or FSKRelay */
+struct fsk_rx_hook {
+	struct fsk_session *session;
+	struct ast_trans_pvt *trans;    /*!< to signed linear, when the read path carries something else */
+	struct ast_format *trans_format;
+	unsigned int flags;
+	char variable[0];               /*!< set to the received data when the receive ends, if not empty */
+};
+
+static void fsk_rx_hook_destroy(void *data)
+{
+	struct fsk_rx_hook *hook = data;
+
+	if (hook->trans) {
+		ast_translator_free_path(hook->trans);
+	}
+	ao2_cleanup(hook->trans_format);
+	ao2_ref(hook->session, -1);
+	ast_free(hook);
+}
+
+/*! \brief Report the end of a background receive, with the channel locked */
+static void fsk_rx_hook_finish(struct ast_channel *chan, struct fsk_rx_hook *hook)
+{
+	receive_buffer_t *in = &hook->session->in;
+
+	if (in->ami) {
+		fsk_ami_end(in);
+		in->ami = NULL;
+	}
+	if (!ast_strlen_zero(hook->variable)) {
+		pbx_builtin_setvar_helper(chan, hook->variable, in->buffer);
+	}
+	fsk_quality_setvars(chan, in);
+	if (hook->flags & FSK_HOOK_RELAY) {
+		fsk_session_carrier_pause(chan, hook->session);
+	}
+	ao2_lock(hook->session);
+	ast_free(in->buffer);
+	in->buffer = NULL;
+	hook->session->rx_hook = -1;
+	fsk_session_slot_release(hook->session);
+	ao2_unlock(hook->session);
+}
+
+/*! \brief Modulate text written to a relaying channel, the held carrier picks it up from the queue */
+static void fsk_relay_write(struct fsk_rx_hook *hook, struct ast_frame *frame)
+{
+	struct fsk_session *session = hook->session;
+	struct fsk_queue_entry *entry;
+	size_t len = frame->datalen;
+
+	/* text frames usually carry their terminator */
+	if (len && !((char *) frame->data.ptr)[len - 1]) {
+		len--;
+	}
+	if (!len || !(entry = fsk_queue_entry_render(frame->data.ptr, len, &fsk_framing_8n1))) {
+		return;
+	}
+	ao2_lock(session);
+	if (session->out.queued < FSK_QUEUE_MAX) {
+		AST_LIST_INSERT_TAIL(&session->out.queue, entry, list);
+		session->out.queued++;
+		entry = NULL;
+	}
+	ao2_unlock(session);
+	if (entry) {
+		ast_log(LOG_WARNING, "FSK relay queue is full, dropping %zu bytes\n", len);
+		ast_free(entry);
+	}
+}
+
+/*! \brief In place of the audio just demodulated, the bytes it carried as a text frame, or nothing */
+static struct ast_frame *fsk_relay_read(struct fsk_rx_hook *hook, struct ast_frame *frame)
+{
+	receive_buffer_t *in = &hook->session->in;
+	struct ast_frame text = {
+		.frametype = AST_FRAME_TEXT,
+		.src = "FSKRelay",
+	};
+
+	ast_frfree(frame);
+	if (!in->ptr) {
+		return &ast_null_frame;
+	}
+	in->buffer[in->ptr] = '\0';
+	text.data.ptr = in->buffer;
+	text.datalen = in->ptr + 1;
+	if (hook->flags & FSK_HOOK_T140) {
+		text.subclass.format = ast_format_t140;
+	}
+	in->ptr = 0;
+	return ast_frdup(&text);
+}
+
+static struct ast_frame *fsk_rx_hook_event(struct ast_channel *chan, struct ast_frame *frame, enum ast_framehook_event event, void *data)
+{
+	struct fsk_rx_hook *hook = data;
+	receive_buffer_t *in = &hook->session->in;
+	struct ast_frame *slin;
+	uint64_t busy;
 
-	if (ast_strlen_zero(data)) {
-		ast_log(LOG_WARNING, "SendFSK requires an argument\n");
+	if (event == AST_FRAMEHOOK_EVENT_DETACHED) {
+		fsk_rx_hook_finish(chan, hook);
+		return frame;
+	}
+	if ((hook->flags & FSK_HOOK_RELAY) && event == AST_FRAMEHOOK_EVENT_WRITE && frame && frame->frametype == AST_FRAME_TEXT) {
+		fsk_relay_write(hook, frame);
+		return &ast_null_frame;
+	}
+	if (event != AST_FRAMEHOOK_EVENT_READ || !frame || frame->frametype != AST_FRAME_VOICE || in->rcv.eof) {
+		return frame;
+	}
+
+	slin = frame;
+	if (ast_format_cmp(frame->subclass.format, ast_format_slin) != AST_FORMAT_CMP_EQUAL) {
+		if (!hook->trans || ast_format_cmp(frame->subclass.format, hook->trans_format) != AST_FORMAT_CMP_EQUAL) {
+			if (hook->trans) {
+				ast_translator_free_path(hook->trans);
+			}
+			ao2_replace(hook->trans_format, frame->subclass.format);
+			hook->trans = ast_translator_build_path(ast_format_slin, frame->subclass.format);
+			if (!hook->trans) {
+				ast_log(LOG_WARNING, "Unable to demodulate %s on %s\n", ast_format_get_name(frame->subclass.format), ast_channel_name(chan));
+				return frame;
+			}
+		}
+		/* the translated frame belongs to the translator, the original goes on untouched */
+		if (!(slin = ast_translate(hook->trans, frame, 0))) {
+			return frame;
+		}
+	}
+	busy = fsk_admission_clock();
+	fsk_receive_feed(hook->session->rx, &in->rcv, slin->data.ptr, slin->samples);
+	ao2_lock(hook->session);
+	fsk_admission_charge(&hook->session->ticket, busy);
+	ao2_unlock(hook->session);
+	if (hook->flags & FSK_HOOK_RELAY) {
+		return fsk_relay_read(hook, frame);
+	}
+	if (in->ami) {
+		fsk_ami_poll(in);
+	}
+	if (in->rcv.eof) {
+		ast_debug(1, "Background FSK receive on %s complete\n", ast_channel_name(chan));
+		ast_framehook_detach(chan, hook->session->rx_hook);
+	}
+	return frame;
+}
+
+/*!
+ * \brief Start demodulating the read path of a channel in the background
+ * \param ticket admission handed to the receive, or one not admitted to admit it at once unless the session holds a slot
+ * \note The channel must not be locked.
+ */
+static int fsk_rx_hook_start(struct ast_channel *chan, struct fsk_profile *profile, unsigned int flags, const char *variable,
+	struct fsk_admission_ticket *ticket, char *error, size_t len)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = fsk_rx_hook_event,
+		.destroy_cb = fsk_rx_hook_destroy,
+		.disable_inheritance = 1,
+	};
+	struct fsk_session *session;
+	struct fsk_rx_hook *hook;
+	receive_buffer_t *in;
+	int id;
+
+	if (!(session = fsk_session_find(chan, 1))) {
+		ast_copy_string(error, "Out of memory", len);
 		return -1;
 	}
-	if (chan == NULL) {
-		ast_log(LOG_ERROR, "SendFSK channel is NULL. Giving up.\n");
+	hook = ast_calloc(1, sizeof(*hook) + strlen(S_OR(variable, "")) + 1);
+	if (!hook) {
+		ao2_ref(session, -1);
+		ast_copy_string(error, "Out of memory", len);
 		return -1;
 	}
+	strcpy(hook->variable, S_OR(variable, "")); /* safe */
+	hook->session = session;
+	hook->flags = flags;
 
-	argcopy = ast_strdupa(data);
-	AST_STANDARD_APP_ARGS(arglist, argcopy);
+	ast_channel_lock(chan);
+	ao2_lock(session);
+	in = &session->in;
+	if (session->rx_hook >= 0 || in->ami || in->buffer || in->sink) {
+		ao2_unlock(session);
+		ast_channel_unlock(chan);
+		fsk_rx_hook_destroy(hook);
+		ast_copy_string(error, "A receive is already running", len);
+		return -1;
+	}
+	if (!ticket->admitted && !session->ticket.admitted && fsk_admission_try(ticket)) {
+		ao2_unlock(session);
+		ast_channel_unlock(chan);
+		fsk_rx_hook_destroy(hook);
+		ast_copy_string(error, "Module at capacity", len);
+		return -1;
+	}
+	fsk_receive_start(&in->rcv, 0, !(flags & (FSK_HOOK_UNTIL_HANGUP | FSK_HOOK_RELAY)));
+	in->ptr = 0;
+	in->size = 65536;
+	in->shm = 0;
+	in->buffer = ast_calloc(1, in->size);
+	if (!in->buffer || fsk_session_rx_prepare(session, profile)) {
+		ast_free(in->buffer);
+		in->buffer = NULL;
+		ao2_unlock(session);
+		ast_channel_unlock(chan);
+		fsk_rx_hook_destroy(hook);
+		ast_copy_string(error, "Unable to start the demodulator", len);
+		return -1;
+	}
+	if (!(flags & FSK_HOOK_RELAY)) {
+		in->ami = chan;
+		in->ami_receive = __atomic_add_fetch(&fsk_ami_receives, 1, __ATOMIC_RELAXED);
+		in->ami_seq = 0;
+		in->ami_len = 0;
+	}
 
-	modem = FSK_BELL103CH1;
-	if (!ast_strlen_zero(arglist.modem)) {
-		if (!strcmp(arglist.modem, "103")) {
-			modem = FSK_BELL103CH1;
-		} else if (!strcmp(arglist.modem, "202")) {
-			modem = FSK_BELL202;
-		} else {
-			ast_log(LOG_WARNING, "Unknown modem protocol: %s\n", arglist.modem);
-			return -1;
-		}
+	interface.data = hook;
+	id = ast_framehook_attach(chan, &interface);
+	if (id < 0) {
+		in->ami = NULL;
+		ast_free(in->buffer);
+		in->buffer = NULL;
+		ao2_unlock(session);
+		ast_channel_unlock(chan);
+		fsk_rx_hook_destroy(hook);
+		ast_copy_string(error, "Unable to attach to the channel", len);
+		return -1;
 	}
+	session->rx_hook = id;
+	fsk_session_slot_adopt(session, ticket);
+	ao2_unlock(session);
+	ast_channel_unlock(chan);
+	return 0;
+}
 
-	ast_debug(1, "Modem channel is '%s'\n", preset_fsk_specs[modem].name);
+/*! \brief Decode the Data header of a manager action as its Encoding header says */
+static int fsk_manager_payload(const struct message *m, unsigned char **data, size_t *len)
+{
+	const char *encoding = astman_get_header(m, "Encoding");
+	const char *value = astman_get_header(m, "Data");
+	size_t max = strlen(value);
+	unsigned int byte;
+	size_t i;
 
-	out = (transmit_buffer_t *) ast_malloc(sizeof(*out));
-	out->buffer = (char *) arglist.data;
-	out->bytes2send = strlen(arglist.data);
-	out->current_bit_no = 0;
-	out->ptr = 0;
-	memset(caller_amp, 0, sizeof(*caller_amp));
-	caller_tx = fsk_tx_init(NULL, &preset_fsk_specs[modem], (get_bit_func_t) &put_bit, out);
-	while (out->ptr < out->bytes2send) {
-		res = ast_waitfor(chan, 1000);
-		fr = ast_read(chan);
-		if (!fr) {
-			ast_debug(1, "Null == hangup() detected\n");
-			res = -1;
-			break;
+	/* room for a CRC trailer */
+	if (!(*data = ast_malloc(max + 3))) {
+		return -1;
+	}
+	if (ast_strlen_zero(encoding) || !strcasecmp(encoding, "text")) {
+		memcpy(*data, value, max);
+		*len = max;
+	} else if (!strcasecmp(encoding, "base64")) {
+		*len = ast_base64decode(*data, value, max);
+	} else if (!strcasecmp(encoding, "hex") && !(max % 2)) {
+		for (i = 0; i < max / 2; i++) {
+			if (sscanf(value + i * 2, "%2x", &byte) != 1) {
+				ast_free(*data);
+				return -1;
+			}
+			(*data)[i] = byte;
 		}
-		if (fr->frametype == AST_FRAME_DTMF) {
-			ast_debug(1, "User pressed a key\n");
+		*len = max / 2;
+	} else {
+		ast_free(*data);
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief The profile named by the Modem header, NULL if there is no such profile */
+static struct fsk_profile *fsk_manager_modem(const struct message *m)
+{
+	return fsk_profile_find(astman_get_header(m, "Modem"));
+}
+
+/*!
+ * \brief Work on one channel of a batch
+ * \param out extra "Header: value\r\n" lines for the result event, or the reason of a failure
+ * \retval 0 on success
+ * \retval -1 on failure
+ */
+typedef int (*fsk_manager_channel_fn)(struct ast_channel *chan, const struct message *m, void *arg, struct ast_str **out);
+
+/*!
+ * \brief Run an action on each channel of its Channel header
+ *
+ * Channel takes a comma separated list, so a single action can drive a
+ * whole batch of channels. The response is an event list with an
+ * FSKChannelResult per channel.
+ */
+static int fsk_manager_batch(struct mansession *s, const struct message *m, const char *action, fsk_manager_channel_fn fn, void *arg)
+{
+	const char *id = astman_get_header(m, "ActionID");
+	char *names = ast_strdupa(astman_get_header(m, "Channel"));
+	char id_text[256] = "";
+	struct ast_str *out;
+	struct ast_channel *chan;
+	char *name;
+	int count = 0;
+	int failed = 0;
+	int res;
+
+	if (ast_strlen_zero(names)) {
+		astman_send_error(s, m, "Channel not specified");
+		return 0;
+	}
+	if (!(out = ast_str_create(256))) {
+		astman_send_error(s, m, "Out of memory");
+		return 0;
+	}
+	if (!ast_strlen_zero(id)) {
+		snprintf(id_text, sizeof(id_text), "ActionID: %s\r\n", id);
+	}
+
+	astman_send_listack(s, m, "Channel results will follow", "start");
+	while ((name = strsep(&names, ","))) {
+		name = ast_strip(name);
+		if (ast_strlen_zero(name)) {
+			continue;
 		}
-		samples = fsk_tx(caller_tx, caller_amp, BLOCK_LEN);
-		if ((res = ast_write(chan, &f)) < 0) {
-			ast_debug(1, "Failed to write %d samples\n", samples);
+		ast_str_reset(out);
+		if (!(chan = ast_channel_get_by_name(name))) {
+			ast_str_set(&out, 0, "Message: No such channel\r\n");
 			res = -1;
-			ast_frfree(fr);
-			break;
+		} else {
+			res = fn(chan, m, arg, &out);
+			ast_channel_unref(chan);
 		}
+		count++;
+		failed += res ? 1 : 0;
+		/*** DOCUMENTATION
+			<managerEvent language="en_US" name="FSKChannelResult">
+				<managerEventInstance class="EVENT_FLAG_CALL">
+					<synopsis>Outcome of an FSK manager action on one of its channels.</synopsis>
+					<syntax>
+						<parameter name="Channel" />
+						<parameter name="Result">
+							<enumlist>
+								<enum name="Success" />
+								<enum name="Error" />
+							</enumlist>
+						</parameter>
+						<parameter name="Message">
+							<para>Why the action failed on this channel.</para>
+						</parameter>
+					</syntax>
+					<see-also>
+						<ref type="manager">FSKSend</ref>
+						<ref type="manager">FSKReceive</ref>
+						<ref type="manager">FSKStatus</ref>
+						<ref type="manager">FSKCancel</ref>
+					</see-also>
+				</managerEventInstance>
+			</managerEvent>
+		***/
+		astman_append(s, "Event: FSKChannelResult\r\n%sChannel: %s\r\nResult: %s\r\n%s\r\n",
+			id_text, name, res ? "Error" : "Success", ast_str_buffer(out));
 	}
-	memset(caller_amp, 0, sizeof(caller_amp));
-	res = ast_waitfor(chan, -1);
-	fr = ast_read(chan);
-	if (fr != NULL) {
-		if (ast_write(chan, &f) < 0) {
-			res = -1;
-			ast_frfree(fr);
-		}
+	astman_send_list_complete_start(s, m, action, count);
+	astman_append(s, "Failed: %d\r\n", failed);
+	astman_send_list_complete_end(s);
+	ast_free(out);
+	return 0;
+}
+
+struct fsk_manager_send {
+	struct fsk_profile *profile;
+	unsigned char *data;
+	size_t len;
+};
+
+static int fsk_manager_send_channel(struct ast_channel *chan, const struct message *m, void *arg, struct ast_str **out)
+{
+	struct fsk_manager_send *send = arg;
+	struct fsk_admission_ticket ticket = { .admitted = 0 };
+	struct fsk_session *session;
+	struct fsk_queue_entry *entry;
+	int busy = 0;
+	int res = -1;
+
+	if (!(entry = fsk_queue_entry_render((const char *) send->data, send->len, &fsk_framing_8n1))) {
+		ast_str_set(out, 0, "Message: Out of memory\r\n");
+		return -1;
+	}
+	if (!(session = fsk_session_find(chan, 1))) {
+		ast_free(entry);
+		ast_str_set(out, 0, "Message: Out of memory\r\n");
+		return -1;
+	}
+	fsk_session_codec(session, chan);
+	ao2_lock(session);
+	/* whoever is already modulating, generator or application, goes on with the queue */
+	busy = session->carrier || fsk_tx_pending(&session->out);
+	if (session->out.queued >= FSK_QUEUE_MAX) {
+		ast_str_set(out, 0, "Message: Queue full\r\n");
+	} else if (busy && session->tx_profile != send->profile) {
+		/* preparing now would restart the modulator under the character in flight */
+		ast_str_set(out, 0, "Message: Channel is sending on modem %s\r\n",
+			session->tx_profile ? session->tx_profile->name : "unknown");
+	} else if (!busy && !session->ticket.admitted && fsk_admission_try(&ticket)) {
+		/* the carrier would run a modem of its own, there is no channel in the dialplan to queue */
+		ast_str_set(out, 0, "Message: Module at capacity\r\n");
+	} else if (!busy && fsk_session_tx_prepare(session, send->profile)) {
+		ast_str_set(out, 0, "Message: Unable to start the modulator\r\n");
 	} else {
-		ast_log(LOG_WARNING, "ast_read returned NULL value.\n");
+		AST_LIST_INSERT_TAIL(&session->out.queue, entry, list);
+		session->out.queued++;
+		session->out.draining = 1;
+		entry = NULL;
+		res = 0;
 	}
-	ast_debug(1, "SendFSK Completed.\n");
+	ao2_unlock(session);
+	if (!res && !busy && fsk_session_carrier_hold(chan, session, &ticket)) {
+		ast_str_set(out, 0, "Message: Unable to start the generator\r\n");
+		res = -1;
+	}
+	fsk_admission_leave(&ticket);
+	ast_free(entry);
+	ao2_ref(session, -1);
+	return res;
+}
+
+static int manager_fsk_send(struct mansession *s, const struct message *m)
+{
+	struct fsk_manager_send send;
+
+	if (!(send.profile = fsk_manager_modem(m))) {
+		astman_send_error(s, m, "Unknown modem");
+		return 0;
+	}
+	if (fsk_manager_payload(m, &send.data, &send.len)) {
+		ao2_ref(send.profile, -1);
+		astman_send_error(s, m, "Invalid Data or Encoding");
+		return 0;
+	}
+	if (!send.len) {
+		ao2_ref(send.profile, -1);
+		ast_free(send.data);
+		astman_send_error(s, m, "Empty Data");
+		return 0;
+	}
+	if (ast_true(astman_get_header(m, "CRC"))) {
+		uint16_t crc = crc_itu16_calc(send.data, send.len, 0xffff) ^ 0xffff;
+
+		send.data[send.len++] = crc & 0xff;
+		send.data[send.len++] = crc >> 8;
+	}
+	fsk_manager_batch(s, m, "FSKSendComplete", fsk_manager_send_channel, &send);
+	ao2_ref(send.profile, -1);
+	ast_free(send.data);
 	return 0;
 }
 
-static int fskRX_exec(struct ast_channel *chan, const char *data) { /* ReceiveFSK */
-	fsk_rx_state_t *caller_rx;
-	receive_buffer_t *in;
-	char *argcopy = NULL;
-	struct ast_frame *f;
+static int fsk_manager_receive_channel(struct ast_channel *chan, const struct message *m, void *arg, struct ast_str **out)
+{
+	struct fsk_admission_ticket ticket = { .admitted = 0 };
+	char error[64];
+	int res;
+
+	res = fsk_rx_hook_start(chan, arg, ast_true(astman_get_header(m, "UntilHangup")) ? FSK_HOOK_UNTIL_HANGUP : 0,
+		astman_get_header(m, "Variable"), &ticket, error, sizeof(error));
+	fsk_admission_leave(&ticket);
+	if (res) {
+		ast_str_set(out, 0, "Message: %s\r\n", error);
+		return -1;
+	}
+	return 0;
+}
+
+static int manager_fsk_receive(struct mansession *s, const struct message *m)
+{
+	struct fsk_profile *profile;
+	int res;
+
+	if (!(profile = fsk_manager_modem(m))) {
+		astman_send_error(s, m, "Unknown modem");
+		return 0;
+	}
+	res = fsk_manager_batch(s, m, "FSKReceiveComplete", fsk_manager_receive_channel, profile);
+	ao2_ref(profile, -1);
+	return res;
+}
+
+static int fsk_manager_status_channel(struct ast_channel *chan, const struct message *m, void *arg, struct ast_str **out)
+{
+	struct fsk_session *session;
+	char quality[256];
+
+	if (!(session = fsk_session_find(chan, 0))) {
+		ast_str_set(out, 0, "Sending: No\r\nQueued: 0\r\nCarrierHeld: No\r\nReceiving: No\r\n");
+		return 0;
+	}
+	ao2_lock(session);
+	ast_str_set(out, 0, "Sending: %s\r\nQueued: %d\r\nCarrierHeld: %s\r\nReceiving: %s\r\n",
+		AST_YESNO(fsk_tx_pending(&session->out)), session->out.queued, AST_YESNO(session->carrier),
+		AST_YESNO(session->rx_hook >= 0 || session->in.buffer || session->in.sink));
+	if (session->rx_hook >= 0 || session->in.buffer || session->in.sink) {
+		fsk_quality_headers(&session->in, quality, sizeof(quality));
+		ast_str_append(out, 0, "Carrier: %s\r\nBytesReceived: %d\r\n%s", session->in.rcv.carrier ? "Up" : "Down",
+			session->in.rcv.received, quality);
+	}
+	ao2_unlock(session);
+	ao2_ref(session, -1);
+	return 0;
+}
+
+static int manager_fsk_status(struct mansession *s, const struct message *m)
+{
+	return fsk_manager_batch(s, m, "FSKStatusComplete", fsk_manager_status_channel, NULL);
+}
+
+static int fsk_manager_cancel_channel(struct ast_channel *chan, const struct message *m, void *arg, struct ast_str **out)
+{
+	const char *direction = astman_get_header(m, "Direction");
+	int send = ast_strlen_zero(direction) || !strcasecmp(direction, "both") || !strcasecmp(direction, "send");
+	int receive = ast_strlen_zero(direction) || !strcasecmp(direction, "both") || !strcasecmp(direction, "receive");
+	struct fsk_session *session;
+	struct fsk_queue_entry *entry;
+	int hooked;
+
+	if (!(session = fsk_session_find(chan, 0))) {
+		ast_str_set(out, 0, "Message: Nothing to cancel\r\n");
+		return -1;
+	}
+	if (send) {
+		ao2_lock(session);
+		while ((entry = AST_LIST_REMOVE_HEAD(&session->out.queue, list))) {
+			ast_free(entry);
+		}
+		session->out.queued = 0;
+		ast_free(session->out.framed);
+		session->out.framed = NULL;
+		/* a running SendFSK sees nothing left to send and returns */
+		session->out.bytes2send = session->out.ptr;
+		session->out.crc = 0;
+		session->out.draining = 0;
+		ao2_unlock(session);
+		fsk_session_carrier_pause(chan, session);
+	}
+	if (receive) {
+		ast_channel_lock(chan);
+		if ((hooked = session->rx_hook >= 0)) {
+			ast_framehook_detach(chan, session->rx_hook);
+		}
+		ast_channel_unlock(chan);
+		if (!hooked) {
+			/* a running ReceiveFSK returns with what it has got so far */
+			ao2_lock(session);
+			session->in.rcv.eof = 1;
+			ao2_unlock(session);
+		}
+	}
+	ao2_ref(session, -1);
+	return 0;
+}
+
+static int manager_fsk_cancel(struct mansession *s, const struct message *m)
+{
+	return fsk_manager_batch(s, m, "FSKCancelComplete", fsk_manager_cancel_channel, NULL);
+}
+
+static int fskRelay_exec(struct ast_channel *chan, const char *data) { /* FSKRelay */
+	struct fsk_session *session;
+	struct fsk_admission_ticket ticket;
 	struct ast_flags flags = {0};
-	struct ast_silence_generator *silgen = NULL;
-	int16_t output_frame[BLOCK_LEN];
-	int modem;
-	int silence_flag = 0;
-	int res = 0;
+	char error[64];
+	char *argcopy;
+	struct fsk_profile *profile;
+	int res;
 
 	AST_DECLARE_APP_ARGS(arglist,
-		AST_APP_ARG(variable);
 		AST_APP_ARG(modem);
 		AST_APP_ARG(options);
 	);
 
-	argcopy = ast_strdupa(data);
+	argcopy = ast_strdupa(S_OR(data, ""));
 	AST_STANDARD_APP_ARGS(arglist, argcopy);
-	if (ast_strlen_zero(data)) {
-		ast_log(LOG_WARNING, "ReceiveFSK requires at least a variable as argument\n");
-		return -1;
-	}
-	if (chan == NULL)          {
-		ast_log(LOG_ERROR, "ReceiveFSK channel is NULL. Giving up.\n");
-		return -1;
-	}
-	if (ast_channel_state(chan) != AST_STATE_UP) { /* answer channel if unanswered */
-		res = ast_answer(chan);
-		if (res) {
-			ast_log(LOG_WARNING, "Failed to answer channel\n");
-			return -1;
-		}
+	if (!ast_strlen_zero(arglist.options)) {
+		ast_app_parse_options(relay_app_options, &flags, NULL, arglist.options);
 	}
 
-	modem = FSK_BELL103CH2;
-	if (!ast_strlen_zero(arglist.modem)) {
-		if (!strcmp(arglist.modem, "103")) {
-			modem = FSK_BELL103CH2;
-		} else if (!strcmp(arglist.modem, "202")) {
-			modem = FSK_BELL202;
-		} else {
-			ast_log(LOG_WARNING, "Unknown modem protocol: %s\n", arglist.modem);
-			return -1;
+	if (ast_test_flag(&flags, OPT_RELAY_STOP)) {
+		if ((session = fsk_session_find(chan, 0))) {
+			ast_channel_lock(chan);
+			if (session->rx_hook >= 0) {
+				ast_framehook_detach(chan, session->rx_hook);
+			}
+			ast_channel_unlock(chan);
+			ao2_ref(session, -1);
 		}
+		return 0;
 	}
 
-	pbx_builtin_setvar_helper(chan, arglist.variable, ""); /* initialize variable */
-	ast_debug(1, "Modem channel is '%s'\n", preset_fsk_specs[modem].name);
-	if ((res = ast_set_read_format(chan, ast_format_slin)) < 0) {
-		ast_log(LOG_WARNING, "Unable to set channel to linear mode, giving up\n");
+	if (!(profile = fsk_profile_find(arglist.modem))) {
+		return -1;
+	}
+	/* the slot goes to the receive and the carrier, which both run on once FSKRelay returns */
+	if ((res = fsk_session_admission_enter(chan, &ticket))) {
+		ao2_ref(profile, -1);
+		return res < 0 ? -1 : 0;
+	}
+	if (fsk_rx_hook_start(chan, profile, FSK_HOOK_RELAY | (ast_test_flag(&flags, OPT_RELAY_T140) ? FSK_HOOK_T140 : 0),
+		NULL, &ticket, error, sizeof(error))) {
+		ast_log(LOG_WARNING, "Unable to start FSK relay on %s: %s\n", ast_channel_name(chan), error);
+		fsk_admission_leave(&ticket);
+		ao2_ref(profile, -1);
+		return -1;
+	}
+	if (!(session = fsk_session_find(chan, 0))) {
+		ao2_ref(profile, -1);
 		return -1;
 	}
+	/* text from the peer is modulated by the held carrier as it is queued */
+	fsk_session_carrier_pause(chan, session);
+	fsk_session_codec(session, chan);
+	ao2_lock(session);
+	res = fsk_session_tx_prepare(session, profile);
+	session->out.draining = 1;
+	ao2_unlock(session);
+	ao2_ref(profile, -1);
+	if (!res) {
+		res = fsk_session_carrier_hold(chan, session, NULL);
+	}
+	ao2_ref(session, -1);
+	return res;
+}
 
-	memset(output_frame, 0, sizeof(output_frame));
-	in = (receive_buffer_t *) ast_malloc(sizeof(*in));
+static int load_config(int reload)
+{
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct fsk_spool_config cfg = {
+		.enabled = 0,
+		.commit_interval = 10,
+		.segment_size = 64 * 1024 * 1024,
+		.retention_segments = 16,
+		.retention_days = 0,
+	};
+	struct fsk_outbound_config ocfg = {
+		.enabled = 0,
+		.workers = 4,
+		.scan_interval = 1000,
+		.trunk_limit = 0,
+	};
+	struct fsk_ami_config ami = {
+		.window = 100,
+		.bytes = 64,
+	};
+	struct fsk_recorder_config rcfg = {
+		.enabled = 0,
+		.seconds = 10,
+	};
+	struct fsk_admission_config acfg = {
+		.max_sessions = 0,
+		.cpu_budget = 0,
+		.session_cost = 1.0,
+		.queue_timeout = 0,
+	};
+	struct fsk_agc_config agc = {
+		.enabled = 0,
+	};
+	struct fsk_outbound_trunk *trunk;
+	struct ast_config *config;
+	struct ast_variable *var;
+	unsigned int limit;
+	int restart;
 
-	if (!ast_strlen_zero(arglist.options)) {
-		ast_debug(1, "This instance has flags\n");
-		ast_app_parse_options(read_app_options, &flags, NULL, arglist.options);
-		if (ast_test_flag(&flags, OPT_HANGOUT )) {
-			in->quitoncarrierlost = 0;
+	snprintf(cfg.directory, sizeof(cfg.directory), "%s/fsk", ast_config_AST_SPOOL_DIR);
+	snprintf(ocfg.directory, sizeof(ocfg.directory), "%s/fsk-outgoing", ast_config_AST_SPOOL_DIR);
+	snprintf(rcfg.directory, sizeof(rcfg.directory), "%s/fsk-recorder", ast_config_AST_SPOOL_DIR);
+	fsk_agc_params_default(&agc.params);
+
+	config = ast_config_load(fsk_config_file, config_flags);
+	if (config == CONFIG_STATUS_FILEUNCHANGED) {
+		return 0;
+	}
+	if (config == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Config file %s is in an invalid format, not loading\n", fsk_config_file);
+		return -1;
+	}
+	if (config) {
+		for (var = ast_variable_browse(config, "spool"); var; var = var->next) {
+			if (!strcasecmp(var->name, "enabled")) {
+				cfg.enabled = ast_true(var->value);
+			} else if (!strcasecmp(var->name, "directory")) {
+				ast_copy_string(cfg.directory, var->value, sizeof(cfg.directory));
+			} else if (!strcasecmp(var->name, "commit_interval")) {
+				if (sscanf(var->value, "%30u", &cfg.commit_interval) != 1 || cfg.commit_interval > 1000) {
+					ast_log(LOG_WARNING, "Invalid commit_interval '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					cfg.commit_interval = 10;
+				}
+			} else if (!strcasecmp(var->name, "segment_size")) {
+				if (sscanf(var->value, "%30zu", &cfg.segment_size) != 1 || cfg.segment_size < 4096) {
+					ast_log(LOG_WARNING, "Invalid segment_size '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					cfg.segment_size = 64 * 1024 * 1024;
+				}
+			} else if (!strcasecmp(var->name, "retention_segments")) {
+				sscanf(var->value, "%30u", &cfg.retention_segments);
+			} else if (!strcasecmp(var->name, "retention_days")) {
+				sscanf(var->value, "%30u", &cfg.retention_days);
+			} else {
+				ast_log(LOG_WARNING, "Unknown option '%s' in [spool] at line %d of %s\n", var->name, var->lineno, fsk_config_file);
+			}
 		}
-		if (ast_test_flag(&flags, OPT_SILENCE )) {
-			silence_flag = 1;
+		for (var = ast_variable_browse(config, "ami"); var; var = var->next) {
+			if (!strcasecmp(var->name, "window")) {
+				if (sscanf(var->value, "%30u", &ami.window) != 1) {
+					ast_log(LOG_WARNING, "Invalid window '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					ami.window = 100;
+				}
+			} else if (!strcasecmp(var->name, "bytes")) {
+				if (sscanf(var->value, "%30u", &ami.bytes) != 1 || !ami.bytes || ami.bytes > FSK_AMI_BATCH_MAX) {
+					ast_log(LOG_WARNING, "Invalid bytes '%s' at line %d of %s, must be 1 to %d\n", var->value, var->lineno, fsk_config_file, FSK_AMI_BATCH_MAX);
+					ami.bytes = 64;
+				}
+			} else if (!strcasecmp(var->name, "encoding")) {
+				if (!strcasecmp(var->value, "base64")) {
+					ami.base64 = 1;
+				} else if (!strcasecmp(var->value, "hex")) {
+					ami.base64 = 0;
+				} else {
+					ast_log(LOG_WARNING, "Invalid encoding '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+				}
+			} else {
+				ast_log(LOG_WARNING, "Unknown option '%s' in [ami] at line %d of %s\n", var->name, var->lineno, fsk_config_file);
+			}
+		}
+		for (var = ast_variable_browse(config, "recorder"); var; var = var->next) {
+			if (!strcasecmp(var->name, "enabled")) {
+				rcfg.enabled = ast_true(var->value);
+			} else if (!strcasecmp(var->name, "seconds")) {
+				if (sscanf(var->value, "%30u", &rcfg.seconds) != 1 || !rcfg.seconds || rcfg.seconds > 300) {
+					ast_log(LOG_WARNING, "Invalid seconds '%s' at line %d of %s, must be 1 to 300\n", var->value, var->lineno, fsk_config_file);
+					rcfg.seconds = 10;
+				}
+			} else if (!strcasecmp(var->name, "directory")) {
+				ast_copy_string(rcfg.directory, var->value, sizeof(rcfg.directory));
+			} else {
+				ast_log(LOG_WARNING, "Unknown option '%s' in [recorder] at line %d of %s\n", var->name, var->lineno, fsk_config_file);
+			}
+		}
+		for (var = ast_variable_browse(config, "admission"); var; var = var->next) {
+			if (!strcasecmp(var->name, "max_sessions")) {
+				if (sscanf(var->value, "%30u", &acfg.max_sessions) != 1) {
+					ast_log(LOG_WARNING, "Invalid max_sessions '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					acfg.max_sessions = 0;
+				}
+			} else if (!strcasecmp(var->name, "cpu_budget")) {
+				if (sscanf(var->value, "%30lf", &acfg.cpu_budget) != 1 || acfg.cpu_budget < 0) {
+					ast_log(LOG_WARNING, "Invalid cpu_budget '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					acfg.cpu_budget = 0;
+				}
+			} else if (!strcasecmp(var->name, "session_cost")) {
+				if (sscanf(var->value, "%30lf", &acfg.session_cost) != 1 || acfg.session_cost <= 0) {
+					ast_log(LOG_WARNING, "Invalid session_cost '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					acfg.session_cost = 1.0;
+				}
+			} else if (!strcasecmp(var->name, "queue_timeout")) {
+				if (sscanf(var->value, "%30u", &acfg.queue_timeout) != 1) {
+					ast_log(LOG_WARNING, "Invalid queue_timeout '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					acfg.queue_timeout = 0;
+				}
+			} else if (!strcasecmp(var->name, "musicclass")) {
+				ast_copy_string(acfg.musicclass, var->value, sizeof(acfg.musicclass));
+			} else {
+				ast_log(LOG_WARNING, "Unknown option '%s' in [admission] at line %d of %s\n", var->name, var->lineno, fsk_config_file);
+			}
+		}
+		for (var = ast_variable_browse(config, "agc"); var; var = var->next) {
+			if (!strcasecmp(var->name, "enabled")) {
+				agc.enabled = ast_true(var->value);
+			} else if (!strcasecmp(var->name, "dc")) {
+				agc.params.dc = ast_true(var->value);
+			} else if (!strcasecmp(var->name, "target")) {
+				if (sscanf(var->value, "%30f", &agc.params.target) != 1 || agc.params.target > 0 || agc.params.target < -40) {
+					ast_log(LOG_WARNING, "Invalid target '%s' at line %d of %s, must be -40 to 0 dBm0\n", var->value, var->lineno, fsk_config_file);
+					agc.params.target = -14;
+				}
+			} else if (!strcasecmp(var->name, "max_gain")) {
+				if (sscanf(var->value, "%30f", &agc.params.max_gain) != 1 || agc.params.max_gain < 0 || agc.params.max_gain > 60) {
+					ast_log(LOG_WARNING, "Invalid max_gain '%s' at line %d of %s, must be 0 to 60 dB\n", var->value, var->lineno, fsk_config_file);
+					agc.params.max_gain = 40;
+				}
+			} else if (!strcasecmp(var->name, "attack")) {
+				if (sscanf(var->value, "%30f", &agc.params.attack_ms) != 1 || agc.params.attack_ms < 0) {
+					ast_log(LOG_WARNING, "Invalid attack '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					agc.params.attack_ms = 5;
+				}
+			} else if (!strcasecmp(var->name, "decay")) {
+				if (sscanf(var->value, "%30f", &agc.params.decay_ms) != 1 || agc.params.decay_ms < 0) {
+					ast_log(LOG_WARNING, "Invalid decay '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					agc.params.decay_ms = 500;
+				}
+			} else if (!strcasecmp(var->name, "margin")) {
+				if (sscanf(var->value, "%30f", &agc.params.margin) != 1 || agc.params.margin < 3) {
+					ast_log(LOG_WARNING, "Invalid margin '%s' at line %d of %s, must be at least 3 dB\n", var->value, var->lineno, fsk_config_file);
+					agc.params.margin = 9;
+				}
+			} else if (!strcasecmp(var->name, "floor")) {
+				if (sscanf(var->value, "%30f", &agc.params.floor) != 1 || agc.params.floor > 0) {
+					ast_log(LOG_WARNING, "Invalid floor '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					agc.params.floor = -48;
+				}
+			} else {
+				ast_log(LOG_WARNING, "Unknown option '%s' in [agc] at line %d of %s\n", var->name, var->lineno, fsk_config_file);
+			}
+		}
+		for (var = ast_variable_browse(config, "outbound"); var; var = var->next) {
+			if (!strcasecmp(var->name, "enabled")) {
+				ocfg.enabled = ast_true(var->value);
+			} else if (!strcasecmp(var->name, "directory")) {
+				ast_copy_string(ocfg.directory, var->value, sizeof(ocfg.directory));
+			} else if (!strcasecmp(var->name, "workers")) {
+				if (sscanf(var->value, "%30u", &ocfg.workers) != 1 || !ocfg.workers || ocfg.workers > 1024) {
+					ast_log(LOG_WARNING, "Invalid workers '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					ocfg.workers = 4;
+				}
+			} else if (!strcasecmp(var->name, "scan_interval")) {
+				if (sscanf(var->value, "%30u", &ocfg.scan_interval) != 1 || ocfg.scan_interval < 10) {
+					ast_log(LOG_WARNING, "Invalid scan_interval '%s' at line %d of %s\n", var->value, var->lineno, fsk_config_file);
+					ocfg.scan_interval = 1000;
+				}
+			} else if (!strcasecmp(var->name, "trunk_limit")) {
+				sscanf(var->value, "%30u", &ocfg.trunk_limit);
+			} else {
+				ast_log(LOG_WARNING, "Unknown option '%s' in [outbound] at line %d of %s\n", var->name, var->lineno, fsk_config_file);
+			}
 		}
 	}
 
-	in->FSK_eof = 0;
-	in->quitoncarrierlost = 1;
+	ast_rwlock_wrlock(&fsk_ami_lock);
+	fsk_ami_cfg = ami;
+	ast_rwlock_unlock(&fsk_ami_lock);
+	/* receives already running keep the AGC they started with */
+	ast_rwlock_wrlock(&fsk_agc_lock);
+	fsk_agc_cfg = agc;
+	ast_rwlock_unlock(&fsk_agc_lock);
 
-	in->buffer = (char *) ast_malloc(65536);
-	memset(in->buffer, 0, 65536); /* Reserve 64KB space for receive buffer and set to 0 its pointer. */
-	in->ptr = 0;
-	ast_debug(1, "output buffer allocated\n");
+	ast_rwlock_wrlock(&fsk_recorder_lock);
+	fsk_recorder_cfg = rcfg;
+	ast_rwlock_unlock(&fsk_recorder_lock);
 
-	if (silence_flag) {
-		silgen = ast_channel_start_silence_generator(chan);
+	ast_mutex_lock(&admission.lock);
+	/* what was learned stays, unless the starting estimate itself changed */
+	if (!admission.session_cost || acfg.session_cost != admission.cfg.session_cost) {
+		admission.session_cost = acfg.session_cost;
 	}
-	caller_rx = fsk_rx_init(NULL, &preset_fsk_specs[modem], FSK_FRAME_MODE_8N1_FRAMES, get_bit, in);
-	fsk_rx_set_modem_status_handler(caller_rx, rx_status, (void *) in);
-	while (ast_waitfor(chan, -1) > -1) {
-		f = ast_read(chan);
-		if (!f) {
-			res = -1;
-			break;
-		}
-		if (f->frametype == AST_FRAME_VOICE){
-			fsk_rx(caller_rx, f->data.ptr, f->samples);
-		}
-		if (in->FSK_eof != 0) {
-			ast_log(LOG_NOTICE, "FSK_eof\n");
-			break;
-		}
-		f->subclass.format = ast_format_slin;
-		f->datalen = BLOCK_LEN;
-		f->samples = BLOCK_LEN / 2;
-		f->offset = AST_FRIENDLY_OFFSET;
-		f->src = __PRETTY_FUNCTION__;
-		f->data.ptr = &output_frame;
-		if (ast_write(chan, f) < 0) {
-			res = -1;
-			ast_frfree(f);
-			break;
+	admission.cfg = acfg;
+	ast_mutex_unlock(&admission.lock);
+
+	ast_mutex_lock(&outbound.lock);
+	restart = outbound.running && (!ocfg.enabled || strcmp(ocfg.directory, outbound.cfg.directory));
+	outbound.cfg = ocfg;
+	/* more workers start now, the extra ones leave as their calls end */
+	if (outbound.running && !restart) {
+		fsk_outbound_spawn();
+	}
+	AST_LIST_TRAVERSE(&outbound.trunks, trunk, list) {
+		trunk->limit = ocfg.trunk_limit;
+	}
+	for (var = config ? ast_variable_browse(config, "trunks") : NULL; var; var = var->next) {
+		if (sscanf(var->value, "%30u", &limit) != 1) {
+			ast_log(LOG_WARNING, "Invalid limit '%s' for trunk '%s' at line %d of %s\n", var->value, var->name, var->lineno, fsk_config_file);
+		} else if ((trunk = fsk_outbound_trunk_get(var->name))) {
+			trunk->limit = limit;
 		}
-		ast_frfree(f);
 	}
-	if (!f) {
-		ast_debug(1, "Got hangup\n");
-		res = -1;
+	/* raised limits may let waiting jobs go */
+	ast_cond_broadcast(&outbound.cond);
+	ast_mutex_unlock(&outbound.lock);
+	fsk_keyring_load(config);
+	fsk_shapings_load(config);
+	fsk_profiles_load(config);
+	fsk_ladders_load(config);
+	if (config) {
+		ast_config_destroy(config);
 	}
-	ast_debug(1, "received buffer is: %s\n", in->buffer);
-	pbx_builtin_setvar_helper(chan, arglist.variable, in->buffer);
-	ast_free(in->buffer);
-	if (silgen) {
-		ast_channel_stop_silence_generator(chan, silgen);
+	if (restart) {
+		fsk_outbound_stop();
+	}
+	fsk_outbound_start();
+
+	ast_mutex_lock(&spool.lock);
+	restart = spool.running && !cfg.enabled;
+	if (strcmp(cfg.directory, spool.cfg.directory)) {
+		spool.rotate = 1;
+	}
+	spool.cfg = cfg;
+	ast_mutex_unlock(&spool.lock);
+
+	if (restart) {
+		fsk_spool_stop();
 	}
-	ast_free(in);
+	fsk_spool_start();
 	return 0;
 }
 
+#ifdef TEST_FRAMEWORK
+AST_TEST_DEFINE(fsk_sink_no_peer)
+{
+	char path[64];
+	struct fsk_sink *sink;
+	unsigned int attempts;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "sink_no_peer";
+		info->category = "/apps/app_fsk/";
+		info->summary = "Sink writer waits for a peer that is not there";
+		info->description = "Keeps a socket sink nobody listens on open with more than a batch buffered, "
+			"and checks that its writer backs off instead of retrying the connect in a loop.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	snprintf(path, sizeof(path), "/tmp/fsk-test-%ld.sock", (long) getpid());
+	unlink(path);
+	if (!(sink = fsk_sink_alloc(path, 1))) {
+		ast_test_status_update(test, "Unable to start the sink\n");
+		return AST_TEST_FAIL;
+	}
+	for (i = 0; i < 2 * FSK_SINK_BATCH; i++) {
+		fsk_sink_put(sink, i);
+	}
+	/* tries at 200, 400, 800 ms and so on, a few in 2 s where a spinning writer makes millions */
+	usleep(2000 * 1000);
+	attempts = __atomic_load_n(&sink->attempts, __ATOMIC_RELAXED);
+	fsk_sink_close(sink);
+	ast_test_status_update(test, "%u tries at connecting in 2 s\n", attempts);
+	return attempts <= 2000 / FSK_SINK_FLUSH_MS + 1 ? AST_TEST_PASS : AST_TEST_FAIL;
+}
+#endif
+
 static int unload_module(void) {
+	struct fsk_outbound_trunk *trunk;
 	int res;
 
 	res = ast_unregister_application(app_fskTX);
 	res |= ast_unregister_application(app_fskRX);
+	res |= ast_unregister_application(app_fskTXQueue);
+	res |= ast_unregister_application(app_cidfsk);
+	res |= ast_unregister_application(app_smsTX);
+	res |= ast_unregister_application(app_smsRX);
+	res |= ast_unregister_application(app_relay);
+	res |= ast_custom_function_unregister(&fsk_queue_function);
+	res |= ast_custom_function_unregister(&fsk_admission_function);
+	res |= ast_manager_unregister("FSKSend");
+	res |= ast_manager_unregister("FSKReceive");
+	res |= ast_manager_unregister("FSKStatus");
+	res |= ast_manager_unregister("FSKCancel");
+	res |= ast_manager_unregister("FSKAdmission");
+	ast_cli_unregister_multiple(fsk_cli, ARRAY_LEN(fsk_cli));
+	AST_TEST_UNREGISTER(fsk_sink_no_peer);
+	fsk_outbound_stop();
+	while ((trunk = AST_LIST_REMOVE_HEAD(&outbound.trunks, list))) {
+		ast_free(trunk);
+	}
+	ao2_cleanup(outbound_jobs);
+	ao2_cleanup(outbound_payloads);
+	ast_cond_destroy(&outbound.cond);
+	ast_mutex_destroy(&outbound.lock);
+	fsk_spool_stop();
+	/* sinks and sources of ended sessions may still be flushing */
+	fsk_threads_join();
+	fsk_cid_unload();
+	fsk_profiles_destroy();
+	OPENSSL_cleanse(fsk_keyring, sizeof(fsk_keyring));
+	ast_cond_destroy(&spool.done);
+	ast_cond_destroy(&spool.work);
+	ast_mutex_destroy(&spool.lock);
+	ast_mutex_destroy(&admission.lock);
+	fsk_shm_destroy();
 
 	return res;
 }
@@ -440,10 +8274,56 @@ static int unload_module(void) {
 static int load_module(void) {
 	int res;
 
+	ast_mutex_init(&spool.lock);
+	ast_cond_init(&spool.work, NULL);
+	ast_cond_init(&spool.done, NULL);
+	ast_mutex_init(&outbound.lock);
+	ast_cond_init(&outbound.cond, NULL);
+	ast_mutex_init(&admission.lock);
+	admission.sampled = ast_tvnow();
+	outbound_jobs = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 61,
+		fsk_outbound_job_hash, NULL, fsk_outbound_job_cmp);
+	outbound_payloads = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 61,
+		fsk_outbound_payload_hash, NULL, fsk_outbound_payload_cmp);
+	if (!outbound_jobs || !outbound_payloads || fsk_profiles_init() || fsk_cid_load() || load_config(0)) {
+		fsk_cid_unload();
+		fsk_profiles_destroy();
+		ao2_cleanup(outbound_jobs);
+		ao2_cleanup(outbound_payloads);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (fsk_shm_create()) {
+		ast_log(LOG_NOTICE, "Shared-memory export of received data is not available\n");
+	}
+
 	res = ast_register_application_xml(app_fskTX, fskTX_exec);
 	res |= ast_register_application_xml(app_fskRX, fskRX_exec);
+	res |= ast_register_application_xml(app_fskTXQueue, fskTXQueue_exec);
+	res |= ast_register_application_xml(app_cidfsk, fskCidT2_exec);
+	res |= ast_register_application_xml(app_smsTX, fskSMSTX_exec);
+	res |= ast_register_application_xml(app_smsRX, fskSMSRX_exec);
+	res |= ast_register_application_xml(app_relay, fskRelay_exec);
+	res |= ast_custom_function_register(&fsk_queue_function);
+	res |= ast_custom_function_register(&fsk_admission_function);
+	res |= ast_cli_register_multiple(fsk_cli, ARRAY_LEN(fsk_cli));
+	res |= ast_manager_register_xml("FSKSend", EVENT_FLAG_CALL, manager_fsk_send);
+	res |= ast_manager_register_xml("FSKReceive", EVENT_FLAG_CALL, manager_fsk_receive);
+	res |= ast_manager_register_xml("FSKStatus", EVENT_FLAG_CALL, manager_fsk_status);
+	res |= ast_manager_register_xml("FSKCancel", EVENT_FLAG_CALL, manager_fsk_cancel);
+	res |= ast_manager_register_xml("FSKAdmission", EVENT_FLAG_REPORTING, manager_fsk_admission);
+	AST_TEST_REGISTER(fsk_sink_no_peer);
 
 	return res;
 }
 
-AST_MODULE_INFO_STANDARD_EXTENDED(ASTERISK_GPL_KEY, "FSK utility application");
+static int reload_module(void)
+{
+	return load_config(1);
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "FSK utility application",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+);
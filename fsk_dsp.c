@@ -0,0 +1,687 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Signal processing core of app_fsk, see fsk_dsp.h
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "fsk_dsp.h"
+
+/* Power of a full scale sine in dBm0, G.711 */
+#define FSK_DBM0_MAX_SINE   3.14f
+
+/* Samples each kernel renders per calibration round, and rounds timed of which the best counts */
+#define FSK_TUNE_SAMPLES    16000
+#define FSK_TUNE_ROUNDS     5
+
+static void fsk_render_scalar(const int32_t *sine, int16_t *amp, int len, uint32_t *phase, uint32_t rate)
+{
+	uint32_t p = *phase;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		amp[i] = sine[p >> (32 - FSK_SINE_BITS)];
+		p += rate;
+	}
+	*phase = p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* SSE2 has no gather, the phases are stepped four at a time and the table read per lane */
+__attribute__((target("sse2")))
+static void fsk_render_sse2(const int32_t *sine, int16_t *amp, int len, uint32_t *phase, uint32_t rate)
+{
+	__m128i p = _mm_add_epi32(_mm_set1_epi32(*phase), _mm_set_epi32(rate * 3, rate * 2, rate, 0));
+	__m128i step = _mm_set1_epi32(rate * 4);
+	uint32_t idx[4] __attribute__((aligned(16)));
+	int i = 0;
+
+	for (; i + 4 <= len; i += 4) {
+		_mm_store_si128((__m128i *) idx, _mm_srli_epi32(p, 32 - FSK_SINE_BITS));
+		amp[i] = sine[idx[0]];
+		amp[i + 1] = sine[idx[1]];
+		amp[i + 2] = sine[idx[2]];
+		amp[i + 3] = sine[idx[3]];
+		p = _mm_add_epi32(p, step);
+	}
+	*phase += rate * i;
+	fsk_render_scalar(sine, amp + i, len - i, phase, rate);
+}
+
+__attribute__((target("avx2")))
+static void fsk_render_avx2(const int32_t *sine, int16_t *amp, int len, uint32_t *phase, uint32_t rate)
+{
+	__m256i p = _mm256_add_epi32(_mm256_set1_epi32(*phase),
+		_mm256_mullo_epi32(_mm256_set1_epi32(rate), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	__m256i step = _mm256_set1_epi32(rate * 8);
+	__m256i s;
+	int i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		s = _mm256_i32gather_epi32((const int *) sine, _mm256_srli_epi32(p, 32 - FSK_SINE_BITS), 4);
+		_mm_storeu_si128((__m128i *) (amp + i), _mm_packs_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1)));
+		p = _mm256_add_epi32(p, step);
+	}
+	*phase += rate * i;
+	fsk_render_scalar(sine, amp + i, len - i, phase, rate);
+}
+
+__attribute__((target("avx512f")))
+static void fsk_render_avx512(const int32_t *sine, int16_t *amp, int len, uint32_t *phase, uint32_t rate)
+{
+	__m512i p = _mm512_add_epi32(_mm512_set1_epi32(*phase),
+		_mm512_mullo_epi32(_mm512_set1_epi32(rate), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+	__m512i step = _mm512_set1_epi32(rate * 16);
+	__m512i s;
+	int i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		s = _mm512_i32gather_epi32(_mm512_srli_epi32(p, 32 - FSK_SINE_BITS), (const int *) sine, 4);
+		_mm256_storeu_si256((__m256i *) (amp + i), _mm512_cvtepi32_epi16(s));
+		p = _mm512_add_epi32(p, step);
+	}
+	*phase += rate * i;
+	fsk_render_scalar(sine, amp + i, len - i, phase, rate);
+}
+
+static int fsk_cpu_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int fsk_cpu_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int fsk_cpu_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+const struct fsk_kernel fsk_kernels[] = {
+	{ "scalar", fsk_render_scalar, NULL },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse2", fsk_render_sse2, fsk_cpu_sse2 },
+	{ "avx2", fsk_render_avx2, fsk_cpu_avx2 },
+	{ "avx512", fsk_render_avx512, fsk_cpu_avx512 },
+#endif
+};
+
+const int fsk_kernel_count = sizeof(fsk_kernels) / sizeof(fsk_kernels[0]);
+
+void fsk_framing_init(struct fsk_framing *framing, int data_bits, int stop_bits)
+{
+	int byte;
+
+	framing->data_bits = data_bits;
+	framing->stop_bits = stop_bits;
+	framing->bits = 1 + data_bits + stop_bits;
+	for (byte = 0; byte < 256; byte++) {
+		/* start bit is a zero, stop bits are ones */
+		framing->frame[byte] = ((byte & ((1 << data_bits) - 1)) << 1) | (((1 << stop_bits) - 1) << (1 + data_bits));
+	}
+}
+
+void fsk_mod_params_init(struct fsk_mod_params *params, int space_hz, int mark_hz, int level_dbm0, int baud_rate)
+{
+	float scale = 32767.0f * powf(10.0f, (level_dbm0 - FSK_DBM0_MAX_SINE) / 20.0f);
+	int i;
+
+	params->phase_rate[0] = (uint32_t) lrint(space_hz * 4294967296.0 / FSK_DSP_SAMPLE_RATE);
+	params->phase_rate[1] = (uint32_t) lrint(mark_hz * 4294967296.0 / FSK_DSP_SAMPLE_RATE);
+	params->baud_rate = baud_rate;
+	params->kernel = &fsk_kernels[0];
+	params->taps = 0;
+	for (i = 0; i < FSK_SINE_LEN; i++) {
+		params->sine[0][i] = params->sine[1][i] = lrintf(scale * sinf(2.0f * M_PI * i / FSK_SINE_LEN));
+	}
+}
+
+void fsk_mod_params_shape(struct fsk_mod_params *params, int level_dbm0, const struct fsk_shape *shape)
+{
+	float scale;
+	int t;
+	int i;
+
+	for (t = 0; t < 2; t++) {
+		scale = 32767.0f * powf(10.0f, (level_dbm0 + shape->gain[t] - FSK_DBM0_MAX_SINE) / 20.0f);
+		for (i = 0; i < FSK_SINE_LEN; i++) {
+			params->sine[t][i] = lrintf(scale * sinf(2.0f * M_PI * i / FSK_SINE_LEN));
+		}
+	}
+	params->taps = shape->taps < FSK_SHAPE_TAPS ? shape->taps : FSK_SHAPE_TAPS;
+	memcpy(params->fir, shape->fir, sizeof(params->fir));
+}
+
+/*! \brief Power gain of the filter 1 - a z^-1 at a tone */
+static double fsk_shape_power(double a, int hz)
+{
+	return 1.0 + a * a - 2.0 * a * cos(2.0 * M_PI * hz / FSK_DSP_SAMPLE_RATE);
+}
+
+void fsk_shape_tilt(struct fsk_shape *shape, int space_hz, int mark_hz, float tilt_db)
+{
+	int low = space_hz < mark_hz ? space_hz : mark_hz;
+	int high = space_hz < mark_hz ? mark_hz : space_hz;
+	double want = pow(10.0, tilt_db / 10.0);
+	double lo = -0.95;
+	double hi = 0.95;
+	double a = 0;
+	double rest;
+	int i;
+
+	/* the ratio of the two tones grows with a */
+	for (i = 0; i < 40; i++) {
+		a = (lo + hi) / 2;
+		if (fsk_shape_power(a, high) / fsk_shape_power(a, low) < want) {
+			lo = a;
+		} else {
+			hi = a;
+		}
+	}
+	/* unity at the geometric mean of the two gains */
+	shape->fir[0] = 1.0 / sqrt(sqrt(fsk_shape_power(a, high) * fsk_shape_power(a, low)));
+	shape->fir[1] = -a * shape->fir[0];
+	shape->taps = 2;
+	/* what one tap cannot reach goes on the tones themselves */
+	rest = tilt_db - 10.0 * log10(fsk_shape_power(a, high) / fsk_shape_power(a, low));
+	shape->gain[space_hz > mark_hz ? 0 : 1] += rest / 2;
+	shape->gain[space_hz > mark_hz ? 1 : 0] -= rest / 2;
+}
+
+void fsk_mod_init(struct fsk_mod *s, const struct fsk_mod_params *params, fsk_get_bit_fn get_bit, void *user_data)
+{
+	s->params = params;
+	s->phase = 0;
+	s->tone = 1;
+	s->rate = params->phase_rate[1];
+	s->baud_frac = 0;
+	memset(s->history, 0, sizeof(s->history));
+	s->get_bit = get_bit;
+	s->user_data = user_data;
+}
+
+/* Samples the pre-emphasis filter works on at once */
+#define FSK_SHAPE_CHUNK     64
+
+/*! \brief Run the pre-emphasis filter over rendered samples, in place */
+static void fsk_mod_filter(struct fsk_mod *s, int16_t *amp, int len)
+{
+	const struct fsk_mod_params *params = s->params;
+	int keep = params->taps - 1;
+	int16_t x[FSK_SHAPE_TAPS - 1 + FSK_SHAPE_CHUNK];
+	float acc[FSK_SHAPE_CHUNK];
+	int done;
+	int n;
+	int i;
+	int k;
+
+	for (done = 0; done < len; done += n) {
+		n = len - done < FSK_SHAPE_CHUNK ? len - done : FSK_SHAPE_CHUNK;
+		memcpy(x, s->history, keep * sizeof(*x));
+		memcpy(x + keep, amp + done, n * sizeof(*x));
+		/* tap by tap over the chunk, so each pass vectorizes */
+		for (i = 0; i < n; i++) {
+			acc[i] = params->fir[0] * x[keep + i];
+		}
+		for (k = 1; k < params->taps; k++) {
+			for (i = 0; i < n; i++) {
+				acc[i] += params->fir[k] * x[keep + i - k];
+			}
+		}
+		for (i = 0; i < n; i++) {
+			amp[done + i] = acc[i] > 32767.0f ? 32767 : acc[i] < -32768.0f ? -32768 : (int16_t) acc[i];
+		}
+		memcpy(s->history, x + n, keep * sizeof(*x));
+	}
+}
+
+void fsk_mod_render(struct fsk_mod *s, fsk_render_fn render, int16_t *amp, int len)
+{
+	const struct fsk_mod_params *params = s->params;
+	int i = 0;
+	int run;
+
+	while (i < len) {
+		s->baud_frac += params->baud_rate;
+		if (s->baud_frac >= FSK_BAUD_WRAP) {
+			/* this sample starts a new bit */
+			s->baud_frac -= FSK_BAUD_WRAP;
+			s->tone = s->get_bit(s->user_data) & 1;
+			s->rate = params->phase_rate[s->tone];
+		}
+		/* and the following ones that stay within it have the same tone */
+		run = (FSK_BAUD_WRAP - 1 - s->baud_frac) / params->baud_rate;
+		if (run > len - i - 1) {
+			run = len - i - 1;
+		}
+		s->baud_frac += run * params->baud_rate;
+		render(params->sine[s->tone], amp + i, run + 1, &s->phase, s->rate);
+		i += run + 1;
+	}
+	if (params->taps) {
+		fsk_mod_filter(s, amp, len);
+	}
+}
+
+int fsk_mod(struct fsk_mod *s, int16_t *amp, int len)
+{
+	const struct fsk_kernel *kernel = __atomic_load_n(&s->params->kernel, __ATOMIC_RELAXED);
+
+	fsk_mod_render(s, kernel->render, amp, len);
+	return len;
+}
+
+/*! \brief Bits for calibration, a 2^15 - 1 pseudo random sequence */
+static int fsk_tune_bit(void *user_data)
+{
+	uint16_t *lfsr = user_data;
+	int bit = ((*lfsr >> 14) ^ (*lfsr >> 13)) & 1;
+
+	*lfsr = ((*lfsr << 1) | bit) & 0x7fff;
+	return bit;
+}
+
+static int64_t fsk_tune_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*!
+ * \brief Render the calibration signal with a kernel
+ * \return best time of FSK_TUNE_ROUNDS in ns
+ */
+static int64_t fsk_tune_run(const struct fsk_mod_params *params, fsk_render_fn render, int16_t *amp)
+{
+	struct fsk_mod mod;
+	uint16_t lfsr;
+	int64_t best = INT64_MAX;
+	int64_t elapsed;
+	int round;
+
+	for (round = 0; round < FSK_TUNE_ROUNDS; round++) {
+		lfsr = 1;
+		fsk_mod_init(&mod, params, fsk_tune_bit, &lfsr);
+		elapsed = fsk_tune_now();
+		fsk_mod_render(&mod, render, amp, FSK_TUNE_SAMPLES);
+		elapsed = fsk_tune_now() - elapsed;
+		if (elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+const struct fsk_kernel *fsk_tune(const struct fsk_mod_params *params, float ns[FSK_KERNELS_MAX])
+{
+	const struct fsk_kernel *best = &fsk_kernels[0];
+	int16_t *reference;
+	int16_t *amp;
+	int64_t elapsed;
+	int64_t best_elapsed = INT64_MAX;
+	int i;
+
+	memset(ns, 0, sizeof(float) * FSK_KERNELS_MAX);
+	reference = malloc(FSK_TUNE_SAMPLES * sizeof(*reference));
+	amp = malloc(FSK_TUNE_SAMPLES * sizeof(*amp));
+	if (!reference || !amp) {
+		free(reference);
+		free(amp);
+		return best;
+	}
+	for (i = 0; i < fsk_kernel_count; i++) {
+		if (fsk_kernels[i].supported && !fsk_kernels[i].supported()) {
+			continue;
+		}
+		elapsed = fsk_tune_run(params, fsk_kernels[i].render, i ? amp : reference);
+		if (i && memcmp(amp, reference, FSK_TUNE_SAMPLES * sizeof(*amp))) {
+			ns[i] = -1;
+			continue;
+		}
+		ns[i] = (float) elapsed / FSK_TUNE_SAMPLES;
+		if (elapsed < best_elapsed) {
+			best_elapsed = elapsed;
+			best = &fsk_kernels[i];
+		}
+	}
+	free(reference);
+	free(amp);
+	return best;
+}
+
+
+void fsk_quality_init(struct fsk_quality *q, int space_hz, int mark_hz, int baud_rate)
+{
+	int hz[2] = { space_hz, mark_hz };
+	int t;
+
+	memset(q, 0, sizeof(*q));
+	for (t = 0; t < 2; t++) {
+		q->phase_rate[t] = (uint32_t) ((double) hz[t] * 4294967296.0 / FSK_DSP_SAMPLE_RATE);
+	}
+	for (t = 0; t < FSK_SINE_LEN; t++) {
+		q->sine[t] = lrintf(32767.0f * sinf(2.0f * M_PI * t / FSK_SINE_LEN));
+	}
+	q->baud_rate = baud_rate > 0 ? baud_rate : 100;
+	q->window = (FSK_BAUD_WRAP + q->baud_rate / 2) / q->baud_rate;
+	if (q->window > FSK_QUALITY_WINDOW_MAX) {
+		q->window = FSK_QUALITY_WINDOW_MAX;
+	} else if (q->window < 2) {
+		q->window = 2;
+	}
+	q->tone = 1;
+	q->bit_tone = -1;
+}
+
+void fsk_quality_reset(struct fsk_quality *q)
+{
+	memset(&q->bits, 0, sizeof(*q) - offsetof(struct fsk_quality, bits));
+}
+
+/*! \brief At the middle of a bit, with the window over just that bit */
+static void fsk_quality_bit(struct fsk_quality *q, float energy[2])
+{
+	int w = energy[1] > energy[0];
+	float corr[2] = { q->sum[2 * w], q->sum[2 * w + 1] };
+	double total = q->sum[4];
+	double noise;
+	double sigma2;
+	double ebn0;
+
+	/* a tone of amplitude A correlates to A * window / 2, and carries A^2 * window / 2 */
+	noise = total - energy[w];
+	if (noise < total * 1e-6) {
+		noise = total * 1e-6;
+	}
+	q->bits++;
+	q->signal += energy[w];
+	q->noise += noise;
+	q->tone_energy[w] += energy[w];
+	q->tone_bits[w]++;
+	/* non coherent FSK errs with probability exp(-Eb/2N0) / 2, the noise taken over all bits so far */
+	sigma2 = q->noise / ((double) q->bits * q->window);
+	if (sigma2 > 0) {
+		ebn0 = energy[w] / (2 * sigma2);
+		/* below 1e-17 it makes no difference to the sum */
+		if (ebn0 < 80) {
+			q->error_prob += 0.5 * exp(-ebn0 / 2);
+		}
+	}
+	/* same tone as the last bit: the phase has drifted by the frequency offset since */
+	if (w == q->bit_tone && q->since_bit >= q->window / 2 && q->since_bit <= 2 * q->window) {
+		/* averaged as phasors, the angle is taken once in the report */
+		q->offset[0] += (double) corr[0] * q->bit_corr[0] + (double) corr[1] * q->bit_corr[1];
+		q->offset[1] += (double) corr[1] * q->bit_corr[0] - (double) corr[0] * q->bit_corr[1];
+		q->offset_samples += q->since_bit;
+		q->offsets++;
+	}
+	q->bit_tone = w;
+	q->bit_corr[0] = corr[0];
+	q->bit_corr[1] = corr[1];
+	q->since_bit = 0;
+}
+
+void fsk_quality_feed(struct fsk_quality *q, const int16_t *amp, int len, int active)
+{
+	int32_t *slot;
+	float energy[2];
+	double mag[2];
+	int32_t x;
+	int32_t error;
+	int tone;
+	int i;
+	int k;
+
+	for (i = 0; i < len; i++) {
+		x = amp[i];
+		slot = q->ring[q->pos];
+		for (k = 0; k < 5; k++) {
+			q->sum[k] -= slot[k];
+		}
+		/* x * e^-jwn, with the oscillators in Q15 */
+		slot[0] = x * q->sine[((q->phase[0] >> (32 - FSK_SINE_BITS)) + FSK_SINE_LEN / 4) & (FSK_SINE_LEN - 1)];
+		slot[1] = -x * q->sine[q->phase[0] >> (32 - FSK_SINE_BITS)];
+		slot[2] = x * q->sine[((q->phase[1] >> (32 - FSK_SINE_BITS)) + FSK_SINE_LEN / 4) & (FSK_SINE_LEN - 1)];
+		slot[3] = -x * q->sine[q->phase[1] >> (32 - FSK_SINE_BITS)];
+		slot[4] = x * x;
+		for (k = 0; k < 5; k++) {
+			q->sum[k] += slot[k];
+		}
+		q->phase[0] += q->phase_rate[0];
+		q->phase[1] += q->phase_rate[1];
+		if (++q->pos == q->window) {
+			q->pos = 0;
+		}
+
+		/* the tones are compared unscaled, energies are only worked out once a bit */
+		mag[0] = (double) q->sum[0] * q->sum[0] + (double) q->sum[1] * q->sum[1];
+		mag[1] = (double) q->sum[2] * q->sum[2] + (double) q->sum[3] * q->sum[3];
+		tone = mag[1] > mag[0];
+		q->since_bit++;
+		/* a tone change is half a bit into the new bit, the middle of a bit is half a bit later */
+		if (tone != q->tone) {
+			q->tone = tone;
+			error = q->baud_frac - FSK_BAUD_WRAP / 2;
+			q->baud_frac -= error / 4;
+			if (active) {
+				q->jitter += (double) error * error / ((double) FSK_BAUD_WRAP * FSK_BAUD_WRAP);
+				q->jitters++;
+			}
+		}
+		q->baud_frac += q->baud_rate;
+		if (q->baud_frac >= FSK_BAUD_WRAP) {
+			q->baud_frac -= FSK_BAUD_WRAP;
+			if (active) {
+				/* a tone of amplitude A correlates to A * 32767 * window / 2 */
+				energy[0] = 2.0 * mag[0] / ((double) q->window * 32767.0 * 32767.0);
+				energy[1] = 2.0 * mag[1] / ((double) q->window * 32767.0 * 32767.0);
+				fsk_quality_bit(q, energy);
+			}
+		}
+		if (active) {
+			q->power += x * x;
+			q->samples++;
+		}
+	}
+}
+
+void fsk_quality_report(const struct fsk_quality *q, struct fsk_quality_report *r)
+{
+	memset(r, 0, sizeof(*r));
+	if (!q->bits) {
+		return;
+	}
+	r->bits = q->bits;
+	/* a full scale sine is FSK_DBM0_MAX_SINE */
+	r->level = 10.0f * log10f(q->power / q->samples / (32767.0 * 32767.0 / 2) + 1e-12) + FSK_DBM0_MAX_SINE;
+	r->snr = 10.0f * log10f(q->signal / q->noise);
+	if (q->tone_bits[0] && q->tone_bits[1] && q->tone_energy[0] > 0) {
+		r->imbalance = 10.0f * log10f((q->tone_energy[1] / q->tone_bits[1]) / (q->tone_energy[0] / q->tone_bits[0]) + 1e-12);
+	}
+	if (q->offsets) {
+		r->offset = atan2(q->offset[1], q->offset[0]) * FSK_DSP_SAMPLE_RATE / (2.0 * M_PI * q->offset_samples / q->offsets);
+	}
+	if (q->jitters) {
+		r->jitter = 100.0f * sqrtf(q->jitter / q->jitters);
+	}
+	r->ber = q->error_prob / q->bits;
+}
+
+/* Time constants of the DC estimate and of the noise floor rising back, ms */
+#define FSK_AGC_DC_MS       200.0f
+#define FSK_AGC_NOISE_MS    2000.0f
+
+/* Mean square of a full scale sine */
+#define FSK_AGC_FULL_SCALE  (32767.0f * 32767.0f / 2.0f)
+
+void fsk_agc_params_default(struct fsk_agc_params *params)
+{
+	params->target = -14.0f;
+	params->max_gain = 40.0f;
+	params->attack_ms = 5.0f;
+	params->decay_ms = 500.0f;
+	params->margin = 9.0f;
+	params->floor = -48.0f;
+	params->ceiling = -30.0f;
+	params->dc = 1;
+}
+
+/*! \brief Smoothing of a one pole filter over len samples */
+static float fsk_agc_smoothing(float ms, int len)
+{
+	return ms > 0 ? 1.0f - expf(-len / (ms * FSK_DSP_SAMPLE_RATE / 1000.0f)) : 1.0f;
+}
+
+void fsk_agc_init(struct fsk_agc *agc, const struct fsk_agc_params *params)
+{
+	memset(agc, 0, sizeof(*agc));
+	agc->params = *params;
+	agc->attack = fsk_agc_smoothing(params->attack_ms, FSK_AGC_BLOCK);
+	agc->decay = fsk_agc_smoothing(params->decay_ms, FSK_AGC_BLOCK);
+	agc->target = FSK_AGC_FULL_SCALE * powf(10.0f, (params->target - FSK_DBM0_MAX_SINE) / 10.0f);
+	agc->gain = 1.0f;
+}
+
+/* GCC only vectorizes loops of unknown length at -O2 when its cost model says it is cheap, which these are not */
+#if defined(__GNUC__) && !defined(__clang__)
+#define FSK_VECTORIZE __attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+#define FSK_VECTORIZE
+#endif
+
+/* in integers, which the compiler can vectorize without reordering float sums */
+FSK_VECTORIZE
+static void fsk_agc_sums(const int16_t *restrict in, int len, int32_t *sum, int64_t *sum2)
+{
+	int32_t s = 0;
+	int64_t s2 = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		s += in[i];
+		s2 += in[i] * in[i];
+	}
+	*sum = s;
+	*sum2 = s2;
+}
+
+FSK_VECTORIZE
+static void fsk_agc_apply(const int16_t *restrict in, int16_t *restrict out, int len, float dc, float g, float step)
+{
+	float y;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		y = (in[i] - dc) * (g + step * i);
+		y = y > 32767.0f ? 32767.0f : y < -32768.0f ? -32768.0f : y;
+		out[i] = y;
+	}
+}
+
+void fsk_agc_process(struct fsk_agc *agc, const int16_t *in, int16_t *out, int len, int active)
+{
+	float scale = (float) len / FSK_AGC_BLOCK;
+	int32_t sum;
+	int64_t sum2;
+	float power;
+	float mean;
+	float gain;
+	float step;
+	float dc;
+	float g;
+
+	if (len <= 0) {
+		return;
+	}
+	fsk_agc_sums(in, len, &sum, &sum2);
+	mean = (float) sum / len;
+	if (agc->params.dc) {
+		/* the first block sets out where the estimates start from */
+		agc->dc += (mean - agc->dc) * (agc->level ? fsk_agc_smoothing(FSK_AGC_DC_MS, len) : 1.0f);
+	}
+	dc = agc->dc;
+	/* of the block with the estimated DC taken out */
+	power = (float) sum2 / len - 2.0f * dc * mean + dc * dc;
+	if (power < 1.0f) {
+		power = 1.0f;
+	}
+	if (!agc->level) {
+		agc->level = power;
+	} else {
+		agc->level += (power - agc->level) * (power > agc->level ? agc->attack : agc->decay) * scale;
+	}
+	if (!active) {
+		if (!agc->noise || power < agc->noise) {
+			agc->noise = power;
+		} else {
+			agc->noise += (power - agc->noise) * fsk_agc_smoothing(FSK_AGC_NOISE_MS, len);
+		}
+	}
+
+	gain = sqrtf(agc->target / agc->level);
+	if (gain > powf(10.0f, agc->params.max_gain / 20.0f)) {
+		gain = powf(10.0f, agc->params.max_gain / 20.0f);
+	} else if (gain < 0.1f) {
+		gain = 0.1f;
+	}
+	/* ramped over the block, no step for the demodulator to take for a tone change; a
+	 * louder block was measured before it is scaled, so it is not clipped on its way in */
+	g = gain < agc->gain ? gain : agc->gain;
+	step = (gain - g) / len;
+	fsk_agc_apply(in, out, len, dc, g, step);
+	agc->gain = gain;
+}
+
+float fsk_agc_cutoff(const struct fsk_agc *agc)
+{
+	float cutoff = agc->params.floor;
+	float noise;
+
+	/* a carrier there from the start is taken for noise, the ceiling still lets it in */
+	if (agc->noise > 0) {
+		noise = 10.0f * log10f(agc->noise / FSK_AGC_FULL_SCALE) + FSK_DBM0_MAX_SINE + agc->params.margin;
+		cutoff = noise > cutoff ? noise : cutoff;
+	}
+	if (cutoff > agc->params.ceiling) {
+		cutoff = agc->params.ceiling;
+	}
+	return cutoff + fsk_agc_gain(agc);
+}
+
+float fsk_agc_gain(const struct fsk_agc *agc)
+{
+	return 20.0f * log10f(agc->gain);
+}
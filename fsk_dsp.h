@@ -0,0 +1,275 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Signal processing core of app_fsk: character framing, the modulator
+ * and its transmit shaping, the line quality estimator and the receive AGC
+ *
+ * Nothing here depends on Asterisk or spandsp, so the same code runs in the
+ * module and in the tools under utils/. Audio is 16 bit linear at 8 kHz.
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#ifndef _FSK_DSP_H
+#define _FSK_DSP_H
+
+#include <stdint.h>
+
+#define FSK_DSP_SAMPLE_RATE 8000
+
+/* Full sine table of the modulator, indexed by the top bits of the phase */
+#define FSK_SINE_BITS       10
+#define FSK_SINE_LEN        (1 << FSK_SINE_BITS)
+
+/* The bit clock wraps once per bit, in units of 0.01 baud per sample as spandsp keeps it */
+#define FSK_BAUD_WRAP       (100 * FSK_DSP_SAMPLE_RATE)
+
+/* Room for every render kernel any build may have */
+#define FSK_KERNELS_MAX     4
+
+/* Taps of the transmit pre-emphasis filter */
+#define FSK_SHAPE_TAPS      8
+
+/* Longest bit the quality estimator correlates over, in samples: down to 31.25 baud */
+#define FSK_QUALITY_WINDOW_MAX 256
+
+/* Samples the AGC measures and sets its gain over at once, a 20 ms frame */
+#define FSK_AGC_BLOCK       160
+
+/*! \brief Next bit to send, 0 or 1 */
+typedef int (*fsk_get_bit_fn)(void *user_data);
+
+/*! \brief Asynchronous character framing, with the bits of every byte value worked out once */
+struct fsk_framing {
+	int data_bits;                  /*!< 5 to 8 */
+	int stop_bits;                  /*!< 1 or 2 */
+	int bits;                       /*!< start, data and stop bits of a character */
+	uint16_t frame[256];            /*!< character by byte value, first bit to send in bit 0 */
+};
+
+void fsk_framing_init(struct fsk_framing *framing, int data_bits, int stop_bits);
+
+/*!
+ * \brief Render samples of a constant tone from the sine table
+ * \param phase in: phase of the first sample, out: phase after the last one
+ */
+typedef void (*fsk_render_fn)(const int32_t *sine, int16_t *amp, int len, uint32_t *phase, uint32_t rate);
+
+/*! \brief A render kernel the tuner can pick */
+struct fsk_kernel {
+	const char *name;
+	fsk_render_fn render;
+	int (*supported)(void);         /*!< NULL if every host runs it */
+};
+
+/*! \brief Render kernels of this build, the scalar one first */
+extern const struct fsk_kernel fsk_kernels[];
+extern const int fsk_kernel_count;
+
+/*! \brief Transmit shaping against a channel that does not pass both tones alike */
+struct fsk_shape {
+	float gain[2];                  /*!< dB over the transmit level, space and mark */
+	int taps;                       /*!< of the filter over the modulated audio, 0 for none */
+	float fir[FSK_SHAPE_TAPS];
+};
+
+/*! \brief What a modulator needs, worked out once per set of parameters */
+struct fsk_mod_params {
+	uint32_t phase_rate[2];         /*!< phase step per sample of space and mark */
+	int32_t baud_rate;              /*!< 0.01 baud */
+	const struct fsk_kernel *kernel; /*!< render kernel in use, may be swapped while modulators run */
+	int taps;                       /*!< of the pre-emphasis filter, 0 for none */
+	float fir[FSK_SHAPE_TAPS];
+	int32_t sine[2][FSK_SINE_LEN];  /*!< space and mark, each scaled to its transmit level */
+};
+
+/*! \brief Phase continuous FSK modulator, equivalent to spandsp's fsk_tx() */
+struct fsk_mod {
+	const struct fsk_mod_params *params;
+	uint32_t phase;
+	uint32_t rate;
+	int tone;
+	int32_t baud_frac;
+	int16_t history[FSK_SHAPE_TAPS - 1]; /*!< last samples rendered, oldest first, for the filter */
+	fsk_get_bit_fn get_bit;
+	void *user_data;
+};
+
+/*!
+ * \param space_hz tone of a 0
+ * \param mark_hz tone of a 1
+ * \param level_dbm0 transmit level
+ * \param baud_rate in units of 0.01 baud
+ */
+void fsk_mod_params_init(struct fsk_mod_params *params, int space_hz, int mark_hz, int level_dbm0, int baud_rate);
+
+/*!
+ * \brief Shape what parameters from fsk_mod_params_init() render
+ * \param level_dbm0 transmit level they were initialized with
+ */
+void fsk_mod_params_shape(struct fsk_mod_params *params, int level_dbm0, const struct fsk_shape *shape);
+
+/*!
+ * \brief Set the filter of a shape to a first order pre-emphasis that puts the higher tone tilt_db over the lower one
+ *
+ * The lower tone loses half the tilt and the higher one gains the other half,
+ * so the power sent stays about the same. Negative tilts favour the lower tone.
+ * What is beyond a single tap is added to the gains of the tones.
+ */
+void fsk_shape_tilt(struct fsk_shape *shape, int space_hz, int mark_hz, float tilt_db);
+
+void fsk_mod_init(struct fsk_mod *s, const struct fsk_mod_params *params, fsk_get_bit_fn get_bit, void *user_data);
+
+/*! \brief Modulate len samples with the given kernel, pulling bits as the bit clock asks for them */
+void fsk_mod_render(struct fsk_mod *s, fsk_render_fn render, int16_t *amp, int len);
+
+/*!
+ * \brief Modulate len samples with the kernel of the parameters
+ * \return len
+ */
+int fsk_mod(struct fsk_mod *s, int16_t *amp, int len);
+
+/*!
+ * \brief Pick the fastest kernel this host runs that renders exactly what the scalar one does
+ * \param ns time per sample of each of fsk_kernels, 0 if the host does not run it,
+ *        negative if its output differs from the scalar one
+ */
+const struct fsk_kernel *fsk_tune(const struct fsk_mod_params *params, float ns[FSK_KERNELS_MAX]);
+
+/*!
+ * \brief Line quality estimator, run alongside the demodulator
+ *
+ * Correlates each sample against both tones over a sliding window of one bit,
+ * recovers the bit timing from the tone changes and, at the middle of each bit,
+ * measures how clearly the winning tone stands out of the rest of the signal.
+ * The correlator is integer and costs some ten times the modulator's scalar
+ * kernel per sample; fsk_bench times it next to spandsp's demodulator.
+ */
+struct fsk_quality {
+	uint32_t phase[2];              /*!< local oscillators of space and mark */
+	uint32_t phase_rate[2];
+	int16_t sine[FSK_SINE_LEN];     /*!< full scale */
+	int32_t ring[FSK_QUALITY_WINDOW_MAX][5]; /*!< per sample: space and mark products, energy */
+	int64_t sum[5];                 /*!< of the window, exact so it never drifts */
+	int window;                     /*!< samples of a bit */
+	int pos;
+	int32_t baud_rate;              /*!< 0.01 baud */
+	int32_t baud_frac;              /*!< wraps at the middle of a bit */
+	int tone;                       /*!< winning tone of the last sample */
+	int bit_tone;                   /*!< winning tone at the last bit */
+	float bit_corr[2];              /*!< its correlation, for the phase drift to the next bit */
+	int since_bit;                  /*!< samples since the last bit */
+	/* statistics of the bits received while active */
+	unsigned int bits;
+	uint64_t samples;
+	double power;
+	double signal;
+	double noise;
+	double tone_energy[2];
+	unsigned int tone_bits[2];
+	double error_prob;
+	double offset[2];               /*!< sum of the phase drifts between bits, as complex numbers */
+	double offset_samples;          /*!< over this many samples */
+	unsigned int offsets;
+	double jitter;
+	unsigned int jitters;
+};
+
+/*! \brief Estimates of a fsk_quality since it was reset, all 0 until bits is not */
+struct fsk_quality_report {
+	unsigned int bits;              /*!< bits measured */
+	float level;                    /*!< dBm0 */
+	float snr;                      /*!< dB, tone against everything else in the voice band */
+	float imbalance;                /*!< dB, mark over space */
+	float offset;                   /*!< Hz, received over nominal tones */
+	float jitter;                   /*!< RMS timing error of tone changes, percent of a bit */
+	float ber;                      /*!< bit errors expected from the decision margins */
+};
+
+/*!
+ * \param space_hz tone of a 0
+ * \param mark_hz tone of a 1
+ * \param baud_rate in units of 0.01 baud
+ */
+void fsk_quality_init(struct fsk_quality *q, int space_hz, int mark_hz, int baud_rate);
+
+/*! \brief Clear the statistics, the correlators and bit timing carry on */
+void fsk_quality_reset(struct fsk_quality *q);
+
+/*!
+ * \brief Run len received samples through the estimator
+ * \param active whether they count, normally while the carrier is up
+ */
+void fsk_quality_feed(struct fsk_quality *q, const int16_t *amp, int len, int active);
+
+void fsk_quality_report(const struct fsk_quality *q, struct fsk_quality_report *r);
+
+/*! \brief Settings of the receive AGC */
+struct fsk_agc_params {
+	float target;                   /*!< dBm0 the carrier is brought to */
+	float max_gain;                 /*!< dB */
+	float attack_ms;                /*!< time constant of the level going up */
+	float decay_ms;                 /*!< and down */
+	float margin;                   /*!< dB over the noise floor a carrier must be */
+	float floor;                    /*!< dBm0, weakest carrier accepted however quiet the line */
+	float ceiling;                  /*!< dBm0, the threshold never goes above it however noisy the line */
+	int dc;                         /*!< remove DC ahead of the gain */
+};
+
+/*!
+ * \brief Automatic gain control and DC blocker ahead of the demodulator
+ *
+ * Works a block at a time: the mean and power of the block are taken first,
+ * then DC removal and the gain, ramped from that of the previous block, are
+ * applied in one pass with no dependency between samples. While the carrier is
+ * down the noise floor is tracked, and the carrier threshold follows it between
+ * floor and ceiling.
+ */
+struct fsk_agc {
+	struct fsk_agc_params params;
+	float attack;                   /*!< smoothing per full block */
+	float decay;
+	float dc;                       /*!< DC estimate */
+	float level;                    /*!< mean square of the input, without DC */
+	float noise;                    /*!< mean square of the input while the carrier is down, 0 until measured */
+	float gain;                     /*!< applied at the end of the last block */
+	float target;                   /*!< mean square of the target level */
+};
+
+/*! \brief -14 dBm0 target, up to 40 dB of gain, 5 ms attack, 500 ms decay, 9 dB over noise between -48 and -30 dBm0, DC removed */
+void fsk_agc_params_default(struct fsk_agc_params *params);
+
+void fsk_agc_init(struct fsk_agc *agc, const struct fsk_agc_params *params);
+
+/*!
+ * \brief Level and clean up to FSK_AGC_BLOCK received samples
+ * \param out not overlapping in
+ * \param active whether the carrier is up, the noise floor is only measured when it is not
+ */
+void fsk_agc_process(struct fsk_agc *agc, const int16_t *in, int16_t *out, int len, int active);
+
+/*! \return carrier threshold for the output of the AGC at its present gain, dBm0 */
+float fsk_agc_cutoff(const struct fsk_agc *agc);
+
+/*! \return gain at the end of the last block, dB */
+float fsk_agc_gain(const struct fsk_agc *agc);
+
+#endif /* _FSK_DSP_H */
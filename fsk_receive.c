@@ -0,0 +1,118 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Receive core of app_fsk
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include "fsk_receive.h"
+
+void fsk_receive_start(struct fsk_receive *rcv, int crc, int quit_on_carrier_lost)
+{
+	rcv->quit_on_carrier_lost = quit_on_carrier_lost;
+	rcv->eof = 0;
+	rcv->idle_samples = 0;
+	rcv->received = 0;
+	rcv->crc = crc;
+	rcv->crc_value = 0xffff;
+	rcv->crc_bytes = 0;
+	if (rcv->quality) {
+		fsk_quality_reset(rcv->quality);
+	}
+}
+
+void fsk_receive_status(void *user_data, int status)
+{
+	struct fsk_receive *rcv = user_data;
+
+	if (status != SIG_STATUS_CARRIER_UP && status != SIG_STATUS_CARRIER_DOWN) {
+		return;
+	}
+	rcv->carrier = status == SIG_STATUS_CARRIER_UP;
+	if (rcv->carrier_change) {
+		rcv->carrier_change(rcv, rcv->carrier);
+	}
+	if (!rcv->carrier && rcv->quit_on_carrier_lost) {
+		rcv->eof = 1;
+	}
+}
+
+void fsk_receive_put_bit(void *user_data, int bit)
+{
+	struct fsk_receive *rcv = user_data;
+
+	if (bit < 0) {
+		fsk_receive_status(user_data, bit);
+		return;
+	}
+
+	bit &= rcv->data_mask;
+	rcv->idle_samples = 0;
+	rcv->received++;
+	if (rcv->crc) {
+		if (rcv->crc_bytes >= 2) {
+			rcv->crc_value = crc_itu16_calc(rcv->crc_tail, 1, rcv->crc_value);
+		}
+		rcv->crc_tail[0] = rcv->crc_tail[1];
+		rcv->crc_tail[1] = bit & 0xff;
+		rcv->crc_bytes++;
+	}
+	if (rcv->byte) {
+		rcv->byte(rcv, bit & 0xff);
+	}
+}
+
+void fsk_receive_feed(fsk_rx_state_t *rx, struct fsk_receive *rcv, const int16_t *amp, int samples)
+{
+	int16_t leveled[FSK_AGC_BLOCK];
+	int done;
+	int len;
+
+	if (rcv->agc) {
+		for (done = 0; done < samples; done += len) {
+			len = samples - done < FSK_AGC_BLOCK ? samples - done : FSK_AGC_BLOCK;
+			fsk_agc_process(rcv->agc, amp + done, leveled, len, rcv->carrier);
+			fsk_rx_signal_cutoff(rx, fsk_agc_cutoff(rcv->agc));
+			fsk_rx(rx, leveled, len);
+		}
+	} else {
+		fsk_rx(rx, amp, samples);
+	}
+	/* on the line as it came, the level is reported as received */
+	if (rcv->quality) {
+		fsk_quality_feed(rcv->quality, amp, samples, rcv->carrier);
+	}
+	/* characters found in this frame reset it, the whole frame counts either way */
+	rcv->idle_samples += samples;
+}
+
+int fsk_receive_idle(const struct fsk_receive *rcv, int eom_samples)
+{
+	return rcv->received > 0 && rcv->idle_samples >= eom_samples;
+}
+
+int fsk_receive_crc_ok(const struct fsk_receive *rcv)
+{
+	return rcv->crc_bytes >= 2 && (rcv->crc_value ^ 0xffff) == (rcv->crc_tail[0] | (rcv->crc_tail[1] << 8));
+}
@@ -0,0 +1,84 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Receive core of app_fsk: what a receive makes of the demodulator output
+ *
+ * Character masking, carrier tracking, the CRC check and the end of message
+ * decisions, shared by ReceiveFSK and utils/fsk_replay so that a recording
+ * replayed frame by frame decodes exactly as it did on the channel. Depends
+ * on spandsp for the demodulator, not on Asterisk.
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#ifndef _FSK_RECEIVE_H
+#define _FSK_RECEIVE_H
+
+#include <stdint.h>
+#include <spandsp.h>
+
+#include "fsk_dsp.h"
+
+struct fsk_receive;
+
+/*! \brief A character was received, after the core has accounted for it */
+typedef void (*fsk_receive_byte_fn)(struct fsk_receive *rcv, unsigned char byte);
+
+/*! \brief The carrier came up (1) or went away (0) */
+typedef void (*fsk_receive_carrier_fn)(struct fsk_receive *rcv, int up);
+
+/*! \brief State of a receive, whatever is done with the bytes */
+struct fsk_receive {
+	unsigned int data_mask;         /*!< data bits of a received character */
+	int carrier;
+	int quit_on_carrier_lost;
+	int eof;                        /*!< carrier lost with quit_on_carrier_lost set, or ended from outside */
+	int idle_samples;               /*!< since the last character, in whole frames */
+	int received;                   /*!< characters */
+	int crc;                        /*!< the last two bytes are a CRC-16 over the others */
+	uint16_t crc_value;
+	int crc_bytes;
+	unsigned char crc_tail[2];      /*!< the last two bytes seen, kept out of crc_value until more arrive */
+	fsk_receive_byte_fn byte;       /*!< may be NULL */
+	fsk_receive_carrier_fn carrier_change; /*!< may be NULL */
+	struct fsk_quality *quality;    /*!< fed the audio while the carrier is up, may be NULL */
+	struct fsk_agc *agc;            /*!< levels the audio and sets the carrier threshold ahead of the demodulator, may be NULL */
+};
+
+/*! \brief Start a receive: the carrier and the callbacks are left as they are, the quality statistics start over */
+void fsk_receive_start(struct fsk_receive *rcv, int crc, int quit_on_carrier_lost);
+
+/*! \brief put_bit handler of fsk_rx(), user_data is the struct fsk_receive */
+void fsk_receive_put_bit(void *user_data, int bit);
+
+/*! \brief Modem status handler of fsk_rx(), user_data is the struct fsk_receive */
+void fsk_receive_status(void *user_data, int status);
+
+/*! \brief Demodulate a frame of audio as it was read from the channel, through the AGC if any, and measure the line with it */
+void fsk_receive_feed(fsk_rx_state_t *rx, struct fsk_receive *rcv, const int16_t *amp, int samples);
+
+/*! \brief Whether data was received and the peer has been back to mark-idle for eom_samples */
+int fsk_receive_idle(const struct fsk_receive *rcv, int eom_samples);
+
+/*! \brief Whether the last two bytes are the CRC-16 of the others */
+int fsk_receive_crc_ok(const struct fsk_receive *rcv);
+
+#endif /* _FSK_RECEIVE_H */
@@ -0,0 +1,135 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Layout of the shared-memory ring ReceiveFSK exports received data to
+ *
+ * The module creates the POSIX shared memory object FSK_SHM_NAME (visible
+ * as /dev/shm/asterisk-fsk on Linux) when it loads and removes it when it
+ * unloads. A consumer maps it read-only and follows the records with no
+ * system call and no copy:
+ *
+ * \code
+ *	fd = shm_open(FSK_SHM_NAME, O_RDONLY, 0);
+ *	fstat(fd, &st);
+ *	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+ *	next = fsk_shm_head(hdr);
+ *	for (;;) {
+ *		slot = fsk_shm_slot(hdr, next);
+ *		switch (fsk_shm_ready(slot, next)) {
+ *		case 0: ... nothing new, poll again later ...
+ *		case 1: ... use slot->data[0 .. slot->length) in place ...
+ *			if (fsk_shm_valid(slot, next)) { ... accept it ... }
+ *			next++;
+ *			break;
+ *		case -1: ... overrun, resync with next = fsk_shm_tail(hdr) ...
+ *		}
+ *	}
+ * \endcode
+ *
+ * Records are numbered from 0 and record n lives in slot n % slot_count.
+ * Each slot carries a sequence word that is 2n+1 while record n is being
+ * written and 2n+2 once it is complete, so a reader can both wait for a
+ * record and detect that it was overwritten while being read.
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#ifndef _FSK_SHM_H
+#define _FSK_SHM_H
+
+#include <stdint.h>
+
+#define FSK_SHM_NAME        "/asterisk-fsk"
+#define FSK_SHM_MAGIC       0x524b5346      /* "FSKR" in memory on little endian hosts */
+#define FSK_SHM_VERSION     1
+
+/*! \brief Record types */
+enum fsk_shm_type {
+	FSK_SHM_DATA = 1,               /*!< received bytes */
+	FSK_SHM_START = 2,              /*!< a receive started, data is "<uniqueid> <channel name>" */
+	FSK_SHM_END = 3,                /*!< a receive ended, data is the byte count as text */
+	FSK_SHM_CARRIER_UP = 4,
+	FSK_SHM_CARRIER_DOWN = 5,
+};
+
+/*! \brief At offset 0 of the shared memory object */
+struct fsk_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;           /*!< offset of slot 0 */
+	uint32_t slot_size;             /*!< bytes per slot, slot header included */
+	uint32_t slot_count;            /*!< power of two */
+	uint32_t reserved;
+	uint64_t write_seq;             /*!< number of records claimed by writers so far */
+};
+
+struct fsk_shm_slot {
+	uint64_t seq;                   /*!< 2n+1 while record n is written, 2n+2 when complete */
+	uint64_t session;               /*!< receive session the record belongs to */
+	uint64_t timestamp_us;          /*!< wall clock, microseconds since the epoch */
+	uint32_t session_seq;           /*!< per session record counter, gaps mean lost records */
+	uint16_t type;                  /*!< enum fsk_shm_type */
+	uint16_t length;                /*!< bytes used in data */
+	uint8_t data[0];
+};
+
+static inline struct fsk_shm_slot *fsk_shm_slot(const struct fsk_shm_header *hdr, uint64_t n)
+{
+	return (struct fsk_shm_slot *) ((char *) hdr + hdr->header_size + (n & (hdr->slot_count - 1)) * hdr->slot_size);
+}
+
+/*! \brief Number of the next record to be written */
+static inline uint64_t fsk_shm_head(const struct fsk_shm_header *hdr)
+{
+	return __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+}
+
+/*! \brief Number of the oldest record still in the ring */
+static inline uint64_t fsk_shm_tail(const struct fsk_shm_header *hdr)
+{
+	uint64_t head = fsk_shm_head(hdr);
+
+	return head > hdr->slot_count ? head - hdr->slot_count : 0;
+}
+
+/*!
+ * \retval 1 record n is complete in slot
+ * \retval 0 record n is not written yet
+ * \retval -1 record n has already been overwritten
+ */
+static inline int fsk_shm_ready(const struct fsk_shm_slot *slot, uint64_t n)
+{
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+	if (seq == 2 * n + 2) {
+		return 1;
+	}
+	return seq < 2 * n + 2 ? 0 : -1;
+}
+
+/*! \brief After using a record in place, whether it was left untouched meanwhile */
+static inline int fsk_shm_valid(const struct fsk_shm_slot *slot, uint64_t n)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == 2 * n + 2;
+}
+
+#endif /* _FSK_SHM_H */
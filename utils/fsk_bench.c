@@ -0,0 +1,619 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Loopback benchmark of the app_fsk signal processing core
+ *
+ * Modulates a corpus of payloads with every render kernel the host runs, on
+ * each built in modem, and reports the time per sample. Built with spandsp
+ * (HAVE_SPANDSP), the audio is also demodulated again and compared with the
+ * payloads. This is the training workload of "make pgo".
+ *
+ * \code
+ *	fsk_bench [-m modem] [-k kernel] [-r rounds] [-t tilt] [-q | -s] [payload file ...]
+ *	fsk_bench -c channel [-m modem] [-n noise] [-t tilt] [payload file ...]
+ * \endcode
+ *
+ * Without payload files a built in corpus of mixed sizes and contents is used.
+ * -s prints only the mean time per sample with the kernels the tuner picks,
+ * which is what the module would run. After the kernels of a modem come the
+ * picked kernel with transmit shaping, "+tilt" for the filter of a tilt of
+ * -t dB (default 6) and "+fir8" for one of all FSK_SHAPE_TAPS taps, then the
+ * receive side: the line quality estimator ("quality") every receive runs,
+ * and with spandsp the demodulator ("fsk_rx") it runs alongside.
+ *
+ * -c passes the audio through a codec channel before demodulating it, once as
+ * modulated and once with the higher tone pre-emphasized by tilt dB (default
+ * 6), and reports the byte errors of both. The channels are those of
+ * fsk_channel.c, "opus:6000" runs a codec at a setting of its own and "all"
+ * runs each of them at its default. Noise is added ahead of the codec
+ * at -n dBm0 (default -30); the Codec column reads "model" for the filters
+ * that stand in for codec libraries not built in. The channel mode needs
+ * spandsp.
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifdef HAVE_SPANDSP
+#include <spandsp.h>
+#endif
+
+#include "../fsk_dsp.h"
+#ifdef HAVE_SPANDSP
+#include "fsk_channel.h"
+#endif
+
+/* Mark-idle before and after each payload, in bit times */
+#define BENCH_IDLE_BITS     20
+
+/* Payloads of the built in corpus */
+#define BENCH_CORPUS        48
+
+/*! \brief Built in modems of the module, on their transmit side */
+static const struct bench_modem {
+	const char *name;
+	int space;
+	int mark;
+	int level;
+	int baud_rate;                  /*!< 0.01 baud */
+} modems[] = {
+	{ "103", 2025, 2225, -14, 300 * 100 },
+	{ "202", 2200, 1200, -14, 1200 * 100 },
+	{ "v23", 2100, 1300, -14, 1200 * 100 },
+};
+#define BENCH_MODEMS        ((int) (sizeof(modems) / sizeof(modems[0])))
+
+struct payload {
+	unsigned char *data;
+	size_t len;
+};
+
+/*! \brief Bits of a payload as the module's put_bit() sends them, then mark-idle */
+struct bench_source {
+	const struct fsk_framing *framing;
+	const struct payload *payload;
+	size_t ptr;
+	int bit;
+	int lead;
+};
+
+static int bench_get_bit(void *user_data)
+{
+	struct bench_source *src = user_data;
+	int bit;
+
+	if (src->lead > 0) {
+		src->lead--;
+		return 1;
+	}
+	if (src->ptr >= src->payload->len) {
+		return 1;
+	}
+	bit = (src->framing->frame[src->payload->data[src->ptr]] >> src->bit) & 1;
+	if (++src->bit == src->framing->bits) {
+		src->bit = 0;
+		src->ptr++;
+	}
+	return bit;
+}
+
+static size_t bench_samples(const struct bench_modem *modem, const struct fsk_framing *framing, size_t len)
+{
+	return ((len * framing->bits + 2 * BENCH_IDLE_BITS) * (size_t) FSK_BAUD_WRAP + modem->baud_rate - 1) / modem->baud_rate;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*! \brief Modulate a payload into amp, which holds bench_samples() of it */
+static void bench_modulate(const struct fsk_mod_params *params, fsk_render_fn render, const struct fsk_framing *framing,
+	const struct payload *payload, int16_t *amp, size_t samples)
+{
+	struct bench_source src = {
+		.framing = framing,
+		.payload = payload,
+		.lead = BENCH_IDLE_BITS,
+	};
+	struct fsk_mod mod;
+	size_t done;
+	int chunk;
+
+	fsk_mod_init(&mod, params, bench_get_bit, &src);
+	/* in 20 ms blocks as a channel would */
+	for (done = 0; done < samples; done += chunk) {
+		chunk = samples - done < 160 ? samples - done : 160;
+		fsk_mod_render(&mod, render, amp + done, chunk);
+	}
+}
+
+#ifdef HAVE_SPANDSP
+struct bench_sink {
+	const struct payload *payload;
+	size_t ptr;
+	size_t errors;
+};
+
+static void bench_put_bit(void *user_data, int bit)
+{
+	struct bench_sink *sink = user_data;
+
+	if (bit < 0) {
+		return;
+	}
+	if (sink->ptr >= sink->payload->len || sink->payload->data[sink->ptr] != (bit & 0xff)) {
+		sink->errors++;
+	}
+	sink->ptr++;
+}
+
+/*! \return bytes lost, added or received wrong */
+static size_t bench_demodulate(const struct bench_modem *modem, const struct payload *payload, const int16_t *amp, size_t samples)
+{
+	fsk_spec_t spec = { modem->name, modem->space, modem->mark, modem->level, -30, modem->baud_rate };
+	struct bench_sink sink = { .payload = payload };
+	fsk_rx_state_t *rx;
+	size_t done;
+	int chunk;
+
+	if (!(rx = fsk_rx_init(NULL, &spec, 10, bench_put_bit, &sink))) {
+		return payload->len;
+	}
+	for (done = 0; done < samples; done += chunk) {
+		chunk = samples - done < 160 ? samples - done : 160;
+		fsk_rx(rx, amp + done, chunk);
+	}
+	fsk_rx_free(rx);
+	return sink.errors + (sink.ptr < payload->len ? payload->len - sink.ptr : 0);
+}
+
+/*! \brief Byte errors of each modem over each channel, without and with shaping */
+static int bench_channels(const char *only_channel, const char *only_modem, int noise_dbm0, float tilt_db,
+	const struct payload *corpus, int count, int16_t *amp)
+{
+	struct fsk_framing framing;
+	struct fsk_mod_params *params;
+	struct fsk_shape shape;
+	struct fsk_channel_state channel;
+	const struct fsk_channel *only = NULL;
+	size_t errors[2];
+	size_t bytes;
+	size_t samples;
+	int setting = 0;
+	int shaped;
+	int c;
+	int m;
+	int i;
+
+	if (strcasecmp(only_channel, "all") && !(only = fsk_channel_find(only_channel, &setting))) {
+		fprintf(stderr, "unknown channel %s\n", only_channel);
+		return -1;
+	}
+	if (!(params = malloc(sizeof(*params)))) {
+		return -1;
+	}
+	fsk_framing_init(&framing, 8, 1);
+	printf("%-6s %-8s %-8s %10s %10s %8s %10s %8s\n", "Modem", "Channel", "Codec", "Bytes", "Plain", "%", "Shaped", "%");
+	for (c = 0; c < fsk_channel_count; c++) {
+		if (only && only != &fsk_channels[c]) {
+			continue;
+		}
+		for (m = 0; m < BENCH_MODEMS; m++) {
+			if (only_modem && strcasecmp(only_modem, modems[m].name)) {
+				continue;
+			}
+			bytes = 0;
+			for (shaped = 0; shaped < 2; shaped++) {
+				fsk_mod_params_init(params, modems[m].space, modems[m].mark, modems[m].level, modems[m].baud_rate);
+				if (shaped) {
+					memset(&shape, 0, sizeof(shape));
+					fsk_shape_tilt(&shape, modems[m].space, modems[m].mark, tilt_db);
+					fsk_mod_params_shape(params, modems[m].level, &shape);
+				}
+				/* the same noise for both, so only the shaping differs */
+				if (fsk_channel_init(&channel, &fsk_channels[c], setting, noise_dbm0, 1234567)) {
+					free(params);
+					return -1;
+				}
+				errors[shaped] = 0;
+				for (i = 0; i < count; i++) {
+					samples = bench_samples(&modems[m], &framing, corpus[i].len);
+					bench_modulate(params, fsk_kernels[0].render, &framing, &corpus[i], amp, samples);
+					fsk_channel_run(&channel, amp, samples);
+					errors[shaped] += bench_demodulate(&modems[m], &corpus[i], amp, samples);
+					bytes += shaped ? 0 : corpus[i].len;
+				}
+				fsk_channel_release(&channel);
+			}
+			printf("%-6s %-8s %-8s %10zu %10zu %8.3f %10zu %8.3f\n", modems[m].name, only ? only_channel : fsk_channels[c].name,
+				fsk_channel_source(&fsk_channels[c]), bytes,
+				errors[0], bytes ? 100.0 * errors[0] / bytes : 0.0, errors[1], bytes ? 100.0 * errors[1] / bytes : 0.0);
+		}
+	}
+	free(params);
+	return 0;
+}
+#endif
+
+/*! \brief Best time of modulating the corpus with a kernel, ns per sample */
+static double bench_render(const struct bench_modem *modem, const struct fsk_mod_params *params, fsk_render_fn render,
+	const struct fsk_framing *framing, const struct payload *corpus, int count, int16_t *amp, int rounds, size_t *total_samples)
+{
+	size_t samples;
+	size_t total = 0;
+	int64_t elapsed;
+	int64_t best = INT64_MAX;
+	int r;
+	int i;
+
+	for (r = 0; r < rounds; r++) {
+		elapsed = 0;
+		total = 0;
+		for (i = 0; i < count; i++) {
+			samples = bench_samples(modem, framing, corpus[i].len);
+			elapsed -= now_ns();
+			bench_modulate(params, render, framing, &corpus[i], amp, samples);
+			elapsed += now_ns();
+			total += samples;
+		}
+		best = elapsed < best ? elapsed : best;
+	}
+	*total_samples = total;
+	return total ? (double) best / total : 0;
+}
+
+/*! \brief Best time of a receive pass over the modulated corpus, ns per sample */
+static double bench_receive(const struct bench_modem *modem, const struct fsk_mod_params *params,
+	const struct fsk_framing *framing, const struct payload *corpus, int count, int16_t *amp, int rounds, int demodulator,
+	size_t *total_samples)
+{
+	struct fsk_quality quality;
+#ifdef HAVE_SPANDSP
+	fsk_spec_t spec = { modem->name, modem->space, modem->mark, modem->level, -30, modem->baud_rate };
+	struct bench_sink sink;
+	fsk_rx_state_t *rx;
+#endif
+	size_t samples;
+	size_t total = 0;
+	size_t done;
+	int64_t elapsed;
+	int64_t best = INT64_MAX;
+	int chunk;
+	int r;
+	int i;
+
+#ifndef HAVE_SPANDSP
+	(void) demodulator;
+#endif
+	for (r = 0; r < rounds; r++) {
+		elapsed = 0;
+		total = 0;
+		for (i = 0; i < count; i++) {
+			samples = bench_samples(modem, framing, corpus[i].len);
+			bench_modulate(params, fsk_kernels[0].render, framing, &corpus[i], amp, samples);
+			fsk_quality_init(&quality, modem->space, modem->mark, modem->baud_rate);
+#ifdef HAVE_SPANDSP
+			sink = (struct bench_sink) { .payload = &corpus[i] };
+			if (demodulator && !(rx = fsk_rx_init(NULL, &spec, 10, bench_put_bit, &sink))) {
+				return 0;
+			}
+#endif
+			elapsed -= now_ns();
+			/* in 20 ms blocks as a channel would */
+			for (done = 0; done < samples; done += chunk) {
+				chunk = samples - done < 160 ? samples - done : 160;
+#ifdef HAVE_SPANDSP
+				if (demodulator) {
+					fsk_rx(rx, amp + done, chunk);
+					continue;
+				}
+#endif
+				fsk_quality_feed(&quality, amp + done, chunk, 1);
+			}
+			elapsed += now_ns();
+#ifdef HAVE_SPANDSP
+			if (demodulator) {
+				fsk_rx_free(rx);
+			}
+#endif
+			total += samples;
+		}
+		best = elapsed < best ? elapsed : best;
+	}
+	*total_samples = total;
+	return total ? (double) best / total : 0;
+}
+
+static int load_file(const char *path, struct payload *payload)
+{
+	FILE *fp;
+	long len;
+
+	if (!(fp = fopen(path, "rb"))) {
+		perror(path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	payload->len = len > 0 ? len : 0;
+	payload->data = malloc(payload->len + 1);
+	if (!payload->data || fread(payload->data, 1, payload->len, fp) != payload->len) {
+		fprintf(stderr, "%s: unable to read\n", path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*! \brief Short and long payloads, of text, binary and all-ones bytes */
+static int build_corpus(struct payload *corpus)
+{
+	static const char text[] = "The quick brown fox jumps over the lazy dog 0123456789\r\n";
+	uint32_t seed = 1;
+	size_t j;
+	int i;
+
+	for (i = 0; i < BENCH_CORPUS; i++) {
+		corpus[i].len = 1 + (i * i * 37) % 2048;
+		if (!(corpus[i].data = malloc(corpus[i].len))) {
+			return -1;
+		}
+		for (j = 0; j < corpus[i].len; j++) {
+			switch (i % 3) {
+			case 0:
+				corpus[i].data[j] = text[j % (sizeof(text) - 1)];
+				break;
+			case 1:
+				seed = seed * 1103515245 + 12345;
+				corpus[i].data[j] = seed >> 16;
+				break;
+			default:
+				corpus[i].data[j] = 0xff;
+			}
+		}
+	}
+	return BENCH_CORPUS;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fsk_bench [-m modem] [-k kernel] [-r rounds] [-t tilt] [-q | -s] [payload file ...]\n"
+		"       fsk_bench -c channel [-m modem] [-n noise] [-t tilt] [payload file ...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct fsk_framing framing;
+	struct fsk_mod_params *params;
+	struct payload *corpus;
+	const char *only_modem = NULL;
+	const char *only_kernel = NULL;
+#ifdef HAVE_SPANDSP
+	const char *only_channel = NULL;
+	int noise_dbm0 = -30;
+#endif
+	float tilt_db = 6;
+	struct fsk_mod_params *shaped;
+	struct fsk_shape shape;
+	const struct fsk_kernel *picked;
+	float tune_ns[FSK_KERNELS_MAX];
+	size_t samples;
+	size_t total_samples;
+	size_t max_samples = 0;
+#ifdef HAVE_SPANDSP
+	size_t errors;
+#endif
+	int16_t *amp;
+	int64_t elapsed;
+	int64_t best;
+	double summary_ns = 0;
+	double receive_ns;
+	double shaped_ns;
+	int summary_n = 0;
+	int rounds = 3;
+	int quiet = 0;
+	int summary = 0;
+	int count;
+	int opt;
+	int m;
+	int k;
+	int i;
+	int r;
+
+	while ((opt = getopt(argc, argv, "m:k:r:qsc:n:t:")) != -1) {
+		switch (opt) {
+		case 'm':
+			only_modem = optarg;
+			break;
+		case 'k':
+			only_kernel = optarg;
+			break;
+		case 'r':
+			rounds = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 's':
+			summary = 1;
+			break;
+#ifdef HAVE_SPANDSP
+		case 'c':
+			only_channel = optarg;
+			break;
+		case 'n':
+			noise_dbm0 = atoi(optarg);
+			break;
+#endif
+		case 't':
+			tilt_db = atof(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	count = argc > optind ? argc - optind : BENCH_CORPUS;
+	if (!(corpus = calloc(count, sizeof(*corpus)))) {
+		return 1;
+	}
+	if (argc > optind) {
+		for (i = 0; i < count; i++) {
+			if (load_file(argv[optind + i], &corpus[i])) {
+				return 1;
+			}
+		}
+	} else if (build_corpus(corpus) < 0) {
+		return 1;
+	}
+
+	fsk_framing_init(&framing, 8, 1);
+	for (m = 0; m < BENCH_MODEMS; m++) {
+		for (i = 0; i < count; i++) {
+			samples = bench_samples(&modems[m], &framing, corpus[i].len);
+			max_samples = samples > max_samples ? samples : max_samples;
+		}
+	}
+	params = malloc(sizeof(*params));
+	shaped = malloc(sizeof(*shaped));
+	amp = malloc(max_samples * sizeof(*amp));
+	if (!params || !shaped || !amp) {
+		return 1;
+	}
+
+#ifdef HAVE_SPANDSP
+	if (only_channel) {
+		return bench_channels(only_channel, only_modem, noise_dbm0, tilt_db, corpus, count, amp) ? 1 : 0;
+	}
+#endif
+
+	if (!quiet && !summary) {
+		printf("%-6s %-8s %12s %10s %12s %8s\n", "Modem", "Kernel", "Samples", "ns/sample", "Channels", "Errors");
+	}
+	for (m = 0; m < BENCH_MODEMS; m++) {
+		if (only_modem && strcasecmp(only_modem, modems[m].name)) {
+			continue;
+		}
+		fsk_mod_params_init(params, modems[m].space, modems[m].mark, modems[m].level, modems[m].baud_rate);
+		picked = fsk_tune(params, tune_ns);
+		for (k = 0; k < fsk_kernel_count; k++) {
+			if (only_kernel && strcasecmp(only_kernel, fsk_kernels[k].name)) {
+				continue;
+			}
+			if (summary && &fsk_kernels[k] != picked) {
+				continue;
+			}
+			if (fsk_kernels[k].supported && !fsk_kernels[k].supported()) {
+				continue;
+			}
+			best = INT64_MAX;
+			total_samples = 0;
+#ifdef HAVE_SPANDSP
+			errors = 0;
+#endif
+			for (r = 0; r < rounds; r++) {
+				elapsed = 0;
+				total_samples = 0;
+				for (i = 0; i < count; i++) {
+					samples = bench_samples(&modems[m], &framing, corpus[i].len);
+					elapsed -= now_ns();
+					bench_modulate(params, fsk_kernels[k].render, &framing, &corpus[i], amp, samples);
+					elapsed += now_ns();
+					total_samples += samples;
+#ifdef HAVE_SPANDSP
+					if (r == 0) {
+						errors += bench_demodulate(&modems[m], &corpus[i], amp, samples);
+					}
+#endif
+				}
+				best = elapsed < best ? elapsed : best;
+			}
+			if (summary) {
+				summary_ns += (double) best / total_samples;
+				summary_n++;
+			} else if (!quiet) {
+				printf("%-6s %-8s %12zu %10.3f %12.0f", modems[m].name, fsk_kernels[k].name, total_samples,
+					(double) best / total_samples, 1e9 / ((double) best / total_samples * FSK_DSP_SAMPLE_RATE));
+#ifdef HAVE_SPANDSP
+				printf(" %8zu\n", errors);
+#else
+				printf(" %8s\n", "-");
+#endif
+			}
+		}
+		if (quiet || summary || only_kernel) {
+			continue;
+		}
+		/* the pre-emphasis of a type = shaping section on the kernel the tuner picked: a tilt, and all the taps */
+		for (k = 0; k < 2; k++) {
+			memset(&shape, 0, sizeof(shape));
+			if (k) {
+				shape.taps = FSK_SHAPE_TAPS;
+				shape.fir[0] = 1.0f;
+				for (i = 1; i < FSK_SHAPE_TAPS; i++) {
+					shape.fir[i] = i & 1 ? -0.1f : 0.05f;
+				}
+			} else {
+				fsk_shape_tilt(&shape, modems[m].space, modems[m].mark, tilt_db);
+			}
+			fsk_mod_params_init(shaped, modems[m].space, modems[m].mark, modems[m].level, modems[m].baud_rate);
+			fsk_mod_params_shape(shaped, modems[m].level, &shape);
+			shaped_ns = bench_render(&modems[m], shaped, picked->render, &framing, corpus, count, amp, rounds, &total_samples);
+			printf("%-6s %-8s %12zu %10.3f %12.0f %8s\n", modems[m].name, k ? "+fir8" : "+tilt", total_samples,
+				shaped_ns, shaped_ns > 0 ? 1e9 / (shaped_ns * FSK_DSP_SAMPLE_RATE) : 0.0, "-");
+		}
+#ifdef HAVE_SPANDSP
+		for (k = 1; k >= 0; k--) {
+#else
+		for (k = 0; k >= 0; k--) {
+#endif
+			receive_ns = bench_receive(&modems[m], params, &framing, corpus, count, amp, rounds, k, &total_samples);
+			printf("%-6s %-8s %12zu %10.3f %12.0f %8s\n", modems[m].name, k ? "fsk_rx" : "quality", total_samples,
+				receive_ns, receive_ns > 0 ? 1e9 / (receive_ns * FSK_DSP_SAMPLE_RATE) : 0.0, "-");
+		}
+	}
+	if (summary) {
+		printf("%.4f\n", summary_n ? summary_ns / summary_n : 0.0);
+	}
+
+	for (i = 0; i < count; i++) {
+		free(corpus[i].data);
+	}
+	free(corpus);
+	free(params);
+	free(shaped);
+	free(amp);
+	return 0;
+}
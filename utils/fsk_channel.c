@@ -0,0 +1,371 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Codec channels of the app_fsk tools
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_GSM
+#ifdef HAVE_GSM_GSM_H
+#include <gsm/gsm.h>
+#else
+#include <gsm.h>
+#endif
+#endif
+#ifdef HAVE_BCG729
+#include <bcg729/encoder.h>
+#include <bcg729/decoder.h>
+#endif
+#ifdef HAVE_ILBC
+#include <ilbc.h>
+#endif
+#ifdef HAVE_OPUS
+#include <opus.h>
+#endif
+
+#include "fsk_channel.h"
+
+/* Bytes of the largest coded frame */
+#define FSK_CHANNEL_BITS_MAX 256
+/* Of the Opus channel, the rate AMR-WB and Opus run at on mobile networks, unless set */
+#define FSK_CHANNEL_OPUS_RATE 12000
+/* Of the iLBC channel, the frame in ms Asterisk runs it in, unless set */
+#define FSK_CHANNEL_ILBC_MS 30
+
+#if defined(HAVE_GSM) || defined(HAVE_BCG729)
+/*! \brief Frame of the codecs that have nothing to set */
+static int codec_frame_fixed(int setting, int frame)
+{
+	return setting ? 0 : frame;
+}
+#endif
+
+#ifdef HAVE_GSM
+static int codec_gsm_open(struct fsk_channel_state *s)
+{
+	return (s->encoder = gsm_create()) && (s->decoder = gsm_create()) ? 0 : -1;
+}
+
+static void codec_gsm_code(struct fsk_channel_state *s, const int16_t *in, int16_t *out)
+{
+	gsm_frame bits;
+
+	gsm_encode(s->encoder, (gsm_signal *) in, bits);
+	gsm_decode(s->decoder, bits, out);
+}
+
+static void codec_gsm_close(struct fsk_channel_state *s)
+{
+	if (s->encoder) {
+		gsm_destroy(s->encoder);
+	}
+	if (s->decoder) {
+		gsm_destroy(s->decoder);
+	}
+}
+
+static int codec_gsm_frame(int setting)
+{
+	return codec_frame_fixed(setting, 160);
+}
+
+static const struct fsk_codec codec_gsm = { "libgsm", 0, codec_gsm_frame, codec_gsm_open, codec_gsm_code, codec_gsm_close };
+#endif
+
+#ifdef HAVE_BCG729
+/* the API of bcg729 1.0 and later */
+static int codec_g729_open(struct fsk_channel_state *s)
+{
+	return (s->encoder = initBcg729EncoderChannel(0)) && (s->decoder = initBcg729DecoderChannel()) ? 0 : -1;
+}
+
+static void codec_g729_code(struct fsk_channel_state *s, const int16_t *in, int16_t *out)
+{
+	uint8_t bits[FSK_CHANNEL_BITS_MAX];
+	uint8_t len;
+
+	bcg729Encoder(s->encoder, in, bits, &len);
+	bcg729Decoder(s->decoder, bits, len, 0, 0, 0, out);
+}
+
+static void codec_g729_close(struct fsk_channel_state *s)
+{
+	if (s->encoder) {
+		closeBcg729EncoderChannel(s->encoder);
+	}
+	if (s->decoder) {
+		closeBcg729DecoderChannel(s->decoder);
+	}
+}
+
+static int codec_g729_frame(int setting)
+{
+	return codec_frame_fixed(setting, 80);
+}
+
+static const struct fsk_codec codec_g729 = { "bcg729", 0, codec_g729_frame, codec_g729_open, codec_g729_code, codec_g729_close };
+#endif
+
+#ifdef HAVE_ILBC
+/* the API of libilbc 3.0, in 20 or 30 ms frames */
+static int codec_ilbc_frame(int setting)
+{
+	return setting == 20 || setting == 30 ? setting * 8 : 0;
+}
+
+static int codec_ilbc_open(struct fsk_channel_state *s)
+{
+	IlbcEncoderInstance *encoder;
+	IlbcDecoderInstance *decoder;
+
+	if (WebRtcIlbcfix_EncoderCreate(&encoder)) {
+		return -1;
+	}
+	s->encoder = encoder;
+	if (WebRtcIlbcfix_DecoderCreate(&decoder)) {
+		return -1;
+	}
+	s->decoder = decoder;
+	return WebRtcIlbcfix_EncoderInit(encoder, s->setting) || WebRtcIlbcfix_DecoderInit(decoder, s->setting) ? -1 : 0;
+}
+
+static void codec_ilbc_code(struct fsk_channel_state *s, const int16_t *in, int16_t *out)
+{
+	uint8_t bits[FSK_CHANNEL_BITS_MAX];
+	int16_t speech;
+	int len;
+
+	len = WebRtcIlbcfix_Encode(s->encoder, in, s->frame, bits);
+	if (len <= 0 || WebRtcIlbcfix_Decode(s->decoder, bits, len, out, &speech) != s->frame) {
+		memset(out, 0, s->frame * sizeof(*out));
+	}
+}
+
+static void codec_ilbc_close(struct fsk_channel_state *s)
+{
+	if (s->encoder) {
+		WebRtcIlbcfix_EncoderFree(s->encoder);
+	}
+	if (s->decoder) {
+		WebRtcIlbcfix_DecoderFree(s->decoder);
+	}
+}
+
+static const struct fsk_codec codec_ilbc = { "libilbc", FSK_CHANNEL_ILBC_MS, codec_ilbc_frame, codec_ilbc_open, codec_ilbc_code, codec_ilbc_close };
+#endif
+
+#ifdef HAVE_OPUS
+/* in 20 ms frames, at 6 to 510 kbit/s as libopus takes them */
+static int codec_opus_frame(int setting)
+{
+	return setting >= 6000 && setting <= 510000 ? 160 : 0;
+}
+
+static int codec_opus_open(struct fsk_channel_state *s)
+{
+	int error;
+
+	if (!(s->encoder = opus_encoder_create(8000, 1, OPUS_APPLICATION_VOIP, &error))
+		|| !(s->decoder = opus_decoder_create(8000, 1, &error))) {
+		return -1;
+	}
+	return opus_encoder_ctl((OpusEncoder *) s->encoder, OPUS_SET_BITRATE(s->setting)) == OPUS_OK ? 0 : -1;
+}
+
+static void codec_opus_code(struct fsk_channel_state *s, const int16_t *in, int16_t *out)
+{
+	unsigned char bits[FSK_CHANNEL_BITS_MAX];
+	int len;
+
+	len = opus_encode(s->encoder, in, 160, bits, sizeof(bits));
+	if (len <= 0 || opus_decode(s->decoder, bits, len, out, 160, 0) != 160) {
+		memset(out, 0, 160 * sizeof(*out));
+	}
+}
+
+static void codec_opus_close(struct fsk_channel_state *s)
+{
+	if (s->encoder) {
+		opus_encoder_destroy(s->encoder);
+	}
+	if (s->decoder) {
+		opus_decoder_destroy(s->decoder);
+	}
+}
+
+static const struct fsk_codec codec_opus = { "libopus", FSK_CHANNEL_OPUS_RATE, codec_opus_frame, codec_opus_open, codec_opus_code, codec_opus_close };
+#endif
+
+/*
+ * Binomial roll-offs: 3 taps lose 2 dB at 1200 Hz and 7.5 dB at 2200 Hz,
+ * about what GSM full rate and G.729 do to the band; 5 taps lose 4 and 15 dB,
+ * closer to the lowest rates of iLBC, AMR or Opus.
+ */
+const struct fsk_channel fsk_channels[] = {
+	{ "ulaw", "G.711 u-law", 0, 1, 0, NULL },
+	{ "alaw", "G.711 a-law", 1, 1, 0, NULL },
+#ifdef HAVE_GSM
+	{ "gsm", "GSM full rate", 0, 1, 0, &codec_gsm },
+#endif
+#ifdef HAVE_BCG729
+	{ "g729", "G.729", 0, 1, 0, &codec_g729 },
+#endif
+#ifdef HAVE_ILBC
+	{ "ilbc", "iLBC", 0, 1, 0, &codec_ilbc },
+#endif
+#ifdef HAVE_OPUS
+	{ "opus", "Opus", 0, 1, 0, &codec_opus },
+#endif
+	{ "lowrate", "GSM, G.729", 0, 3, 1, NULL },
+	{ "narrow", "iLBC, AMR, Opus below 12 kbit/s", 0, 5, 1, NULL },
+};
+
+const int fsk_channel_count = sizeof(fsk_channels) / sizeof(fsk_channels[0]);
+
+static const int32_t binomial[FSK_CHANNEL_TAPS + 1][FSK_CHANNEL_TAPS] = {
+	[1] = { 1 },
+	[3] = { 1, 2, 1 },
+	[5] = { 1, 4, 6, 4, 1 },
+};
+
+const struct fsk_channel *fsk_channel_find(const char *name, int *setting)
+{
+	const char *colon = strchr(name, ':');
+	size_t len = colon ? (size_t) (colon - name) : strlen(name);
+	char *end;
+	int i;
+
+	*setting = 0;
+	if (colon) {
+		*setting = strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end || *setting <= 0) {
+			return NULL;
+		}
+	}
+	for (i = 0; i < fsk_channel_count; i++) {
+		if (strlen(fsk_channels[i].name) == len && !strncasecmp(name, fsk_channels[i].name, len)) {
+			if (*setting && (!fsk_channels[i].codec || !fsk_channels[i].codec->frame(*setting))) {
+				return NULL;
+			}
+			return &fsk_channels[i];
+		}
+	}
+	return NULL;
+}
+
+const char *fsk_channel_source(const struct fsk_channel *channel)
+{
+	return channel->model ? "model" : channel->codec ? channel->codec->library : "spandsp";
+}
+
+int fsk_channel_init(struct fsk_channel_state *s, const struct fsk_channel *channel, int setting, int noise_dbm0, int seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->channel = channel;
+	if (channel->codec) {
+		s->setting = setting ? setting : channel->codec->setting;
+		if (!(s->frame = channel->codec->frame(s->setting))) {
+			return -1;
+		}
+	}
+	if (noise_dbm0 >= -90 && !(s->noise = awgn_init_dbm0(NULL, seed, noise_dbm0))) {
+		return -1;
+	}
+	if (channel->codec && channel->codec->open(s)) {
+		fsk_channel_release(s);
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Code what went through the rest of the channel, a frame at a time */
+static void fsk_channel_code(struct fsk_channel_state *s, int16_t *amp, int len)
+{
+	const struct fsk_codec *codec = s->channel->codec;
+	int16_t in[FSK_CHANNEL_FRAME_MAX];
+	int16_t out[FSK_CHANNEL_FRAME_MAX];
+	int n;
+	int i;
+
+	for (i = 0; i < len; i += n) {
+		n = len - i < s->frame ? len - i : s->frame;
+		memcpy(in, amp + i, n * sizeof(*amp));
+		memset(in + n, 0, (s->frame - n) * sizeof(*amp));
+		codec->code(s, in, out);
+		memcpy(amp + i, out, n * sizeof(*amp));
+	}
+}
+
+void fsk_channel_run(struct fsk_channel_state *s, int16_t *amp, int len)
+{
+	const int32_t *fir = binomial[s->channel->taps];
+	int taps = s->channel->taps;
+	int shift = taps - 1;
+	int32_t x;
+	int i;
+	int t;
+
+	for (i = 0; i < len; i++) {
+		/* history holds the last samples in, newest first */
+		x = fir[0] * amp[i];
+		for (t = 1; t < taps; t++) {
+			x += fir[t] * s->history[t - 1];
+		}
+		for (t = taps - 2; t > 0; t--) {
+			s->history[t] = s->history[t - 1];
+		}
+		if (taps > 1) {
+			s->history[0] = amp[i];
+		}
+		x >>= shift;
+		if (s->noise) {
+			x += awgn(s->noise);
+		}
+		x = x > INT16_MAX ? INT16_MAX : x < INT16_MIN ? INT16_MIN : x;
+		if (s->channel->codec) {
+			amp[i] = x;
+		} else {
+			amp[i] = s->channel->alaw ? alaw_to_linear(linear_to_alaw(x)) : ulaw_to_linear(linear_to_ulaw(x));
+		}
+	}
+	if (s->channel->codec) {
+		fsk_channel_code(s, amp, len);
+	}
+}
+
+void fsk_channel_release(struct fsk_channel_state *s)
+{
+	if (s->noise) {
+		awgn_free(s->noise);
+		s->noise = NULL;
+	}
+	if (s->channel->codec) {
+		s->channel->codec->close(s);
+	}
+	s->encoder = NULL;
+	s->decoder = NULL;
+}
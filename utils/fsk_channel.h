@@ -0,0 +1,111 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Codec channels the tools put between the modulator and the demodulator
+ *
+ * G.711 is exact, through spandsp's companding. GSM, G.729, iLBC and Opus run
+ * through libgsm, bcg729, libilbc and libopus when the Makefile finds them
+ * (HAVE_GSM, HAVE_BCG729, HAVE_ILBC, HAVE_OPUS). Without a codec library, the
+ * low rate codecs are still modelled by how much of the high band they lose,
+ * over u-law, and those channels say they are a model. Noise is added ahead
+ * of the codec, as it would be on the line.
+ *
+ * A codec channel named "opus:6000" or "ilbc:20" runs the codec at that
+ * setting, the bit rate of Opus or the frame of iLBC in ms, in place of its
+ * default of 12 kbit/s and 30 ms.
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#ifndef _FSK_CHANNEL_H
+#define _FSK_CHANNEL_H
+
+#include <stdint.h>
+#include <spandsp.h>
+
+/* Taps of the longest roll-off */
+#define FSK_CHANNEL_TAPS    5
+/* Samples of the longest codec frame, 30 ms of iLBC */
+#define FSK_CHANNEL_FRAME_MAX 240
+
+struct fsk_channel_state;
+
+/*! \brief A codec library, coding a frame at a time */
+struct fsk_codec {
+	const char *library;
+	int setting;                    /*!< default of what a name sets after a colon, 0 for nothing to set */
+	int (*frame)(int setting);      /*!< samples at a setting, 0 if the codec has no such setting */
+	int (*open)(struct fsk_channel_state *s);
+	void (*code)(struct fsk_channel_state *s, const int16_t *in, int16_t *out);
+	void (*close)(struct fsk_channel_state *s);
+};
+
+struct fsk_channel {
+	const char *name;
+	const char *models;             /*!< codecs it stands for */
+	int alaw;
+	int taps;                       /*!< of the binomial roll-off, 1 for none */
+	int model;                      /*!< a filter standing in for codecs, none of them runs */
+	const struct fsk_codec *codec;  /*!< in place of G.711, NULL for none */
+};
+
+extern const struct fsk_channel fsk_channels[];
+extern const int fsk_channel_count;
+
+/*!
+ * \brief Find a channel by name, "name" or "name:setting"
+ *
+ * \param setting of the codec, 0 for its default
+ * \return NULL if unknown, or if its codec has no such setting
+ */
+const struct fsk_channel *fsk_channel_find(const char *name, int *setting);
+
+/*! \return what codes the channel for the tables: "model", the codec library, or "spandsp" for G.711 */
+const char *fsk_channel_source(const struct fsk_channel *channel);
+
+struct fsk_channel_state {
+	const struct fsk_channel *channel;
+	int setting;                    /*!< of the codec, its default if none was set */
+	int frame;                      /*!< samples the codec codes at a time */
+	awgn_state_t *noise;
+	int32_t history[FSK_CHANNEL_TAPS - 1];
+	void *encoder;
+	void *decoder;
+};
+
+/*!
+ * \param setting of the codec as fsk_channel_find() gave it, 0 for its default
+ * \param noise_dbm0 level of the noise added, none below -90
+ * \param seed of the noise, the same seed adds the same noise
+ */
+int fsk_channel_init(struct fsk_channel_state *s, const struct fsk_channel *channel, int setting, int noise_dbm0, int seed);
+
+/*!
+ * \brief Pass audio through the channel, in place
+ *
+ * Through a codec, a run that ends inside a frame has the frame completed
+ * with silence, so that each run comes out whole and as long as it went in.
+ */
+void fsk_channel_run(struct fsk_channel_state *s, int16_t *amp, int len);
+
+void fsk_channel_release(struct fsk_channel_state *s);
+
+#endif /* _FSK_CHANNEL_H */
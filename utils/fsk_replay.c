@@ -0,0 +1,608 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Replay of recorded receives through the receive core of app_fsk
+ *
+ * Feeds flight recorder dumps (see the [recorder] section of fsk.conf), or
+ * plain 8 kHz signed linear recordings, to the same receive core ReceiveFSK
+ * runs, frame by frame as the channel delivered them, and reports what was
+ * decoded with a digest of it, and the line quality the module measured.
+ *
+ * \code
+ *	fsk_replay [-j jobs] [-p modem] [-m mark,space,baud,min_level] [-b bits]
+ *	           [-a | -A] [-t] [-v] [-o results] [-c baseline] recording ...
+ * \endcode
+ *
+ * A recording is the base path of a dump, any of its files, or a .sln file.
+ * Dumps carry their demodulator settings and frame timing; a .sln file is
+ * fed in 20 ms frames with the settings of -p (default 103), and -m and -b
+ * override either. Dumps of receives that ran the AGC run it again with the
+ * same settings; -a runs every recording through it with the defaults of
+ * fsk.conf, -A none. -t paces the frames as they were timed on the channel.
+ *
+ * -o writes a line per recording, and -c compares against such a file from
+ * an earlier run, so the whole set of recordings serves as a regression
+ * suite across builds of the receiver: the exit status is 1 when a decode
+ * changed. Recordings are replayed on -j threads, and the time the receive
+ * core took is reported per recording and overall.
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <spandsp.h>
+
+#include "../fsk_dsp.h"
+#include "../fsk_receive.h"
+
+/* Frames of a plain recording, as channels mostly deliver them */
+#define REPLAY_FRAME        160
+
+/* Decoded bytes kept per recording, as ReceiveFSK keeps in its variable */
+#define REPLAY_MAX_BYTES    65536
+
+struct replay_frame {
+	int64_t offset_us;
+	size_t position;                /*!< first sample in the audio */
+	int samples;
+};
+
+struct replay_case {
+	char base[4096];
+	const char *name;               /*!< base without directories, the key of results files */
+	fsk_spec_t spec;
+	int data_bits;
+	int crc;
+	int quit_on_carrier_lost;
+	int eom_samples;                /*!< a persistent receive, 0 otherwise */
+	int recorded_bytes;             /*!< as the dump says ReceiveFSK got, -1 if not known */
+	int complete;                   /*!< the recording starts with the receive */
+	int agc;                        /*!< ahead of the demodulator, with agc_params */
+	struct fsk_agc_params agc_params;
+	int16_t *audio;
+	size_t samples;
+	struct replay_frame *frames;
+	size_t nframes;
+	/* outcome */
+	struct fsk_receive rcv;
+	struct fsk_quality quality;
+	struct fsk_agc agc_state;
+	unsigned char *bytes;
+	size_t len;
+	int carrier_events;
+	int gaps;
+	const char *end;
+	uint32_t digest;
+	int64_t ns;
+	size_t fed;                     /*!< samples through the receive core */
+	char error[128];
+};
+
+static struct replay_case *cases;
+static int ncases;
+static int next_case;
+static int pace;
+
+static void digest_add(uint32_t *digest, unsigned int value)
+{
+	*digest = (*digest ^ value) * 16777619u;
+}
+
+/*! \brief As ReceiveFSK's rx_byte() does with its buffer */
+static void replay_byte(struct fsk_receive *rcv, unsigned char byte)
+{
+	struct replay_case *c = (struct replay_case *) ((char *) rcv - offsetof(struct replay_case, rcv));
+
+	digest_add(&c->digest, byte);
+	if (c->len < REPLAY_MAX_BYTES - 1) {
+		c->bytes[c->len++] = byte;
+	}
+}
+
+static void replay_carrier(struct fsk_receive *rcv, int up)
+{
+	struct replay_case *c = (struct replay_case *) ((char *) rcv - offsetof(struct replay_case, rcv));
+
+	digest_add(&c->digest, 0x100 | up);
+	c->carrier_events++;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *read_file(const char *path, size_t *len)
+{
+	FILE *fp;
+	struct stat st;
+	char *data;
+
+	if (!(fp = fopen(path, "rb"))) {
+		return NULL;
+	}
+	if (fstat(fileno(fp), &st) || !(data = malloc(st.st_size + 1))) {
+		fclose(fp);
+		return NULL;
+	}
+	*len = fread(data, 1, st.st_size, fp);
+	data[*len] = '\0';
+	fclose(fp);
+	return data;
+}
+
+/*! \brief Settings of the receive from the .meta of a dump */
+static int load_meta(struct replay_case *c, const char *path)
+{
+	char line[512];
+	char key[64];
+	char value[448];
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r"))) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63[^=]=%447[^\n]", key, value) != 2) {
+			continue;
+		}
+		if (!strcmp(key, "rx_mark")) {
+			c->spec.freq_one = atoi(value);
+		} else if (!strcmp(key, "rx_space")) {
+			c->spec.freq_zero = atoi(value);
+		} else if (!strcmp(key, "rx_baud_rate")) {
+			c->spec.baud_rate = atoi(value);
+		} else if (!strcmp(key, "rx_min_level")) {
+			c->spec.min_level = atoi(value);
+		} else if (!strcmp(key, "data_bits")) {
+			c->data_bits = atoi(value);
+		} else if (!strcmp(key, "crc")) {
+			c->crc = strcmp(value, "none") != 0;
+		} else if (!strcmp(key, "quit_on_carrier_lost")) {
+			c->quit_on_carrier_lost = atoi(value);
+		} else if (!strcmp(key, "eom_samples")) {
+			c->eom_samples = atoi(value);
+		} else if (!strcmp(key, "bytes")) {
+			c->recorded_bytes = atoi(value);
+		} else if (!strcmp(key, "complete")) {
+			c->complete = !strcmp(value, "yes");
+		} else if (!strcmp(key, "agc")) {
+			c->agc = sscanf(value, "%f,%f,%f,%f,%f,%f,%d", &c->agc_params.target, &c->agc_params.max_gain,
+				&c->agc_params.attack_ms, &c->agc_params.decay_ms, &c->agc_params.margin, &c->agc_params.floor,
+				&c->agc_params.dc) == 7;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*! \brief Frames that went through the demodulator on the channel */
+static int load_frames(struct replay_case *c, const char *path)
+{
+	char line[256];
+	char direction[8];
+	struct replay_frame frame;
+	size_t alloc = 0;
+	unsigned int demodulated;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r"))) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%" SCNd64 " %7s %d %zu %u", &frame.offset_us, direction,
+			&frame.samples, &frame.position, &demodulated) != 5) {
+			continue;
+		}
+		if (strcmp(direction, "rx") || !demodulated || frame.position + frame.samples > c->samples) {
+			continue;
+		}
+		if (c->nframes == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			if (!(c->frames = realloc(c->frames, alloc * sizeof(*c->frames)))) {
+				fclose(fp);
+				return -1;
+			}
+		}
+		c->frames[c->nframes++] = frame;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*! \brief A plain recording, in frames of REPLAY_FRAME at their nominal time */
+static int plain_frames(struct replay_case *c)
+{
+	size_t i;
+
+	c->nframes = (c->samples + REPLAY_FRAME - 1) / REPLAY_FRAME;
+	if (!(c->frames = calloc(c->nframes ? c->nframes : 1, sizeof(*c->frames)))) {
+		return -1;
+	}
+	for (i = 0; i < c->nframes; i++) {
+		c->frames[i].position = i * REPLAY_FRAME;
+		c->frames[i].samples = c->samples - c->frames[i].position < REPLAY_FRAME ? c->samples - c->frames[i].position : REPLAY_FRAME;
+		c->frames[i].offset_us = (int64_t) c->frames[i].position * 1000000 / FSK_DSP_SAMPLE_RATE;
+	}
+	return 0;
+}
+
+static int load_case(struct replay_case *c, const char *arg, const fsk_spec_t *spec, int data_bits)
+{
+	static const char *suffixes[] = { ".rx.sln", ".tx.sln", ".frames", ".meta" };
+	char path[4200];
+	size_t len = strlen(arg);
+	size_t bytes;
+	int plain = 0;
+	int i;
+
+	snprintf(c->base, sizeof(c->base), "%s", arg);
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		if (len > strlen(suffixes[i]) && !strcmp(arg + len - strlen(suffixes[i]), suffixes[i])) {
+			c->base[len - strlen(suffixes[i])] = '\0';
+			break;
+		}
+	}
+	c->name = strrchr(c->base, '/') ? strrchr(c->base, '/') + 1 : c->base;
+	c->spec = *spec;
+	c->data_bits = data_bits;
+	c->quit_on_carrier_lost = 1;
+	c->recorded_bytes = -1;
+	c->complete = 1;
+
+	snprintf(path, sizeof(path), "%s.meta", c->base);
+	if (load_meta(c, path)) {
+		if (len > 4 && !strcmp(arg + len - 4, ".sln")) {
+			plain = 1;
+			snprintf(c->base, sizeof(c->base), "%s", arg);
+			c->base[len - 4] = '\0';
+			c->name = strrchr(c->base, '/') ? strrchr(c->base, '/') + 1 : c->base;
+		} else {
+			snprintf(c->error, sizeof(c->error), "no %s.meta", c->base);
+			return -1;
+		}
+	}
+	snprintf(path, sizeof(path), plain ? "%s.sln" : "%s.rx.sln", c->base);
+	if (!(c->audio = read_file(path, &bytes))) {
+		snprintf(c->error, sizeof(c->error), "unable to read audio");
+		return -1;
+	}
+	c->samples = bytes / sizeof(int16_t);
+	snprintf(path, sizeof(path), "%s.frames", c->base);
+	if (plain ? plain_frames(c) : load_frames(c, path)) {
+		snprintf(c->error, sizeof(c->error), "unable to read frames");
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Run a recording through the receive core the way fskRX_exec() runs a channel */
+static void replay(struct replay_case *c)
+{
+	fsk_rx_state_t *rx;
+	int64_t start;
+	int64_t began;
+	int64_t wait;
+	size_t i;
+	struct timespec ts;
+
+	if (!(c->bytes = malloc(REPLAY_MAX_BYTES))) {
+		snprintf(c->error, sizeof(c->error), "out of memory");
+		return;
+	}
+	c->digest = 2166136261u;
+	c->end = "end";
+	memset(&c->rcv, 0, sizeof(c->rcv));
+	if (!(rx = fsk_rx_init(NULL, &c->spec, c->data_bits + 2, fsk_receive_put_bit, &c->rcv))) {
+		snprintf(c->error, sizeof(c->error), "unable to start the demodulator");
+		return;
+	}
+	fsk_rx_set_modem_status_handler(rx, fsk_receive_status, &c->rcv);
+	c->rcv.data_mask = (1 << c->data_bits) - 1;
+	c->rcv.byte = replay_byte;
+	c->rcv.carrier_change = replay_carrier;
+	fsk_quality_init(&c->quality, c->spec.freq_zero, c->spec.freq_one, c->spec.baud_rate);
+	c->rcv.quality = &c->quality;
+	if (c->agc) {
+		/* as fsk_agc_setup() does in the module */
+		c->agc_params.ceiling = c->spec.min_level;
+		fsk_agc_init(&c->agc_state, &c->agc_params);
+		c->rcv.agc = &c->agc_state;
+	}
+	fsk_receive_start(&c->rcv, c->crc, c->quit_on_carrier_lost);
+
+	began = now_ns();
+	for (i = 0; i < c->nframes; i++) {
+		/* a frame late by more than one frame time is a gap on the channel */
+		if (i && c->frames[i].offset_us - c->frames[i - 1].offset_us
+			> 2 * (int64_t) c->frames[i - 1].samples * 1000000 / FSK_DSP_SAMPLE_RATE) {
+			c->gaps++;
+		}
+		if (pace && (wait = began + (c->frames[i].offset_us - c->frames[0].offset_us) * 1000 - now_ns()) > 0) {
+			ts.tv_sec = wait / 1000000000;
+			ts.tv_nsec = wait % 1000000000;
+			nanosleep(&ts, NULL);
+		}
+		start = now_ns();
+		fsk_receive_feed(rx, &c->rcv, c->audio + c->frames[i].position, c->frames[i].samples);
+		c->ns += now_ns() - start;
+		c->fed += c->frames[i].samples;
+		if (c->rcv.eof) {
+			c->end = "carrier";
+			break;
+		}
+		if (c->eom_samples && fsk_receive_idle(&c->rcv, c->eom_samples)) {
+			c->end = "idle";
+			break;
+		}
+	}
+	fsk_rx_free(rx);
+}
+
+static void *replay_worker(void *unused)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&next_case, 1, __ATOMIC_RELAXED)) < ncases) {
+		if (!cases[i].error[0]) {
+			replay(&cases[i]);
+		}
+	}
+	return NULL;
+}
+
+static const char *crc_result(const struct replay_case *c)
+{
+	if (!c->crc) {
+		return "none";
+	}
+	return fsk_receive_crc_ok(&c->rcv) ? "ok" : "error";
+}
+
+/*! \brief The digest a baseline file has for a recording, 0 with found clear if none */
+static uint32_t baseline_digest(const char *path, const char *name, int *found)
+{
+	char line[4400];
+	char key[4200];
+	unsigned int digest;
+	FILE *fp;
+
+	*found = 0;
+	if (!(fp = fopen(path, "r"))) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%4199s %*s %*s %*s %*s digest=%x", key, &digest) == 2 && !strcmp(key, name)) {
+			*found = 1;
+			break;
+		}
+	}
+	fclose(fp);
+	return *found ? digest : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fsk_replay [-j jobs] [-p 103|202|v23] [-m mark,space,baud,min_level] [-b bits]\n"
+		"                  [-a | -A] [-t] [-v] [-o results] [-c baseline] recording ...\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		int spec;
+	} modems[] = {
+		{ "103", FSK_BELL103CH2 },
+		{ "202", FSK_BELL202 },
+		{ "v23", FSK_V23CH1 },
+	};
+	fsk_spec_t spec = preset_fsk_specs[FSK_BELL103CH2];
+	fsk_spec_t custom = { "custom", 0, 0, -14, -30, 0 };
+	const char *results = NULL;
+	const char *baseline = NULL;
+	pthread_t *threads;
+	struct replay_case *c;
+	struct fsk_quality_report quality;
+	FILE *out = NULL;
+	int64_t wall;
+	int64_t busy = 0;
+	size_t fed = 0;
+	size_t j;
+	uint32_t digest;
+	int override_spec = 0;
+	int override_bits = 0;
+	int override_agc = -1;
+	int data_bits = 8;
+	int verbose = 0;
+	int jobs = 1;
+	int changed = 0;
+	int found;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "j:p:m:b:aAtvo:c:")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'p':
+			for (i = 0; i < sizeof(modems) / sizeof(modems[0]) && strcasecmp(optarg, modems[i].name); i++);
+			if (i == sizeof(modems) / sizeof(modems[0])) {
+				fprintf(stderr, "Unknown modem '%s'\n", optarg);
+				return 2;
+			}
+			spec = preset_fsk_specs[modems[i].spec];
+			break;
+		case 'm':
+			if (sscanf(optarg, "%d,%d,%d,%d", &custom.freq_one, &custom.freq_zero, &custom.baud_rate, &custom.min_level) < 3) {
+				usage();
+				return 2;
+			}
+			custom.baud_rate *= 100;
+			override_spec = 1;
+			break;
+		case 'b':
+			data_bits = atoi(optarg);
+			if (data_bits < 5 || data_bits > 8) {
+				usage();
+				return 2;
+			}
+			override_bits = 1;
+			break;
+		case 'a':
+		case 'A':
+			override_agc = opt == 'a';
+			break;
+		case 't':
+			pace = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'o':
+			results = optarg;
+			break;
+		case 'c':
+			baseline = optarg;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		usage();
+		return 2;
+	}
+	if (override_spec) {
+		spec = custom;
+	}
+
+	ncases = argc - optind;
+	if (!(cases = calloc(ncases, sizeof(*cases))) || !(threads = calloc(jobs, sizeof(*threads)))) {
+		return 2;
+	}
+	for (i = 0; i < ncases; i++) {
+		load_case(&cases[i], argv[optind + i], &spec, data_bits);
+		/* the dump's own settings, unless told otherwise */
+		if (override_spec) {
+			cases[i].spec = spec;
+		}
+		if (override_bits) {
+			cases[i].data_bits = data_bits;
+		}
+		if (override_agc >= 0) {
+			cases[i].agc = override_agc;
+			fsk_agc_params_default(&cases[i].agc_params);
+		}
+	}
+
+	wall = now_ns();
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, replay_worker, NULL)) {
+			jobs = i;
+			break;
+		}
+	}
+	replay_worker(NULL);
+	for (i = 0; i < jobs; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	wall = now_ns() - wall;
+
+	if (results && !(out = fopen(results, "w"))) {
+		perror(results);
+		return 2;
+	}
+	for (i = 0; i < ncases; i++) {
+		c = &cases[i];
+		if (c->error[0]) {
+			printf("%s: %s\n", c->name, c->error);
+			changed = 1;
+			continue;
+		}
+		printf("%s bytes=%zu crc=%s end=%s carrier=%d digest=%08x frames=%zu gaps=%d %.1f ns/sample",
+			c->name, c->len, crc_result(c), c->end, c->carrier_events, c->digest, c->nframes, c->gaps,
+			c->fed ? (double) c->ns / c->fed : 0.0);
+		fsk_quality_report(&c->quality, &quality);
+		if (quality.bits) {
+			printf(" level=%.1f snr=%.1f ber=%.2e offset=%.1f jitter=%.1f imbalance=%.1f",
+				quality.level, quality.snr, quality.ber, quality.offset, quality.jitter, quality.imbalance);
+		}
+		if (c->agc) {
+			printf(" agc_gain=%.1f", fsk_agc_gain(&c->agc_state));
+		}
+		if (c->recorded_bytes >= 0) {
+			printf(" %s", (int) c->rcv.received == c->recorded_bytes ? "as-recorded" : "differs-from-recorded");
+		}
+		if (!c->complete) {
+			printf(" partial");
+		}
+		if (baseline) {
+			digest = baseline_digest(baseline, c->name, &found);
+			printf(" %s", !found ? "new" : digest == c->digest ? "same" : "CHANGED");
+			changed |= found && digest != c->digest;
+		}
+		printf("\n");
+		if (verbose) {
+			for (j = 0; j < c->len; j++) {
+				printf(c->bytes[j] >= 0x20 && c->bytes[j] < 0x7f && c->bytes[j] != '\\' ? "%c" : "\\x%02x", c->bytes[j]);
+			}
+			printf("\n");
+		}
+		if (out) {
+			fprintf(out, "%s bytes=%zu crc=%s end=%s carrier=%d digest=%08x\n",
+				c->name, c->len, crc_result(c), c->end, c->carrier_events, c->digest);
+		}
+		busy += c->ns;
+		fed += c->fed;
+	}
+	if (out) {
+		fclose(out);
+	}
+	printf("%d recordings, %.1f s of audio in %.3f s on %d threads, receive core %.1f ns/sample (%.0fx real time per core)\n",
+		ncases, (double) fed / FSK_DSP_SAMPLE_RATE, wall / 1e9, jobs + 1,
+		fed ? (double) busy / fed : 0.0, busy ? fed * 1e9 / FSK_DSP_SAMPLE_RATE / busy : 0.0);
+
+	for (i = 0; i < ncases; i++) {
+		free(cases[i].audio);
+		free(cases[i].frames);
+		free(cases[i].bytes);
+	}
+	free(cases);
+	free(threads);
+	return changed;
+}
@@ -0,0 +1,667 @@
+/*
+ *  FSK util for Asterisk
+ *
+ *  Copyright (C) 2013-2021 Alessandro Carminati <alessandro.carminati@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file
+ *
+ * \brief Capacity sweep of the app_fsk modems over codec channels
+ *
+ * Sends messages on each modem, at each baud rate of a grid, through each
+ * codec channel of fsk_channel.c with noise at each level of a grid, and
+ * receives them with the receive core ReceiveFSK runs. A message counts when
+ * every byte of it arrives. Prints, per channel and modem, the highest
+ * goodput among the baud rates that delivered enough of their messages at
+ * each noise level, which is what the ladders of fsk.conf should be built
+ * from. The Codec column says what coded each channel, "model" for the
+ * filters standing in for codec libraries that were not built in. A channel
+ * of -c may set its codec, the bit rate of Opus or the frame of iLBC in ms,
+ * so that -c opus:6000,opus:12000,opus:24000,ilbc:20,ilbc:30 sweeps the
+ * codec rate as one more axis.
+ *
+ * \code
+ *	fsk_sweep [-j jobs] [-c channel,...] [-p modem,...] [-f fsk.conf] [-b baud,...] [-n noise,...]
+ *	          [-m messages] [-l length] [-r ratio] [-t tilt] [-a] [-v]
+ * \endcode
+ *
+ * Modems are 103, 202 and v23, or mark:space in Hz for tones of your own, each
+ * run at every baud rate of -b (default 300,600,1200,1800,2400). -f adds the
+ * type = profile sections of an fsk.conf, after the modems of -p or in place
+ * of the default ones, each with the tones it receives on, its level, min_level
+ * and framing; the baud rate is what the sweep looks for, so a profile runs at
+ * those of -b as well. Noise levels are in dBm0 (default -50,-40,-35,-30,-25).
+ * Each cell of the grid sends -m messages (default 16) of -l random bytes
+ * (default 128), framed 8N1 at -14 dBm0 with a carrier down to -30 dBm0
+ * accepted unless its profile says otherwise, and is reliable when at least
+ * -r of them (default 1, all) arrive whole. Goodput is the bytes of the messages that arrived over the time on
+ * the line, idle included. -t sends with the higher tone pre-emphasized by
+ * tilt dB, as a type = shaping section would, and -a receives through the AGC
+ * with its defaults. Cells run on -j threads besides the main one, which
+ * makes one per CPU by default; -v prints every cell as it was measured.
+ *
+ * \author Alessandro Carminati <alessandro.carminati@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <spandsp.h>
+
+#include "../fsk_dsp.h"
+#include "../fsk_receive.h"
+#include "fsk_channel.h"
+
+/* Mark-idle before and after each message, in bit times */
+#define SWEEP_IDLE_BITS     20
+
+/* Entries of a grid axis */
+#define SWEEP_MAX_AXIS      16
+
+/* Levels of what is sent and of the weakest carrier accepted, dBm0, as the built in profiles have them */
+#define SWEEP_LEVEL         -14
+#define SWEEP_MIN_LEVEL     -30
+
+struct sweep_modem {
+	char name[24];
+	int space;
+	int mark;
+	int level;                      /*!< sent, dBm0 */
+	int min_level;                  /*!< weakest carrier accepted, dBm0 */
+	int data_bits;
+	int stop_bits;
+};
+
+/*! \brief A channel of the grid, with the setting of its codec */
+struct sweep_channel {
+	char name[24];
+	const struct fsk_channel *channel;
+	int setting;                    /*!< 0 for the default of the codec */
+};
+
+struct sweep_cell {
+	const struct sweep_channel *channel;
+	const struct sweep_modem *modem;
+	int baud_rate;                  /*!< 0.01 baud */
+	int noise;                      /*!< dBm0 */
+	int sent;
+	int arrived;
+	size_t samples;                 /*!< on the line, for all the messages */
+};
+
+/*! \brief A message as the module's put_bit() sends it, between mark-idle */
+struct sweep_source {
+	const struct fsk_framing *framing;
+	const unsigned char *data;
+	int len;
+	int ptr;
+	int bit;
+	int lead;
+};
+
+/*! \brief What the receive core made of a message */
+struct sweep_sink {
+	struct fsk_receive rcv;
+	unsigned char *data;
+	int len;
+	int max;
+};
+
+/* the tones the module receives on */
+static const struct sweep_modem builtin_modems[] = {
+	{ "103", 2025, 2225, SWEEP_LEVEL, SWEEP_MIN_LEVEL, 8, 1 },
+	{ "202", 2200, 1200, SWEEP_LEVEL, SWEEP_MIN_LEVEL, 8, 1 },
+	{ "v23", 2100, 1300, SWEEP_LEVEL, SWEEP_MIN_LEVEL, 8, 1 },
+};
+
+#define SWEEP_BUILTIN_MODEMS ((int) (sizeof(builtin_modems) / sizeof(builtin_modems[0])))
+
+static struct sweep_cell *cells;
+static int ncells;
+static int next_cell;
+static int messages = 16;
+static int length = 128;
+static float tilt_db;
+static int agc;
+
+static int sweep_get_bit(void *user_data)
+{
+	struct sweep_source *src = user_data;
+	int bit;
+
+	if (src->lead > 0) {
+		src->lead--;
+		return 1;
+	}
+	if (src->ptr >= src->len) {
+		return 1;
+	}
+	bit = (src->framing->frame[src->data[src->ptr]] >> src->bit) & 1;
+	if (++src->bit == src->framing->bits) {
+		src->bit = 0;
+		src->ptr++;
+	}
+	return bit;
+}
+
+static void sweep_byte(struct fsk_receive *rcv, unsigned char byte)
+{
+	struct sweep_sink *sink = (struct sweep_sink *) ((char *) rcv - offsetof(struct sweep_sink, rcv));
+
+	if (sink->len < sink->max) {
+		sink->data[sink->len] = byte;
+	}
+	sink->len++;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*! \brief Send the messages of a cell over its channel and count those that arrive whole */
+static void sweep(struct sweep_cell *cell)
+{
+	const struct sweep_modem *modem = cell->modem;
+	fsk_spec_t spec = { modem->name, modem->space, modem->mark, modem->level, modem->min_level, cell->baud_rate };
+	struct fsk_framing framing;
+	struct fsk_mod_params *params;
+	struct fsk_shape shape;
+	struct fsk_mod mod;
+	struct fsk_channel_state channel;
+	struct fsk_agc_params agc_params;
+	struct fsk_agc agc_state;
+	struct sweep_source src;
+	struct sweep_sink sink;
+	fsk_rx_state_t *rx;
+	unsigned char *sent;
+	int16_t *amp;
+	uint32_t seed;
+	size_t samples;
+	size_t done;
+	int chunk;
+	int msg;
+	int i;
+
+	fsk_framing_init(&framing, modem->data_bits, modem->stop_bits);
+	samples = ((size_t) (length * framing.bits + 2 * SWEEP_IDLE_BITS) * FSK_BAUD_WRAP + cell->baud_rate - 1) / cell->baud_rate;
+	params = malloc(sizeof(*params));
+	amp = malloc(samples * sizeof(*amp));
+	sent = malloc(length);
+	sink.data = malloc(length);
+	if (!params || !amp || !sent || !sink.data) {
+		goto done;
+	}
+	fsk_mod_params_init(params, modem->space, modem->mark, modem->level, cell->baud_rate);
+	if (tilt_db) {
+		memset(&shape, 0, sizeof(shape));
+		fsk_shape_tilt(&shape, modem->space, modem->mark, tilt_db);
+		fsk_mod_params_shape(params, modem->level, &shape);
+	}
+	fsk_agc_params_default(&agc_params);
+	/* as fsk_agc_setup() does in the module */
+	agc_params.ceiling = modem->min_level;
+
+	for (msg = 0; msg < messages; msg++) {
+		/* the same messages and noise in every cell */
+		seed = msg + 1;
+		for (i = 0; i < length; i++) {
+			seed = seed * 1103515245 + 12345;
+			sent[i] = (seed >> 16) & ((1 << framing.data_bits) - 1);
+		}
+		src = (struct sweep_source) { .framing = &framing, .data = sent, .len = length, .lead = SWEEP_IDLE_BITS };
+		fsk_mod_init(&mod, params, sweep_get_bit, &src);
+		for (done = 0; done < samples; done += chunk) {
+			chunk = samples - done < 160 ? samples - done : 160;
+			fsk_mod_render(&mod, fsk_kernels[0].render, amp + done, chunk);
+		}
+		if (fsk_channel_init(&channel, cell->channel->channel, cell->channel->setting, cell->noise, msg + 1)) {
+			break;
+		}
+		fsk_channel_run(&channel, amp, samples);
+		fsk_channel_release(&channel);
+
+		memset(&sink.rcv, 0, sizeof(sink.rcv));
+		sink.len = 0;
+		sink.max = length;
+		if (!(rx = fsk_rx_init(NULL, &spec, framing.data_bits + 2, fsk_receive_put_bit, &sink.rcv))) {
+			break;
+		}
+		fsk_rx_set_modem_status_handler(rx, fsk_receive_status, &sink.rcv);
+		sink.rcv.data_mask = (1 << framing.data_bits) - 1;
+		sink.rcv.byte = sweep_byte;
+		if (agc) {
+			fsk_agc_init(&agc_state, &agc_params);
+			sink.rcv.agc = &agc_state;
+		}
+		fsk_receive_start(&sink.rcv, 0, 0);
+		/* in 20 ms frames as a channel delivers them */
+		for (done = 0; done < samples; done += chunk) {
+			chunk = samples - done < 160 ? samples - done : 160;
+			fsk_receive_feed(rx, &sink.rcv, amp + done, chunk);
+		}
+		fsk_rx_free(rx);
+
+		cell->sent++;
+		cell->arrived += sink.len == length && !memcmp(sink.data, sent, length);
+		cell->samples += samples;
+	}
+
+done:
+	free(params);
+	free(amp);
+	free(sent);
+	free(sink.data);
+}
+
+static void *sweep_worker(void *unused)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&next_cell, 1, __ATOMIC_RELAXED)) < ncells) {
+		sweep(&cells[i]);
+	}
+	return NULL;
+}
+
+/*! \return bit/s of the messages that arrived */
+static double goodput(const struct sweep_cell *cell)
+{
+	return cell->samples ? cell->arrived * length * 8.0 * FSK_DSP_SAMPLE_RATE / cell->samples : 0;
+}
+
+/*! \return entries of a comma separated list of numbers, scaled, -1 if invalid */
+static int parse_axis(const char *list, int *axis, int scale)
+{
+	char *copy = strdup(list);
+	char *item;
+	char *rest = copy;
+	char *end;
+	int n = 0;
+
+	if (!copy) {
+		return -1;
+	}
+	while ((item = strsep(&rest, ","))) {
+		if (n == SWEEP_MAX_AXIS) {
+			n = -1;
+			break;
+		}
+		axis[n++] = (int) (strtod(item, &end) * scale + (*item == '-' ? -0.5 : 0.5));
+		if (end == item || *end) {
+			n = -1;
+			break;
+		}
+	}
+	free(copy);
+	return n;
+}
+
+static int parse_modems(const char *list, struct sweep_modem *modems)
+{
+	char *copy = strdup(list);
+	char *item;
+	char *rest = copy;
+	int n = 0;
+	int i;
+
+	if (!copy) {
+		return -1;
+	}
+	while ((item = strsep(&rest, ","))) {
+		if (n == SWEEP_MAX_AXIS) {
+			n = -1;
+			break;
+		}
+		for (i = 0; i < SWEEP_BUILTIN_MODEMS && strcasecmp(item, builtin_modems[i].name); i++);
+		if (i < SWEEP_BUILTIN_MODEMS) {
+			modems[n++] = builtin_modems[i];
+		} else if (sscanf(item, "%d:%d", &modems[n].mark, &modems[n].space) == 2 && modems[n].mark > 0 && modems[n].space > 0) {
+			snprintf(modems[n].name, sizeof(modems[n].name), "%d:%d", modems[n].mark, modems[n].space);
+			modems[n].level = SWEEP_LEVEL;
+			modems[n].min_level = SWEEP_MIN_LEVEL;
+			modems[n].data_bits = 8;
+			modems[n].stop_bits = 1;
+			n++;
+		} else {
+			fprintf(stderr, "Unknown modem '%s'\n", item);
+			n = -1;
+			break;
+		}
+	}
+	free(copy);
+	return n;
+}
+
+/*! \brief Check a profile as fsk_profile_compile() does in the module, and add it to the modems */
+static int add_profile(const char *path, struct sweep_modem *profile, struct sweep_modem *modems, int n)
+{
+	if (!profile->name[0] || profile->data_bits < 0) {
+		/* already reported */
+	} else if (profile->space < 100 || profile->space > 3800 || profile->mark < 100 || profile->mark > 3800
+		|| profile->space == profile->mark) {
+		fprintf(stderr, "%s: profile '%s' has tones out of the band, left out\n", path, profile->name);
+	} else if (profile->level > 0 || profile->min_level > 0) {
+		fprintf(stderr, "%s: profile '%s' has levels above 0 dBm0, left out\n", path, profile->name);
+	} else if (n == SWEEP_MAX_AXIS) {
+		fprintf(stderr, "%s: more than %d modems, profile '%s' left out\n", path, SWEEP_MAX_AXIS, profile->name);
+	} else {
+		modems[n++] = *profile;
+	}
+	profile->name[0] = '\0';
+	return n;
+}
+
+/*!
+ * \brief Add the type = profile sections of an fsk.conf to the modems
+ *
+ * Reads the settings of a profile that make a difference on the line, the
+ * others are left to the module. A profile the module would refuse is left
+ * out with a warning, as the module does.
+ *
+ * \return entries of modems, -1 if the file cannot be read
+ */
+static int parse_profiles(const char *path, struct sweep_modem *modems, int n)
+{
+	struct sweep_modem profile = { .name = "" };
+	char line[512];
+	char section[24] = "";
+	char key[64];
+	char value[256];
+	char parity;
+	char *semicolon;
+	int is_profile = 0;
+	int tones = 0;
+	int i;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r"))) {
+		fprintf(stderr, "%s: unable to read\n", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if ((semicolon = strchr(line, ';'))) {
+			*semicolon = '\0';
+		}
+		if (sscanf(line, " [%23[^]]]", section) == 1) {
+			n = is_profile ? add_profile(path, &profile, modems, n) : n;
+			is_profile = 0;
+			/* until its type says so, as the type may come anywhere in the section */
+			profile = builtin_modems[0];
+			snprintf(profile.name, sizeof(profile.name), "%s", section);
+			tones = 0;
+			continue;
+		}
+		if (!section[0] || sscanf(line, " %63[^= \t] = %255s", key, value) != 2) {
+			continue;
+		}
+		if (!strcasecmp(key, "type")) {
+			is_profile = !strcasecmp(value, "profile");
+		} else if (!strcasecmp(key, "base")) {
+			for (i = 0; i < SWEEP_BUILTIN_MODEMS && strcasecmp(value, builtin_modems[i].name); i++);
+			if (i == SWEEP_BUILTIN_MODEMS) {
+				fprintf(stderr, "%s: profile '%s' is based on '%s', not one of 103, 202 or v23\n", path, section, value);
+				profile.data_bits = -1;
+				continue;
+			}
+			/* the tones of the section, whichever line they are on, win over those of the base */
+			profile.space = tones & 1 ? profile.space : builtin_modems[i].space;
+			profile.mark = tones & 2 ? profile.mark : builtin_modems[i].mark;
+		} else if (!strcasecmp(key, "mark") || !strcasecmp(key, "rx_mark")) {
+			profile.mark = atoi(value);
+			tones |= 2;
+		} else if (!strcasecmp(key, "space") || !strcasecmp(key, "rx_space")) {
+			profile.space = atoi(value);
+			tones |= 1;
+		} else if (!strcasecmp(key, "level")) {
+			profile.level = atoi(value);
+		} else if (!strcasecmp(key, "min_level")) {
+			profile.min_level = atoi(value);
+		} else if (!strcasecmp(key, "framing") && profile.data_bits >= 0) {
+			if (sscanf(value, "%1d%c%1d", &profile.data_bits, &parity, &profile.stop_bits) != 3 || profile.data_bits < 5
+				|| profile.data_bits > 8 || toupper(parity) != 'N' || profile.stop_bits < 1 || profile.stop_bits > 2) {
+				fprintf(stderr, "%s: profile '%s' has framing '%s', only 5N1 to 8N2 are supported\n", path, section, value);
+				profile.data_bits = -1;
+			}
+		}
+	}
+	n = is_profile ? add_profile(path, &profile, modems, n) : n;
+	fclose(fp);
+	return n;
+}
+
+/*! \return entries of a comma separated list of channels, "opus:6000" at a setting of the codec, -1 if invalid */
+static int parse_channels(const char *list, struct sweep_channel *channels)
+{
+	char *copy = strdup(list);
+	char *item;
+	char *rest = copy;
+	int n = 0;
+
+	if (!copy) {
+		return -1;
+	}
+	while ((item = strsep(&rest, ","))) {
+		if (n == SWEEP_MAX_AXIS) {
+			n = -1;
+			break;
+		}
+		if (!(channels[n].channel = fsk_channel_find(item, &channels[n].setting))) {
+			fprintf(stderr, "Unknown channel or codec setting '%s'\n", item);
+			n = -1;
+			break;
+		}
+		snprintf(channels[n].name, sizeof(channels[n].name), "%s", item);
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fsk_sweep [-j jobs] [-c channel,...] [-p modem,...] [-f fsk.conf] [-b baud,...] [-n noise,...]\n"
+		"                 [-m messages] [-l length] [-r ratio] [-t tilt] [-a] [-v]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sweep_channel channels[SWEEP_MAX_AXIS];
+	struct sweep_modem modems[SWEEP_MAX_AXIS];
+	int bauds[SWEEP_MAX_AXIS];
+	int noises[SWEEP_MAX_AXIS];
+	const char *config = NULL;
+	int nchannels = 0;
+	int nmodems = 0;
+	int nbauds;
+	int nnoises;
+	const struct sweep_cell *best;
+	struct sweep_cell *cell;
+	pthread_t *threads;
+	char text[32];
+	double ratio = 1;
+	int64_t wall;
+	size_t line = 0;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN) > 2 ? sysconf(_SC_NPROCESSORS_ONLN) - 1 : 1;
+	int verbose = 0;
+	int opt;
+	int c;
+	int m;
+	int b;
+	int n;
+	int i;
+
+	nbauds = parse_axis("300,600,1200,1800,2400", bauds, 100);
+	nnoises = parse_axis("-50,-40,-35,-30,-25", noises, 1);
+	while ((opt = getopt(argc, argv, "j:c:p:f:b:n:m:l:r:t:av")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'c':
+			nchannels = parse_channels(optarg, channels);
+			break;
+		case 'p':
+			nmodems = parse_modems(optarg, modems);
+			break;
+		case 'f':
+			config = optarg;
+			break;
+		case 'b':
+			nbauds = parse_axis(optarg, bauds, 100);
+			break;
+		case 'n':
+			nnoises = parse_axis(optarg, noises, 1);
+			break;
+		case 'm':
+			messages = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'l':
+			length = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'r':
+			ratio = atof(optarg);
+			break;
+		case 't':
+			tilt_db = atof(optarg);
+			break;
+		case 'a':
+			agc = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+		if (nchannels < 0 || nmodems < 0 || nbauds < 0 || nnoises < 0) {
+			usage();
+			return 2;
+		}
+	}
+	if (!nmodems && !config) {
+		nmodems = parse_modems("103,202,v23", modems);
+	}
+	if (config && (nmodems = parse_profiles(config, modems, nmodems)) <= 0) {
+		if (!nmodems) {
+			fprintf(stderr, "%s: no profile to sweep\n", config);
+		}
+		return 2;
+	}
+	if (!nchannels) {
+		for (nchannels = 0; nchannels < fsk_channel_count && nchannels < SWEEP_MAX_AXIS; nchannels++) {
+			snprintf(channels[nchannels].name, sizeof(channels[nchannels].name), "%s", fsk_channels[nchannels].name);
+			channels[nchannels].channel = &fsk_channels[nchannels];
+			channels[nchannels].setting = 0;
+		}
+	}
+	for (b = 0; b < nbauds; b++) {
+		if (bauds[b] <= 0) {
+			usage();
+			return 2;
+		}
+	}
+
+	ncells = nchannels * nmodems * nbauds * nnoises;
+	if (!(cells = calloc(ncells, sizeof(*cells))) || !(threads = calloc(jobs, sizeof(*threads)))) {
+		return 2;
+	}
+	cell = cells;
+	for (c = 0; c < nchannels; c++) {
+		for (m = 0; m < nmodems; m++) {
+			for (n = 0; n < nnoises; n++) {
+				for (b = 0; b < nbauds; b++, cell++) {
+					cell->channel = &channels[c];
+					cell->modem = &modems[m];
+					cell->baud_rate = bauds[b];
+					cell->noise = noises[n];
+				}
+			}
+		}
+	}
+
+	wall = now_ns();
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, sweep_worker, NULL)) {
+			jobs = i;
+			break;
+		}
+	}
+	sweep_worker(NULL);
+	for (i = 0; i < jobs; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	wall = now_ns() - wall;
+
+	if (verbose) {
+		for (i = 0; i < ncells; i++) {
+			cell = &cells[i];
+			printf("%s %s baud=%g noise=%d arrived=%d/%d goodput=%.0f\n", cell->channel->name, cell->modem->name,
+				cell->baud_rate / 100.0, cell->noise, cell->arrived, cell->sent, goodput(cell));
+		}
+		printf("\n");
+	}
+
+	/* goodput in bit/s, and the baud rate giving it, of the best reliable cell */
+	printf("%-10s %-8s %-10s", "Channel", "Codec", "Modem");
+	for (n = 0; n < nnoises; n++) {
+		snprintf(text, sizeof(text), "%d dBm0", noises[n]);
+		printf(" %12s", text);
+	}
+	printf("\n");
+	cell = cells;
+	for (c = 0; c < nchannels; c++) {
+		for (m = 0; m < nmodems; m++) {
+			printf("%-10s %-8s %-10s", channels[c].name, fsk_channel_source(channels[c].channel), modems[m].name);
+			for (n = 0; n < nnoises; n++) {
+				best = NULL;
+				for (b = 0; b < nbauds; b++, cell++) {
+					if (cell->sent && cell->arrived >= ratio * cell->sent && (!best || goodput(cell) > goodput(best))) {
+						best = cell;
+					}
+				}
+				if (best) {
+					snprintf(text, sizeof(text), "%.0f@%g", goodput(best), best->baud_rate / 100.0);
+				} else {
+					snprintf(text, sizeof(text), "-");
+				}
+				printf(" %12s", text);
+			}
+			printf("\n");
+		}
+	}
+	for (i = 0; i < ncells; i++) {
+		line += cells[i].samples;
+	}
+	printf("%d cells, %.1f s of audio in %.3f s on %d threads\n",
+		ncells, (double) line / FSK_DSP_SAMPLE_RATE, wall / 1e9, jobs + 1);
+
+	free(cells);
+	free(threads);
+	return 0;
+}